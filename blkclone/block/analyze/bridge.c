@@ -0,0 +1,129 @@
+/* Block list gap bridging
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  On a fragmented filesystem, the block list alternates short runs of
+ *   allocated blocks with short runs of free blocks.  Each free run is a
+ *   seek when the image is made or restored, and on rotational media the
+ *   seeks cost far more than simply copying the free blocks would.
+ *  This pass rewrites a block list so that small gaps are copied instead
+ *   of skipped, trading image size for fewer seeks.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block/map-parse-v1.h"
+#include "analyze/bridge.h"
+
+int map_bridge_gaps(FILE * in, FILE * out, unsigned long long int threshold,
+		    struct bridge_stats * stats)
+{
+  struct bridge_stats st = {0};
+  struct v1_extent pend = {0};	// extent being extended
+  struct v1_extent e = {0};	// extent just read
+  int have_pend = 0;
+  char * linebuf = NULL;
+  size_t linebuflen = 0;
+  char * pre = NULL;  size_t prelen = 0;	// header before BlockCount
+  char * post = NULL; size_t postlen = 0;	// header after BlockCount
+  char * list = NULL; size_t listlen = 0;	// rewritten extent list
+  FILE * pref = NULL;
+  FILE * postf = NULL;
+  FILE * listf = NULL;
+  FILE * hdr = NULL;
+  int ret = -1;
+
+  void flush_pend(void) {
+    if (!have_pend) return;
+    if (pend.length)
+      fprintf(listf,"%llu+%llu\n",pend.start,pend.length);
+    else
+      fprintf(listf,"%llu+.%lu/%lu\n",pend.start,pend.num,pend.denom);
+    have_pend = 0;
+  }
+
+  pref = open_memstream(&pre,&prelen);
+  postf = open_memstream(&post,&postlen);
+  listf = open_memstream(&list,&listlen);
+  if (!(pref && postf && listf)) goto out;
+
+  // copy header keys; BlockCount is held back to be rewritten
+  hdr = pref;
+  while (getline(&linebuf, &linebuflen, in) != -1) {
+    if (!strcmp(linebuf,MAP_V1_STARTBLOCKS"\n")) break;
+    if (!strncmp(linebuf,"BlockCount:",11)) {
+      st.blockcount = strtoull(linebuf+11,NULL,0);
+      hdr = postf; continue;
+    }
+    if (!strncmp(linebuf,"BlockSize:",10))
+      st.blocksize = strtoull(linebuf+10,NULL,0);
+    fputs(linebuf,hdr);
+  }
+  if (hdr != postf) {
+    fprintf(stderr,"block list to bridge lacks BlockCount key\n");
+    goto out;
+  }
+
+  // merge extents across small gaps
+  while (!(ret = map_v1_readcell(in, &e))) {
+    if (have_pend && pend.length && e.length
+	&& (e.start >= pend.start + pend.length)
+	&& (e.start - (pend.start + pend.length) <= threshold)) {
+      unsigned long long int gap = e.start - (pend.start + pend.length);
+      if (gap) { st.gaps++; st.blocks += gap; }
+      pend.length = e.start + e.length - pend.start;
+      continue;
+    }
+    flush_pend();
+    pend = e; have_pend = 1;
+  }
+  if (ret != -1) goto out; // map_v1_readcell already complained
+  flush_pend();
+  ret = -1;
+
+  fclose(pref);  pref = NULL;
+  fclose(postf); postf = NULL;
+  fclose(listf); listf = NULL;
+
+  st.blockcount += st.blocks;
+
+  fputs(pre,out);
+  fprintf(out,"BlockCount:\t%llu\n",st.blockcount);
+  fputs(post,out);
+  fprintf(out,"# bridged %llu gaps of at most %llu blocks (%llu blocks added)\n",
+	  st.gaps,threshold,st.blocks);
+  fprintf(out,MAP_V1_STARTBLOCKS"\n");
+  fputs(list,out);
+  fprintf(out,MAP_V1_ENDBLOCKS"\n");
+
+  if (stats) *stats = st;
+  ret = 0;
+
+ out:
+  if (pref) fclose(pref);
+  if (postf) fclose(postf);
+  if (listf) fclose(listf);
+  free(pre); free(post); free(list);
+  free(linebuf);
+  return ret;
+}
@@ -0,0 +1,552 @@
+/*
+ *  Analyze a btrfs filesystem to generate a block map for sparse imaging.
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+/* to ensure ability to scan entire filesystem */
+#define _FILE_OFFSET_BITS 64
+
+/* PORTABILITY NOTE: this code assumes a little-endian CPU */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "multicall.h"
+
+#include "analyze/dispatch.h"
+#include "analyze/extents.h"
+
+/* Btrfs addresses everything by "logical" byte number; the chunk tree maps
+ *  logical ranges (chunks) onto one or more devices.  The chunks holding
+ *  the chunk tree itself are listed in the superblock.
+ * Every allocated range, data or metadata, has an item in the extent tree,
+ *  so the block list is built by:
+ *    -- reading the system chunks from the superblock
+ *    -- walking the chunk tree to map all chunks
+ *    -- finding the extent tree in the root tree
+ *    -- walking the extent tree and mapping each extent to this device
+ *  The first megabyte (which btrfs never allocates, and where boot loaders
+ *  live) and the superblock mirrors are listed too.
+ * Only the copies on the device being analyzed are listed; the others are
+ *  imaged from their own devices.  For striped profiles (RAID0, RAID10,
+ *  RAID5, RAID6), whole device extents of any chunk in use are listed,
+ *  rather than working out which stripes each extent touches.
+ * A filesystem that was not cleanly unmounted may have a log tree whose
+ *  blocks are not yet in the extent tree; then every chunk is listed whole.
+ */
+
+struct btrfs_super {		// the parts of the superblock we need
+  uint8_t  csum[32];		// 0x00
+  uint8_t  fsid[16];		// 0x20
+  uint64_t bytenr;		// 0x30 physical address of this copy
+  uint64_t flags;		// 0x38
+  char     magic[8];		// 0x40 "_BHRfS_M"
+  uint64_t generation;		// 0x48
+  uint64_t root;		// 0x50 logical address of root tree
+  uint64_t chunk_root;		// 0x58 logical address of chunk tree
+  uint64_t log_root;		// 0x60 logical address of log tree (or 0)
+  uint8_t  rsrv_1[0x28];	// 0x68 sizes, device count
+  uint32_t sectorsize;		// 0x90
+  uint32_t nodesize;		// 0x94
+  uint8_t  rsrv_2[8];		// 0x98
+  uint32_t sys_chunk_array_size;// 0xA0
+  uint8_t  rsrv_3[0x22];	// 0xA4 feature flags, checksum type
+  uint8_t  root_level;		// 0xC6
+  uint8_t  chunk_root_level;	// 0xC7
+  uint8_t  log_root_level;	// 0xC8
+  uint64_t devid;		// 0xC9 dev_item: ID of this device
+  uint64_t dev_total_bytes;	// 0xD1 dev_item: size of this device
+  uint8_t  rsrv_4[0x252];	// 0xD9 rest of dev_item, label, reserved
+  uint8_t  sys_chunk_array[2048];// 0x32B
+} __attribute__((packed));
+
+struct btrfs_key {
+  uint64_t objectid;
+  uint8_t  type;
+  uint64_t offset;
+} __attribute__((packed));
+
+struct btrfs_header {		// header of every tree block
+  uint8_t  csum[32];
+  uint8_t  fsid[16];
+  uint64_t bytenr;		// logical address of this block
+  uint8_t  rsrv_1[0x28];	// flags, chunk tree UUID, generation, owner
+  uint32_t nritems;
+  uint8_t  level;		// 0 for leaves
+} __attribute__((packed));
+
+struct btrfs_item {		// leaf item; data offset is from end of header
+  struct btrfs_key key;
+  uint32_t offset;
+  uint32_t size;
+} __attribute__((packed));
+
+struct btrfs_key_ptr {		// node entry
+  struct btrfs_key key;
+  uint64_t blockptr;
+  uint64_t generation;
+} __attribute__((packed));
+
+struct btrfs_chunk {		// chunk item; stripes follow
+  uint64_t length;
+  uint64_t owner;
+  uint64_t stripe_len;
+  uint64_t type;
+  uint32_t io_align;
+  uint32_t io_width;
+  uint32_t sector_size;
+  uint16_t num_stripes;
+  uint16_t sub_stripes;
+} __attribute__((packed));
+
+struct btrfs_stripe {
+  uint64_t devid;
+  uint64_t offset;		// physical address on device
+  uint8_t  dev_uuid[16];
+} __attribute__((packed));
+
+#define BTRFS_SUPER_OFFSET	0x10000
+#define BTRFS_SUPER_MIRROR_MAX	3
+#define BTRFS_SUPER_SIZE	4096
+#define BTRFS_RESERVED_START	(1024 * 1024)	/* never allocated */
+
+#define BTRFS_EXTENT_TREE_OBJECTID 2
+#define BTRFS_ROOT_ITEM_KEY	132
+#define BTRFS_EXTENT_ITEM_KEY	168
+#define BTRFS_METADATA_ITEM_KEY	169
+#define BTRFS_CHUNK_ITEM_KEY	228
+
+#define BTRFS_ROOT_ITEM_BYTENR	176	/* offsets in root item */
+#define BTRFS_ROOT_ITEM_LEVEL	238
+
+#define BTRFS_BLOCK_GROUP_RAID0	 (1ULL << 3)
+#define BTRFS_BLOCK_GROUP_RAID10 (1ULL << 6)
+#define BTRFS_BLOCK_GROUP_RAID5	 (1ULL << 7)
+#define BTRFS_BLOCK_GROUP_RAID6	 (1ULL << 8)
+#define BTRFS_BLOCK_GROUP_STRIPED (BTRFS_BLOCK_GROUP_RAID0	\
+				   | BTRFS_BLOCK_GROUP_RAID10	\
+				   | BTRFS_BLOCK_GROUP_RAID5	\
+				   | BTRFS_BLOCK_GROUP_RAID6)
+
+#define BTRFS_MAX_LEVEL	8
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+struct btrfs_chunk_map {	// a chunk, as it lies on this device
+  uint64_t logical;		// first logical byte
+  uint64_t length;		// logical length
+  uint64_t type;		// BTRFS_BLOCK_GROUP_*
+  uint64_t devlen;		// length of each stripe on a device
+  uint64_t * phys;		// physical address of each stripe on this device
+  int nphys;
+  int whole;			// TRUE once the whole chunk has been listed
+};
+
+struct btrfs_chunk_table {
+  struct btrfs_chunk_map * map;	// in ascending logical order
+  size_t count, alloc;
+};
+
+struct btrfs_context {
+  int fd;			// file descriptor for filesystem
+  struct btrfs_super sb;
+  struct btrfs_chunk_table chunks; // chunks used for address mapping
+  struct btrfs_chunk_table loaded; // chunks read from the chunk tree
+  uint64_t extent_root;		// logical address of extent tree
+  int extent_root_level;	// -1 until found
+  struct extent_list used;	// sectors in use on this device (unordered)
+  uint64_t extents;		// extent items seen
+};
+
+//given: context, table, chunk key offset (logical address), and chunk item
+//return: 0 on success, -error code on error
+//side effect: chunk is added to T (which must stay in order)
+static int btrfs_add_chunk(struct btrfs_context * ctx,
+			   struct btrfs_chunk_table * t, uint64_t logical,
+			   const struct btrfs_chunk * c, uint32_t size)
+{
+  const struct btrfs_stripe * s = (const struct btrfs_stripe *)(c + 1);
+  struct btrfs_chunk_map * m;
+  uint64_t ndata = 1;
+  int i;
+
+  if ((size < sizeof(*c))
+      || (size < sizeof(*c) + c->num_stripes * sizeof(*s))
+      || !c->num_stripes)
+    return -EIO;
+  if (t->count && (logical < t->map[t->count-1].logical
+		    + t->map[t->count-1].length))
+    return -EIO; // chunks overlap or are out of order
+
+  if (t->count == t->alloc) {
+    size_t n = t->alloc ? t->alloc * 2 : 64;
+    m = realloc(t->map, n * sizeof(struct btrfs_chunk_map));
+    if (!m) return -ENOMEM;
+    t->map = m; t->alloc = n;
+  }
+  m = t->map + t->count;
+  memset(m, 0, sizeof(*m));
+  m->logical = logical;
+  m->length = c->length;
+  m->type = c->type;
+  m->phys = malloc(c->num_stripes * sizeof(uint64_t));
+  if (!m->phys) return -ENOMEM;
+  for (i = 0; i < c->num_stripes; i++)
+    if (s[i].devid == ctx->sb.devid)
+      m->phys[m->nphys++] = s[i].offset;
+
+  // how many stripes share the data of a striped chunk
+  if (c->type & BTRFS_BLOCK_GROUP_RAID0) ndata = c->num_stripes;
+  if (c->type & BTRFS_BLOCK_GROUP_RAID10)
+    ndata = c->num_stripes / (c->sub_stripes ? c->sub_stripes : 2);
+  if (c->type & BTRFS_BLOCK_GROUP_RAID5) ndata = c->num_stripes - 1;
+  if (c->type & BTRFS_BLOCK_GROUP_RAID6) ndata = c->num_stripes - 2;
+  if (!ndata || (ndata > c->num_stripes)) ndata = 1;
+  m->devlen = (c->length + ndata - 1) / ndata;
+
+  t->count++;
+  return 0;
+}
+
+static void btrfs_free_chunks(struct btrfs_chunk_table * t)
+{
+  size_t i;
+
+  for (i = 0; i < t->count; i++) free(t->map[i].phys);
+  free(t->map);
+  t->map = NULL; t->count = t->alloc = 0;
+}
+
+//given: context and logical address
+//return: chunk containing address, or NULL
+static struct btrfs_chunk_map * btrfs_find_chunk(struct btrfs_context * ctx,
+						 uint64_t logical)
+{
+  struct btrfs_chunk_map * map = ctx->chunks.map;
+  size_t lo = 0, hi = ctx->chunks.count;
+
+  // binary search for the last chunk starting at or before LOGICAL
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (map[mid].logical <= logical) lo = mid; else hi = mid;
+  }
+  if (!ctx->chunks.count || (logical < map[lo].logical)
+      || (logical >= map[lo].logical + map[lo].length))
+    return NULL;
+  return map + lo;
+}
+
+//adds the physical bytes START+LEN to the block list, in sectors
+static inline int btrfs_add_phys(struct btrfs_context * ctx,
+				 uint64_t start, uint64_t len)
+{
+  uint64_t ss = ctx->sb.sectorsize;
+  return extent_list_add(&ctx->used, start / ss,
+			 (start + len + ss - 1) / ss - start / ss);
+}
+
+//given: context and chunk
+//return: 0 on success, -ENOMEM on failure
+//side effect: every copy of the chunk on this device is listed
+static int btrfs_add_whole_chunk(struct btrfs_context * ctx,
+				 struct btrfs_chunk_map * m)
+{
+  int i;
+
+  if (m->whole) return 0;
+  m->whole = 1;
+  for (i = 0; i < m->nphys; i++)
+    if (btrfs_add_phys(ctx, m->phys[i], m->devlen)) return -ENOMEM;
+  return 0;
+}
+
+//given: context and logical range
+//return: 0 on success, -error code on error
+//side effect: the copies of the range on this device are listed
+static int btrfs_mark(struct btrfs_context * ctx, uint64_t logical,
+		      uint64_t len)
+{
+  struct btrfs_chunk_map * m = btrfs_find_chunk(ctx, logical);
+  int i;
+
+  if (!m || (logical + len > m->logical + m->length)) return -EIO;
+  if (m->type & BTRFS_BLOCK_GROUP_STRIPED)
+    return btrfs_add_whole_chunk(ctx, m);
+  for (i = 0; i < m->nphys; i++)
+    if (btrfs_add_phys(ctx, m->phys[i] + (logical - m->logical), len))
+      return -ENOMEM;
+  return 0;
+}
+
+//given: context, logical address of tree block, and buffer
+//return: 0 on success, -error code on error
+static int btrfs_read_node(struct btrfs_context * ctx, uint64_t logical,
+			   uint8_t * buf)
+{
+  struct btrfs_chunk_map * m = btrfs_find_chunk(ctx, logical);
+  struct btrfs_header * h = (struct btrfs_header *) buf;
+  uint32_t nodesize = ctx->sb.nodesize;
+
+  if (!m || (logical + nodesize > m->logical + m->length)) return -EIO;
+  if (!m->nphys || (m->type & BTRFS_BLOCK_GROUP_STRIPED)) {
+    fprintf(stderr,"btrfs: tree block %llu is not readable on this device\n",
+	    (unsigned long long) logical);
+    return -ENXIO;
+  }
+  if (pread(ctx->fd, buf, nodesize, m->phys[0] + (logical - m->logical))
+      != nodesize)
+    return -EIO;
+  if ((h->bytenr != logical) || memcmp(h->fsid, ctx->sb.fsid, 16))
+    return -EIO; // not the block we were looking for
+  return 0;
+}
+
+//walks the tree rooted at LOGICAL, calling FN on each leaf item
+// returns -error code on error, or the first nonzero value from FN
+static int btrfs_walk(struct btrfs_context * ctx, uint64_t logical, int level,
+		      int (*fn)(struct btrfs_context *, struct btrfs_key *,
+				uint8_t *, uint32_t))
+{
+  uint32_t nodesize = ctx->sb.nodesize;
+  uint8_t * buf = malloc(nodesize);
+  struct btrfs_header * h = (struct btrfs_header *) buf;
+  uint32_t i;
+  int ret;
+
+  if (!buf) return -ENOMEM;
+  if ((ret = btrfs_read_node(ctx, logical, buf)) < 0) goto out;
+  ret = -EIO;
+  if ((h->level != level) || (level > BTRFS_MAX_LEVEL)) goto out;
+  // tree blocks are also in the extent tree, but listing them here
+  //  costs nothing and covers the chunk tree before the extent tree is read
+  if ((ret = btrfs_mark(ctx, logical, nodesize)) < 0) goto out;
+
+  if (level == 0) {
+    struct btrfs_item * it = (struct btrfs_item *)(h + 1);
+    if (h->nritems > (nodesize - sizeof(*h)) / sizeof(*it))
+      { ret = -EIO; goto out; }
+    for (i = 0; i < h->nritems; i++) {
+      if ((uint64_t) it[i].offset + it[i].size > nodesize - sizeof(*h))
+	{ ret = -EIO; goto out; }
+      ret = fn(ctx, &it[i].key, buf + sizeof(*h) + it[i].offset,
+	       it[i].size);
+      if (ret) goto out;
+    }
+  } else {
+    struct btrfs_key_ptr * p = (struct btrfs_key_ptr *)(h + 1);
+    if (h->nritems > (nodesize - sizeof(*h)) / sizeof(*p))
+      { ret = -EIO; goto out; }
+    for (i = 0; i < h->nritems; i++)
+      if ((ret = btrfs_walk(ctx, p[i].blockptr, level - 1, fn)))
+	goto out;
+  }
+  ret = 0;
+
+ out:
+  free(buf);
+  return ret;
+}
+
+static int btrfs_chunk_item(struct btrfs_context * ctx, struct btrfs_key * k,
+			    uint8_t * data, uint32_t size)
+{
+  if (k->type != BTRFS_CHUNK_ITEM_KEY) return 0;
+  return btrfs_add_chunk(ctx, &ctx->loaded, k->offset,
+			 (struct btrfs_chunk *) data, size);
+}
+
+static int btrfs_root_item(struct btrfs_context * ctx, struct btrfs_key * k,
+			   uint8_t * data, uint32_t size)
+{
+  if ((k->objectid != BTRFS_EXTENT_TREE_OBJECTID)
+      || (k->type != BTRFS_ROOT_ITEM_KEY))
+    return 0;
+  if (size <= BTRFS_ROOT_ITEM_LEVEL) return -EIO;
+  ctx->extent_root = *((uint64_t*)(data + BTRFS_ROOT_ITEM_BYTENR));
+  ctx->extent_root_level = data[BTRFS_ROOT_ITEM_LEVEL];
+  return 1; // found; stop walking
+}
+
+static int btrfs_extent_item(struct btrfs_context * ctx, struct btrfs_key * k,
+			     uint8_t * data, uint32_t size)
+{
+  // EXTENT_ITEM keys hold the length; skinny METADATA_ITEM keys the level
+  if (k->type == BTRFS_EXTENT_ITEM_KEY) {
+    ctx->extents++;
+    return btrfs_mark(ctx, k->objectid, k->offset);
+  }
+  if (k->type == BTRFS_METADATA_ITEM_KEY) {
+    ctx->extents++;
+    return btrfs_mark(ctx, k->objectid, ctx->sb.nodesize);
+  }
+  return 0;
+}
+
+//reads superblock and maps the system chunks
+// returns -error code on error
+static int btrfs_init(struct btrfs_context * ctx, FILE * fs)
+{
+  uint8_t * p;
+  uint8_t * end;
+  int ret;
+
+  ctx->fd = fileno(fs);
+  ctx->extent_root_level = -1;
+  if (pread(ctx->fd, &ctx->sb, sizeof(ctx->sb), BTRFS_SUPER_OFFSET)
+      != sizeof(ctx->sb))
+    return -EIO;
+  if (memcmp(ctx->sb.magic, "_BHRfS_M", 8)
+      || (ctx->sb.sectorsize < 512)
+      || (ctx->sb.sectorsize & (ctx->sb.sectorsize - 1))
+      || (ctx->sb.nodesize < ctx->sb.sectorsize)
+      || (ctx->sb.nodesize > 65536)
+      || (ctx->sb.sys_chunk_array_size > sizeof(ctx->sb.sys_chunk_array)))
+    return -EINVAL;
+
+  // the system chunk array is a list of (key, chunk item) pairs
+  p = ctx->sb.sys_chunk_array;
+  end = p + ctx->sb.sys_chunk_array_size;
+  while (p + sizeof(struct btrfs_key) + sizeof(struct btrfs_chunk) <= end) {
+    struct btrfs_key * k = (struct btrfs_key *) p;
+    struct btrfs_chunk * c = (struct btrfs_chunk *)(k + 1);
+    uint32_t size = sizeof(*c) + c->num_stripes * sizeof(struct btrfs_stripe);
+    if ((k->type != BTRFS_CHUNK_ITEM_KEY) || ((uint8_t *) c + size > end))
+      return -EIO;
+    if ((ret = btrfs_add_chunk(ctx, &ctx->chunks, k->offset, c, size)) < 0)
+      return ret;
+    p = (uint8_t *) c + size;
+  }
+  return 0;
+}
+
+//walks the chunk tree, then the extent tree, listing used sectors in EXT
+// returns -error code on error
+static int btrfs_scan(struct btrfs_context * ctx, struct extent_list * ext)
+{
+  uint64_t mirror;
+  size_t i;
+  int ret;
+
+  // map all chunks: read the chunk tree through the system chunks, which
+  //  are listed again in the chunk tree itself
+  ret = btrfs_walk(ctx, ctx->sb.chunk_root, ctx->sb.chunk_root_level,
+		   btrfs_chunk_item);
+  if (ret < 0) return ret;
+  if (!ctx->loaded.count) return -EIO;
+  btrfs_free_chunks(&ctx->chunks);
+  ctx->chunks = ctx->loaded;
+  memset(&ctx->loaded, 0, sizeof(ctx->loaded));
+
+  if (ctx->sb.log_root) {
+    // log tree blocks are not in the extent tree yet; be safe
+    for (i = 0; i < ctx->chunks.count; i++)
+      if ((ret = btrfs_add_whole_chunk(ctx, ctx->chunks.map + i)) < 0)
+	return ret;
+  } else {
+    ret = btrfs_walk(ctx, ctx->sb.root, ctx->sb.root_level, btrfs_root_item);
+    if (ret < 0) return ret;
+    if (ctx->extent_root_level < 0) return -ENOENT;
+    ret = btrfs_walk(ctx, ctx->extent_root, ctx->extent_root_level,
+		     btrfs_extent_item);
+    if (ret < 0) return ret;
+  }
+
+  // the unallocated start of the device, and the superblock mirrors
+  if (btrfs_add_phys(ctx, 0, BTRFS_RESERVED_START)) return -ENOMEM;
+  for (i = 1; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+    mirror = (uint64_t) 0x4000 << (12 * i); // 64 MiB, 256 GiB
+    if (mirror + BTRFS_SUPER_SIZE <= ctx->sb.dev_total_bytes)
+      if (btrfs_add_phys(ctx, mirror, BTRFS_SUPER_SIZE)) return -ENOMEM;
+  }
+
+  extent_list_sort(&ctx->used);
+  *ext = ctx->used;
+  memset(&ctx->used, 0, sizeof(ctx->used));
+  return 0;
+}
+
+static int btrfs_ad_recognize(FILE * fs, const void * hdrbuf)
+{
+  struct btrfs_super sb;
+  int ret = 1;
+
+  // the superblock is 64 KiB in, well past the common header buffer
+  ret = ret && (pread(fileno(fs), &sb, sizeof(sb), BTRFS_SUPER_OFFSET)
+		== sizeof(sb));
+  // the magic number must match
+  ret = ret && !memcmp(sb.magic, "_BHRfS_M", 8);
+  // and this copy must know where it is
+  ret = ret && (sb.bytenr == BTRFS_SUPER_OFFSET);
+
+  return ret;
+}
+
+static int btrfs_ad_analyze(FILE * fs, FILE * out, char * ignore)
+{
+  struct btrfs_context ctx = { 0 };
+  struct extent_list ext = {0};
+  int ret = 0;
+
+  ret = btrfs_init(&ctx,fs);
+  if (ret < 0) { errno = -ret; fatal("failed to read btrfs superblock"); }
+
+  ret = btrfs_scan(&ctx,&ext);
+  if (ret < 0) { errno = -ret; fatal("failed to scan btrfs extent tree"); }
+
+  fprintf(out,"Type:\tbtrfs\n");
+
+  fprintf(out,"# %u bytes/sector; %u bytes/node; %llu chunks; device %llu\n",
+	  ctx.sb.sectorsize,ctx.sb.nodesize,
+	  (unsigned long long) ctx.chunks.count,
+	  (unsigned long long) ctx.sb.devid);
+  if (ctx.sb.log_root)
+    fprintf(out,"# log tree present; all chunks listed whole\n");
+  else
+    fprintf(out,"# %llu extents\n",(unsigned long long) ctx.extents);
+
+  fprintf(out,"BlockSize:\t%u\n",ctx.sb.sectorsize);
+  fprintf(out,"BlockCount:\t%llu\n",(unsigned long long) ext.blocks);
+  fprintf(out,"BlockRange:\t%llu\n",
+	  (unsigned long long) (ctx.sb.dev_total_bytes / ctx.sb.sectorsize));
+
+  fprintf(out,"BEGIN BLOCK LIST\n");
+  extent_list_emit(out,&ext);
+  fprintf(out,"END BLOCK LIST\n");
+
+  btrfs_free_chunks(&ctx.chunks);
+  extent_list_free(&ext);
+
+  return 0;
+}
+
+DECLARE_ANALYSIS_MODULE(btrfs) = {
+  .name = "btrfs",
+  .fs_hdrsize = 0, // superblock is read with pread(); see recognize
+  .recognize = btrfs_ad_recognize,
+  .analyze = btrfs_ad_analyze,
+  0 };
+
+//EOF
@@ -35,36 +35,53 @@
 #include "keylist.h"
 #include "multicall.h"
 #include "analyze/dispatch.h"
+#include "analyze/bridge.h"
+#include "analyze/sink.h"
 
 REGISTER_LDTABLE(analysis_modules);
 
+struct keylist * analysis_args = NULL;
+
 static char usagetext[] =
   "analyze [type=<fstype>] src=<source> <other options>\n";
 static char helptext[] =
   "Options:\n"
   "\ttype   -- specify type of filesystem (omit for auto-detection)\n"
   "\tsrc    -- specify source from which to read filesystem\n"
-  "\tdetect -- only determine filesystem type; do not actually analyze\n";
+  "\tdetect -- only determine filesystem type; do not actually analyze\n"
+  "\tbridge -- copy free gaps of at most this many blocks between extents\n"
+  "\t          (trades image size for fewer seeks on rotational media)\n"
+  "\texclude -- comma-separated paths of files whose contents to omit\n"
+  "\t          (FAT and NTFS; paths are relative to the volume root)\n"
+  "\t          (NTFS always omits pagefile.sys, hiberfil.sys and\n"
+  "\t           swapfile.sys in the root directory unless noexclude is given)\n"
+  "\tthreads -- number of threads to use for scanning (default: all CPUs)\n"
+  "\tmnt    -- where SRC is mounted, for modules that need it\n"
+  "\t          (without type, selects the online module, which asks the\n"
+  "\t           kernel for the block map instead of reading the disk)\n"
+  "\tfiemap -- (online module) map files one by one even if the\n"
+  "\t          filesystem supports GETFSMAP\n"
+  "\tbs     -- (sparsefile module) block size of the map (default 4096)\n"
+  "\twithin -- (sparsefile module) keep only blocks also in the map from\n"
+  "\t          this module (auto to detect the filesystem in the image)\n";
 
 static inline void fatal(char * msg)
 { perror(msg); exit (1); }
 
-DECLARE_MULTICALL_TABLE(main);
-SUBCALL_MAIN(main, analyze, usagetext, helptext,
-	     int argc, char ** argv)
+struct analysis_module * analysis_find_module(FILE * fs, const char * type)
 {
   LDTABLE_ITERATOR(analysis_modules, i);
   struct analysis_module * mod = NULL;
-  struct keylist * args = NULL;
-  FILE * fs = NULL;
   void * fshdrbuf = NULL;
   size_t fshdrlen = 0;
-  int ret = 0;
 
-  args = keylist_parse_args(argc, argv);
-
-  if (!keylist_get(args,"src"))
-    print_usage_and_exit(usagetext);
+  if (type) {
+    // use particular module (case-insensitive)
+    LDTABLE_FOREACH(analysis_modules, i)
+      if (i->name && !strcasecmp(i->name,type))
+	mod = i;
+    return mod;
+  }
 
   LDTABLE_FOREACH(analysis_modules, i)
     if (i->fs_hdrsize > fshdrlen) fshdrlen = i->fs_hdrsize;
@@ -74,52 +91,125 @@ SUBCALL_MAIN(main, analyze, usagetext, helptext,
     fatal("failed to allocate buffer for filesystem header");
   memset(fshdrbuf,0,fshdrlen);
 
-  fs = fopen(keylist_get(args,"src"),"r");
-  if (!fs) fatal("could not open filesystem");
-
   if (fread(fshdrbuf,fshdrlen,1,fs) != 1)
     fatal("failed to read filesystem header");
 
-  if (keylist_get(args,"type")) {
-    // use particular module (case-insensitive)
-    char * name = keylist_get(args,"type");
-    LDTABLE_FOREACH(analysis_modules, i)
-      if (i->name && !strcasecmp(i->name,name))
-	mod = i;
-    if (!mod) {
-      fprintf(stderr,"Requested module %s not found.\n",name);
-      return 1;
+  // attempt to auto-detect
+  LDTABLE_FOREACH(analysis_modules, i)
+    if (i->recognize && !i->weak_signature && i->recognize(fs, fshdrbuf)) {
+      mod = i; // We found an analysis module for this fs
+      break;  // Take first match only
     }
-  } else {
-    // attempt to auto-detect
+  // then try the modules whose signatures may be stale
+  if (!mod)
     LDTABLE_FOREACH(analysis_modules, i)
-      if (i->recognize && i->recognize(fs, fshdrbuf)) {
-	mod = i; // We found an analysis module for this fs
-	break;  // Take first match only
+      if (i->recognize && i->weak_signature && i->recognize(fs, fshdrbuf)) {
+	mod = i;
+	break;
       }
-    if (!mod) {
+
+  free(fshdrbuf);
+  rewind(fs);
+  return mod;
+}
+
+int analysis_run_sink(struct analysis_module * mod, FILE * fs,
+		      char * mntpnt, struct extent_sink * sink)
+{
+  FILE * out;
+  int ret;
+
+  if (!mod->need_mounted_fs) mntpnt = NULL;
+  if (mod->analyze_sink)
+    return mod->analyze_sink(fs, sink, mntpnt);
+
+  // parse the text on its way out of the module
+  out = extent_sink_open(sink);
+  if (!out) return -ENOMEM;
+  ret = mod->analyze(fs, out, mntpnt);
+  if (fclose(out) && !ret) ret = -EIO;
+  return ret;
+}
+
+DECLARE_MULTICALL_TABLE(main);
+SUBCALL_MAIN(main, analyze, usagetext, helptext,
+	     int argc, char ** argv)
+{
+  struct analysis_module * mod = NULL;
+  struct keylist * args = NULL;
+  FILE * fs = NULL;
+  char * type = NULL;
+  char * mnt = NULL;
+  int ret = 0;
+
+  args = keylist_parse_args(argc, argv);
+  analysis_args = args;
+
+  if (!keylist_get(args,"src"))
+    print_usage_and_exit(usagetext);
+
+  fs = fopen(keylist_get(args,"src"),"r");
+  if (!fs) fatal("could not open filesystem");
+
+  type = keylist_get(args,"type");
+  mnt = keylist_get(args,"mnt");
+  if (!type && mnt) type = "online";
+
+  mod = analysis_find_module(fs, type);
+  if (!mod) {
+    if (type)
+      fprintf(stderr,"Requested module %s not found.\n",type);
+    else
       fprintf(stderr,"No module recognizes %s.\n",keylist_get(args,"src"));
-      return 1;
-    }
+    return 1;
   }
 
   if (keylist_get(args,"detect")) {
     printf("Would analyze %s using module %s.%s\n",
 	   keylist_get(args,"src"),mod->name,
-	   keylist_get(args,"type") ? "  (as requested)" : "");
+	   type ? "  (as requested)" : "");
     return 0;
   }
 
-  if (mod->need_mounted_fs) {
+  if (mod->need_mounted_fs && !mnt) {
     fprintf(stderr,
-	    "Mounting filesystem under analysis not yet implemented.\n"
-	    "    (needed by module %s)\n", mod->name);
+	    "Module %s needs the filesystem mounted; give mnt=<dir>.\n",
+	    mod->name);
     return 1;
   }
+  if (!mod->need_mounted_fs) mnt = NULL;
 
   rewind(fs);
 
-  ret = mod->analyze(fs,stdout,NULL);
+  if (keylist_get(args,"bridge")) {
+    // run the module into memory, then bridge gaps on the way out
+    unsigned long long int threshold =
+      strtoull(keylist_get(args,"bridge"),NULL,0);
+    struct bridge_stats st = {0};
+    char * buf = NULL;
+    size_t buflen = 0;
+    FILE * raw = open_memstream(&buf,&buflen);
+    if (!raw) fatal("failed to allocate block list buffer");
+
+    ret = mod->analyze(fs,raw,mnt);
+    fclose(raw);
+
+    if (!ret) {
+      raw = fmemopen(buf,buflen,"r");
+      if (!raw) fatal("failed to reopen block list buffer");
+      if (map_bridge_gaps(raw,stdout,threshold,&st) < 0) {
+	fprintf(stderr,"failed to bridge gaps in block list\n");
+	ret = 1;
+      } else
+	fprintf(stderr,
+		"Bridged %llu gaps:  image grows by %llu blocks"
+		" (%llu bytes); about %llu seeks saved\n",
+		st.gaps,st.blocks,st.blocks*st.blocksize,st.gaps);
+      fclose(raw);
+    }
+    free(buf);
+  } else
+    ret = mod->analyze(fs,stdout,mnt);
 
   fclose(fs);
 
@@ -0,0 +1,393 @@
+/*
+ *  Analyze an exFAT filesystem to generate a block map for sparse imaging.
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+/* to ensure ability to scan entire filesystem */
+#define _FILE_OFFSET_BITS 64
+
+/* PORTABILITY NOTE: this code assumes a little-endian CPU */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "multicall.h"
+
+#include "analyze/dispatch.h"
+#include "analyze/extents.h"
+#include "analyze/sink.h"
+
+/* Unlike FAT, exFAT does not use its FAT to record which clusters are
+ *  free: a file stored in one contiguous run need not have a FAT chain at
+ *  all.  Allocation is recorded in a bitmap, itself stored in the cluster
+ *  heap and found through an entry in the root directory.  The bitmap is
+ *  scanned a word at a time (see extent_list_add_bitmap).
+ * The boot regions (main and backup, 12 sectors each) and the FATs are
+ *  listed as well; formatters often leave a large gap before the FAT and
+ *  before the cluster heap to align them to flash erase blocks, and that
+ *  gap is not imaged.
+ * As with FAT, the cluster is the imaging block when the cluster heap is
+ *  cluster-aligned; otherwise the largest power-of-two number of sectors
+ *  that divides both the cluster size and the heap offset is used.
+ */
+
+struct exfat_boot {		// exFAT boot sector
+  uint8_t  jump[3];		// 0x00 JMP to boot code
+  char     fsname[8];		// 0x03 "EXFAT   "
+  uint8_t  zero[53];		// 0x0B must be zero (where a BPB would be)
+  uint64_t partoffset;		// 0x40 sectors preceding partition
+  uint64_t vollength;		// 0x48 sectors in volume
+  uint32_t fatoffset;		// 0x50 first sector of first FAT
+  uint32_t fatlength;		// 0x54 sectors in each FAT
+  uint32_t heapoffset;		// 0x58 first sector of cluster heap
+  uint32_t ccount;		// 0x5C clusters in cluster heap
+  uint32_t rdfc;		// 0x60 first cluster of root directory
+  uint32_t serno;		// 0x64 volume serial number
+  uint16_t revision;		// 0x68 filesystem revision
+  uint16_t flags;		// 0x6A bit 0: second FAT and bitmap are active
+  uint8_t  ssize_log;		// 0x6C sector size is 1 << this
+  uint8_t  spc_log;		// 0x6D sectors per cluster is 1 << this
+  uint8_t  fatcnt;		// 0x6E number of FATs (1, or 2 for TexFAT)
+  uint8_t  drvno;		// 0x6F physical drive number
+  uint8_t  pctused;		// 0x70 percent of heap in use
+  uint8_t  rsrv_1[7];		// 0x71
+  uint8_t  code[390];		// 0x78 boot code
+  uint16_t sig;			// 0x1FE == 0xAA55
+} __attribute__((packed));
+
+// assertion (neat trick from autoconf)
+static unsigned char ____assert_struct_exfat_boot_size_check
+[ (sizeof(struct exfat_boot) == 512) ? 0 : -512 ];
+
+#define EXFAT_BOOT_REGION	24	/* sectors in main and backup boot regions */
+#define EXFAT_ENTRY_EOD		0x00	/* directory entry types */
+#define EXFAT_ENTRY_BITMAP	0x81
+#define EXFAT_BITMAP_PIECE	(1 << 20) /* bytes of bitmap read at once */
+
+struct exfat_chain {		// position in a cluster chain
+  uint32_t n;			// current cluster
+  uint32_t used;		// bytes of it already read
+};
+
+struct exfat_context {
+  int fd;			// file descriptor for filesystem
+  struct exfat_boot boot;
+  uint32_t ssize;		// sector size in bytes
+  uint32_t spc;			// sectors per cluster
+  uint32_t spb;			// sectors per imaging block
+  uint32_t csize;		// cluster size in bytes
+  int active;			// index of active FAT and bitmap
+};
+
+//given: context and cluster number
+//return: byte offset of cluster
+static inline off_t exfat_cluster_offset(struct exfat_context * ctx,
+					 uint32_t n)
+{ return ((off_t) ctx->boot.heapoffset + (off_t) (n - 2) * ctx->spc)
+    * ctx->ssize; }
+
+//given: context and cluster number
+//return: next cluster in chain, N + 1 if the FAT holds no chain,
+//	  or 0 at the end of the chain or on error
+// Files stored contiguously may have no FAT chain; their FAT entries are
+//  then zero and the clusters simply follow one another.
+static uint32_t exfat_next(struct exfat_context * ctx, uint32_t n)
+{
+  uint32_t cell = 0;
+  off_t where = ((off_t) ctx->boot.fatoffset
+		 + (off_t) ctx->active * ctx->boot.fatlength) * ctx->ssize
+    + (off_t) n * 4;
+
+  if (pread(ctx->fd, &cell, 4, where) != 4) return 0;
+  if (cell == 0) cell = n + 1;
+  if ((cell < 2) || (cell >= ctx->boot.ccount + 2)) return 0;
+  return cell;
+}
+
+//reads the next LEN bytes of the chain at C into BUF
+//return: 0 on success, -EIO on error
+// Clusters that follow one another on disk are read in one request.
+static int exfat_chain_read(struct exfat_context * ctx,
+			    struct exfat_chain * c, uint8_t * buf, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    uint32_t run = c->n, count = 1, next = 0;
+    size_t want;
+    if ((run < 2) || (run >= ctx->boot.ccount + 2)) return -EIO;
+    // extend the run while the chain goes on to the next cluster
+    while ((size_t) count * ctx->csize - c->used < len - done) {
+      next = exfat_next(ctx, run + count - 1);
+      if (next != run + count) break;
+      count++; next = 0;
+    }
+    want = (size_t) count * ctx->csize - c->used;
+    if (want > len - done) want = len - done;
+    if (pread(ctx->fd, buf + done, want,
+	      exfat_cluster_offset(ctx, run) + c->used) != want)
+      return -EIO;
+    done += want;
+    // move on to the cluster holding the next byte
+    c->used += want;
+    c->n = run + c->used / ctx->csize;
+    c->used %= ctx->csize;
+    if (c->n == run + count)
+      c->n = next ? next : exfat_next(ctx, run + count - 1);
+  }
+  return 0;
+}
+
+//reads boot sector and fills in context struct
+// returns -error code on error
+static int exfat_init(struct exfat_context * ctx, FILE * fs)
+{
+  ctx->fd = fileno(fs);
+  if (pread(ctx->fd, &ctx->boot, sizeof(ctx->boot), 0)
+      != sizeof(ctx->boot))
+    return -EIO;
+  if (memcmp(ctx->boot.fsname, "EXFAT   ", 8)
+      || (ctx->boot.ssize_log < 9) || (ctx->boot.ssize_log > 12)
+      || (ctx->boot.ssize_log + ctx->boot.spc_log > 25)
+      || !ctx->boot.fatcnt || (ctx->boot.fatcnt > 2))
+    return -EINVAL;
+
+  ctx->ssize = 1 << ctx->boot.ssize_log;
+  ctx->spc = 1 << ctx->boot.spc_log;
+  ctx->csize = ctx->ssize * ctx->spc;
+  ctx->active = (ctx->boot.fatcnt == 2) && (ctx->boot.flags & 1);
+
+  // choose the imaging block; see comment at top of file
+  for (ctx->spb = ctx->spc; ctx->boot.heapoffset % ctx->spb; ctx->spb >>= 1);
+
+  return 0;
+}
+
+//given: context and ptrs for first cluster and length of bitmap
+//return: 0 on success, -error code on error
+static int exfat_find_bitmap(struct exfat_context * ctx, uint32_t * first,
+			     uint64_t * len)
+{
+  uint32_t n = ctx->boot.rdfc;
+  uint32_t hops = 0;
+  uint8_t * buf = malloc(ctx->csize);
+  size_t off;
+
+  if (!buf) return -ENOMEM;
+  // the root directory always has a FAT chain
+  while (n && (hops++ <= ctx->boot.ccount)) {
+    if ((n < 2) || (n >= ctx->boot.ccount + 2)
+	|| (pread(ctx->fd, buf, ctx->csize, exfat_cluster_offset(ctx, n))
+	    != ctx->csize))
+      break;
+    for (off = 0; off < ctx->csize; off += 32) {
+      if (buf[off] == EXFAT_ENTRY_EOD) goto out;
+      // TexFAT volumes have two bitmaps; bit 0 of flags says which
+      if ((buf[off] == EXFAT_ENTRY_BITMAP)
+	  && ((buf[off + 1] & 1) == ctx->active)) {
+	*first = *((uint32_t*)(buf + off + 0x14));
+	*len = *((uint64_t*)(buf + off + 0x18));
+	free(buf);
+	return 0;
+      }
+    }
+    n = exfat_next(ctx, n);
+  }
+ out:
+  free(buf);
+  return -ENOENT;
+}
+
+//adds the blocks FIRST up to END to EXT, less any it already has
+// Regions rounded out to whole blocks can share a block with the region
+//  before: the FATs share block 0 with the boot region when the FAT offset
+//  is less than an imaging block.
+static int exfat_append(struct extent_list * ext, uint64_t first, uint64_t end)
+{
+  // (a sink on EXT has everything but the extent still held)
+  if (ext->count) {
+    uint64_t last = ext->ext[ext->count-1].start
+      + ext->ext[ext->count-1].length;
+    if (first < last) first = last;
+  }
+  return (end > first) ? extent_list_append(ext, first, end - first) : 0;
+}
+
+//adds the sectors START+LEN to EXT, in imaging blocks
+static inline int exfat_add_sectors(struct exfat_context * ctx,
+				    struct extent_list * ext,
+				    uint64_t start, uint64_t len)
+{
+  return exfat_append(ext, start / ctx->spb,
+		      (start + len + ctx->spb - 1) / ctx->spb);
+}
+
+//reads the allocation bitmap and builds the block list in EXT
+// returns -error code on error
+// The bitmap is read a piece at a time, and each piece is added to EXT
+//  before the next is read, so a sink on EXT sees extents early.
+static int exfat_scan(struct exfat_context * ctx, struct extent_list * ext)
+{
+  struct extent_list clus = {0};
+  struct exfat_chain c = {0};
+  uint64_t len = 0, done;
+  uint64_t heap = ctx->boot.heapoffset / ctx->spb;	// first heap block
+  uint32_t bpc = ctx->spc / ctx->spb;			// blocks per cluster
+  uint8_t * bitmap = NULL;
+  size_t i, piece;
+  int ret;
+
+  if ((ret = exfat_find_bitmap(ctx, &c.n, &len)) < 0) return ret;
+  if (len < (ctx->boot.ccount + 7) / 8) return -EINVAL;
+  len = (ctx->boot.ccount + 7) / 8;
+  bitmap = malloc((len < EXFAT_BITMAP_PIECE) ? len : EXFAT_BITMAP_PIECE);
+  if (!bitmap) return -ENOMEM;
+
+  // boot regions, then FATs, then the clusters in use
+  if ((ret = exfat_add_sectors(ctx, ext, 0, EXFAT_BOOT_REGION))
+      || (ret = exfat_add_sectors(ctx, ext, ctx->boot.fatoffset,
+				  (uint64_t) ctx->boot.fatcnt
+				  * ctx->boot.fatlength)))
+    goto out;
+  for (done = 0; done < len; done += piece) {
+    uint64_t nbits = ctx->boot.ccount - done * 8;
+    piece = (len - done < EXFAT_BITMAP_PIECE) ? len - done
+      : EXFAT_BITMAP_PIECE;
+    if (nbits > piece * 8) nbits = piece * 8;
+    if ((ret = exfat_chain_read(ctx, &c, bitmap, piece)) < 0) goto out;
+    // bit N stands for cluster N+2, the Nth cluster of the heap
+    clus.count = 0;
+    if ((ret = extent_list_add_bitmap(&clus, bitmap, nbits, done * 8)) < 0)
+      goto out;
+    // runs that cross into the next piece are joined in EXT
+    for (i = 0; i < clus.count; i++)
+      if ((ret = exfat_append(ext, heap + clus.ext[i].start * bpc,
+			      heap + (clus.ext[i].start + clus.ext[i].length)
+			      * bpc)))
+	goto out;
+  }
+  ret = extent_list_flush(ext);
+
+ out:
+  free(bitmap);
+  extent_list_free(&clus);
+  return ret;
+}
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+static int exfat_ad_recognize(FILE * fs, const void * hdrbuf)
+{
+  const struct exfat_boot * b = hdrbuf;
+  int ret = 1;
+
+  // the filesystem name must be "EXFAT   "
+  ret = ret && !memcmp(b->fsname, "EXFAT   ", 8);
+  // and the sector and cluster sizes must be within the allowed ranges
+  ret = ret && (b->ssize_log >= 9) && (b->ssize_log <= 12)
+    && (b->ssize_log + b->spc_log <= 25);
+  // and the boot signature must be present
+  ret = ret && (b->sig == 0xAA55);
+
+  return ret;
+}
+
+static int exfat_ad_analyze(FILE * fs, FILE * out, char * ignore)
+{
+  struct exfat_context ctx = { 0 };
+  struct extent_list ext = {0};
+  int ret = 0;
+
+  ret = exfat_init(&ctx,fs);
+  if (ret < 0) { errno = -ret; fatal("failed to read exFAT boot sector"); }
+
+  ret = exfat_scan(&ctx,&ext);
+  if (ret < 0) { errno = -ret; fatal("failed to read allocation bitmap"); }
+
+  fprintf(out,"Type:\texFAT\n");
+
+  fprintf(out,"# %d bytes/sector; %d sectors/cluster; %u clusters\n",
+	  ctx.ssize,ctx.spc,ctx.boot.ccount);
+  if (ctx.active)
+    fprintf(out,"# second FAT and bitmap are active\n");
+  if (ctx.spb == ctx.spc)
+    fprintf(out,"# cluster heap is cluster-aligned; 1 cluster/block\n");
+  else
+    fprintf(out,"# cluster heap is not cluster-aligned; %d sectors/block\n",
+	    ctx.spb);
+
+  fprintf(out,"BlockSize:\t%d\n",ctx.ssize * ctx.spb);
+  fprintf(out,"BlockCount:\t%llu\n",(unsigned long long) ext.blocks);
+  fprintf(out,"BlockRange:\t%llu\n",
+	  (unsigned long long) (ctx.boot.vollength / ctx.spb));
+
+  fprintf(out,"BEGIN BLOCK LIST\n");
+  extent_list_emit(out,&ext);
+  fprintf(out,"END BLOCK LIST\n");
+
+  extent_list_free(&ext);
+
+  return 0;
+}
+
+// the heap comes last on disk, so the extents can be passed on while the
+//  bitmap is still being read; BlockCount follows them
+static int exfat_ad_analyze_sink(FILE * fs, struct extent_sink * sink,
+				 char * ignore)
+{
+  struct exfat_context ctx = { 0 };
+  struct extent_list ext = { .sink = sink };
+  int ret = 0;
+
+  ret = exfat_init(&ctx,fs);
+  if (ret < 0) { errno = -ret; fatal("failed to read exFAT boot sector"); }
+
+  if ((ret = extent_sink_keyf(sink,"Type","exFAT"))
+      || (ret = extent_sink_keyf(sink,"BlockSize","%d",ctx.ssize * ctx.spb))
+      || (ret = extent_sink_keyf(sink,"BlockRange","%llu",
+				 (unsigned long long)
+				 (ctx.boot.vollength / ctx.spb))))
+    return ret;
+
+  ret = exfat_scan(&ctx,&ext);
+  if (ret < 0) { errno = -ret; fatal("failed to read allocation bitmap"); }
+
+  ret = extent_sink_keyf(sink,"BlockCount","%llu",
+			 (unsigned long long) ext.blocks);
+  extent_list_free(&ext);
+
+  return ret;
+}
+
+DECLARE_ANALYSIS_MODULE(exFAT) = {
+  .name = "exFAT",
+  .fs_hdrsize = sizeof(struct exfat_boot),
+  .recognize = exfat_ad_recognize,
+  .analyze = exfat_ad_analyze,
+  0,
+  .analyze_sink = exfat_ad_analyze_sink };
+
+//EOF
@@ -0,0 +1,577 @@
+/*
+ *  Analyze an ext2/ext3/ext4 filesystem to generate a block map for
+ *   sparse imaging.
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+/* to ensure ability to scan entire filesystem */
+#define _FILE_OFFSET_BITS 64
+
+/* PORTABILITY NOTE: this code assumes a little-endian CPU */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "multicall.h"
+#include "keylist.h"
+
+#include "analyze/dispatch.h"
+#include "analyze/extents.h"
+#include "analyze/pool.h"
+#include "analyze/sink.h"
+
+/* Every block group has a bitmap of its blocks (of its clusters, with
+ *  bigalloc), so the block list is simply the union of the set bits.
+ *  Groups are independent: a pool of threads reads and scans the bitmaps
+ *  a batch of groups at a time, and the lists from each batch are joined
+ *  in order as soon as the batches before them are done, merging runs
+ *  that cross from one group to the next; a sink on the block list thus
+ *  sees the start of the volume while the rest is still being scanned.
+ *  With flex_bg, the bitmaps of neighbouring groups are usually adjacent
+ *  on disk and are read together.
+ * With uninit_bg or metadata_csum, a group may be marked BLOCK_UNINIT: its
+ *  bitmap was never written and the group holds nothing but metadata.
+ *  Such groups are not read at all; their superblock backup, descriptors,
+ *  bitmaps and inode table are listed from the group descriptors instead,
+ *  as e2fsck does, before the scan starts, and merged in by the join.
+ */
+
+struct ext_super {		// ext2/3/4 superblock (at byte 1024)
+  uint32_t inodes_count;	// 0x00
+  uint32_t blocks_count;	// 0x04 number of blocks (low 32 bits)
+  uint32_t r_blocks_count;	// 0x08
+  uint32_t free_blocks_count;	// 0x0C
+  uint32_t free_inodes_count;	// 0x10
+  uint32_t first_data_block;	// 0x14 block containing superblock
+  uint32_t log_block_size;	// 0x18 block size is 1024 << this
+  uint32_t log_cluster_size;	// 0x1C cluster size is 1024 << this
+  uint32_t blocks_per_group;	// 0x20
+  uint32_t clusters_per_group;	// 0x24
+  uint32_t inodes_per_group;	// 0x28
+  uint8_t  rsrv_1[12];		// 0x2C mount/write times and counts
+  uint16_t magic;		// 0x38 == 0xEF53
+  uint8_t  rsrv_2[18];		// 0x3A state, errors, check times, OS
+  uint32_t rev_level;		// 0x4C
+  uint8_t  rsrv_3[8];		// 0x50 reserved uid/gid, first inode
+  uint16_t inode_size;		// 0x58
+  uint16_t block_group_nr;	// 0x5A
+  uint32_t feature_compat;	// 0x5C
+  uint32_t feature_incompat;	// 0x60
+  uint32_t feature_ro_compat;	// 0x64
+  uint8_t  rsrv_4[102];		// 0x68 UUID, label, last mount point
+  uint16_t reserved_gdt_blocks;	// 0xCE blocks kept after GDT for growth
+  uint8_t  rsrv_5[46];		// 0xD0 journal info, hash seed
+  uint16_t desc_size;		// 0xFE size of group descriptor (64bit)
+  uint32_t default_mount_opts;	// 0x100
+  uint32_t first_meta_bg;	// 0x104 first group using META_BG layout
+  uint8_t  rsrv_6[72];		// 0x108 mkfs time, journal backup
+  uint32_t blocks_count_hi;	// 0x150 number of blocks (high 32 bits)
+  uint8_t  rsrv_7[248];		// 0x154
+  uint32_t backup_bgs[2];	// 0x24C groups with superblock (sparse_super2)
+  uint8_t  rsrv_8[428];		// 0x254
+} __attribute__((packed));
+
+// assertion (neat trick from autoconf)
+static unsigned char ____assert_struct_ext_super_size_check
+[ (sizeof(struct ext_super) == 1024) ? 0 : -1024 ];
+
+#define EXT_SUPER_MAGIC			0xEF53
+#define EXT_SUPER_OFFSET		1024
+
+#define EXT_COMPAT_HAS_JOURNAL		0x0004
+#define EXT_COMPAT_SPARSE_SUPER2	0x0200
+#define EXT_INCOMPAT_JOURNAL_DEV	0x0008
+#define EXT_INCOMPAT_META_BG		0x0010
+#define EXT_INCOMPAT_EXTENTS		0x0040
+#define EXT_INCOMPAT_64BIT		0x0080
+#define EXT_INCOMPAT_FLEX_BG		0x0200
+#define EXT_RO_COMPAT_SPARSE_SUPER	0x0001
+#define EXT_RO_COMPAT_GDT_CSUM		0x0010
+#define EXT_RO_COMPAT_BIGALLOC		0x0200
+#define EXT_RO_COMPAT_METADATA_CSUM	0x0400
+
+#define EXT_BG_BLOCK_UNINIT		0x0002
+
+#define EXT_GROUP_BATCH	64	/* groups scanned per request to a thread */
+
+struct ext_group {		// the parts of a group descriptor we need
+  uint64_t block_bitmap;	// block holding block bitmap
+  uint64_t inode_bitmap;	// block holding inode bitmap
+  uint64_t inode_table;		// first block of inode table
+  uint16_t flags;		// EXT_BG_*
+};
+
+struct ext_context {
+  int fd;			// file descriptor for filesystem
+  struct ext_super sb;
+  uint32_t bsize;		// block size in bytes
+  uint32_t ratio;		// blocks per cluster (1 unless bigalloc)
+  uint64_t bcount;		// number of blocks
+  uint64_t ccount;		// number of clusters (imaging blocks)
+  uint32_t ngroups;		// number of block groups
+  uint32_t dpb;			// group descriptors per block
+  uint32_t itblocks;		// blocks in each inode table
+  int csum;			// TRUE if BLOCK_UNINIT may be trusted
+  struct ext_group * groups;
+  // scan state, shared by threads
+  uint32_t next;		// next batch to scan (atomic)
+  uint32_t skipped;		// groups not read
+  int error;			// first error seen by any thread (set once,
+				//  by ext_scan_error)
+  struct extent_list * batches;	// clusters in use, per batch
+  // join state, protected by LOCK
+  pthread_mutex_t lock;
+  uint8_t * done;		// per batch: scanned, waiting to be joined
+  uint32_t joined;		// batches passed to OUT so far
+  int joining;			// a thread is joining batches
+  struct extent_list meta;	// metadata of skipped groups, in order
+  size_t nextmeta;		// next extent of META to join
+  struct extent_list * out;	// the block list being built
+};
+
+//given: context and group number
+//return: first block of group
+static inline uint64_t ext_group_first(struct ext_context * ctx, uint32_t g)
+{ return ctx->sb.first_data_block + (uint64_t) g * ctx->sb.blocks_per_group; }
+
+static inline int ext_power_of(uint32_t g, uint32_t base)
+{ while (!(g % base) && (g > 1)) g /= base; return g == 1; }
+
+//given: context and group number
+//return: TRUE if the group holds a copy of the superblock
+static int ext_has_super(struct ext_context * ctx, uint32_t g)
+{
+  if (g == 0) return 1;
+  if (ctx->sb.feature_compat & EXT_COMPAT_SPARSE_SUPER2)
+    return (g == ctx->sb.backup_bgs[0]) || (g == ctx->sb.backup_bgs[1]);
+  if ((g <= 1) || !(ctx->sb.feature_ro_compat & EXT_RO_COMPAT_SPARSE_SUPER))
+    return 1;
+  return ext_power_of(g, 3) || ext_power_of(g, 5) || ext_power_of(g, 7);
+}
+
+//given: context and index of block of group descriptors
+//return: block number where that block of descriptors is kept
+static uint64_t ext_desc_block(struct ext_context * ctx, uint32_t i)
+{
+  uint32_t g = i * ctx->dpb;
+
+  if (!(ctx->sb.feature_incompat & EXT_INCOMPAT_META_BG)
+      || (i < ctx->sb.first_meta_bg))
+    return ctx->sb.first_data_block + 1 + i;
+  // META_BG: each descriptor block is kept in the first group it describes
+  return ext_group_first(ctx, g) + ext_has_super(ctx, g);
+}
+
+//reads superblock and group descriptors and fills in context struct
+// returns -error code on error
+static int ext_init(struct ext_context * ctx, FILE * fs)
+{
+  uint32_t dsize = 32, i, nblk;
+  uint8_t * buf = NULL;
+
+  ctx->fd = fileno(fs);
+  if (pread(ctx->fd, &ctx->sb, sizeof(ctx->sb), EXT_SUPER_OFFSET)
+      != sizeof(ctx->sb))
+    return -EIO;
+  if ((ctx->sb.magic != EXT_SUPER_MAGIC) || (ctx->sb.log_block_size > 6)
+      || !ctx->sb.blocks_per_group || !ctx->sb.inodes_per_group)
+    return -EINVAL;
+
+  ctx->bsize = 1024 << ctx->sb.log_block_size;
+  ctx->ratio = 1;
+  if (ctx->sb.feature_ro_compat & EXT_RO_COMPAT_BIGALLOC) {
+    if (ctx->sb.log_cluster_size < ctx->sb.log_block_size)
+      return -EINVAL;
+    ctx->ratio = 1 << (ctx->sb.log_cluster_size - ctx->sb.log_block_size);
+  }
+  ctx->bcount = ctx->sb.blocks_count;
+  if (ctx->sb.feature_incompat & EXT_INCOMPAT_64BIT) {
+    ctx->bcount |= (uint64_t) ctx->sb.blocks_count_hi << 32;
+    dsize = ctx->sb.desc_size;
+    if ((dsize < 64) || (dsize > ctx->bsize) || (dsize & (dsize - 1)))
+      return -EINVAL;
+  }
+  if (ctx->bcount <= ctx->sb.first_data_block)
+    return -EINVAL;
+  ctx->ccount = (ctx->bcount + ctx->ratio - 1) / ctx->ratio;
+  ctx->ngroups = (ctx->bcount - ctx->sb.first_data_block
+		  + ctx->sb.blocks_per_group - 1) / ctx->sb.blocks_per_group;
+  ctx->dpb = ctx->bsize / dsize;
+  ctx->itblocks = ((uint64_t) ctx->sb.inodes_per_group
+		   * (ctx->sb.rev_level ? ctx->sb.inode_size : 128)
+		   + ctx->bsize - 1) / ctx->bsize;
+  ctx->csum = !!(ctx->sb.feature_ro_compat
+		 & (EXT_RO_COMPAT_GDT_CSUM | EXT_RO_COMPAT_METADATA_CSUM));
+
+  ctx->groups = calloc(ctx->ngroups, sizeof(struct ext_group));
+  buf = malloc(ctx->bsize);
+  if (!(ctx->groups && buf)) { free(buf); return -ENOMEM; }
+
+  nblk = (ctx->ngroups + ctx->dpb - 1) / ctx->dpb;
+  for (i = 0; i < nblk; i++) {
+    uint32_t j;
+    if (pread(ctx->fd, buf, ctx->bsize,
+	      (off_t) ext_desc_block(ctx, i) * ctx->bsize) != ctx->bsize)
+      { free(buf); return -EIO; }
+    for (j = 0; (j < ctx->dpb) && (i * ctx->dpb + j < ctx->ngroups); j++) {
+      uint8_t * d = buf + j * dsize;
+      struct ext_group * g = ctx->groups + i * ctx->dpb + j;
+      g->block_bitmap = *((uint32_t*)(d + 0x00));
+      g->inode_bitmap = *((uint32_t*)(d + 0x04));
+      g->inode_table  = *((uint32_t*)(d + 0x08));
+      g->flags	      = *((uint16_t*)(d + 0x12));
+      if (dsize >= 64) {
+	g->block_bitmap |= (uint64_t) *((uint32_t*)(d + 0x20)) << 32;
+	g->inode_bitmap |= (uint64_t) *((uint32_t*)(d + 0x24)) << 32;
+	g->inode_table  |= (uint64_t) *((uint32_t*)(d + 0x28)) << 32;
+      }
+    }
+  }
+
+  free(buf);
+  return 0;
+}
+
+//given: context, list, and a run of blocks
+//return: 0 on success; -ENOMEM on failure
+//side effect: the clusters holding the blocks are added to L (unordered)
+static int ext_add_blocks(struct ext_context * ctx, struct extent_list * l,
+			  uint64_t blk, uint64_t n)
+{
+  uint64_t first = blk / ctx->ratio;
+  uint64_t end = (blk + n + ctx->ratio - 1) / ctx->ratio;
+
+  if (first >= ctx->ccount) return 0;
+  if (end > ctx->ccount) end = ctx->ccount;
+  return extent_list_add(l, first, end - first);
+}
+
+//given: context, group number, and list
+//return: 0 on success; -ENOMEM on failure
+//side effect: the metadata belonging to group G is added to L (unordered)
+// This is what the bitmap of a BLOCK_UNINIT group would show.
+static int ext_add_group_meta(struct ext_context * ctx, uint32_t g,
+			      struct extent_list * l)
+{
+  struct ext_group * grp = ctx->groups + g;
+  uint64_t first = ext_group_first(ctx, g);
+  int super = ext_has_super(ctx, g);
+  uint32_t mbg = g / ctx->dpb;
+  uint64_t n = super;
+
+  if (!(ctx->sb.feature_incompat & EXT_INCOMPAT_META_BG)
+      || (mbg < ctx->sb.first_meta_bg)) {
+    // old layout: full copy of descriptors and reserved GDT blocks
+    if (super)
+      n += (ctx->sb.feature_incompat & EXT_INCOMPAT_META_BG)
+	? ctx->sb.first_meta_bg
+	: (ctx->ngroups + ctx->dpb - 1) / ctx->dpb
+	  + ctx->sb.reserved_gdt_blocks;
+  } else if (((g % ctx->dpb) == 0) || ((g % ctx->dpb) == 1)
+	     || ((g % ctx->dpb) == ctx->dpb - 1))
+    n++; // copy of this meta group's descriptor block
+
+  if (ext_add_blocks(ctx, l, first, n)
+      || ext_add_blocks(ctx, l, grp->block_bitmap, 1)
+      || ext_add_blocks(ctx, l, grp->inode_bitmap, 1)
+      || ext_add_blocks(ctx, l, grp->inode_table, ctx->itblocks))
+    return -ENOMEM;
+  return 0;
+}
+
+//records ERR as the error of the scan, unless one was recorded already
+static inline void ext_scan_error(struct ext_context * ctx, int err)
+{ __sync_bool_compare_and_swap(&ctx->error, 0, err); }
+
+//adds the clusters FIRST to END to OUT, less any it already holds
+// (runs arrive in order of FIRST, but may overlap the one before)
+static int ext_append(struct extent_list * out, uint64_t first, uint64_t end)
+{
+  // (a sink on OUT has everything but the extent still held)
+  if (out->count) {
+    uint64_t last = out->ext[out->count-1].start
+      + out->ext[out->count-1].length;
+    if (first < last) first = last;
+  }
+  return (end > first) ? extent_list_append(out, first, end - first) : 0;
+}
+
+//adds the run START+LENGTH to OUT, after the metadata of skipped groups
+// that begins no later than it
+static int ext_join_run(struct ext_context * ctx, uint64_t start,
+			uint64_t length)
+{
+  struct extent * m;
+  int ret;
+
+  for (; ctx->nextmeta < ctx->meta.count; ctx->nextmeta++) {
+    m = ctx->meta.ext + ctx->nextmeta;
+    if (m->start > start) break;
+    if ((ret = ext_append(ctx->out, m->start, m->start + m->length)))
+      return ret;
+  }
+  return ext_append(ctx->out, start, start + length);
+}
+
+//marks BATCH scanned and joins every batch that is now ready, in order
+// The first thread to find batches ready joins them, without holding the
+//  lock while a sink takes each extent; others just mark theirs done.
+static void ext_join(struct ext_context * ctx, uint32_t batch)
+{
+  uint32_t nbatch = (ctx->ngroups + EXT_GROUP_BATCH - 1) / EXT_GROUP_BATCH;
+  size_t j;
+  int ret = 0;
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->done[batch] = 1;
+  if (ctx->joining) { pthread_mutex_unlock(&ctx->lock); return; }
+  ctx->joining = 1;
+  while (!ret && (ctx->joined < nbatch) && ctx->done[ctx->joined]) {
+    struct extent_list * l = ctx->batches + ctx->joined++;
+    pthread_mutex_unlock(&ctx->lock);
+    for (j = 0; !ret && (j < l->count); j++)
+      ret = ext_join_run(ctx, l->ext[j].start, l->ext[j].length);
+    extent_list_free(l);
+    pthread_mutex_lock(&ctx->lock);
+  }
+  ctx->joining = 0;
+  pthread_mutex_unlock(&ctx->lock);
+  if (ret) ext_scan_error(ctx, ret);
+}
+
+static void * ext_scan_worker(void * arg)
+{
+  struct ext_context * ctx = arg;
+  uint8_t * buf = malloc((size_t) ctx->bsize * EXT_GROUP_BATCH);
+  uint32_t batch, g, end, j, k;
+
+  if (!buf) { ext_scan_error(ctx, -ENOMEM); return NULL; }
+
+  while (!ctx->error
+	 && ((batch = __sync_fetch_and_add(&ctx->next, 1))
+	     < (ctx->ngroups + EXT_GROUP_BATCH - 1) / EXT_GROUP_BATCH)) {
+    struct extent_list * l = ctx->batches + batch;
+    g = batch * EXT_GROUP_BATCH;
+    end = g + EXT_GROUP_BATCH;
+    if (end > ctx->ngroups) end = ctx->ngroups;
+
+    while (g < end) {
+      if (ctx->csum && (ctx->groups[g].flags & EXT_BG_BLOCK_UNINIT)) {
+	// bitmap never written; its metadata is in CTX->META already
+	g++;
+	continue;
+      }
+      // read this bitmap and any that follow it directly on disk
+      for (k = g + 1; (k < end)
+	     && !(ctx->csum && (ctx->groups[k].flags & EXT_BG_BLOCK_UNINIT))
+	     && (ctx->groups[k].block_bitmap
+		 == ctx->groups[g].block_bitmap + (k - g)); k++);
+      if ((ctx->groups[g].block_bitmap + (k - g) > ctx->bcount)
+	  || (pread(ctx->fd, buf, (size_t) ctx->bsize * (k - g),
+		    (off_t) ctx->groups[g].block_bitmap * ctx->bsize)
+	      != (ssize_t) ctx->bsize * (k - g))) {
+	ext_scan_error(ctx, -EIO);
+	break;
+      }
+      for (j = g; j < k; j++) {
+	uint64_t base = ext_group_first(ctx, j) / ctx->ratio;
+	uint64_t nbits = ctx->sb.clusters_per_group;
+	if (!(ctx->sb.feature_ro_compat & EXT_RO_COMPAT_BIGALLOC))
+	  nbits = ctx->sb.blocks_per_group;
+	if (nbits > ctx->ccount - base) nbits = ctx->ccount - base;
+	if (nbits > 8ULL * ctx->bsize) nbits = 8ULL * ctx->bsize;
+	if (extent_list_add_bitmap(l, buf + (size_t) (j - g) * ctx->bsize,
+				   nbits, base))
+	  { ext_scan_error(ctx, -ENOMEM); break; }
+      }
+      g = k;
+    }
+    if ((g >= end) && !ctx->error) ext_join(ctx, batch);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+//scans the block bitmaps of all groups and builds the block list in EXT
+// returns -error code on error
+// A sink on EXT is given the extents as the batches are joined.
+static int ext_scan(struct ext_context * ctx, struct extent_list * ext)
+{
+  uint32_t nbatch = (ctx->ngroups + EXT_GROUP_BATCH - 1) / EXT_GROUP_BATCH;
+  uint32_t i;
+  int ret = 0;
+
+  ctx->out = ext;
+  ctx->batches = calloc(nbatch, sizeof(struct extent_list));
+  ctx->done = calloc(nbatch, 1);
+  if (!ctx->batches || !ctx->done) { ret = -ENOMEM; goto out; }
+
+  // bitmaps never written are not read; what they would show is known
+  for (i = 0; i < ctx->ngroups; i++)
+    if (ctx->csum && (ctx->groups[i].flags & EXT_BG_BLOCK_UNINIT)) {
+      ctx->skipped++;
+      if (ext_add_group_meta(ctx, i, &ctx->meta)) { ret = -ENOMEM; goto out; }
+    }
+  extent_list_sort(&ctx->meta);
+
+  // the boot block is outside group 0 when blocks are 1024 bytes
+  if (ctx->sb.first_data_block && (ret = extent_list_append(ext, 0, 1)))
+    goto out;
+
+  pthread_mutex_init(&ctx->lock, NULL);
+  analysis_pool_run(analysis_threads(nbatch), ext_scan_worker, ctx, 0);
+  pthread_mutex_destroy(&ctx->lock);
+  if ((ret = ctx->error)) goto out;
+
+  // metadata of skipped groups past the last run of the last batch
+  for (; ctx->nextmeta < ctx->meta.count; ctx->nextmeta++)
+    if ((ret = ext_append(ext, ctx->meta.ext[ctx->nextmeta].start,
+			  ctx->meta.ext[ctx->nextmeta].start
+			  + ctx->meta.ext[ctx->nextmeta].length)))
+      goto out;
+  ret = extent_list_flush(ext);
+
+ out:
+  if (ctx->batches)
+    for (i = 0; i < nbatch; i++) extent_list_free(ctx->batches + i);
+  free(ctx->batches);
+  free(ctx->done);
+  extent_list_free(&ctx->meta);
+  return ret;
+}
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+static int ext_ad_recognize(FILE * fs, const void * hdrbuf)
+{
+  const struct ext_super * sb =
+    (const struct ext_super *)((const uint8_t *) hdrbuf + EXT_SUPER_OFFSET);
+  int ret = 1;
+
+  // the magic number must match
+  ret = ret && (sb->magic == EXT_SUPER_MAGIC);
+  // and the geometry must be sane
+  ret = ret && (sb->log_block_size <= 6)
+    && sb->blocks_per_group && sb->inodes_per_group;
+  // and it must not be an external journal (which has no bitmaps)
+  ret = ret && !(sb->feature_incompat & EXT_INCOMPAT_JOURNAL_DEV);
+
+  return ret;
+}
+
+//return: the name of the ext version with the features in use
+static const char * ext_fstype(struct ext_context * ctx)
+{
+  if (ctx->sb.feature_incompat
+      & (EXT_INCOMPAT_EXTENTS | EXT_INCOMPAT_64BIT | EXT_INCOMPAT_FLEX_BG))
+    return "ext4";
+  if (ctx->sb.feature_compat & EXT_COMPAT_HAS_JOURNAL)
+    return "ext3";
+  return "ext2";
+}
+
+static int ext_ad_analyze(FILE * fs, FILE * out, char * ignore)
+{
+  struct ext_context ctx = { 0 };
+  struct extent_list ext = {0};
+  int ret = 0;
+
+  ret = ext_init(&ctx,fs);
+  if (ret < 0) { errno = -ret; fatal("failed to read ext superblock"); }
+
+  ret = ext_scan(&ctx,&ext);
+  if (ret < 0) { errno = -ret; fatal("failed to scan block bitmaps"); }
+
+  fprintf(out,"Type:\text\n");
+  fprintf(out,"FsType:\t%s\n",ext_fstype(&ctx));
+
+  fprintf(out,"# %d bytes/block; %u groups of %u blocks\n",
+	  ctx.bsize,ctx.ngroups,ctx.sb.blocks_per_group);
+  if (ctx.ratio > 1)
+    fprintf(out,"# bigalloc: %u blocks/cluster; 1 cluster/block\n",
+	    ctx.ratio);
+  if (ctx.skipped)
+    fprintf(out,"# %u groups not initialized; bitmaps not read\n",
+	    ctx.skipped);
+
+  fprintf(out,"BlockSize:\t%u\n",ctx.bsize * ctx.ratio);
+  fprintf(out,"BlockCount:\t%llu\n",(unsigned long long) ext.blocks);
+  fprintf(out,"BlockRange:\t%llu\n",(unsigned long long) ctx.ccount);
+
+  fprintf(out,"BEGIN BLOCK LIST\n");
+  extent_list_emit(out,&ext);
+  fprintf(out,"END BLOCK LIST\n");
+
+  free(ctx.groups);
+  extent_list_free(&ext);
+
+  return 0;
+}
+
+// the batches are joined in order while later ones are still being
+//  scanned, so the extents can be passed on as they are joined;
+//  BlockCount follows them
+static int ext_ad_analyze_sink(FILE * fs, struct extent_sink * sink,
+			       char * ignore)
+{
+  struct ext_context ctx = { 0 };
+  struct extent_list ext = { .sink = sink };
+  int ret = 0;
+
+  ret = ext_init(&ctx,fs);
+  if (ret < 0) { errno = -ret; fatal("failed to read ext superblock"); }
+
+  if ((ret = extent_sink_keyf(sink,"Type","ext"))
+      || (ret = extent_sink_keyf(sink,"FsType","%s",ext_fstype(&ctx)))
+      || (ret = extent_sink_keyf(sink,"BlockSize","%u",
+				 ctx.bsize * ctx.ratio))
+      || (ret = extent_sink_keyf(sink,"BlockRange","%llu",
+				 (unsigned long long) ctx.ccount)))
+    goto out;
+
+  ret = ext_scan(&ctx,&ext);
+  if (ret < 0) { errno = -ret; fatal("failed to scan block bitmaps"); }
+
+  ret = extent_sink_keyf(sink,"BlockCount","%llu",
+			 (unsigned long long) ext.blocks);
+
+ out:
+  free(ctx.groups);
+  extent_list_free(&ext);
+  return ret;
+}
+
+DECLARE_ANALYSIS_MODULE(ext) = {
+  .name = "ext",
+  .fs_hdrsize = EXT_SUPER_OFFSET + sizeof(struct ext_super),
+  .recognize = ext_ad_recognize,
+  .analyze = ext_ad_analyze,
+  0,
+  .analyze_sink = ext_ad_analyze_sink };
+
+//EOF
@@ -0,0 +1,249 @@
+/* In-memory extent lists for analysis modules
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analyze/extents.h"
+#include "analyze/sink.h"
+#include "block/map-parse-v1.h"
+
+int extent_list_append(struct extent_list * l, uint64_t start, uint64_t length)
+{
+  int ret;
+
+  if (!length) return 0;
+
+  if (l->count && (l->ext[l->count-1].start + l->ext[l->count-1].length
+		   == start)) {
+    // continues the last extent
+    l->ext[l->count-1].length += length;
+    l->blocks += length;
+    return 0;
+  }
+
+  // the last extent is now complete; a sink may have it
+  if ((ret = extent_list_flush(l))) return ret;
+
+  return extent_list_add(l, start, length);
+}
+
+int extent_list_flush(struct extent_list * l)
+{
+  struct v1_extent e = {0};
+  int ret;
+
+  if (!l->sink || !l->count) return 0;
+  e.start = l->ext[0].start;
+  e.length = l->ext[0].length;
+  if ((ret = l->sink->extent(l->sink, &e))) return ret;
+  l->count = 0; // (blocks still counts it)
+  return 0;
+}
+
+int extent_list_add(struct extent_list * l, uint64_t start, uint64_t length)
+{
+  if (!length) return 0;
+
+  if (l->count == l->alloc) {
+    size_t n = l->alloc ? l->alloc * 2 : 256;
+    struct extent * p = realloc(l->ext, n * sizeof(struct extent));
+    if (!p) return -ENOMEM;
+    l->ext = p; l->alloc = n;
+  }
+
+  l->ext[l->count].start = start;
+  l->ext[l->count].length = length;
+  l->count++;
+  l->blocks += length;
+  return 0;
+}
+
+static int extent_cmp(const void * a, const void * b)
+{
+  const struct extent * x = a;
+  const struct extent * y = b;
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+void extent_list_sort(struct extent_list * l)
+{
+  size_t i, j;
+
+  if (!l->count) return;
+
+  qsort(l->ext, l->count, sizeof(struct extent), extent_cmp);
+
+  // merge in place
+  l->blocks = l->ext[0].length;
+  for (i = 0, j = 1; j < l->count; j++) {
+    uint64_t end = l->ext[i].start + l->ext[i].length;
+    if (l->ext[j].start <= end) {
+      if (l->ext[j].start + l->ext[j].length > end) {
+	l->blocks += l->ext[j].start + l->ext[j].length - end;
+	l->ext[i].length = l->ext[j].start + l->ext[j].length
+	  - l->ext[i].start;
+      }
+    } else {
+      l->ext[++i] = l->ext[j];
+      l->blocks += l->ext[i].length;
+    }
+  }
+  l->count = i + 1;
+}
+
+int extent_list_subtract(struct extent_list * l,
+			 const struct extent_list * sub)
+{
+  struct extent_list out = {0};
+  size_t i, j = 0, k;
+
+  for (i = 0; i < l->count; i++) {
+    uint64_t cur = l->ext[i].start;
+    uint64_t end = cur + l->ext[i].length;
+
+    // skip holes that end before this extent begins
+    while ((j < sub->count)
+	   && (sub->ext[j].start + sub->ext[j].length <= cur))
+      j++;
+    // cut out each hole that overlaps this extent
+    for (k = j; (k < sub->count) && (sub->ext[k].start < end); k++) {
+      if ((sub->ext[k].start > cur)
+	  && extent_list_append(&out, cur, sub->ext[k].start - cur))
+	goto fail;
+      if (sub->ext[k].start + sub->ext[k].length > cur)
+	cur = sub->ext[k].start + sub->ext[k].length;
+      if (cur >= end) break;
+    }
+    if ((cur < end) && extent_list_append(&out, cur, end - cur))
+      goto fail;
+  }
+
+  extent_list_free(l);
+  *l = out;
+  return 0;
+
+ fail:
+  extent_list_free(&out);
+  return -ENOMEM;
+}
+
+int extent_list_intersect(struct extent_list * l,
+			  const struct extent_list * with)
+{
+  struct extent_list out = {0};
+  size_t i, j = 0, k;
+
+  for (i = 0; i < l->count; i++) {
+    uint64_t cur = l->ext[i].start;
+    uint64_t end = cur + l->ext[i].length;
+
+    // skip runs that end before this extent begins
+    while ((j < with->count)
+	   && (with->ext[j].start + with->ext[j].length <= cur))
+      j++;
+    // keep the part of this extent inside each run that overlaps it
+    for (k = j; (k < with->count) && (with->ext[k].start < end); k++) {
+      uint64_t from = (with->ext[k].start > cur) ? with->ext[k].start : cur;
+      uint64_t to = with->ext[k].start + with->ext[k].length;
+      if (to > end) to = end;
+      if (extent_list_append(&out, from, to - from))
+	goto fail;
+    }
+  }
+
+  extent_list_free(l);
+  *l = out;
+  return 0;
+
+ fail:
+  extent_list_free(&out);
+  return -ENOMEM;
+}
+
+/* PORTABILITY NOTE: assumes a little-endian CPU, so that bit N of a
+ *			 64-bit word loaded from the bitmap is bit N%8 of
+ *			 byte N/8, as on disk
+ */
+int extent_list_add_bitmap(struct extent_list * l, const void * bitmap,
+			   uint64_t nbits, uint64_t base)
+{
+  const uint8_t * p = bitmap;
+  uint64_t i = 0;	// bit index of current word
+  uint64_t run = 0;	// bit index where current run of set bits began
+  int in_run = 0;
+  int ret;
+
+  for (i = 0; i < nbits; i += 64, p += 8) {
+    uint64_t w = 0;
+    unsigned int pos = 0;
+
+    if (nbits - i >= 64)
+      memcpy(&w, p, 8);
+    else {
+      // final partial word: load only the bytes that exist, mask the rest
+      memcpy(&w, p, (nbits - i + 7) / 8);
+      w &= (1ULL << (nbits - i)) - 1;
+    }
+
+    if (w == (in_run ? ~0ULL : 0ULL))
+      continue; // no edge in this word
+
+    while (pos < 64) {
+      uint64_t x = (in_run ? ~w : w) >> pos;
+      if (!x) break;
+      pos += __builtin_ctzll(x);
+      if (in_run) {
+	if ((ret = extent_list_append(l, base + run, i + pos - run)))
+	  return ret;
+      } else
+	run = i + pos;
+      in_run = !in_run;
+    }
+  }
+  if (in_run) {
+    // run extends to the end of the bitmap; I is past NBITS here
+    if ((ret = extent_list_append(l, base + run, nbits - run)))
+      return ret;
+  }
+
+  return 0;
+}
+
+void extent_list_emit(FILE * out, const struct extent_list * l)
+{
+  size_t i;
+
+  for (i = 0; i < l->count; i++)
+    fprintf(out,"%llu+%llu\n",
+	    (unsigned long long) l->ext[i].start,
+	    (unsigned long long) l->ext[i].length);
+}
+
+void extent_list_free(struct extent_list * l)
+{
+  free(l->ext);
+  memset(l,0,sizeof(struct extent_list));
+}
@@ -30,34 +30,48 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "multicall.h"
+#include "keylist.h"
 
 #include "analyze/ecma-107.h"
 #include "analyze/dispatch.h"
+#include "analyze/extents.h"
 
 /* It appears that the ONLY aligned block in a FAT filesystem is the
  *  hardware sector.  In other words, the cluster size means nothing beyond
  *  the amount of space each FAT entry represents.  In particular, we have
  *  no guarantee that bootsect+FATs+rootdir align the data region on a
- *  cluster boundary.  This means that the blocksize used for imaging just
- *  about must be the sector size, since otherwise the blocks can't be
- *  guaranteed to line up with the allocation unit used in the filesystem.
+ *  cluster boundary.
+ * Most formatters do align it, though, and then the cluster is the natural
+ *  imaging block.  When they do not, any power-of-two number of sectors
+ *  that divides both the cluster size and the size of the System Area
+ *  still lines up with every cluster, so we use the largest such block.
+ *  In the worst case (odd-sized System Area) this is the sector size.
  */
 
 struct FAT_context {
   off_t FAT_offset;	// offset of first FAT in filesystem
   FILE * fs;		// stream open on filesystem
-  uint32_t ssize;	// sector size in bytes (imaging block size)
+  uint32_t ssize;	// sector size in bytes
   uint32_t spc;		// sectors per cluster
+  uint32_t spb;		// sectors per imaging block
   uint32_t spf;		// sectors per FAT
   uint32_t ssa;		// number of sectors preceding data region
   uint32_t scount;	// total number of sectors
-  uint32_t dscount;	// number of sectors with data (includes system area)
+  uint32_t ccount;	// number of clusters in data region
   uint32_t type;	// bits per FAT entry
+  uint32_t rdfc;	// first cluster of root directory (FAT32 only)
+  uint32_t active;	// index of FAT to read (FAT32 may disable mirroring)
+  uint32_t rdecnt;	// number of root directory entries (FAT12/FAT16)
+  off_t rd_offset;	// offset of root directory (FAT12/FAT16)
+  uint8_t * FAT;	// in-memory copy of first FAT
+  size_t FATlen;	// size of FAT in bytes
+  struct extent_list ext; // blocks with data (includes system area)
 };
 
 //reads boot record and fills in context struct
@@ -77,6 +91,7 @@ static int FAT_init(struct FAT_context * ctx, FILE * fs)
   ctx->ssize = brec.ssize;
   ctx->spc   = brec.spc;
   ctx->spf   = brec.spf;
+  ctx->rdecnt = brec.rdecnt;
   ctx->ssa   = ssa_from_ecma107_desc(&brec);
   if (brec.scnt_small) ctx->scount = brec.scnt_small;
   else ctx->scount = brec.scnt;
@@ -103,7 +118,20 @@ static int FAT_init(struct FAT_context * ctx, FILE * fs)
     // this sure *looks* like FAT32; paranoia here because FAT32
     //  puts the EPB signature where FAT12/FAT16 stored boot code
     ctx->type = 32;
-    //fixup other values (I'm doubting SSA is still valid, for example)
+    //fixup other values; the 16-bit sectors/FAT is zero on FAT32
+    ctx->spf  = brec.f32.spf;
+    ctx->ssa  = COMPUTE_SSA(brec.rscnt,brec.fatcnt,ctx->spf,
+			    brec.rdecnt,brec.ssize);
+    ctx->rdfc = brec.f32.rdfc;
+    // bit 7 set means mirroring is disabled and only the FAT named
+    //  in bits 0-3 is current; otherwise all FATs match the first
+    if (brec.f32.flags & 0x80)
+      ctx->active = brec.f32.flags & 0x0F;
+    if (ctx->active >= brec.fatcnt) {
+      fprintf(stderr,"FAT32 active FAT %d does not exist; using FAT 0\n",
+	      ctx->active);
+      ctx->active = 0;
+    }
   } else {
     // ancient FAT filesystem
     fprintf(stderr,
@@ -116,172 +144,456 @@ static int FAT_init(struct FAT_context * ctx, FILE * fs)
   fseeko(fs, brec.ssize * (brec.rscnt - 1), SEEK_CUR);
 
   ctx->FAT_offset = ftello(fs);
+  ctx->rd_offset = ctx->FAT_offset
+    + (off_t) brec.fatcnt * ctx->spf * ctx->ssize;
+  ctx->FAT_offset += (off_t) ctx->active * ctx->spf * ctx->ssize;
 
   return 0; //success
 }
 
-static uint32_t FAT_count_used_sectors(struct FAT_context * ctx)
+//reads the active FAT into memory in one request
+// returns -error code on error
+static int FAT_load(struct FAT_context * ctx)
+{
+  size_t FATlen = (size_t) ctx->spf * ctx->ssize;
+
+  // one extra word so that the FAT12 decoder may read past the last entry
+  ctx->FAT = malloc(FATlen + sizeof(uint32_t));
+  if (!ctx->FAT) return -ENOMEM;
+  memset(ctx->FAT + FATlen, 0, sizeof(uint32_t));
+
+  if (fseeko(ctx->fs, ctx->FAT_offset, SEEK_SET))
+    return -EIO;
+  if (fread(ctx->FAT, FATlen, 1, ctx->fs) != 1)
+    return -EIO;
+
+  ctx->FATlen = FATlen;
+  ctx->ccount = (ctx->scount - ctx->ssa) / ctx->spc;
+  // a FAT can be longer than the volume needs, but never shorter
+  if (ctx->ccount > (FATlen * 8 / ctx->type) - 2)
+    ctx->ccount = (FATlen * 8 / ctx->type) - 2;
+
+  // choose the imaging block; see comment at top of file
+  for (ctx->spb = ctx->spc; ctx->ssa % ctx->spb; ctx->spb >>= 1);
+
+  return 0;
+}
+
+// FAT12 entries are 1.5 bytes; each is found in the 16-bit word at
+//  byte offset N + N/2 and is the low 12 bits (even N) or high 12 bits
+//  (odd N) of that word.  Computing the shift avoids a branch per entry.
+static inline uint32_t FAT12_entry(const uint8_t * FAT, uint32_t n)
+{ return (*((uint16_t*)(FAT + n + (n >> 1))) >> ((n & 1) << 2)) & 0xFFF; }
+static inline uint32_t FAT16_entry(const uint8_t * FAT, uint32_t n)
+{ return ((uint16_t*)FAT)[n]; }
+// FAT32 entries are really 28 bits; the top 4 bits are reserved
+static inline uint32_t FAT32_entry(const uint8_t * FAT, uint32_t n)
+{ return ((uint32_t*)FAT)[n] & 0x0FFFFFFF; }
+
+/* A FAT32 table on a large card runs to hundreds of MB, but long stretches
+ *  are either entirely free or entirely allocated.  FAT32_skip compares 8
+ *  entries at a time (GCC vector extensions; SSE2/AVX2 or NEON as the
+ *  target allows) and returns the first cluster at or after N, rounded
+ *  down to a group of 8, whose state may differ from ALLOC.
+ */
+typedef uint32_t FAT32_vec __attribute__((vector_size(32)));
+static uint32_t FAT32_skip(const uint8_t * FAT, uint32_t n, uint32_t end,
+			   int alloc)
+{
+  const FAT32_vec mask = (FAT32_vec){0} + 0x0FFFFFFF;
+  const FAT32_vec bad  = (FAT32_vec){0} + 0x0FFFFFF7;
+  union { FAT32_vec v; uint64_t q[4]; } f;
+
+  for (n &= ~7; n + 8 <= end; n += 8) {
+    FAT32_vec cells;
+    memcpy(&cells, FAT + ((size_t) n << 2), sizeof(cells));
+    cells &= mask;
+    // lanes are all-ones where the cluster is free or bad
+    f.v = (FAT32_vec)((cells == 0) | (cells == bad));
+    if (alloc) {
+      if (f.q[0] | f.q[1] | f.q[2] | f.q[3]) break;
+    } else {
+      if (~(f.q[0] & f.q[1] & f.q[2] & f.q[3])) break;
+    }
+  }
+  return n;
+}
+
+//scans the in-memory FAT and builds the block list in CTX->EXT
+// the system area and every allocated cluster are listed;
+// free clusters and clusters marked bad are omitted
+// returns -error code on error
+static int FAT_scan(struct FAT_context * ctx)
 {
-  uint32_t count = 0;
-  uint32_t block = 0;
+  uint32_t n = 0;	// cluster number
+  uint32_t run = 0;	// first cluster in current run of allocated clusters
+  uint32_t end = ctx->ccount + 2;
+  int alloc = 0, was = 0;
+
+  // close a run of allocated clusters ending before cluster N
+#define FAT_RUN_EDGE						\
+  do {								\
+    if (alloc && !was) run = n;					\
+    else if (was && !alloc						\
+	     && extent_list_append(&ctx->ext,			\
+				   CN_TO_LSN(run,ctx->spc,ctx->ssa)	\
+				   / ctx->spb,					\
+				   (uint64_t)(n - run) * ctx->spc	\
+				   / ctx->spb))				\
+      return -ENOMEM;						\
+    was = alloc;						\
+  } while (0)
 
   //first: account for the System Area
-  block = count = ctx->ssa;
+  if (extent_list_append(&ctx->ext, 0, ctx->ssa / ctx->spb))
+    return -ENOMEM;
 
-  //second: run through the FAT and count used sectors
-  fseeko(ctx->fs, ctx->FAT_offset, SEEK_SET);
+  //second: run through the FAT and list the used clusters in the Data Area
   switch (ctx->type) {
   case 12:
-    {
-      union {
-	uint8_t buf[3];
-	uint16_t even;
-	struct {
-	  uint8_t pad;
-	  uint16_t odd;
-	} __attribute__((packed));
-      } cell;
-      uint16_t step = 0;
-#define FATcell ((step & 1) ? ((cell.odd >> 4) & 0xFFF) : (cell.even & 0xFFF))
-      //skip the first two FAT entries
-      fread(cell.buf,3,1,ctx->fs);
-      fread(cell.buf,3,1,ctx->fs);
-      for (step=0; block < ctx->scount; step++, block += ctx->spc) {
-	// skip bad clusters also (0xFF7)
-	if ((FATcell != 0) && (FATcell != 0xFF7))
-	  count +=ctx->spc;
-	if (step & 1) fread(cell.buf,3,1,ctx->fs);
-      }
-#undef FATcell
+    for (n = 2; n < end; n++) {
+      uint32_t cell = FAT12_entry(ctx->FAT, n);
+      // skip bad clusters also (0xFF7)
+      alloc = (cell != 0) & (cell != 0xFF7);
+      if (alloc != was) FAT_RUN_EDGE;
     }
     break;
   case 16:
-    {
-      uint16_t FATcell;
-
-      //skip first two FAT entries
-      fseek(ctx->fs,4,SEEK_CUR);
-      for (FATcell=0; block < ctx->scount; block += ctx->spc) {
-	fread(&FATcell,2,1,ctx->fs);
-	//also skip bad clusters (0xFFF7)
-	if ((FATcell != 0) && (FATcell != 0xFFF7))
-	  count += ctx->spc;
-      }
+    for (n = 2; n < end; n++) {
+      uint32_t cell = FAT16_entry(ctx->FAT, n);
+      // skip bad clusters also (0xFFF7)
+      alloc = (cell != 0) & (cell != 0xFFF7);
+      if (alloc != was) FAT_RUN_EDGE;
     }
     break;
   case 32:
-    {
+    for (n = 2; n < end; n++) {
+      uint32_t cell;
+      if (!(n & 7)) {
+	// skip ahead while whole groups of 8 match the current state
+	uint32_t m = FAT32_skip(ctx->FAT, n, end, was);
+	if (m >= end) { n = end; break; }
+	n = m;
+      }
+      cell = FAT32_entry(ctx->FAT, n);
+      // skip bad clusters also (0x0FFFFFF7)
+      alloc = (cell != 0) & (cell != 0x0FFFFFF7);
+      if (alloc != was) FAT_RUN_EDGE;
     }
     break;
   default:
     fprintf(stderr,"FAT filesystem not one of FAT12/FAT16/FAT32\n");
+    return -EINVAL;
+  }
+  alloc = 0; FAT_RUN_EDGE; //emit last run
+#undef FAT_RUN_EDGE
+
+  return 0;
+}
+
+//given: context and cluster number
+//return: next cluster in chain, or 0 if N is the last cluster (or bad/free)
+static uint32_t FAT_next(struct FAT_context * ctx, uint32_t n)
+{
+  uint32_t cell = 0, eoc = 0;
+
+  if ((n < 2) || (n >= ctx->ccount + 2)) return 0;
+  switch (ctx->type) {
+  case 12: cell = FAT12_entry(ctx->FAT, n); eoc = 0xFF7;	break;
+  case 16: cell = FAT16_entry(ctx->FAT, n); eoc = 0xFFF7;	break;
+  case 32: cell = FAT32_entry(ctx->FAT, n); eoc = 0x0FFFFFF7;	break;
+  }
+  // end-of-chain marks, the bad cluster mark, and nonsense all end a chain
+  if ((cell < 2) || (cell >= eoc) || (cell >= ctx->ccount + 2)) return 0;
+  return cell;
+}
+
+//given: context, first cluster of chain, and function to call on each run
+//return: number of clusters in chain, or -error code
+// Runs of consecutive clusters are passed as (first cluster, count).  The
+//  chain is read from the in-memory FAT, so following it costs no I/O; a
+//  chain longer than the volume must loop and is cut off there.
+static int64_t FAT_chain(struct FAT_context * ctx, uint32_t n,
+			 int (*fn)(uint32_t, uint32_t, void *), void * arg)
+{
+  uint32_t run = n, len = 0;
+  int64_t total = 0;
+  int ret;
+
+  if ((n < 2) || (n >= ctx->ccount + 2)) return 0;
+  while (n) {
+    uint32_t next = FAT_next(ctx, n);
+    len++;
+    if ((next != n + 1) || (total + len > ctx->ccount)) {
+      if ((ret = fn(run, len, arg)) < 0) return ret;
+      total += len;
+      if (total >= ctx->ccount) break;
+      run = next; len = 0;
+    }
+    n = next;
+  }
+  return total;
+}
+
+/* Files to exclude are named by path from the root directory.  Only the
+ *  directories along each path are read; each is read in as few requests
+ *  as its cluster chain allows.  Names match either the long (VFAT) name
+ *  or the 8.3 name, ignoring the case of ASCII letters.
+ */
+
+#define FAT_ATTR_VOLUME	0x08
+#define FAT_ATTR_DIR	0x10
+#define FAT_ATTR_LFN	0x0F
+#define FAT_LFN_MAX	255
+
+struct FAT_dirbuf {		// directory contents being read into memory
+  struct FAT_context * ctx;
+  uint8_t * buf;
+  size_t len;
+};
+
+static int FAT_dirbuf_add(uint32_t run, uint32_t len, void * arg)
+{
+  struct FAT_dirbuf * d = arg;
+  struct FAT_context * ctx = d->ctx;
+  size_t bytes = (size_t) len * ctx->spc * ctx->ssize;
+  uint8_t * p = realloc(d->buf, d->len + bytes);
+
+  if (!p) return -ENOMEM;
+  d->buf = p;
+  if (fseeko(ctx->fs, (off_t) CN_TO_LSN(run, ctx->spc, ctx->ssa) * ctx->ssize,
+	     SEEK_SET)
+      || (fread(d->buf + d->len, bytes, 1, ctx->fs) != 1))
+    return -EIO;
+  d->len += bytes;
+  return 0;
+}
+
+//given: context, first cluster of directory (0 for root), and result buffer
+//return: 0 on success, -error code on error
+//side effect on success: D->BUF holds the directory (caller frees)
+static int FAT_read_dir(struct FAT_context * ctx, uint32_t first,
+			struct FAT_dirbuf * d)
+{
+  int64_t ret;
+
+  d->ctx = ctx; d->buf = NULL; d->len = 0;
+  if (!first && (ctx->type != 32)) {
+    // FAT12/FAT16 root directory is in the System Area, after the FATs
+    d->len = (size_t) ctx->rdecnt * 32;
+    d->buf = malloc(d->len);
+    if (!d->buf) return -ENOMEM;
+    if (fseeko(ctx->fs, ctx->rd_offset, SEEK_SET)
+	|| (fread(d->buf, d->len, 1, ctx->fs) != 1))
+      { free(d->buf); d->buf = NULL; return -EIO; }
     return 0;
   }
-  return count;
+  ret = FAT_chain(ctx, first ? first : ctx->rdfc, FAT_dirbuf_add, d);
+  if (ret < 0) { free(d->buf); d->buf = NULL; return ret; }
+  return 0;
 }
 
-static void emit_FAT_blocklist(FILE * out,struct FAT_context * ctx)
+//given: UTF-16 name and length, and UTF-8 path component and length
+//return: TRUE if they are equal, ignoring case of ASCII letters
+static int FAT_name_eq(const uint16_t * name, int len, const char * s, int slen)
 {
-  uint64_t block = 0; /* counter */
-  uint64_t start = 0; /* first block in current extent */
-  enum {FREE, ALLOC} state = FREE;
+  const uint8_t * p = (const uint8_t *) s;
+  const uint8_t * end = p + slen;
+  int i = 0;
+
+  while (p < end) {
+    uint32_t c = *p++;
+    int more = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+    if (more) c &= 0x3F >> more;
+    for (; more && (p < end); more--)
+      c = (c << 6) | (*p++ & 0x3F);
+    if (c >= 0x10000) {
+      // surrogate pair
+      c -= 0x10000;
+      if ((i + 2 > len) || (name[i] != (0xD800 | (c >> 10)))
+	  || (name[i+1] != (0xDC00 | (c & 0x3FF))))
+	return 0;
+      i += 2;
+    } else {
+      uint32_t x = (i < len) ? name[i] : 0;
+      if ((c >= 'a') && (c <= 'z')) c -= 'a' - 'A';
+      if ((x >= 'a') && (x <= 'z')) x -= 'a' - 'A';
+      if ((i >= len) || (c != x)) return 0;
+      i++;
+    }
+  }
+  return i == len;
+}
 
-  //first: account for the System Area
-  fprintf(out,"0+%ld\n",ctx->ssa);
-  block = ctx->ssa;
+//given: directory entry
+//return: checksum of its 8.3 name, as stored in its long name entries
+static inline uint8_t FAT_lfn_checksum(const uint8_t * ent)
+{
+  uint8_t sum = 0;
+  int i;
 
-  //second: run through the FAT and list the used blocks in the Data Area
-  fseeko(ctx->fs, ctx->FAT_offset, SEEK_SET);
-  switch (ctx->type) {
-  case 12:
-    {
-      union {
-	uint8_t buf[3];
-	uint16_t even;
-	struct {
-	  uint8_t pad;
-	  uint16_t odd;
-	} __attribute__((packed));
-      } cell;
-      uint16_t step = 0;
-#define FATcell ((step & 1) ? ((cell.odd >> 4) & 0xFFF) : (cell.even & 0xFFF))
-#ifdef DUMP_FAT_INSTEAD
-      printf("%6s %4X%4X%4X%4X%4X%4X%4X%4X%4X%4X%4X%4X%4X%4X%4X%4X",
-	     "",0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
-#else
-      //skip the first two FAT entries
-      fread(cell.buf,3,1,ctx->fs);
-#endif
-      fread(cell.buf,3,1,ctx->fs);
-      for (step=0; block < ctx->scount; step++, block += ctx->spc) {
-#ifdef DUMP_FAT_INSTEAD
-	if (!((block - ctx->ssa) & 15))
-	  printf("\n%6X:",block - ctx->ssa);
-	printf("%4X",FATcell);
-#else
-	switch (state) {
-	case FREE:
-	  // skip bad clusters also (0xFF7)
-	  if ((FATcell != 0) && (FATcell != 0xFF7))
-	    { start = block; state = ALLOC; }
-	  break;
-	case ALLOC:
-	  if ((FATcell == 0) || (FATcell == 0xFF7))
-	    { fprintf(out,"%lld+%lld\n",start,block-start); state = FREE; }
-	  break;
-	}
-#endif
-	if (step & 1) fread(cell.buf,3,1,ctx->fs);
+  for (i = 0; i < 11; i++)
+    sum = ((sum & 1) << 7) + (sum >> 1) + ent[i];
+  return sum;
+}
+
+//given: context, directory to search (first cluster; 0 for root),
+//	 path component and its length, and ptr to directory entry copy
+//return: 1 if found, 0 if not, -error code on error
+static int FAT_lookup(struct FAT_context * ctx, uint32_t dir,
+		      const char * name, int namelen, uint8_t * found)
+{
+  struct FAT_dirbuf d;
+  uint16_t lfn[FAT_LFN_MAX + 13 + 1];
+  uint16_t sfn[12];
+  uint8_t lfnsum = 0;
+  int lfnok = 0;	// LFN holds a complete long name for the next entry
+  size_t off;
+  int ret, i, n;
+
+  if ((ret = FAT_read_dir(ctx, dir, &d)) < 0) return ret;
+
+  ret = 0;
+  for (off = 0; off + 32 <= d.len; off += 32) {
+    uint8_t * ent = d.buf + off;
+
+    if (ent[0] == 0x00) break; // end of directory
+    if (ent[0] == 0xE5) { lfnok = 0; continue; } // deleted
+    if ((ent[11] & 0x3F) == FAT_ATTR_LFN) {
+      int ord = ent[0] & 0x1F;
+      if (ent[0] & 0x40) {
+	// last piece of name comes first
+	memset(lfn, 0xFF, sizeof(lfn));
+	lfnsum = ent[13]; lfnok = 1;
       }
-#undef FATcell
+      if (!ord || (ent[13] != lfnsum) || (ord * 13 > FAT_LFN_MAX + 13))
+	{ lfnok = 0; continue; }
+      // 13 UTF-16 characters per entry, in three pieces
+      n = (ord - 1) * 13;
+      for (i = 0; i < 5; i++) lfn[n++] = ent[1 + 2*i] | (ent[2 + 2*i] << 8);
+      for (i = 0; i < 6; i++) lfn[n++] = ent[14 + 2*i] | (ent[15 + 2*i] << 8);
+      for (i = 0; i < 2; i++) lfn[n++] = ent[28 + 2*i] | (ent[29 + 2*i] << 8);
+      continue;
     }
-    break;
-  case 16:
-    {
-      uint16_t FATcell;
-      uint16_t step;
-#ifdef DUMP_FAT_INSTEAD
-      printf("%6s %6X%6X%6X%6X%6X%6X%6X%6X%6X%6X%6X%6X%6X%6X%6X%6X",
-	     "",0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
-#else
-      //skip first two FAT entries
-      fseek(ctx->fs,4,SEEK_CUR);
-#endif
-      for (step=0; block < ctx->scount; step++, block += ctx->spc) {
-	fread(&FATcell,2,1,ctx->fs);
-#ifdef DUMP_FAT_INSTEAD
-	if (!((step) & 15))
-	  printf("\n%6X:",step);
-	printf("%6X",FATcell);
-#else
-	switch (state) {
-	case FREE:
-	  //also skip bad clusters (0xFFF7)
-	  if ((FATcell != 0) && (FATcell != 0xFFF7))
-	    { start = block; state = ALLOC; }
-	  break;
-	case ALLOC:
-	  if ((FATcell == 0) || (FATcell == 0xFFF7))
-	    { fprintf(out,"%lld+%lld\n",start,block-start); state = FREE; }
-	  break;
-	}
-#endif
-      }
+    if (ent[11] & FAT_ATTR_VOLUME) { lfnok = 0; continue; }
+
+    if (lfnok && (FAT_lfn_checksum(ent) == lfnsum)) {
+      for (n = 0; (n < FAT_LFN_MAX) && lfn[n] && (lfn[n] != 0xFFFF); n++);
+      if (FAT_name_eq(lfn, n, name, namelen)) { ret = 1; break; }
     }
-    break;
-  case 32:
-    {
-      fprintf(stderr,"FAT32 support not implemented yet\n");
-      return;
+    lfnok = 0;
+
+    // 8.3 name: blank-padded base and extension; 0x05 stands for 0xE5
+    for (n = 0, i = 0; (i < 8) && (ent[i] != ' '); i++)
+      sfn[n++] = ((i == 0) && (ent[0] == 0x05)) ? 0xE5 : ent[i];
+    if (ent[8] != ' ') sfn[n++] = '.';
+    for (i = 8; (i < 11) && (ent[i] != ' '); i++)
+      sfn[n++] = ent[i];
+    if (FAT_name_eq(sfn, n, name, namelen)) { ret = 1; break; }
+  }
+
+  if (ret) memcpy(found, d.buf + off, 32);
+  free(d.buf);
+  return ret;
+}
+
+struct FAT_holes {		// clusters to remove from the block list
+  struct FAT_context * ctx;
+  struct extent_list list;	// in imaging blocks, unordered
+};
+
+static int FAT_hole_add(uint32_t run, uint32_t len, void * arg)
+{
+  struct FAT_holes * h = arg;
+  struct FAT_context * ctx = h->ctx;
+
+  return extent_list_add(&h->list,
+			 CN_TO_LSN(run,ctx->spc,ctx->ssa) / ctx->spb,
+			 (uint64_t) len * ctx->spc / ctx->spb);
+}
+
+//given: context, and output for comments
+//return: 0 on success, -error code on error
+//side effect: clusters of each file named by the exclude option are
+//	       removed from CTX->EXT and a comment is written to OUT
+static int FAT_exclude_files(struct FAT_context * ctx, FILE * out)
+{
+  struct FAT_holes holes = { ctx, {0} };
+  char * paths = keylist_get(analysis_args, "exclude");
+  char * path;
+  char * p;
+  char * s;
+  int ret = 0;
+
+  if (!paths || !*paths) return 0;
+  paths = strdup(paths);
+  if (!paths) return -ENOMEM;
+  for (p = paths; *p; p++)
+    if (*p == '\\') *p = '/';
+
+  for (path = strtok(paths, ","); path; path = strtok(NULL, ",")) {
+    uint8_t ent[32];
+    uint32_t dir = 0;
+    int64_t n;
+
+    // look up each component in turn
+    for (p = path; *p == '/'; p++);
+    ret = 0;
+    while (*p) {
+      for (s = p; *s && (*s != '/'); s++);
+      ret = FAT_lookup(ctx, dir, p, s - p, ent);
+      if (ret <= 0) break;
+      for (p = s; *p == '/'; p++);
+      dir = ent[26] | (ent[27] << 8);
+      if (ctx->type == 32) dir |= (ent[20] << 16) | (ent[21] << 24);
+      if (*p && !(ent[11] & FAT_ATTR_DIR)) { ret = 0; break; }
     }
-    break;
-  default:
-    fprintf(stderr,"FAT filesystem not one of FAT12/FAT16/FAT32\n");
-    return;
+    if (ret < 0) goto out;
+    if (!ret) {
+      fprintf(stderr,"exclude: %s not found\n", path);
+      continue;
+    }
+    if (ent[11] & FAT_ATTR_DIR) {
+      fprintf(stderr,"exclude: %s is a directory; not excluded\n", path);
+      continue;
+    }
+
+    n = dir ? FAT_chain(ctx, dir, FAT_hole_add, &holes) : 0;
+    if (n < 0) { ret = n; goto out; }
+    fprintf(out,"# excluded %s: %llu clusters\n", path,
+	    (unsigned long long) n);
+  }
+
+  extent_list_sort(&holes.list);
+  ret = extent_list_subtract(&ctx->ext, &holes.list);
+
+ out:
+  extent_list_free(&holes.list);
+  free(paths);
+  return ret;
+}
+
+#ifdef DUMP_FAT_INSTEAD
+static void FAT_dump(FILE * out, struct FAT_context * ctx)
+{
+  uint32_t n;
+
+  fprintf(out,"%6s ","");
+  for (n = 0; n < 16; n++)
+    fprintf(out,(ctx->type == 12) ? "%4X" : (ctx->type == 16) ? "%6X" : "%9X",n);
+  for (n = 0; n < ctx->ccount + 2; n++) {
+    if (!(n & 15))
+      fprintf(out,"\n%6X:",n);
+    if (ctx->type == 12)
+      fprintf(out,"%4X",FAT12_entry(ctx->FAT, n));
+    else if (ctx->type == 16)
+      fprintf(out,"%6X",FAT16_entry(ctx->FAT, n));
+    else
+      fprintf(out,"%9X",FAT32_entry(ctx->FAT, n));
   }
-  if (state == ALLOC) //emit last run
-    fprintf(out,"%lld+%lld\n",start,block-start);
+  fprintf(out,"\n");
 }
+#endif
 
 static char usagetext[] = "analyze_fat <FAT filesystem image>\n";
 
@@ -296,7 +608,8 @@ static int FAT_ad_recognize(FILE * fs, const void * hdrbuf)
   // one of the sector counts must be non-zero
   ret = ret && (f->scnt_small || f->scnt);
   // and both sectors/cluster and sectors/FAT be non-zero
-  ret = ret && f->spc && f->spf;
+  //  (FAT32 keeps sectors/FAT in its own EPB)
+  ret = ret && f->spc && (f->spf || f->f32.spf);
   // and the System Area must have a non-zero computed size
   ret = ret && ssa_from_ecma107_desc(f);
   // and the EPB must contain "FAT" fstype
@@ -323,22 +636,47 @@ static int FAT_ad_analyze(FILE * fs, FILE * out, char * ignore)
   ret = FAT_init(&ctx,fs);
   if (ret < 0) fatal("failed to read FS descriptor");
 
-  ctx.dscount = FAT_count_used_sectors(&ctx);
+  ret = FAT_load(&ctx);
+  if (ret < 0) { errno = -ret; fatal("failed to read FAT"); }
+
+#ifdef DUMP_FAT_INSTEAD
+  FAT_dump(out,&ctx);
+  free(ctx.FAT);
+  return 0;
+#endif
+
+  ret = FAT_scan(&ctx);
+  if (ret < 0) { free(ctx.FAT); extent_list_free(&ctx.ext); return 1; }
 
   fprintf(out,"Type:\tFAT\n");
   fprintf(out,"FsType:\tFAT%d\n",ctx.type);
 
+  ret = FAT_exclude_files(&ctx,out);
+  if (ret < 0) { errno = -ret; fatal("failed to read directories"); }
+
   fprintf(out,"# %d sectors/cluster; %d sectors/FAT\n",ctx.spc,ctx.spf);
-  fprintf(out,"# FAT spans %d entries\n",ctx.spf * ctx.ssize * 8 / ctx.type);
+  fprintf(out,"# FAT spans %llu entries\n",
+	  (unsigned long long) ctx.spf * ctx.ssize * 8 / ctx.type);
+  if (ctx.active)
+    fprintf(out,"# FAT mirroring disabled; using FAT %d\n",ctx.active);
+
+  if (ctx.spb == ctx.spc)
+    fprintf(out,"# data region is cluster-aligned; 1 cluster/block\n");
+  else
+    fprintf(out,"# data region is not cluster-aligned; %d sectors/block\n",
+	    ctx.spb);
 
-  fprintf(out,"BlockSize:\t%d\n",ctx.ssize);
-  fprintf(out,"BlockCount:\t%d\n",ctx.dscount);
-  fprintf(out,"BlockRange:\t%d\n",ctx.scount);
+  fprintf(out,"BlockSize:\t%d\n",ctx.ssize * ctx.spb);
+  fprintf(out,"BlockCount:\t%llu\n",(unsigned long long) ctx.ext.blocks);
+  fprintf(out,"BlockRange:\t%d\n",ctx.scount / ctx.spb);
 
   fprintf(out,"BEGIN BLOCK LIST\n");
-  emit_FAT_blocklist(out,&ctx);
+  extent_list_emit(out,&ctx.ext);
   fprintf(out,"END BLOCK LIST\n");
 
+  free(ctx.FAT);
+  extent_list_free(&ctx.ext);
+
   return 0;
 }
 
@@ -0,0 +1,158 @@
+/* Helpers for mapping mounted filesystems
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <limits.h>
+#include <mntent.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+
+#include "analyze/mounted.h"
+
+#define FSMAP_RECS	512	/* records per GETFSMAP call */
+
+//given: device number as GETFSMAP reports it (with FMH_OF_DEV_T)
+//return: the same in dev_t form
+static inline dev_t fsmap_decode_dev(uint32_t d)
+{ return makedev((d & 0xfff00) >> 8, (d & 0xff) | ((d >> 12) & 0xfff00)); }
+
+int mounted_check_source(int srcfd, const struct stat * mst)
+{
+  struct stat fst, bst;
+  char path[64], backing[PATH_MAX];
+  FILE * f;
+
+  if (fstat(srcfd, &fst) < 0) return -errno;
+  if (S_ISBLK(fst.st_mode))
+    return (fst.st_rdev == mst->st_dev) ? 0 : -EXDEV;
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/loop/backing_file",
+	   major(mst->st_dev), minor(mst->st_dev));
+  f = fopen(path, "r");
+  if (!f) return -EXDEV;
+  if (!fgets(backing, sizeof(backing), f)) backing[0] = '\0';
+  fclose(f);
+  backing[strcspn(backing, "\n")] = '\0';
+  if (stat(backing, &bst) < 0) return -EXDEV;
+  return ((bst.st_dev == fst.st_dev) && (bst.st_ino == fst.st_ino))
+    ? 0 : -EXDEV;
+}
+
+char * mounted_fstype(const char * mntpnt)
+{
+  char * real = realpath(mntpnt, NULL);
+  char * type = NULL;
+  struct mntent * m;
+  FILE * tab;
+
+  if (!real) return NULL;
+  tab = setmntent("/proc/self/mounts", "r");
+  if (tab) {
+    // the last entry for a directory is the one on top
+    while ((m = getmntent(tab)))
+      if (!strcmp(m->mnt_dir, real))
+	{ free(type); type = strdup(m->mnt_type); }
+    endmntent(tab);
+  }
+  free(real);
+  return type;
+}
+
+int mounted_fsmap(int mfd, dev_t dev,
+		  int (*fn)(void * arg, const struct fsmap * r), void * arg)
+{
+  struct fsmap_head * h;
+  unsigned int i;
+  int ret = 0;
+
+  h = calloc(1, fsmap_sizeof(FSMAP_RECS));
+  if (!h) return -ENOMEM;
+  h->fmh_count = FSMAP_RECS;
+  h->fmh_keys[1].fmr_device = UINT32_MAX;
+  h->fmh_keys[1].fmr_flags = UINT32_MAX;
+  h->fmh_keys[1].fmr_physical = UINT64_MAX;
+  h->fmh_keys[1].fmr_owner = UINT64_MAX;
+  h->fmh_keys[1].fmr_offset = UINT64_MAX;
+
+  for (;;) {
+    struct fsmap * r = NULL;
+    if (ioctl(mfd, FS_IOC_GETFSMAP, h) < 0) { ret = -errno; break; }
+    if (!h->fmh_entries) break;
+    for (i = 0; !ret && (i < h->fmh_entries); i++) {
+      r = h->fmh_recs + i;
+      if (!(h->fmh_oflags & FMH_OF_DEV_T)
+	  || (fsmap_decode_dev(r->fmr_device) == dev))
+	ret = fn(arg, r);
+    }
+    if (ret || (r->fmr_flags & FMR_OF_LAST)) break;
+    fsmap_advance(h);
+  }
+
+  free(h);
+  return ret;
+}
+
+struct fsmap_used {
+  struct extent_list free_space;
+  uint64_t bsize;
+  uint64_t end;		// end of the highest range reported, in bytes
+};
+
+static int fsmap_used_record(void * arg, const struct fsmap * r)
+{
+  struct fsmap_used * u = arg;
+
+  if (r->fmr_physical + r->fmr_length > u->end)
+    u->end = r->fmr_physical + r->fmr_length;
+  if ((r->fmr_flags & FMR_OF_SPECIAL_OWNER)
+      && (r->fmr_owner == FMR_OWN_FREE)) {
+    // only blocks wholly free may be left out
+    uint64_t first = (r->fmr_physical + u->bsize - 1) / u->bsize;
+    uint64_t last = (r->fmr_physical + r->fmr_length) / u->bsize;
+    if ((last > first) && extent_list_add(&u->free_space, first, last - first))
+      return -ENOMEM;
+  }
+  return 0;
+}
+
+int mounted_fsmap_used(int mfd, dev_t dev, uint64_t bsize,
+		       struct extent_list * l)
+{
+  struct fsmap_used u = { .bsize = bsize };
+  int ret;
+
+  ret = mounted_fsmap(mfd, dev, fsmap_used_record, &u);
+  if (!ret && !u.end) ret = -ENODATA;
+  if (!ret) {
+    extent_list_sort(&u.free_space);
+    if (extent_list_append(l, 0, (u.end + bsize - 1) / bsize)
+	|| extent_list_subtract(l, &u.free_space))
+      ret = -ENOMEM;
+  }
+  extent_list_free(&u.free_space);
+  return ret;
+}
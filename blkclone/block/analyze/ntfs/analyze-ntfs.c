@@ -32,6 +32,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -39,12 +40,17 @@
 #include <unistd.h>
 
 #include "multicall.h"
+#include "keylist.h"
 
 /* Amazingly enough, NTFS filesystems have a bootsector that includes
  *  a BIOS parameter block, this info gives us the cluster size.
  */
 #include "analyze/ecma-107.h"
 #include "analyze/dispatch.h"
+#include "analyze/extents.h"
+#include "analyze/pool.h"
+#include "analyze/sink.h"
+#include "block/map-parse-v1.h"
 
 /* NOTE: according to comments in the Linux NTFS driver code,
  *	  a backup copy of the NTFS boot sector is stored after the last
@@ -75,14 +81,18 @@ struct NTFS_info {
 //	  (Else chicken-and-egg: need to read $AttrDef's $DATA attribute.)
 //    -- MFT records do not span clusters
 //    -- The extents for the $DATA attribute are themselves resident in the MFT.
-//    -- This code is heavily optimized for sequential reads.
-//	  (Seeking to position 0 is also efficient; anything else requires
-//	    reparsing the data runs from the beginning of the file.)
-//	  (This optimization is actually *less* work than always decoding the
-//	    data runs fully and keeping the decoded extents around in memory.)
+//	  (A fragmented $MFT lists further runs in extension records, named
+//	    by its $ATTRIBUTE_LIST; those are followed for $MFT alone.)
+//  The data runs of a non-resident file are decoded once, when the file is
+//   opened, into an array of (vcn, lcn, length) sorted by vcn.  Seeking is
+//   then O(1) and each read finds its run by binary search, so random
+//   access (looking up many MFT records, for example) does not degrade
+//   into re-walking the encoded runs from the start of the file.
 
 
+#define NTFS_ATTRLIST_ATTRTYPE 0x20
 #define NTFS_DATA_ATTRTYPE 0x80
+#define NTFS_MREF(x)	((x) & 0x0000FFFFFFFFFFFFULL) /* drop sequence number */
 
 //fixed record numbers for system files
 // here for documentation purposes; only $Bitmap is used in this code
@@ -99,20 +109,24 @@ struct NTFS_info {
 #define NTFS_RECNO_UPCASE	10 // $UpCase
 #define NTFS_RECNO_EXTEND	11 // $Extend
 
+struct NTFS_run {		// one decoded data run
+  uint64_t vcn;			// first cluster of run within the file
+  uint64_t length;		// length of run in clusters
+  int64_t lcn;			// first cluster of run on volume; -1 if sparse
+};
+
 struct NTFS_volume_ctx;
 struct NTFS_file_ctx {		// represents a file opened for reading
   struct NTFS_volume_ctx * vol;	// reference to volume containing this file
   char * Frec;			// buffer for FILE record
-  char * first_run;		// pointer into Frec for first run of file
-  char * this_run;		// pointer into Frec to data run for current POS
+  char * resident;		// pointer into Frec to contents of resident file
+  struct NTFS_run * runs;	// decoded runs of non-resident file
+  size_t nruns;			// number of entries in RUNS
+  size_t cur;			// index of run used by last read (search hint)
   uint64_t pos;			// current read position in file
-  uint64_t this_run_lcn;	// base lcn used with THIS_RUN
-  uint64_t this_run_pos;	// read position for start of THIS_RUN
   uint64_t size;		// size of file
   // for a resident file (data is embedded in the MFT record):
-  //  first_run will be NULL, and this_run will point to the file contents
-  // (an explicit flag was not added to the struct because its current size is
-  //  exactly 8 words on 64-bit systems and 12 words on 32-bit systems)
+  //  runs will be NULL, and resident will point to the file contents
 };
 
 struct NTFS_volume_ctx {	// represents an NTFS volume
@@ -164,6 +178,20 @@ static char * find_unnamed_DATA_attr(char * attr)
   return attr;
 }
 
+//given: base of MFT FILE record, ptr to attribute in it, and record length
+//return: TRUE if ATTR is a complete attribute inside the record
+// Records other than the MFT's own have not been checked by anything else,
+//  so every attribute in them is checked before it is used.
+static inline int attr_ok(char * base, char * attr, uint32_t reclen)
+{
+  uint32_t len;
+
+  if (!attr || (attr < base) || (attr - base + 0x18 > reclen)) return 0;
+  if (*((uint32_t*)attr) == 0xFFFFFFFF) return 0;
+  len = *((uint32_t*)(attr + 0x04));
+  return (len >= 0x18) && (len <= reclen - (attr - base));
+}
+
 struct NTFS_decoded_extent {
   uint64_t length;		// length of extent in clusters
   int64_t offset;		// offset from previous extent in clusters
@@ -193,13 +221,89 @@ static char * decode_run(char * run, struct NTFS_decoded_extent * out)
   for (i=0;olen;olen--,i+=8,run++)
     out->offset |= (((uint64_t)(*run))&0xFFLL) << i;
   //...now sign extend it
-  if (out->offset & (1 << (i-1))) // sign bit set
+  if (i && (out->offset & (1ULL << (i-1)))) // sign bit set
     for (;i<64;i+=8)
       out->offset |= 0xFFLL << i;
 
   return run;
 }
 
+//given: ptr to first encoded data run, ptr to end of attribute,
+//	 and the virtual cluster number the runs start at
+//return: status code (TRUE: success)
+//side effect: the runs are appended to FILE->RUNS (as far as they decode)
+static int decode_runlist_at(struct NTFS_file_ctx * file, char * run,
+			     char * end, uint64_t vcn)
+{
+  struct NTFS_decoded_extent ext = {0};
+  struct NTFS_run * p = NULL;
+  size_t alloc = file->nruns;
+  int64_t lcn = 0; // each attribute's runs start over from cluster 0
+
+  while ((run < end) && *run) {
+    // an encoded offset of length zero marks a sparse run
+    int sparse = !(*((uint8_t*)run) & 0xF0);
+    run = decode_run(run, &ext);
+    if (run > end) return 0; // runs overflow the attribute
+    if (file->nruns == alloc) {
+      alloc = alloc ? alloc * 2 : 16;
+      p = realloc(file->runs, alloc * sizeof(struct NTFS_run));
+      if (!p) return 0;
+      file->runs = p;
+    }
+    lcn += ext.offset;
+    file->runs[file->nruns].vcn = vcn;
+    file->runs[file->nruns].length = ext.length;
+    file->runs[file->nruns].lcn = sparse ? -1 : lcn;
+    file->nruns++;
+    vcn += ext.length;
+  }
+  return 1;
+}
+
+//given: ptr to first encoded data run, ptr to end of attribute
+//return: status code (TRUE: success)
+//side effect on success: FILE->RUNS and FILE->NRUNS describe the runs
+static int decode_runlist(struct NTFS_file_ctx * file, char * run, char * end)
+{
+  file->runs = NULL; file->nruns = 0;
+
+  if (decode_runlist_at(file, run, end, 0) && file->nruns)
+    return 1;
+
+  free(file->runs);
+  file->runs = NULL; file->nruns = 0;
+  return 0;
+}
+
+//given: NTFSdrv file handle for non-resident file, virtual cluster number,
+//	 and index of a run to try first (updated to the run found)
+//return: ptr to run containing VCN or NULL if VCN is past the last run
+static struct NTFS_run * find_run(struct NTFS_file_ctx * file, uint64_t vcn,
+				  size_t * hint)
+{
+  struct NTFS_run * r = file->runs + *hint;
+  size_t lo = 0, hi = file->nruns;
+
+  // sequential reads usually stay in the same run or move to the next one
+  if ((vcn >= r->vcn) && (vcn < r->vcn + r->length))
+    return r;
+  if ((*hint + 1 < file->nruns) && (vcn >= r[1].vcn)
+      && (vcn < r[1].vcn + r[1].length))
+    { (*hint)++; return r + 1; }
+
+  // binary search for the last run starting at or before VCN
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (file->runs[mid].vcn <= vcn) lo = mid; else hi = mid;
+  }
+  r = file->runs + lo;
+  if ((vcn < r->vcn) || (vcn >= r->vcn + r->length))
+    return NULL;
+  *hint = lo;
+  return r;
+}
+
 //given: ptr to buffer containing FILE record as read from disk
 //	 sector size
 //return: status value (TRUE: success)
@@ -228,6 +332,7 @@ static int fixup_FILE_record(char * buf, uint32_t ssize)
 }
 
 static int NTFS_get_info(struct NTFS_info *, FILE *);
+static int NTFS_follow_attr_list(struct NTFS_file_ctx *, char *);
 
 //given:  seekable, fd-backed stdio handle for NTFS volume
 //return: ptr to NTFS_volume_ctx struct or NULL on failure
@@ -272,15 +377,21 @@ static struct NTFS_volume_ctx * NTFSdrv_volinit(FILE * fs)
     if (*((uint8_t*)(data + 0x08)) == 0x00)
       //resident $DATA on $MFT???
       goto out_full_cleanup;
-    ctx->MFT.first_run = data + *((uint16_t*)(data + 0x20));
+    if (!decode_runlist(&(ctx->MFT), data + *((uint16_t*)(data + 0x20)),
+			data + *((uint32_t*)(data + 0x04))))
+      goto out_full_cleanup;
     ctx->MFT.size = *((uint64_t*)(data + 0x30));
   }
-  ctx->MFT.this_run = ctx->MFT.first_run;
   ctx->MFT.pos = 0;
-  ctx->MFT.this_run_pos = 0;
-  { struct NTFS_decoded_extent run = {0};
-    decode_run(ctx->MFT.this_run, &run);
-    ctx->MFT.this_run_lcn = run.offset; }
+
+  // a fragmented MFT continues its runs in extension records
+  {
+    char * list = find_attr_by_type(get_first_attr(ctx->MFT.Frec),
+				    NTFS_ATTRLIST_ATTRTYPE);
+    if (list && !NTFS_follow_attr_list(&(ctx->MFT), list))
+      fprintf(stderr,"NTFS: could not follow the $ATTRIBUTE_LIST of $MFT;"
+	      " only its first runs are known\n");
+  }
 
   return ctx;
 
@@ -299,130 +410,160 @@ static inline uint64_t NTFSdrv_tell(struct NTFS_file_ctx * file)
 //given: NTFSdrv file handle and absolute offset
 //return: status code (TRUE: success)
 //side effect on success: current postion of file handle is set as requested
-//side effect on failure: file handle MAY be set to beginning-of-file
 static int NTFSdrv_seekto(struct NTFS_file_ctx * file, uint64_t offset)
 {
-  if (offset == file->pos)
-    // already there
-    return 1;
-
   if (offset > file->size)
     // off the end -- fail
     return 0;
 
-  if (!file->first_run) {
-    // resident data; only one run possible
-    file->pos = offset;
-    return 1;
-  }
-
-  if (offset < file->this_run_pos) {
-    // seeking backwards past the beginning of the current run
-    //  is done by first seeking to the beginning of the file,
-    //  then seeking forwards to the requested position
-    file->this_run = file->first_run;
-    file->pos = file->this_run_lcn = file->this_run_pos = 0; // rewind
-  }
-
-  if (offset < file->pos) {
-    // seeking backwards in the current run
-    file->pos = offset;
-    return 1;
-  }
-
-  // If we get here, then we are seeking forwards,
-  //  possibly after having rewound the file
-  {
-    struct NTFS_decoded_extent run = {0};
-    char * next_run = decode_run(file->this_run, &run);
-    uint64_t run_bound =
-      file->this_run_pos + (run.length * file->vol->info.csize);
-    uint64_t run_lcn = file->this_run_lcn;
-    uint64_t run_pos = file->this_run_pos;
-
-    if (offset < run_bound) {
-      // seeking forwards still within the current run
-      file->pos = offset;
-      return 1;
-    }
-
-    // seeking forwards beyond the current run
-    //  advance by runs until we reach one containing OFFSET
-    while (*next_run && (offset > run_bound)) {
-      next_run = decode_run(next_run, &run);
-      run_pos = run_bound;
-      run_lcn += run.offset;
-      run_bound = run_pos + (run.length * file->vol->info.csize);
-    }
-    if (offset < run_bound) {
-      // we found a run containing the requested offset, make it current
-      file->this_run = next_run;
-      file->this_run_lcn = run_lcn;
-      file->this_run_pos = run_pos;
-      file->pos = offset;
-      return 1;
-    }
-    // we reached EOF while seeking (should not happen)
-    return 0;
-  }
+  // the run containing OFFSET is found when reading
+  file->pos = offset;
+  return 1;
 }
 
-//given: NTFSdrv file handle, target buffer, and length
+//given: NTFSdrv file handle, target buffer, length, file offset,
+//	 and run search hint (see find_run; may be private to the caller)
 //return: bytes read, negative on error
 //	   There is one non-error condition where bytes
 //	    read can be less than requested--EOF was
-//	    encountered during the read and further reads
-//	    will read zero bytes.
+//	    encountered during the read.
 //side effect: data is read from file into buffer
-static ssize_t NTFSdrv_read(struct NTFS_file_ctx * file,
-			    void * buf, size_t len)
+// This does not use or change the file position, so several threads may
+//  read from one handle at once if each has its own HINT.
+static ssize_t NTFSdrv_pread(struct NTFS_file_ctx * file, void * buf,
+			     size_t len, uint64_t offset, size_t * hint)
 {
-  struct NTFS_decoded_extent run = {0};
-  char * next_run = decode_run(file->this_run, &run);
-  uint64_t run_bound =
-    file->this_run_pos + (run.length * file->vol->info.csize);
+  uint64_t csize = file->vol->info.csize;
   ssize_t ret = 0;
   size_t rcnt = 0;
 
   if (len == 0) return 0;
 
-  if (file->pos >= (file->size - 1))
+  if (offset >= file->size)
     //at EOF
     return 0;
 
-  if ((file->pos + len) >= file->size)
-    len = file->size - file->pos; // set bound on LEN at to-end-of-file
+  if ((offset + len) >= file->size)
+    len = file->size - offset; // set bound on LEN at to-end-of-file
 
-  if (!file->first_run) {
+  if (!file->runs) {
     // shortcut: data is resident in FILE record; just copy some bytes
-    memmove(buf,(file->this_run + file->pos),len);
+    memmove(buf,(file->resident + offset),len);
     return len;
   }
 
-  while ((len - rcnt) > 0) {
-    while (file->pos < run_bound) {
-      //attempt to satisfy request from current run
-      ret = pread(file->vol->fs_fd,buf+rcnt,len-rcnt,
-		  (file->this_run_lcn * file->vol->info.csize)
-		  +(file->pos - file->this_run_pos));
+  while (rcnt < len) {
+    struct NTFS_run * r = find_run(file, offset / csize, hint);
+    uint64_t run_bound;
+    size_t want;
+
+    if (!r) return -EIO; // runs end before the file does
+    run_bound = (r->vcn + r->length) * csize;
+    want = len - rcnt;
+    if (want > run_bound - offset) want = run_bound - offset;
+
+    if (r->lcn < 0) {
+      // sparse run reads as zero
+      memset(buf+rcnt, 0, want);
+      ret = want;
+    } else {
+      ret = pread(file->vol->fs_fd,buf+rcnt,want,
+		  (r->lcn * csize) + (offset - (r->vcn * csize)));
       if (ret < 0) return ret; // oops, an error
       if (ret == 0) return -EIO; // failed to read when we expected to read
-      rcnt += ret;
-      file->pos += ret;
-      if (rcnt >= len) return rcnt;
-    }
-    if ((len - rcnt) > 0) {
-      //move to the next run
-      file->this_run = next_run;
-      next_run = decode_run(file->this_run, &run);
-      file->this_run_lcn += run.offset;
-      file->this_run_pos = run_bound;
-      run_bound = file->this_run_pos + (run.length * file->vol->info.csize);
     }
+    rcnt += ret;
+    offset += ret;
   }
   return rcnt;
 }
 
+//given: NTFSdrv file handle, target buffer, and length
+//return: bytes read, negative on error
+//	   There is one non-error condition where bytes
+//	    read can be less than requested--EOF was
+//	    encountered during the read and further reads
+//	    will read zero bytes.
+//side effect: data is read from file into buffer
+static ssize_t NTFSdrv_read(struct NTFS_file_ctx * file,
+			    void * buf, size_t len)
+{
+  ssize_t ret = NTFSdrv_pread(file, buf, len, file->pos, &(file->cur));
+  if (ret > 0) file->pos += ret;
+  return ret;
+}
+
+//given: handle for $MFT holding the runs from its base record,
+//	 and ptr to the $ATTRIBUTE_LIST attribute in that record
+//return: status code (TRUE: success)
+//side effect: the runs of the parts of $DATA held in extension records are
+//	       appended to MFT->RUNS, in order, as far as they can be found
+// Extension records are read through the runs known so far; the list is
+//  in order of VCN, so each one is normally in a part already mapped.
+static int NTFS_follow_attr_list(struct NTFS_file_ctx * mft, char * list)
+{
+  struct NTFS_volume_ctx * vol = mft->vol;
+  uint32_t reclen = vol->info.MFTreclen;
+  char * buf = NULL, * rec = NULL, * e, * end, * attr;
+  uint64_t len;
+  size_t hint = 0;
+  int ok = 0;
+
+  if (list[0x08]) {
+    // non-resident list; read it through its own runs
+    struct NTFS_file_ctx tmp = { .vol = vol };
+    if (!decode_runlist(&tmp, list + *((uint16_t*)(list + 0x20)),
+			list + *((uint32_t*)(list + 0x04))))
+      return 0;
+    tmp.size = len = *((uint64_t*)(list + 0x30));
+    buf = malloc(len);
+    if (buf && (NTFSdrv_pread(&tmp, buf, len, 0, &hint) != len))
+      { free(buf); buf = NULL; }
+    free(tmp.runs);
+  } else {
+    len = *((uint32_t*)(list + 0x10));
+    if (list + *((uint16_t*)(list + 0x14)) + len
+	> list + *((uint32_t*)(list + 0x04)))
+      return 0;
+    buf = malloc(len);
+    if (buf) memcpy(buf, list + *((uint16_t*)(list + 0x14)), len);
+  }
+  if (!buf || !(rec = malloc(reclen))) goto out;
+
+  for (e = buf, end = buf + len; e + 0x1A <= end;
+       e += *((uint16_t*)(e + 0x04))) {
+    uint64_t vcn = *((uint64_t*)(e + 0x08));
+    uint64_t recno = NTFS_MREF(*((uint64_t*)(e + 0x10)));
+    struct NTFS_run * last = mft->runs + mft->nruns - 1;
+
+    if (*((uint16_t*)(e + 0x04)) < 0x1A) goto out; // corrupt list
+    // only the later parts of the unnamed $DATA are of interest
+    if ((*((uint32_t*)e) != NTFS_DATA_ATTRTYPE) || e[0x06] || !vcn
+	|| (recno == NTFS_RECNO_MFT))
+      continue;
+    if (vcn != last->vcn + last->length) goto out; // not the next part
+
+    hint = 0;
+    if ((NTFSdrv_pread(mft, rec, reclen, recno * reclen, &hint) != reclen)
+	|| !fixup_FILE_record(rec, vol->info.ssize))
+      goto out;
+    for (attr = get_first_attr(rec); attr_ok(rec, attr, reclen);
+	 attr = get_next_attr(attr))
+      if (attr_type_p(attr, NTFS_DATA_ATTRTYPE) && !attr[0x09] && attr[0x08]
+	  && (*((uint64_t*)(attr + 0x10)) == vcn))
+	break;
+    if (!attr_ok(rec, attr, reclen)) goto out;
+    if (!decode_runlist_at(mft, attr + *((uint16_t*)(attr + 0x20)),
+			   attr + *((uint32_t*)(attr + 0x04)), vcn))
+      goto out;
+  }
+  ok = 1;
+
+ out:
+  free(rec); free(buf);
+  return ok;
+}
+
 //given: NTFSdrv volume handle and record number in MFT
 //return: NTFSdrv file handle (ptr to NTFS_file_ctx struct) or NULL on failure
 static struct NTFS_file_ctx * NTFSdrv_open(struct NTFS_volume_ctx * vol,
@@ -454,24 +595,20 @@ static struct NTFS_file_ctx * NTFSdrv_open(struct NTFS_volume_ctx * vol,
     if (!data) goto out_full_cleanup; // filesystem is corrupt
     if (*((uint8_t*)(data + 0x08))) {
       // non-resident $DATA
-      ctx->first_run = data + *((uint16_t*)(data + 0x20));
+      if (!decode_runlist(ctx, data + *((uint16_t*)(data + 0x20)),
+			  data + *((uint32_t*)(data + 0x04))))
+	goto out_full_cleanup;
       ctx->size = *((uint64_t*)(data + 0x30));
-      ctx->this_run = ctx->first_run;
     } else {
       // contents of this file are in its FILE record
-      ctx->first_run = NULL; // mark the handle as resident-data
+      ctx->runs = NULL; // mark the handle as resident-data
       ctx->size = *((uint32_t*)(data + 0x10));
-      ctx->this_run = data + *((uint16_t*)(data + 0x14));
+      ctx->resident = data + *((uint16_t*)(data + 0x14));
     }
   }
 
   //implicit seek to beginning-of-file
   ctx->pos = 0;
-  ctx->this_run_pos = 0;
-  if (ctx->first_run)
-    { struct NTFS_decoded_extent run = {0};
-      decode_run(ctx->first_run, &run);
-      ctx->this_run_lcn = run.offset; }
 
   return ctx;
 
@@ -486,7 +623,7 @@ static struct NTFS_file_ctx * NTFSdrv_open(struct NTFS_volume_ctx * vol,
 //returns void
 //side effect: closes file handle, frees associated storage
 static void NTFSdrv_close(struct NTFS_file_ctx * file)
-{ free(file->Frec); free(file); }
+{ free(file->runs); free(file->Frec); free(file); }
 
 //given: NTFSdrv volume handle
 //returns void
@@ -495,7 +632,7 @@ static void NTFSdrv_close(struct NTFS_file_ctx * file)
 //		    USE OF ANY SUCH FILE HANDLES WILL LIKELY CAUSE A CRASH!
 //		    THE ONLY SAFE OPERATION ON SUCH A HANDLE IS TO CLOSE IT!
 static void NTFSdrv_volclose(struct NTFS_volume_ctx * vol)
-{ free(vol->MFT.Frec); close(vol->fs_fd); free(vol); }
+{ free(vol->MFT.runs); free(vol->MFT.Frec); close(vol->fs_fd); free(vol); }
 
 // stdio interface shim for NTFSdrv (glibc interface)
 //  the (void *) used as the cookie is actually a (struct NTFS_file_ctx *)
@@ -584,48 +721,457 @@ static int NTFS_get_info(struct NTFS_info * ctx, FILE * boot)
  * BOUND is the highest cluster number,
  *  apparently, it is possible for the bitmap to show clusters as "in-use"
  *  that are "off the end" of the volume
+ * The bitmap is read in large chunks and scanned a word at a time; the
+ *  extents and their total (BlockCount) are collected in one pass.
+ * The clusters in HOLES (sorted) are left out of each chunk before it is
+ *  added to EXT, so a sink on EXT gets the final list as it is read.
  */
-static uint64_t NTFS_count_used_blocks(FILE * bitmap, unsigned long long int bound)
+#define NTFS_BITMAP_CHUNK (1<<20) /* bytes of $Bitmap read per request */
+static int NTFS_scan_bitmap(FILE * bitmap, unsigned long long int bound,
+			    const struct extent_list * holes,
+			    struct extent_list * ext)
 {
-  unsigned long long int cluster = 0; /*  index  */
-  unsigned long long int count   = 0; /* counter */
-  int bcnt = 0; /* current bit index */
-  int byte = 0; /* byte read from $Bitmap */
+  unsigned long long int cluster = 0; /* first cluster in chunk */
+  unsigned long long int nbits = 0;
+  struct extent_list piece = {0};
+  uint8_t * buf = NULL;
+  size_t len = 0, i;
+  int ret = 0;
+
+  buf = malloc(NTFS_BITMAP_CHUNK);
+  if (!buf) return -ENOMEM;
 
   rewind(bitmap);
 
-  while (((byte = getc(bitmap)) != EOF) && cluster <= bound)
-    for (bcnt=8; bcnt && cluster <= bound; bcnt--, byte>>=1, cluster++)
-      if (byte & 1) count++;
+  while ((cluster <= bound)
+	 && (len = fread(buf, 1, NTFS_BITMAP_CHUNK, bitmap))) {
+    nbits = len * 8ULL;
+    if (nbits > bound + 1 - cluster)
+      nbits = bound + 1 - cluster;
+    piece.count = 0; piece.blocks = 0;
+    if ((ret = extent_list_add_bitmap(&piece, buf, nbits, cluster)) < 0)
+      break;
+    if (holes->count && (ret = extent_list_subtract(&piece, holes)))
+      break;
+    // runs that cross into the next chunk are joined in EXT
+    for (i = 0; !ret && (i < piece.count); i++)
+      ret = extent_list_append(ext, piece.ext[i].start, piece.ext[i].length);
+    if (ret) break;
+    cluster += nbits;
+  }
+  if (!ret && ferror(bitmap)) ret = -EIO;
+  if (!ret) ret = extent_list_flush(ext);
 
-  return count;
+  extent_list_free(&piece);
+  free(buf);
+  return ret;
+}
+
+/*
+ * Some files hold nothing worth imaging: Windows recreates the page file,
+ *  the hibernation file and the swap file at boot.  Their clusters are
+ *  found by scanning the MFT and removed from the block list.
+ * The MFT is read in batches of records by a pool of threads; each thread
+ *  reads with its own run hint, so no lock is taken to read.  Only the
+ *  names of directories and of records that might be wanted are kept, so
+ *  the whole tree is never built in memory.
+ */
+
+#define NTFS_FILENAME_ATTRTYPE 0x30
+#define NTFS_FILE_IN_USE	0x0001	/* FILE record flags */
+#define NTFS_FILE_IS_DIR	0x0002
+#define NTFS_NAMESPACE_DOS	2	/* $FILE_NAME holding only an 8.3 alias */
+#define NTFS_MFT_BATCH		256	/* records read per request when scanning */
+
+// excluded unless the noexclude option is given; only in the root directory
+static char * NTFS_disposable_files[] =
+  { "pagefile.sys", "hiberfil.sys", "swapfile.sys", NULL };
+
+struct NTFS_name {		// a name as stored in $FILE_NAME
+  uint64_t parent;		// record number of parent directory
+  uint8_t len;			// length of name in UTF-16 units
+  uint16_t name[0];
+};
+
+struct NTFS_exclude {		// a file to leave out of the block list
+  char * path;			// path as given
+  struct NTFS_name ** comp;	// path components, leaf last
+  int ncomp;
+  uint64_t recno;		// base FILE record of file, once found
+  uint64_t clusters;		// clusters removed from the block list
+};
+
+struct NTFS_ref {		// a FILE record of interest
+  uint64_t recno;		// its record number
+  uint64_t other;		// parent directory, or base record if extension
+  int ex;			// index into exclusion list, for a name match
+};
+
+struct NTFS_mftscan {		// shared state for MFT scanning threads
+  struct NTFS_volume_ctx * vol;
+  struct NTFS_exclude * ex;
+  int nex;
+  uint64_t nrec;		// number of records in $MFT
+  uint64_t next;		// next batch to scan (atomic)
+  int error;			// first error seen by any thread (set once,
+				//  by NTFS_scan_error)
+  struct NTFS_name ** dirs;	// name of each directory, by record number
+  pthread_mutex_t lock;		// protects the lists below
+  struct NTFS_ref * cand;	// records whose names match a leaf name
+  size_t ncand, alloccand;
+  struct NTFS_ref * extrecs;	// extension records holding $DATA
+  size_t nextrecs, allocextrecs;
+};
+
+//records ERR as the error of the scan, unless one was recorded already
+static inline void NTFS_scan_error(struct NTFS_mftscan * sc, int err)
+{ __sync_bool_compare_and_swap(&sc->error, 0, err); }
+
+//given: UTF-8 string and length in bytes
+//return: newly allocated NTFS_name or NULL on failure
+// Characters outside the BMP are written as surrogate pairs, as NTFS does.
+static struct NTFS_name * NTFS_name_from_utf8(const char * s, size_t len)
+{
+  struct NTFS_name * n = malloc(sizeof(struct NTFS_name) + 4 * len);
+  const uint8_t * p = (const uint8_t *) s;
+  const uint8_t * end = p + len;
+  size_t i = 0;
+
+  if (!n) return NULL;
+  while (p < end) {
+    uint32_t c = *p++;
+    int more = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+    if (more) c &= 0x3F >> more;
+    for (; more && (p < end); more--)
+      c = (c << 6) | (*p++ & 0x3F);
+    if (c >= 0x10000) {
+      c -= 0x10000;
+      n->name[i++] = 0xD800 | (c >> 10);
+      n->name[i++] = 0xDC00 | (c & 0x3FF);
+    } else
+      n->name[i++] = c;
+  }
+  if (i > 255) { free(n); return NULL; } // longer than any NTFS name
+  n->len = i; n->parent = 0;
+  return n;
+}
+
+//given: two names in UTF-16
+//return: TRUE if they are equal, ignoring case of ASCII letters
+// Windows compares names using the $UpCase table; folding only ASCII is
+//  enough for the names of system files and for most paths given by hand.
+static int NTFS_name_eq(const uint16_t * a, uint8_t alen,
+			const uint16_t * b, uint8_t blen)
+{
+  int i;
+
+  if (alen != blen) return 0;
+  for (i = 0; i < alen; i++) {
+    uint16_t x = a[i], y = b[i];
+    if ((x >= 'a') && (x <= 'z')) x -= 'a' - 'A';
+    if ((y >= 'a') && (y <= 'z')) y -= 'a' - 'A';
+    if (x != y) return 0;
+  }
+  return 1;
 }
-static void emit_NTFS_extent_list(FILE * output, FILE * bitmap,
-				  unsigned long long int bound)
+
+//given: exclusion record and path relative to the volume root
+//return: status code (TRUE: success)
+//side effect on success: EX is filled in; its PATH is a copy of PATH
+static int NTFS_exclude_init(struct NTFS_exclude * ex, const char * path)
 {
-  unsigned long long int cluster = 0; /* counter */
-  unsigned long long int start = 0;   /* start of current extent */
-  int bcnt = 0; /* current bit index */
-  int byte = 0; /* byte read from $Bitmap */
-  enum {FREE, ALLOC} state = FREE;
+  char * p;
+  char * s;
+
+  memset(ex, 0, sizeof(struct NTFS_exclude));
+  ex->path = strdup(path);
+  if (!ex->path) return 0;
+  for (p = ex->path; *p; p++)
+    if (*p == '\\') *p = '/';
+  for (p = ex->path; *p == '/'; p++);
+  if (!*p) goto fail;
+
+  ex->comp = malloc(sizeof(struct NTFS_name *) * (strlen(p) / 2 + 1));
+  if (!ex->comp) goto fail;
+  while (*p) {
+    for (s = p; *s && (*s != '/'); s++);
+    if (s > p) {
+      ex->comp[ex->ncomp] = NTFS_name_from_utf8(p, s - p);
+      if (!ex->comp[ex->ncomp]) goto fail;
+      ex->ncomp++;
+    }
+    for (p = s; *p == '/'; p++);
+  }
+  return 1;
 
-  rewind(bitmap);
+ fail:
+  while (ex->ncomp) free(ex->comp[--ex->ncomp]);
+  free(ex->comp); free(ex->path);
+  return 0;
+}
 
-  while (((byte = getc(bitmap)) != EOF) && cluster <= bound)
-    for (bcnt=8; bcnt && cluster <= bound; bcnt--, byte>>=1, cluster++)
-      switch (state) {
-      case FREE:
-	if (byte & 1) { start = cluster; state = ALLOC; }
+static void NTFS_exclude_free(struct NTFS_exclude * ex)
+{
+  while (ex->ncomp) free(ex->comp[--ex->ncomp]);
+  free(ex->comp); free(ex->path);
+}
+
+//given: list to append to, its count and allocation, and the new entry
+//return: status code (TRUE: success)
+static int NTFS_ref_add(struct NTFS_ref ** l, size_t * n, size_t * alloc,
+			uint64_t recno, uint64_t other, int ex)
+{
+  if (*n == *alloc) {
+    size_t a = *alloc ? *alloc * 2 : 16;
+    struct NTFS_ref * p = realloc(*l, a * sizeof(struct NTFS_ref));
+    if (!p) return 0;
+    *l = p; *alloc = a;
+  }
+  (*l)[*n].recno = recno;
+  (*l)[*n].other = other;
+  (*l)[(*n)++].ex = ex;
+  return 1;
+}
+
+//given: scan state, FILE record (as read), and its record number
+//side effect: directory names, candidate matches and extension records
+//	       are added to the scan state
+static void NTFS_scan_record(struct NTFS_mftscan * sc, char * rec,
+			     uint64_t recno)
+{
+  uint32_t reclen = sc->vol->info.MFTreclen;
+  uint16_t flags;
+  uint64_t base;
+  char * attr;
+  int i;
+
+  if (memcmp(rec, "FILE", 4)
+      || (*((uint16_t*)(rec+0x04)) + 2 * *((uint16_t*)(rec+0x06)) > reclen)
+      || !fixup_FILE_record(rec, sc->vol->info.ssize))
+    return;
+  flags = *((uint16_t*)(rec+0x16));
+  if (!(flags & NTFS_FILE_IN_USE)) return;
+  base = NTFS_MREF(*((uint64_t*)(rec+0x20)));
+
+  if (base) {
+    // extension record: remember it if it holds part of an unnamed $DATA
+    for (attr = get_first_attr(rec); attr_ok(rec, attr, reclen);
+	 attr = get_next_attr(attr))
+      if (attr_type_p(attr, NTFS_DATA_ATTRTYPE) && !attr[0x09]) {
+	pthread_mutex_lock(&sc->lock);
+	if (!NTFS_ref_add(&sc->extrecs, &sc->nextrecs, &sc->allocextrecs,
+			  recno, base, -1))
+	  NTFS_scan_error(sc, -ENOMEM);
+	pthread_mutex_unlock(&sc->lock);
 	break;
-      case ALLOC:
-	if (!(byte & 1)) {
-	  fprintf(output,"%lld+%lld\n",start,cluster-start);
-	  state = FREE;
+      }
+    return;
+  }
+
+  for (attr = get_first_attr(rec); attr_ok(rec, attr, reclen);
+       attr = get_next_attr(attr)) {
+    uint8_t * fn;
+    uint16_t * name;
+    uint64_t parent;
+    uint8_t len;
+
+    // $FILE_NAME is always resident
+    if (!attr_type_p(attr, NTFS_FILENAME_ATTRTYPE) || attr[0x08]) continue;
+    fn = (uint8_t *)(attr + *((uint16_t*)(attr + 0x14)));
+    if ((char *)fn + 0x42 > attr + *((uint32_t*)(attr + 0x04))) continue;
+    len = fn[0x40];
+    if ((char *)fn + 0x42 + 2 * len > attr + *((uint32_t*)(attr + 0x04)))
+      continue;
+    if (fn[0x41] == NTFS_NAMESPACE_DOS) continue; // the long name is elsewhere
+    parent = NTFS_MREF(*((uint64_t*)fn));
+    name = (uint16_t *)(fn + 0x42);
+
+    if ((flags & NTFS_FILE_IS_DIR) && !sc->dirs[recno]) {
+      // only this thread scans this record, so no lock is needed
+      struct NTFS_name * d = malloc(sizeof(struct NTFS_name) + 2 * len);
+      if (!d) { NTFS_scan_error(sc, -ENOMEM); return; }
+      d->parent = parent; d->len = len;
+      memcpy(d->name, name, 2 * len);
+      sc->dirs[recno] = d;
+    }
+
+    for (i = 0; i < sc->nex; i++) {
+      struct NTFS_name * leaf = sc->ex[i].comp[sc->ex[i].ncomp - 1];
+      if (!NTFS_name_eq(name, len, leaf->name, leaf->len)) continue;
+      pthread_mutex_lock(&sc->lock);
+      if (!NTFS_ref_add(&sc->cand, &sc->ncand, &sc->alloccand,
+			recno, parent, i))
+	NTFS_scan_error(sc, -ENOMEM);
+      pthread_mutex_unlock(&sc->lock);
+    }
+  }
+}
+
+static void * NTFS_scan_worker(void * arg)
+{
+  struct NTFS_mftscan * sc = arg;
+  uint32_t reclen = sc->vol->info.MFTreclen;
+  char * buf = malloc((size_t)reclen * NTFS_MFT_BATCH);
+  size_t hint = 0;
+  uint64_t first, n, i;
+
+  if (!buf) { NTFS_scan_error(sc, -ENOMEM); return NULL; }
+
+  while (!sc->error
+	 && ((first = __sync_fetch_and_add(&sc->next, 1) * NTFS_MFT_BATCH)
+	     < sc->nrec)) {
+    n = sc->nrec - first;
+    if (n > NTFS_MFT_BATCH) n = NTFS_MFT_BATCH;
+    if (NTFSdrv_pread(&sc->vol->MFT, buf, n * reclen, first * reclen, &hint)
+	!= n * reclen) {
+      NTFS_scan_error(sc, -EIO);
+      break;
+    }
+    for (i = 0; i < n; i++)
+      NTFS_scan_record(sc, buf + i * reclen, first + i);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+//given: scan state, exclusion, and parent directory of a leaf name match
+//return: TRUE if the parent directories match the rest of the path
+static int NTFS_path_matches(struct NTFS_mftscan * sc,
+			     struct NTFS_exclude * ex, uint64_t parent)
+{
+  int k;
+
+  for (k = ex->ncomp - 2; k >= 0; k--) {
+    struct NTFS_name * d;
+    if ((parent >= sc->nrec) || (parent == NTFS_RECNO_ROOTDIR)) return 0;
+    d = sc->dirs[parent];
+    if (!d || !NTFS_name_eq(d->name, d->len,
+			    ex->comp[k]->name, ex->comp[k]->len))
+      return 0;
+    parent = d->parent;
+  }
+  return parent == NTFS_RECNO_ROOTDIR;
+}
+
+//given: volume, FILE record number, and list of clusters to exclude
+//return: clusters added, negative on error
+//side effect: clusters in the unnamed $DATA of the record are added to HOLES
+static int64_t NTFS_add_DATA_runs(struct NTFS_volume_ctx * vol, uint64_t recno,
+				  struct extent_list * holes)
+{
+  uint32_t reclen = vol->info.MFTreclen;
+  struct NTFS_file_ctx tmp = {0};
+  char * rec = malloc(reclen);
+  char * attr;
+  size_t hint = 0, i;
+  int64_t count = 0;
+
+  if (!rec) return -ENOMEM;
+  if ((NTFSdrv_pread(&vol->MFT, rec, reclen, recno * reclen, &hint) != reclen)
+      || !fixup_FILE_record(rec, vol->info.ssize)) {
+    free(rec);
+    return -EIO;
+  }
+
+  for (attr = get_first_attr(rec); attr_ok(rec, attr, reclen);
+       attr = get_next_attr(attr)) {
+    if (!attr_type_p(attr, NTFS_DATA_ATTRTYPE) || attr[0x09] || !attr[0x08])
+      continue; // not the unnamed $DATA or resident
+    if (!decode_runlist(&tmp, attr + *((uint16_t*)(attr + 0x20)),
+			attr + *((uint32_t*)(attr + 0x04))))
+      continue;
+    for (i = 0; i < tmp.nruns; i++)
+      if (tmp.runs[i].lcn >= 0) {
+	if (extent_list_add(holes, tmp.runs[i].lcn, tmp.runs[i].length)) {
+	  free(tmp.runs); free(rec);
+	  return -ENOMEM;
 	}
-	break;
+	count += tmp.runs[i].length;
       }
-  if (state == ALLOC) //emit last run
-    fprintf(output,"%lld+%lld\n",start,cluster-start);
+    free(tmp.runs);
+  }
+
+  free(rec);
+  return count;
+}
+
+//given: volume, extent list from $Bitmap, and output for comments
+//return: 0 on success, negative on error
+//side effect: clusters of excluded files are put in HOLES, in order, and
+//	       a comment naming each excluded file is written to OUT
+//	       (unless it is NULL)
+static int NTFS_exclude_files(struct NTFS_volume_ctx * vol,
+			      struct extent_list * holes, FILE * out)
+{
+  struct NTFS_mftscan sc = {0};
+  char * user = keylist_get(analysis_args, "exclude");
+  char * p;
+  size_t i, j;
+  int ret = 0;
+
+  sc.vol = vol;
+  sc.nrec = vol->MFT.size / vol->info.MFTreclen;
+
+  // collect the paths to exclude
+  sc.ex = malloc(sizeof(struct NTFS_exclude)
+		 * (4 + (user ? strlen(user) : 0)));
+  if (!sc.ex) return -ENOMEM;
+  if (!keylist_find(analysis_args, "noexclude"))
+    for (i = 0; NTFS_disposable_files[i]; i++)
+      if (NTFS_exclude_init(sc.ex + sc.nex, NTFS_disposable_files[i]))
+	sc.nex++;
+  if (user && (user = strdup(user)))
+    for (p = strtok(user, ","); p; p = strtok(NULL, ","))
+      if (NTFS_exclude_init(sc.ex + sc.nex, p))
+	sc.nex++;
+  free(user);
+  if (!sc.nex) goto out_free_ex;
+
+  // scan the MFT
+  sc.dirs = calloc(sc.nrec, sizeof(struct NTFS_name *));
+  if (!sc.dirs) { ret = -ENOMEM; goto out_free_ex; }
+  pthread_mutex_init(&sc.lock, NULL);
+  analysis_pool_run(analysis_threads((sc.nrec + NTFS_MFT_BATCH - 1)
+				     / NTFS_MFT_BATCH),
+		    NTFS_scan_worker, &sc, 0);
+  pthread_mutex_destroy(&sc.lock);
+  if ((ret = sc.error)) goto out_free_scan;
+
+  // match each candidate against its full path, then find its clusters
+  for (i = 0; i < sc.ncand; i++) {
+    struct NTFS_exclude * ex = sc.ex + sc.cand[i].ex;
+    int64_t n;
+    if (ex->recno || !NTFS_path_matches(&sc, ex, sc.cand[i].other))
+      continue;
+    ex->recno = sc.cand[i].recno;
+    if ((n = NTFS_add_DATA_runs(vol, ex->recno, holes)) < 0)
+      { ret = n; goto out_free_scan; }
+    ex->clusters += n;
+    for (j = 0; j < sc.nextrecs; j++)
+      if (sc.extrecs[j].other == ex->recno) {
+	if ((n = NTFS_add_DATA_runs(vol, sc.extrecs[j].recno, holes)) < 0)
+	  { ret = n; goto out_free_scan; }
+	ex->clusters += n;
+      }
+  }
+
+  extent_list_sort(holes);
+
+  for (i = 0; out && (i < sc.nex); i++)
+    if (sc.ex[i].recno)
+      fprintf(out,"# excluded %s (MFT record %llu): %llu clusters\n",
+	      sc.ex[i].path, (unsigned long long) sc.ex[i].recno,
+	      (unsigned long long) sc.ex[i].clusters);
+
+ out_free_scan:
+  for (i = 0; i < sc.nrec; i++) free(sc.dirs[i]);
+  free(sc.dirs); free(sc.cand); free(sc.extrecs);
+  if (ret) extent_list_free(holes);
+ out_free_ex:
+  while (sc.nex) NTFS_exclude_free(sc.ex + --sc.nex);
+  free(sc.ex);
+  return ret;
 }
 
 static char usagetext[] = "analyze_ntfs <mountpoint of NTFS filesystem>\n";
@@ -651,7 +1197,10 @@ static int NTFS_ad_recognize(FILE * fs, const void * hdrbuf)
 static int NTFS_ad_analyze(FILE * fs, FILE * out, char * ignore)
 {
   struct NTFS_volume_ctx * vol = NULL;
+  struct extent_list ext = {0};
+  struct extent_list holes = {0};
   FILE * bitmap = NULL;
+  int ret = 0;
 
   vol = NTFSdrv_volinit(fs);
   if (!vol) fatal("NTFS volinit failed");
@@ -659,34 +1208,97 @@ static int NTFS_ad_analyze(FILE * fs, FILE * out, char * ignore)
   bitmap = NTFSdrv_fopen(vol, NTFS_RECNO_BITMAP);
   if (!bitmap) fatal("could not open bitmap");
 
-  vol->info.dccount = NTFS_count_used_blocks(bitmap,vol->info.ccount - 1);
-
   fprintf(out,"Type:\tNTFS\n");
 
   fprintf(out,"# %d bytes/sector;  %d sectors/cluster; %d bytes/cluster\n",
 	 vol->info.ssize,vol->info.spc,vol->info.csize);
 
+  ret = NTFS_exclude_files(vol,&holes,out);
+  if (ret < 0) {
+    // the map is still good, only larger; the exclusions were a bonus
+    fprintf(stderr,"NTFS: could not scan MFT (%s); nothing excluded\n",
+	    strerror(-ret));
+    fprintf(out,"# could not scan MFT; nothing excluded\n");
+  }
+
+  ret = NTFS_scan_bitmap(bitmap,vol->info.ccount - 1,&holes,&ext);
+  if (ret < 0) { errno = -ret; fatal("could not scan bitmap"); }
+  vol->info.dccount = ext.blocks;
+
   fprintf(out,"BlockSize:\t%lld\n",vol->info.csize);
   fprintf(out,"BlockCount:\t%lld\n",vol->info.dccount);
   fprintf(out,"BlockRange:\t%lld\n",vol->info.ccount - 1);
 
   fprintf(out,"BEGIN BLOCK LIST\n");
-  emit_NTFS_extent_list(out,bitmap,vol->info.ccount - 1);
+  extent_list_emit(out,&ext);
   //also catch the backup boot record
   fprintf(out,"%lld+.1/%d\n",vol->info.ccount,vol->info.spc);
   fprintf(out,"END BLOCK LIST\n");
 
   fclose(bitmap);
   NTFSdrv_volclose(vol);
+  extent_list_free(&holes);
+  extent_list_free(&ext);
 
   return 0;
 }
 
+// the MFT is scanned for excluded files first; the bitmap is then passed
+//  on as it is read, less their clusters; BlockCount follows it
+static int NTFS_ad_analyze_sink(FILE * fs, struct extent_sink * sink,
+				char * ignore)
+{
+  struct NTFS_volume_ctx * vol = NULL;
+  struct extent_list ext = { .sink = sink };
+  struct extent_list holes = {0};
+  struct v1_extent backup = {0};
+  FILE * bitmap = NULL;
+  int ret = 0;
+
+  vol = NTFSdrv_volinit(fs);
+  if (!vol) fatal("NTFS volinit failed");
+
+  bitmap = NTFSdrv_fopen(vol, NTFS_RECNO_BITMAP);
+  if (!bitmap) fatal("could not open bitmap");
+
+  if ((ret = extent_sink_keyf(sink,"Type","NTFS"))
+      || (ret = extent_sink_keyf(sink,"BlockSize","%u",vol->info.csize))
+      || (ret = extent_sink_keyf(sink,"BlockRange","%llu",
+				 (unsigned long long) vol->info.ccount - 1)))
+    goto out;
+
+  ret = NTFS_exclude_files(vol,&holes,NULL);
+  if (ret < 0)
+    fprintf(stderr,"NTFS: could not scan MFT (%s); nothing excluded\n",
+	    strerror(-ret));
+
+  ret = NTFS_scan_bitmap(bitmap,vol->info.ccount - 1,&holes,&ext);
+  if (ret < 0) { errno = -ret; fatal("could not scan bitmap"); }
+  if (ret) goto out;
+
+  //also catch the backup boot record
+  backup.start = vol->info.ccount;
+  backup.num = 1;
+  backup.denom = vol->info.spc;
+  if ((ret = sink->extent(sink,&backup))) goto out;
+
+  ret = extent_sink_keyf(sink,"BlockCount","%llu",
+			 (unsigned long long) ext.blocks);
+
+ out:
+  fclose(bitmap);
+  NTFSdrv_volclose(vol);
+  extent_list_free(&holes);
+  extent_list_free(&ext);
+  return ret;
+}
+
 DECLARE_ANALYSIS_MODULE(NTFS) = {
   .name = "NTFS",
   .fs_hdrsize = sizeof(struct ecma107_desc),
   .recognize = NTFS_ad_recognize,
   .analyze = NTFS_ad_analyze,
-  0 };
+  0,
+  .analyze_sink = NTFS_ad_analyze_sink };
 
 //EOF
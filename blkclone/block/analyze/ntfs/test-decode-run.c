@@ -22,6 +22,8 @@
 
 #include "analyze-ntfs.c" //<-- note that there isn't actually a main() in there
 
+struct keylist * analysis_args = NULL; // normally defined by analyze
+
 void testusage(char * name)
 {
   fprintf(stderr,"usage: %s <hex bytes for encoded run>\n",name);
@@ -0,0 +1,435 @@
+/*
+ *  Ask the kernel for the block map of a mounted filesystem.
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+/* to ensure ability to handle large partitions */
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/magic.h>
+
+#include "keylist.h"
+#include "multicall.h"
+
+#include "analyze/dispatch.h"
+#include "analyze/extents.h"
+#include "analyze/pool.h"
+#include "analyze/mounted.h"
+#include "analyze/sink.h"
+#include "block/map-parse-v1.h"
+
+/* A mounted filesystem changes under an on-disk parser, but the kernel
+ *  knows where everything is.  FS_IOC_GETFSMAP (ext4, XFS) reports every
+ *  range on the device with its owner; this module lists all of the
+ *  filesystem except the ranges reported free, so anything the kernel
+ *  leaves unexplained is kept.
+ * Where GETFSMAP is missing (or with the fiemap option), files are mapped
+ *  one by one with FIEMAP over a directory walk shared by a pool of
+ *  threads.  FIEMAP sees only file contents, not the metadata that holds
+ *  the filesystem together, so the map of the on-disk module for the same
+ *  filesystem (taken after syncfs) is added to it; the file data catches
+ *  blocks allocated since the last checkpoint, whose metadata is then in
+ *  the journal.  Without an on-disk module the fallback refuses to run.
+ *  FIEMAP addresses are only device offsets where the filesystem sits on
+ *  one device at its own addresses: btrfs reports its logical addresses,
+ *  so there the on-disk map alone is used, and elsewhere anything beyond
+ *  the end of the filesystem is dropped.
+ * Either way the result is only as consistent as the filesystem is still;
+ *  a busy filesystem should be frozen around the copy.
+ */
+
+#define ONLINE_FIEMAP_EXTENTS	256	/* extents per FIEMAP call */
+
+struct online_walk {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;	// signalled when DIRS grows or BUSY drops
+  char ** dirs;		// directories still to be read
+  size_t ndirs;
+  size_t alloc;
+  unsigned int busy;	// workers reading a directory
+  dev_t dev;		// walk does not leave this filesystem
+  uint64_t bsize;	// block size of the map
+  uint64_t range;	// blocks in the filesystem; the rest is not its own
+  int error;		// -error code of first failure
+};
+
+struct online_worker {
+  struct online_walk * walk;
+  struct extent_list list; // blocks of files read by this worker
+};
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+//adds the bytes START+LEN to L as whole blocks of BSIZE, below block RANGE
+static inline int online_add_bytes(struct extent_list * l, uint64_t bsize,
+				   uint64_t range, uint64_t start, uint64_t len)
+{
+  uint64_t first = start / bsize;
+  uint64_t end = (start + len + bsize - 1) / bsize;
+  if (end > range) end = range;
+  return (end > first) ? extent_list_add(l, first, end - first) : 0;
+}
+
+//adds the blocks of the file open on FD to L
+// returns -error code on error
+static int online_fiemap(int fd, uint64_t bsize, uint64_t range,
+			 struct extent_list * l)
+{
+  char buf[sizeof(struct fiemap)
+	   + ONLINE_FIEMAP_EXTENTS * sizeof(struct fiemap_extent)];
+  struct fiemap * fm = (struct fiemap *) buf;
+  uint64_t pos = 0;
+  unsigned int i;
+
+  for (;;) {
+    memset(fm, 0, sizeof(struct fiemap));
+    fm->fm_start = pos;
+    fm->fm_length = FIEMAP_MAX_OFFSET - pos;
+    // sync first, so delayed allocations have a place on disk
+    fm->fm_flags = FIEMAP_FLAG_SYNC;
+    fm->fm_extent_count = ONLINE_FIEMAP_EXTENTS;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) return -errno;
+    if (!fm->fm_mapped_extents) return 0;
+    for (i = 0; i < fm->fm_mapped_extents; i++) {
+      struct fiemap_extent * e = fm->fm_extents + i;
+      // data kept in the metadata is mapped by the on-disk module
+      if (!(e->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))
+	  && online_add_bytes(l, bsize, range, e->fe_physical, e->fe_length))
+	return -ENOMEM;
+      if (e->fe_flags & FIEMAP_EXTENT_LAST) return 0;
+      pos = e->fe_logical + e->fe_length;
+    }
+  }
+}
+
+//takes a directory off the walk's stack, waiting while others may add more
+//return: path (must be freed), or NULL when the walk is over
+static char * online_next_dir(struct online_walk * w)
+{
+  char * dir = NULL;
+
+  pthread_mutex_lock(&w->lock);
+  while (!w->ndirs && w->busy && !w->error)
+    pthread_cond_wait(&w->cond, &w->lock);
+  if (w->ndirs && !w->error) {
+    dir = w->dirs[--w->ndirs];
+    w->busy++;
+  } else
+    pthread_cond_broadcast(&w->cond); // let the others see the end
+  pthread_mutex_unlock(&w->lock);
+  return dir;
+}
+
+//puts DIR on the walk's stack; takes ownership of DIR
+static int online_push_dir(struct online_walk * w, char * dir)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->ndirs == w->alloc) {
+    size_t n = w->alloc ? w->alloc * 2 : 64;
+    char ** p = realloc(w->dirs, n * sizeof(char *));
+    if (p) { w->dirs = p; w->alloc = n; } else ret = -ENOMEM;
+  }
+  if (!ret) {
+    w->dirs[w->ndirs++] = dir;
+    pthread_cond_signal(&w->cond);
+  } else
+    free(dir);
+  pthread_mutex_unlock(&w->lock);
+  return ret;
+}
+
+//opens NAME in DFD for FIEMAP, without updating its access time
+static inline int online_open(int dfd, const char * name, int flags)
+{
+  int fd = openat(dfd, name, flags | O_RDONLY | O_NOFOLLOW | O_NOATIME);
+  if ((fd < 0) && (errno == EPERM)) // O_NOATIME needs ownership
+    fd = openat(dfd, name, flags | O_RDONLY | O_NOFOLLOW);
+  return fd;
+}
+
+//reads directory DIR: maps it and its files, and queues its subdirectories
+// returns -error code on error
+static int online_read_dir(struct online_worker * wk, const char * dir)
+{
+  struct online_walk * w = wk->walk;
+  struct dirent * d;
+  DIR * dh;
+  int dfd, ret;
+
+  dfd = online_open(AT_FDCWD, dir, O_DIRECTORY);
+  // files may vanish while the filesystem is in use
+  if (dfd < 0) return (errno == ENOENT) ? 0 : -errno;
+  if ((ret = online_fiemap(dfd, w->bsize, w->range, &wk->list)) < 0)
+    { close(dfd); return ret; }
+  dh = fdopendir(dfd);
+  if (!dh) { ret = -errno; close(dfd); return ret; }
+
+  while (!ret && (d = readdir(dh))) {
+    struct stat st;
+    char * path = NULL;
+    int fd;
+    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+    if (fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      if (errno != ENOENT) ret = -errno;
+      continue;
+    }
+    // whatever is mounted below is some other filesystem
+    if (st.st_dev != w->dev) continue;
+    if (S_ISDIR(st.st_mode)) {
+      if (asprintf(&path, "%s/%s", dir, d->d_name) < 0) ret = -ENOMEM;
+      else ret = online_push_dir(w, path);
+    } else if (S_ISREG(st.st_mode)) {
+      fd = online_open(dfd, d->d_name, 0);
+      if (fd < 0) { if (errno != ENOENT) ret = -errno; continue; }
+      ret = online_fiemap(fd, w->bsize, w->range, &wk->list);
+      close(fd);
+    }
+    // symlinks, devices and the like own no blocks outside metadata
+  }
+
+  closedir(dh);
+  return ret;
+}
+
+static void * online_walk_worker(void * arg)
+{
+  struct online_worker * wk = arg;
+  struct online_walk * w = wk->walk;
+  char * dir;
+  int ret;
+
+  while ((dir = online_next_dir(w))) {
+    ret = online_read_dir(wk, dir);
+    free(dir);
+    pthread_mutex_lock(&w->lock);
+    if (ret && !w->error) w->error = ret;
+    w->busy--;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+  }
+  return NULL;
+}
+
+//adds the blocks (below RANGE) of every file under MNTPNT to L
+// returns -error code on error
+static int online_walk(const char * mntpnt, dev_t dev, uint64_t bsize,
+		       uint64_t range, struct extent_list * l)
+{
+  struct online_walk w = { .dev = dev, .bsize = bsize, .range = range };
+  struct online_worker wk[ANALYSIS_MAX_THREADS];
+  unsigned int nthreads = analysis_threads(0);
+  char * root = strdup(mntpnt);
+  size_t j;
+  int i, n, ret;
+
+  if (!root) return -ENOMEM;
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  if ((ret = online_push_dir(&w, root))) return ret;
+
+  memset(wk, 0, sizeof(wk));
+  for (n = 0; n < nthreads; n++) wk[n].walk = &w;
+  n = analysis_pool_run(nthreads, online_walk_worker, wk, sizeof(wk[0]));
+
+  ret = w.error;
+  for (i = 0; i < n; i++) {
+    for (j = 0; !ret && (j < wk[i].list.count); j++)
+      if (extent_list_add(l, wk[i].list.ext[j].start,
+			  wk[i].list.ext[j].length))
+	ret = -ENOMEM;
+    extent_list_free(&wk[i].list);
+  }
+  while (w.ndirs) free(w.dirs[--w.ndirs]); // left over after an error
+  free(w.dirs);
+  return ret;
+}
+
+/* The on-disk module's map is collected through a sink: whole blocks go
+ *  into the same list as the file data, and the odd partial block at the
+ *  end of the medium is kept aside and written after them.
+ */
+struct online_inner {
+  struct extent_list * list;
+  struct v1_extent * partial;
+  size_t npartial;
+  char * fstype;
+  uint64_t bsize;
+  uint64_t range;
+};
+
+static int online_inner_key(struct extent_sink * s, const char * key,
+			    const char * value)
+{
+  struct online_inner * in = s->arg;
+
+  if (!strcmp(key, "BlockSize")) in->bsize = strtoull(value, NULL, 10);
+  else if (!strcmp(key, "BlockRange")) in->range = strtoull(value, NULL, 10);
+  else if (!strcmp(key, "FsType") || (!strcmp(key, "Type") && !in->fstype))
+    { free(in->fstype); in->fstype = strdup(value); }
+  return 0;
+}
+
+static int online_inner_extent(struct extent_sink * s,
+			       const struct v1_extent * e)
+{
+  struct online_inner * in = s->arg;
+  struct v1_extent * p;
+
+  if (e->length)
+    return extent_list_add(in->list, e->start, e->length) ? -ENOMEM : 0;
+  p = realloc(in->partial, (in->npartial + 1) * sizeof(struct v1_extent));
+  if (!p) return -ENOMEM;
+  in->partial = p;
+  in->partial[in->npartial++] = *e;
+  return 0;
+}
+
+//writes the finished block list
+static void online_emit(FILE * out, const char * fstype, const char * how,
+			uint64_t bsize, uint64_t range,
+			struct extent_list * l, struct online_inner * in)
+{
+  unsigned long long int count = l->blocks;
+  size_t i;
+
+  if (in) count += in->npartial;
+  fprintf(out,"Type:\tonline\n");
+  if (fstype) fprintf(out,"FsType:\t%s\n",fstype);
+  fprintf(out,"# block map from %s\n",how);
+  fprintf(out,"BlockSize:\t%llu\n",(unsigned long long) bsize);
+  fprintf(out,"BlockCount:\t%llu\n",count);
+  fprintf(out,"BlockRange:\t%llu\n",(unsigned long long) range);
+
+  fprintf(out,"BEGIN BLOCK LIST\n");
+  extent_list_emit(out, l);
+  if (in)
+    for (i = 0; i < in->npartial; i++)
+      fprintf(out,"%llu+.%lu/%lu\n",in->partial[i].start,
+	      in->partial[i].num,in->partial[i].denom);
+  fprintf(out,"END BLOCK LIST\n");
+}
+
+static int online_ad_analyze(FILE * fs, FILE * out, char * mntpnt)
+{
+  struct extent_list ext = {0};
+  struct statvfs sv;
+  struct stat mst;
+  char * fstype = NULL;
+  uint64_t bsize, size;
+  off_t end;
+  int mfd, ret;
+
+  mfd = open(mntpnt, O_RDONLY | O_DIRECTORY);
+  if (mfd < 0) fatal("could not open mount point");
+  if ((fstat(mfd, &mst) < 0) || (fstatvfs(mfd, &sv) < 0))
+    fatal("could not stat mount point");
+  ret = mounted_check_source(fileno(fs), &mst);
+  if (ret == -EXDEV) {
+    fprintf(stderr,"%s is not where the source is mounted\n",mntpnt);
+    return 1;
+  } else if (ret < 0) { errno = -ret; fatal("could not stat source"); }
+
+  if (fseeko(fs, 0, SEEK_END) || ((end = ftello(fs)) < 0))
+    fatal("could not find size of source");
+  rewind(fs);
+  size = end;
+  bsize = sv.f_frsize ? sv.f_frsize : sv.f_bsize;
+  fstype = mounted_fstype(mntpnt);
+
+  ret = keylist_get(analysis_args, "fiemap") ? -EOPNOTSUPP
+    : mounted_fsmap_used(mfd, mst.st_dev, bsize, &ext);
+  if (!ret)
+    online_emit(out, fstype, "GETFSMAP", bsize, size / bsize, &ext, NULL);
+  else if ((ret == -ENOTTY) || (ret == -EOPNOTSUPP) || (ret == -EINVAL)) {
+    struct online_inner in = { .list = &ext };
+    struct extent_sink sink = { online_inner_key, online_inner_extent, &in };
+    struct analysis_module * mod;
+    struct statfs sf;
+    uint64_t range;
+    // flush everything the kernel holds, then map what is on disk
+    if (syncfs(mfd) < 0) fatal("failed to sync filesystem");
+    mod = analysis_find_module(fs, NULL);
+    if (!mod) {
+      fprintf(stderr,
+	      "%s has no GETFSMAP and no module can read its metadata\n",
+	      mntpnt);
+      return 1;
+    }
+    ret = analysis_run_sink(mod, fs, NULL, &sink);
+    if (ret) {
+      if (ret < 0) { errno = -ret; fatal("on-disk analysis failed"); }
+      return ret;
+    }
+    if (!in.bsize) {
+      fprintf(stderr,"module %s gave no block size\n",mod->name);
+      return 1;
+    }
+    range = in.range ? in.range : size / in.bsize;
+    if (!fstatfs(mfd, &sf) && (sf.f_type == BTRFS_SUPER_MAGIC)) {
+      // FIEMAP gives btrfs logical addresses, not places on this device
+      extent_list_sort(&ext);
+      online_emit(out, in.fstype ? in.fstype : fstype,
+		  "the on-disk module after syncfs", in.bsize, range, &ext, &in);
+    } else {
+      ret = online_walk(mntpnt, mst.st_dev, in.bsize, range, &ext);
+      if (ret < 0) { errno = -ret; fatal("failed to map files"); }
+      extent_list_sort(&ext);
+      online_emit(out, in.fstype ? in.fstype : fstype, "FIEMAP", in.bsize,
+		  range, &ext, &in);
+    }
+    free(in.fstype);
+    free(in.partial);
+  } else { errno = -ret; fatal("GETFSMAP failed"); }
+
+  extent_list_free(&ext);
+  free(fstype);
+  close(mfd);
+  return 0;
+}
+
+DECLARE_ANALYSIS_MODULE(online) = {
+  .name = "online",
+  .fs_hdrsize = 0,
+  .recognize = NULL, // chosen by giving mnt=; see dispatch.c
+  .analyze = online_ad_analyze,
+  1 };
+
+//EOF
@@ -0,0 +1,60 @@
+/* Thread pools for analysis modules
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "keylist.h"
+#include "analyze/dispatch.h"
+#include "analyze/pool.h"
+
+unsigned int analysis_threads(unsigned long work)
+{
+  long n;
+
+  if (keylist_get(analysis_args, "threads"))
+    n = strtol(keylist_get(analysis_args, "threads"), NULL, 0);
+  else
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > ANALYSIS_MAX_THREADS) n = ANALYSIS_MAX_THREADS;
+  if (work && (n > work)) n = work;
+  return (n < 1) ? 1 : n;
+}
+
+unsigned int analysis_pool_run(unsigned int nthreads,
+			       void * (*worker)(void *),
+			       void * arg, size_t argsize)
+{
+  pthread_t tid[ANALYSIS_MAX_THREADS];
+  unsigned int i, n;
+
+  if (nthreads > ANALYSIS_MAX_THREADS) nthreads = ANALYSIS_MAX_THREADS;
+  for (n = 0; n < nthreads; n++)
+    if (pthread_create(tid + n, NULL, worker, (char *) arg + n * argsize))
+      break;
+  if (!n) { worker(arg); return 1; } // no threads at all; work here
+  for (i = 0; i < n; i++) pthread_join(tid[i], NULL);
+  return n;
+}
@@ -0,0 +1,126 @@
+/* Extent sinks: receiving a block list without going through text
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analyze/sink.h"
+#include "block/map-parse-v1.h"
+
+struct sink_stream {
+  struct extent_sink * sink;
+  char * line;		// partial line carried between writes
+  size_t len;		// bytes in LINE
+  size_t alloc;		// bytes allocated for LINE
+  int in_list;		// TRUE between the list markers
+  int error;		// TRUE once anything has gone wrong
+};
+
+//handles one complete line (without newline); returns -error code on error
+static int sink_line(struct sink_stream * s, char * line)
+{
+  struct v1_extent e = {0};
+  char * value;
+
+  if (line[0] == '#') return 0;
+  if (!strcmp(line, MAP_V1_STARTBLOCKS)) { s->in_list = 1; return 0; }
+  if (!strcmp(line, MAP_V1_ENDBLOCKS)) { s->in_list = 0; return 0; }
+
+  if (!s->in_list) {
+    value = strchr(line, ':');
+    if (!value) return 0;
+    *value++ = '\0';
+    value += strspn(value, " \t");
+    return s->sink->key(s->sink, line, value);
+  }
+
+  // same syntax as map_v1_readcell
+  if (strstr(line, "+.")) {
+    if (sscanf(line, "%llu+.%lu/%lu", &e.start, &e.num, &e.denom) != 3)
+      return -EINVAL;
+  } else if (sscanf(line, "%llu+%llu", &e.start, &e.length) != 2)
+    return -EINVAL;
+  return s->sink->extent(s->sink, &e);
+}
+
+static ssize_t sink_write(void * cookie, const char * buf, size_t size)
+{
+  struct sink_stream * s = cookie;
+  size_t i;
+
+  if (s->error) return -1;
+  for (i = 0; i < size; i++) {
+    if (s->len + 1 >= s->alloc) {
+      size_t n = s->alloc ? s->alloc * 2 : 128;
+      char * p = realloc(s->line, n);
+      if (!p) { s->error = 1; return -1; }
+      s->line = p; s->alloc = n;
+    }
+    if (buf[i] != '\n') { s->line[s->len++] = buf[i]; continue; }
+    s->line[s->len] = '\0';
+    s->len = 0;
+    if (sink_line(s, s->line)) { s->error = 1; return -1; }
+  }
+  return size;
+}
+
+static int sink_close(void * cookie)
+{
+  struct sink_stream * s = cookie;
+  int ret = (s->error || s->len) ? -1 : 0; // no partial last line
+
+  free(s->line);
+  free(s);
+  return ret;
+}
+
+FILE * extent_sink_open(struct extent_sink * sink)
+{
+  cookie_io_functions_t io = { .write = sink_write, .close = sink_close };
+  struct sink_stream * s = calloc(1, sizeof(struct sink_stream));
+  FILE * f;
+
+  if (!s) return NULL;
+  s->sink = sink;
+  f = fopencookie(s, "w", io);
+  if (!f) free(s);
+  return f;
+}
+
+int extent_sink_keyf(struct extent_sink * sink, const char * key,
+		     const char * fmt, ...)
+{
+  char * value = NULL;
+  va_list ap;
+  int ret;
+
+  va_start(ap, fmt);
+  ret = vasprintf(&value, fmt, ap);
+  va_end(ap);
+  if (ret < 0) return -ENOMEM;
+  ret = sink->key(sink, key, value);
+  free(value);
+  return ret;
+}
@@ -0,0 +1,260 @@
+/*
+ *  List the data regions of a sparse file (a disk image) as a block map.
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+/* to ensure ability to handle large partitions */
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "keylist.h"
+#include "multicall.h"
+
+#include "analyze/dispatch.h"
+#include "analyze/extents.h"
+#include "analyze/sink.h"
+#include "block/map-parse-v1.h"
+
+/* A raw disk image kept as a sparse file (a virtual machine's disk, or a
+ *  raw image from sparsecopy) has holes wherever nothing was ever written,
+ *  and the filesystem holding it already knows where they are.  This module
+ *  asks with SEEK_DATA and SEEK_HOLE, so that the map of a mostly empty
+ *  2 TB image costs a few system calls and no reading at all, whatever is
+ *  inside it.  A block that is partly data counts as data.
+ * With within=<type>, the module for the filesystem inside the image is run
+ *  too (within=auto detects it), and only blocks in both maps are kept:
+ *  free blocks that happen to hold stale data are dropped, and so are
+ *  allocated blocks that were never written, which read as zero anyway.
+ *  The block size is then that of the inner map.
+ * The sparsefile module is never auto-detected; any file may be sparse.
+ *  Ask for it with type=sparsefile.
+ */
+
+#define SPARSEFILE_BSIZE	4096	/* default block size */
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+struct sparsefile_inner {
+  struct extent_list * list;	// whole blocks in the inner map
+  struct v1_extent * partial;	// partial blocks in the inner map
+  size_t npartial;
+  uint64_t bsize;
+  char * fstype;
+};
+
+static int sparsefile_inner_key(struct extent_sink * s, const char * key,
+				const char * value)
+{
+  struct sparsefile_inner * in = s->arg;
+
+  if (!strcmp(key, "BlockSize")) in->bsize = strtoull(value, NULL, 10);
+  else if (!strcmp(key, "FsType") || (!strcmp(key, "Type") && !in->fstype))
+    { free(in->fstype); in->fstype = strdup(value); }
+  return 0;
+}
+
+static int sparsefile_inner_extent(struct extent_sink * s,
+				   const struct v1_extent * e)
+{
+  struct sparsefile_inner * in = s->arg;
+  struct v1_extent * p;
+
+  if (e->length)
+    return extent_list_add(in->list, e->start, e->length) ? -ENOMEM : 0;
+  p = realloc(in->partial, (in->npartial + 1) * sizeof(struct v1_extent));
+  if (!p) return -ENOMEM;
+  in->partial = p;
+  in->partial[in->npartial++] = *e;
+  return 0;
+}
+
+//given: file open on FD, SIZE bytes long
+//adds the blocks of BSIZE holding any data to L
+//return: 0, or -error code
+static int sparsefile_scan(int fd, off_t size, uint64_t bsize,
+			   struct extent_list * l)
+{
+  off_t pos = 0, data, hole;
+  uint64_t first, end;
+  int ret;
+
+  while (pos < size) {
+    if ((data = lseek(fd, pos, SEEK_DATA)) < 0) {
+      if (errno == ENXIO) break; // nothing but a hole remains
+      if ((errno != EINVAL) || pos) return -errno;
+      // no SEEK_DATA here (a block device); all of it is data
+      data = 0; hole = size;
+    } else if ((hole = lseek(fd, data, SEEK_HOLE)) < 0)
+      return -errno;
+    if (hole > size) hole = size;
+    // blocks partly data count as data; the last may be a partial block
+    first = data / bsize;
+    end = (hole + bsize - 1) / bsize;
+    // blocks larger than the holes put the ends of two regions in one
+    if (l->count && (first < l->ext[l->count-1].start
+		     + l->ext[l->count-1].length))
+      first = l->ext[l->count-1].start + l->ext[l->count-1].length;
+    if ((end > first) && (ret = extent_list_append(l, first, end - first)))
+      return ret;
+    pos = hole;
+  }
+  return 0;
+}
+
+//return: TRUE if BLOCK is in L
+static int sparsefile_has(const struct extent_list * l, uint64_t block)
+{
+  size_t lo = 0, hi = l->count, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (l->ext[mid].start + l->ext[mid].length <= block) lo = mid + 1;
+    else hi = mid;
+  }
+  return (lo < l->count) && (l->ext[lo].start <= block);
+}
+
+static int sparsefile_ad_analyze(FILE * fs, FILE * out, char * ignore)
+{
+  struct extent_list ext = {0}, inner = {0};
+  struct sparsefile_inner in = { .list = &inner };
+  char * within = keylist_get(analysis_args, "within");
+  uint64_t bsize = SPARSEFILE_BSIZE, tail = 0, last;
+  off_t size;
+  int ret;
+  size_t i, n;
+
+  if (keylist_get(analysis_args, "bs"))
+    bsize = strtoull(keylist_get(analysis_args, "bs"), NULL, 0);
+
+  if (within) {
+    struct extent_sink sink = { sparsefile_inner_key,
+				sparsefile_inner_extent, &in };
+    struct analysis_module * mod;
+
+    mod = analysis_find_module(fs, strcasecmp(within, "auto") ? within : NULL);
+    if (!mod || (mod->analyze == sparsefile_ad_analyze)) {
+      fprintf(stderr,"no module to analyze what is within %s\n",
+	      keylist_get(analysis_args, "src"));
+      return 1;
+    }
+    if (mod->need_mounted_fs) {
+      fprintf(stderr,"module %s cannot be used within a sparse file\n",
+	      mod->name);
+      return 1;
+    }
+    ret = analysis_run_sink(mod, fs, NULL, &sink);
+    if (ret) {
+      if (ret < 0) { errno = -ret; fatal("inner analysis failed"); }
+      return ret;
+    }
+    if (!in.bsize) {
+      fprintf(stderr,"module %s gave no block size\n",mod->name);
+      return 1;
+    }
+    if (keylist_get(analysis_args, "bs") && (bsize != in.bsize)) {
+      fprintf(stderr,"module %s uses %llu-byte blocks; bs= cannot differ\n",
+	      mod->name, (unsigned long long) in.bsize);
+      return 1;
+    }
+    bsize = in.bsize;
+    extent_list_sort(&inner);
+    rewind(fs);
+  }
+  if (!bsize) { fprintf(stderr,"block size must not be zero\n"); return 1; }
+
+  if (fseeko(fs, 0, SEEK_END) || ((size = ftello(fs)) < 0))
+    fatal("could not find size of source");
+
+  ret = sparsefile_scan(fileno(fs), size, bsize, &ext);
+  rewind(fs); // (scanning moved the file offset under stdio)
+  if (ret < 0) { errno = -ret; fatal("could not find data in source"); }
+
+  last = size / bsize; // a partial block at the end is block LAST
+  if (size % bsize) {
+    if (ext.count && (ext.ext[ext.count-1].start
+		      + ext.ext[ext.count-1].length > last)) {
+      // list it as the partial block it is
+      ext.ext[ext.count-1].length--; ext.blocks--;
+      if (!ext.ext[ext.count-1].length) ext.count--;
+      tail = size % bsize;
+    }
+  }
+
+  if (within) {
+    // partial blocks in the inner map are kept where there is data
+    for (i = 0, n = 0; i < in.npartial; i++)
+      if (sparsefile_has(&ext, in.partial[i].start)
+	  || (tail && (in.partial[i].start == last)))
+	in.partial[n++] = in.partial[i];
+    in.npartial = n;
+    if (tail && (n ? (in.partial[n-1].start == last)
+		 : !sparsefile_has(&inner, last)))
+      tail = 0; // the inner map has the last block in part, or not at all
+    if (extent_list_intersect(&ext, &inner))
+      fatal("failed to intersect block maps");
+  }
+
+  fprintf(out,"Type:\tsparsefile\n");
+  if (in.fstype) fprintf(out,"FsType:\t%s\n",in.fstype);
+  fprintf(out,"# data regions from SEEK_DATA%s\n",
+	  within ? ", within the filesystem's block map" : "");
+  fprintf(out,"BlockSize:\t%llu\n",(unsigned long long) bsize);
+  fprintf(out,"BlockCount:\t%llu\n",
+	  (unsigned long long) ext.blocks + in.npartial + !!tail);
+  fprintf(out,"BlockRange:\t%llu\n",
+	  (unsigned long long) (size + bsize - 1) / bsize);
+
+  fprintf(out,"BEGIN BLOCK LIST\n");
+  extent_list_emit(out, &ext);
+  for (i = 0; i < in.npartial; i++)
+    fprintf(out,"%llu+.%lu/%lu\n",in.partial[i].start,
+	    in.partial[i].num,in.partial[i].denom);
+  if (tail) {
+    uint64_t a = tail, b = bsize, t;
+    while (b) { t = a % b; a = b; b = t; } // reduce TAIL/BSIZE
+    fprintf(out,"%llu+.%llu/%llu\n",(unsigned long long) last,
+	    (unsigned long long) (tail / a), (unsigned long long) (bsize / a));
+  }
+  fprintf(out,"END BLOCK LIST\n");
+
+  extent_list_free(&ext);
+  extent_list_free(&inner);
+  free(in.partial);
+  free(in.fstype);
+  return 0;
+}
+
+DECLARE_ANALYSIS_MODULE(sparsefile) = {
+  .name = "sparsefile",
+  .fs_hdrsize = 0,
+  .recognize = NULL, // never auto-detected; see comment at top of file
+  .analyze = sparsefile_ad_analyze,
+  0 };
+
+//EOF
@@ -0,0 +1,189 @@
+/*
+ *  Analyze a Linux swap area (or a partition of no value) to generate a
+ *   block map that covers only its header.
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+/* to ensure ability to handle large partitions */
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "multicall.h"
+
+#include "analyze/dispatch.h"
+
+/* Nothing in a swap area survives a reboot except its first page, which
+ *  holds the signature, UUID and label written by mkswap.  Imaging that
+ *  page alone restores a working swap area with the same identity, so
+ *  /etc/fstab entries by UUID or label still match.
+ * The signature is at the end of the first page, and the page size is
+ *  that of the machine that ran mkswap, so each possible size is tried.
+ * Some mkfs programs (mkfs.xfs among them) leave that page alone, so a
+ *  filesystem made over an old swap area can still carry the signature;
+ *  the module is marked weak_signature and any other module that
+ *  recognizes the header is preferred to it.
+ * A swap area holding a hibernation image has a different signature and
+ *  is deliberately not recognized: its contents do matter, and restoring
+ *  the header without them would leave a resume image that is garbage.
+ *
+ * The "blank" module is for partitions whose contents are known to be of
+ *  no value (scratch space, freshly wiped disks).  Nothing can be known
+ *  about such a partition by looking at it, so it is never auto-detected;
+ *  ask for it with type=blank.  It lists only the first 4 KiB, which
+ *  keeps any partition-level signature that may be there.
+ */
+
+struct swap_header_v1 {		// Linux swap header (in first page)
+  uint8_t  bootbits[1024];	// space for disklabel or boot code
+  uint32_t version;		// == 1
+  uint32_t last_page;		// last usable page
+  uint32_t nr_badpages;		// number of entries in bad page list
+  uint8_t  uuid[16];
+  char     label[16];
+  // bad page list follows; signature is in the last 10 bytes of the page
+} __attribute__((packed));
+
+#define SWAP_SIG_LEN	10
+#define BLANK_HDRSIZE	4096
+
+static const unsigned int swap_pagesizes[] = { 4096, 8192, 16384, 65536, 0 };
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+//given: filesystem, first BLANK_HDRSIZE bytes of it, and ptr for version
+//return: page size of swap area, or 0 if not a swap area
+static unsigned int swap_find_pagesize(FILE * fs, const void * hdrbuf,
+				       int * version)
+{
+  char sig[SWAP_SIG_LEN];
+  int i;
+
+  for (i = 0; swap_pagesizes[i]; i++) {
+    unsigned int psize = swap_pagesizes[i];
+    if (psize <= BLANK_HDRSIZE)
+      memcpy(sig, (const char *) hdrbuf + psize - SWAP_SIG_LEN,
+	     SWAP_SIG_LEN);
+    else if (pread(fileno(fs), sig, SWAP_SIG_LEN, psize - SWAP_SIG_LEN)
+	     != SWAP_SIG_LEN)
+      break;
+    if (!memcmp(sig, "SWAPSPACE2", SWAP_SIG_LEN))
+      { if (version) *version = 1; return psize; }
+    if (!memcmp(sig, "SWAP-SPACE", SWAP_SIG_LEN))
+      { if (version) *version = 0; return psize; }
+  }
+  return 0;
+}
+
+//given: filesystem
+//return: size in bytes, or 0 if it cannot be found
+static unsigned long long int swap_size(FILE * fs)
+{
+  off_t len = 0;
+
+  if (fseeko(fs, 0, SEEK_END)) return 0;
+  len = ftello(fs);
+  rewind(fs);
+  return (len < 0) ? 0 : len;
+}
+
+//writes a block list holding only the first block of a device SIZE bytes
+static void header_only_blocklist(FILE * out, unsigned int bsize,
+				  unsigned long long int size)
+{
+  fprintf(out,"BlockSize:\t%u\n",bsize);
+  fprintf(out,"BlockCount:\t1\n");
+  fprintf(out,"BlockRange:\t%llu\n",(size + bsize - 1) / bsize);
+
+  fprintf(out,"BEGIN BLOCK LIST\n");
+  fprintf(out,"0+1\n");
+  fprintf(out,"END BLOCK LIST\n");
+}
+
+static int swap_ad_recognize(FILE * fs, const void * hdrbuf)
+{ return swap_find_pagesize(fs, hdrbuf, NULL) != 0; }
+
+static int swap_ad_analyze(FILE * fs, FILE * out, char * ignore)
+{
+  struct swap_header_v1 hdr;
+  unsigned char hdrbuf[BLANK_HDRSIZE];
+  unsigned int psize = 0;
+  unsigned long long int size = 0;
+  int version = 0;
+
+  if (fread(hdrbuf, sizeof(hdrbuf), 1, fs) != 1)
+    fatal("failed to read swap header");
+  psize = swap_find_pagesize(fs, hdrbuf, &version);
+  if (!psize) {
+    fprintf(stderr,"no swap signature found\n");
+    return 1;
+  }
+  memcpy(&hdr, hdrbuf, sizeof(hdr));
+  size = swap_size(fs);
+
+  fprintf(out,"Type:\tswap\n");
+  fprintf(out,"FsType:\tswap v%d\n",version);
+
+  fprintf(out,"# %u bytes/page; only the header page is imaged\n",psize);
+  if (version && (hdr.version == 1)) {
+    fprintf(out,"# last page %u; %u bad pages\n",
+	    hdr.last_page,hdr.nr_badpages);
+    if (hdr.label[0])
+      fprintf(out,"# label %.16s\n",hdr.label);
+  }
+
+  header_only_blocklist(out, psize, size);
+
+  return 0;
+}
+
+DECLARE_ANALYSIS_MODULE(swap) = {
+  .name = "swap",
+  .fs_hdrsize = BLANK_HDRSIZE,
+  .recognize = swap_ad_recognize,
+  .analyze = swap_ad_analyze,
+  .weak_signature = 1 };
+
+static int blank_ad_analyze(FILE * fs, FILE * out, char * ignore)
+{
+  fprintf(out,"Type:\tblank\n");
+  fprintf(out,"# contents declared of no value; only the first %d bytes"
+	  " are imaged\n",BLANK_HDRSIZE);
+
+  header_only_blocklist(out, BLANK_HDRSIZE, swap_size(fs));
+
+  return 0;
+}
+
+DECLARE_ANALYSIS_MODULE(blank) = {
+  .name = "blank",
+  .fs_hdrsize = 0,
+  .recognize = NULL, // never auto-detected; see comment at top of file
+  .analyze = blank_ad_analyze,
+  0 };
+
+//EOF
@@ -0,0 +1,332 @@
+/*
+ *  Analyze an XFS filesystem to generate a block map for sparse imaging.
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+/* to ensure ability to scan entire filesystem */
+#define _FILE_OFFSET_BITS 64
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "multicall.h"
+#include "keylist.h"
+
+#include "analyze/dispatch.h"
+#include "analyze/extents.h"
+#include "analyze/pool.h"
+
+/* XFS has no allocation bitmap.  Each allocation group (AG) instead keeps
+ *  its free space in two B+trees; the one ordered by block number (the
+ *  bnobt) lists the free extents of the AG in ascending order, so the
+ *  allocated blocks are simply the gaps between them.
+ * Only the leftmost path to the leaf level is read from the root, and then
+ *  the leaves are followed through their right-sibling pointers.  The AGs
+ *  are independent and are walked by a pool of threads; the lists for each
+ *  AG are joined in order at the end.
+ * The free list (AGFL) is not in the bnobt, so its few blocks are imaged.
+ * All on-disk values are big-endian.
+ */
+
+struct xfs_super {		// the parts of the XFS superblock we need
+  char     magic[4];		// 0x00 "XFSB"
+  uint32_t blocksize;		// 0x04 filesystem block size in bytes
+  uint64_t dblocks;		// 0x08 blocks in data device
+  uint8_t  rsrv_1[0x44];	// 0x10 realtime, UUID, log, root inodes
+  uint32_t agblocks;		// 0x54 blocks in each AG (except perhaps last)
+  uint32_t agcount;		// 0x58 number of AGs
+  uint8_t  rsrv_2[8];		// 0x5C realtime bitmap, log sizes
+  uint16_t versionnum;		// 0x64 low 4 bits are the format version
+  uint16_t sectsize;		// 0x66 sector size in bytes
+} __attribute__((packed));
+
+struct xfs_agf {		// the parts of the AG free space header we need
+  char     magic[4];		// 0x00 "XAGF"
+  uint32_t versionnum;		// 0x04
+  uint32_t seqno;		// 0x08 AG number
+  uint32_t length;		// 0x0C blocks in this AG
+  uint32_t bno_root;		// 0x10 root of bnobt
+  uint32_t cnt_root;		// 0x14 root of cntbt
+  uint32_t rmap_root;		// 0x18
+  uint32_t bno_level;		// 0x1C levels in bnobt
+  uint32_t cnt_level;		// 0x20
+} __attribute__((packed));
+
+struct xfs_btree_short {	// header of an AG btree block
+  char     magic[4];
+  uint16_t level;		// 0 for leaves
+  uint16_t numrecs;		// records (or keys) in this block
+  uint32_t leftsib;
+  uint32_t rightsib;
+  // v5 adds block number, LSN, UUID, owner and CRC (56 bytes in all)
+} __attribute__((packed));
+
+struct xfs_alloc_rec {		// a free extent (also the key format)
+  uint32_t startblock;
+  uint32_t blockcount;
+} __attribute__((packed));
+
+#define XFS_SB_VERSION_NUMBITS	0x000F
+#define XFS_BTREE_SBLOCK_LEN	16
+#define XFS_BTREE_SBLOCK_CRC_LEN 56
+#define XFS_NULLAGBLOCK		0xFFFFFFFF
+
+struct xfs_context {
+  int fd;			// file descriptor for filesystem
+  uint32_t bsize;		// block size in bytes
+  uint32_t sectsize;		// sector size in bytes
+  uint64_t dblocks;		// blocks in filesystem
+  uint32_t agblocks;		// blocks in each AG
+  uint32_t agcount;		// number of AGs
+  int version;			// format version (4 or 5)
+  uint32_t hdrlen;		// length of btree block header
+  const char * bno_magic;	// magic number of bnobt blocks
+  // scan state, shared by threads
+  uint32_t next;		// next AG to walk (atomic)
+  int error;			// first error seen by any thread (set once,
+				//  by xfs_scan_error)
+  uint64_t freeblks;		// free blocks found (atomic)
+  struct extent_list * ags;	// allocated blocks, per AG
+};
+
+//reads superblock and fills in context struct
+// returns -error code on error
+static int xfs_init(struct xfs_context * ctx, FILE * fs)
+{
+  struct xfs_super sb;
+
+  ctx->fd = fileno(fs);
+  if (pread(ctx->fd, &sb, sizeof(sb), 0) != sizeof(sb))
+    return -EIO;
+  if (memcmp(sb.magic, "XFSB", 4))
+    return -EINVAL;
+
+  ctx->bsize	= be32toh(sb.blocksize);
+  ctx->sectsize	= be16toh(sb.sectsize);
+  ctx->dblocks	= be64toh(sb.dblocks);
+  ctx->agblocks	= be32toh(sb.agblocks);
+  ctx->agcount	= be32toh(sb.agcount);
+  ctx->version	= be16toh(sb.versionnum) & XFS_SB_VERSION_NUMBITS;
+
+  if ((ctx->bsize < 512) || (ctx->bsize & (ctx->bsize - 1))
+      || (ctx->sectsize < 512) || (ctx->sectsize > ctx->bsize)
+      || !ctx->agblocks || !ctx->agcount)
+    return -EINVAL;
+
+  if (ctx->version >= 5) {
+    ctx->hdrlen = XFS_BTREE_SBLOCK_CRC_LEN;
+    ctx->bno_magic = "AB3B";
+  } else {
+    ctx->hdrlen = XFS_BTREE_SBLOCK_LEN;
+    ctx->bno_magic = "ABTB";
+  }
+  return 0;
+}
+
+//given: context, AG number, AG block number, buffer, and expected level
+//return: 0 on success, -error code on error
+//side effect on success: block is in BUF and has a sane btree header
+static int xfs_read_bnobt(struct xfs_context * ctx, uint32_t ag,
+			  uint32_t agbno, uint8_t * buf, int level)
+{
+  struct xfs_btree_short * h = (struct xfs_btree_short *) buf;
+  uint32_t max = (ctx->bsize - ctx->hdrlen)
+    / (level ? sizeof(struct xfs_alloc_rec) + 4
+	     : sizeof(struct xfs_alloc_rec));
+
+  if (agbno >= ctx->agblocks) return -EIO;
+  if (pread(ctx->fd, buf, ctx->bsize,
+	    ((off_t) ag * ctx->agblocks + agbno) * ctx->bsize) != ctx->bsize)
+    return -EIO;
+  if (memcmp(h->magic, ctx->bno_magic, 4)
+      || (be16toh(h->level) != level)
+      || (be16toh(h->numrecs) > max))
+    return -EIO; // not the block we were looking for
+  return 0;
+}
+
+//given: context, AG number, buffer for one block, and list
+//return: 0 on success, -error code on error
+//side effect: the allocated blocks of the AG are appended to L
+static int xfs_walk_ag(struct xfs_context * ctx, uint32_t ag, uint8_t * buf,
+		       struct extent_list * l)
+{
+  struct xfs_agf agf;
+  struct xfs_btree_short * h = (struct xfs_btree_short *) buf;
+  struct xfs_alloc_rec * rec;
+  uint64_t base = (uint64_t) ag * ctx->agblocks;
+  uint32_t agbno, length, cur = 0, nleaves = 0, i;
+  int level, ret;
+
+  if (pread(ctx->fd, &agf, sizeof(agf),
+	    (off_t) base * ctx->bsize + ctx->sectsize) != sizeof(agf))
+    return -EIO;
+  if (memcmp(agf.magic, "XAGF", 4) || (be32toh(agf.seqno) != ag))
+    return -EIO;
+  length = be32toh(agf.length);
+  if (length > ctx->agblocks) return -EIO;
+  agbno = be32toh(agf.bno_root);
+  level = be32toh(agf.bno_level) - 1;
+  if ((level < 0) || (level > 32)) return -EIO;
+
+  // descend along the left edge of the tree
+  for (; level > 0; level--) {
+    uint32_t maxrecs = (ctx->bsize - ctx->hdrlen)
+      / (sizeof(struct xfs_alloc_rec) + 4);
+    if ((ret = xfs_read_bnobt(ctx, ag, agbno, buf, level)) < 0) return ret;
+    if (!h->numrecs) return -EIO;
+    // pointers follow the space for MAXRECS keys
+    agbno = be32toh(*((uint32_t*)(buf + ctx->hdrlen
+				  + maxrecs * sizeof(struct xfs_alloc_rec))));
+  }
+
+  // then across the leaves, listing the gaps between free extents
+  while (agbno != XFS_NULLAGBLOCK) {
+    if (++nleaves > length) return -EIO; // sibling pointers form a loop
+    if ((ret = xfs_read_bnobt(ctx, ag, agbno, buf, 0)) < 0) return ret;
+    rec = (struct xfs_alloc_rec *)(buf + ctx->hdrlen);
+    for (i = 0; i < be16toh(h->numrecs); i++) {
+      uint32_t start = be32toh(rec[i].startblock);
+      uint32_t count = be32toh(rec[i].blockcount);
+      if ((start < cur) || (start + (uint64_t) count > length))
+	return -EIO; // out of order or off the end
+      if (extent_list_append(l, base + cur, start - cur)) return -ENOMEM;
+      __sync_fetch_and_add(&ctx->freeblks, count);
+      cur = start + count;
+    }
+    agbno = be32toh(h->rightsib);
+  }
+  if (extent_list_append(l, base + cur, length - cur)) return -ENOMEM;
+
+  return 0;
+}
+
+//records ERR as the error of the scan, unless one was recorded already
+static inline void xfs_scan_error(struct xfs_context * ctx, int err)
+{ __sync_bool_compare_and_swap(&ctx->error, 0, err); }
+
+static void * xfs_scan_worker(void * arg)
+{
+  struct xfs_context * ctx = arg;
+  uint8_t * buf = malloc(ctx->bsize);
+  uint32_t ag;
+  int ret;
+
+  if (!buf) { xfs_scan_error(ctx, -ENOMEM); return NULL; }
+
+  while (!ctx->error
+	 && ((ag = __sync_fetch_and_add(&ctx->next, 1)) < ctx->agcount))
+    if ((ret = xfs_walk_ag(ctx, ag, buf, ctx->ags + ag)) < 0) {
+      fprintf(stderr,"bad free space btree in AG %u\n",ag);
+      xfs_scan_error(ctx, ret);
+    }
+
+  free(buf);
+  return NULL;
+}
+
+//walks the free space btrees of all AGs and builds the block list in EXT
+// returns -error code on error
+static int xfs_scan(struct xfs_context * ctx, struct extent_list * ext)
+{
+  uint32_t i;
+  size_t j;
+  int ret = 0;
+
+  ctx->ags = calloc(ctx->agcount, sizeof(struct extent_list));
+  if (!ctx->ags) return -ENOMEM;
+
+  analysis_pool_run(analysis_threads(ctx->agcount), xfs_scan_worker, ctx, 0);
+  if ((ret = ctx->error)) goto out;
+
+  // join the AGs in order; runs crossing between AGs are merged
+  for (i = 0; i < ctx->agcount; i++)
+    for (j = 0; j < ctx->ags[i].count; j++)
+      if (extent_list_append(ext, ctx->ags[i].ext[j].start,
+			     ctx->ags[i].ext[j].length))
+	{ ret = -ENOMEM; goto out; }
+
+ out:
+  for (i = 0; i < ctx->agcount; i++) extent_list_free(ctx->ags + i);
+  free(ctx->ags);
+  return ret;
+}
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+static int xfs_ad_recognize(FILE * fs, const void * hdrbuf)
+{
+  const struct xfs_super * sb = hdrbuf;
+  int ret = 1;
+
+  // the magic number must match
+  ret = ret && !memcmp(sb->magic, "XFSB", 4);
+  // and there must be at least one AG
+  ret = ret && sb->agblocks && sb->agcount;
+
+  return ret;
+}
+
+static int xfs_ad_analyze(FILE * fs, FILE * out, char * ignore)
+{
+  struct xfs_context ctx = { 0 };
+  struct extent_list ext = {0};
+  int ret = 0;
+
+  ret = xfs_init(&ctx,fs);
+  if (ret < 0) { errno = -ret; fatal("failed to read XFS superblock"); }
+
+  ret = xfs_scan(&ctx,&ext);
+  if (ret < 0) { errno = -ret; fatal("failed to walk free space btrees"); }
+
+  fprintf(out,"Type:\tXFS\n");
+
+  fprintf(out,"# version %d; %d bytes/block; %u AGs of %u blocks\n",
+	  ctx.version,ctx.bsize,ctx.agcount,ctx.agblocks);
+  fprintf(out,"# %llu blocks free\n",(unsigned long long) ctx.freeblks);
+
+  fprintf(out,"BlockSize:\t%u\n",ctx.bsize);
+  fprintf(out,"BlockCount:\t%llu\n",(unsigned long long) ext.blocks);
+  fprintf(out,"BlockRange:\t%llu\n",(unsigned long long) ctx.dblocks);
+
+  fprintf(out,"BEGIN BLOCK LIST\n");
+  extent_list_emit(out,&ext);
+  fprintf(out,"END BLOCK LIST\n");
+
+  extent_list_free(&ext);
+
+  return 0;
+}
+
+DECLARE_ANALYSIS_MODULE(XFS) = {
+  .name = "XFS",
+  .fs_hdrsize = sizeof(struct xfs_super),
+  .recognize = xfs_ad_recognize,
+  .analyze = xfs_ad_analyze,
+  0 };
+
+//EOF
@@ -0,0 +1,361 @@
+/* Batch imaging: many devices at once, scheduled together
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  A batch runs the imaging jobs in a job list, one per line:
+ *	<device> <operation> <image> [options...]
+ *   where <operation> is "export" (analyze, then sparsecopy export, making
+ *   IMAGE.idx and IMAGE.img) or "import" (sparsecopy import from them),
+ *   and the options are passed to each subprogram the job runs.  Blank
+ *   lines and text after # are ignored.
+ *
+ *  As in "disk", each stage of a job runs in a child process with its
+ *   output in a log; here, the batch decides which stage of which job runs
+ *   next, so that the jobs share the machine instead of fighting over it:
+ *   no more than "jobs" copies and "analyses" analyses run at once, and no
+ *   more than "perdisk" stages touch one disk at once (partitions count as
+ *   their disk).  Given "bw", all copies also share one throttle (see
+ *   throttle.h), which holds their total to that rate and divides it
+ *   evenly between them, so a shared network link or HBA is kept busy at
+ *   its own speed rather than thrashed by every device at once.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include "multicall.h"
+
+#include "uuid.h"
+#include "keylist.h"
+#include "throttle.h"
+#include "block/map-parse-v1.h"
+
+#define BATCH_MAX_OPTS	16	/* options on one job line */
+
+enum batch_stage {
+  STAGE_ANALYZE,		// (export only) index not yet made
+  STAGE_COPY,			// ready to copy
+  STAGE_DONE,
+  STAGE_FAILED };
+
+struct batch_job {
+  unsigned int line;		// in job list; names the job and its log
+  char * dev;			// device to image or restore
+  char * image;			// IMAGE.idx and IMAGE.img
+  char * opt[BATCH_MAX_OPTS];	// passed to subprograms
+  int nopt;
+  int export;			// else import
+  char * disk;			// whole disk holding DEV
+  enum batch_stage stage;
+  pid_t pid;			// stage running, or 0
+};
+
+struct batch_context {
+  struct keylist * args;
+  struct batch_job * job;
+  unsigned int count;
+  char * logdir;
+  struct io_throttle * bw;	// shared by all copies, or NULL
+  unsigned int max_copy;	// copies at once
+  unsigned int max_analyze;	// analyses at once
+  unsigned int per_disk;	// stages on one disk at once
+};
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+//adds the options from the job line of J to A
+static void batch_opts(struct batch_job * j, struct multicall_argv * a)
+{
+  int i;
+  for (i = 0; i < j->nopt; i++)
+    multicall_arg(a, "%s", j->opt[i]);
+}
+
+//return: path naming the whole disk that holds DEV (caller frees)
+// partitions are found through sysfs; anything else stands for itself
+static char * batch_disk(const char * dev)
+{
+  char sys[64], * real, * part, * ret;
+  struct stat st;
+
+  if (stat(dev, &st) || !S_ISBLK(st.st_mode)) return strdup(dev);
+  snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u",
+	   major(st.st_rdev), minor(st.st_rdev));
+  if (!(real = realpath(sys, NULL))) return strdup(dev);
+  if (asprintf(&part, "%s/partition", real) < 0) fatal("failed to allocate");
+  if (!access(part, F_OK)) ret = strdup(dirname(real));
+  else ret = strdup(real);
+  free(part); free(real);
+  return ret;
+}
+
+//reads the job list from IN
+static void batch_read_jobs(struct batch_context * ctx, FILE * in)
+{
+  char * line = NULL, * save, * word, * hash;
+  size_t linelen = 0;
+  unsigned int n = 0, alloc = 0;
+
+  while (getline(&line, &linelen, in) != -1) {
+    struct batch_job * j;
+    char * op;
+    n++;
+    if ((hash = strchr(line, '#'))) *hash = '\0';
+    if (!(word = strtok_r(line, " \t\n", &save))) continue;
+
+    if (ctx->count == alloc) {
+      alloc = alloc ? alloc * 2 : 32;
+      ctx->job = realloc(ctx->job, alloc * sizeof(struct batch_job));
+      if (!ctx->job) fatal("failed to allocate job list");
+    }
+    j = ctx->job + ctx->count;
+    memset(j, 0, sizeof(struct batch_job));
+    j->line = n;
+    j->dev = strdup(word);
+    op = strtok_r(NULL, " \t\n", &save);
+    word = strtok_r(NULL, " \t\n", &save);
+    if (!op || !word
+	|| (strcmp(op, "export") && strcmp(op, "import"))) {
+      fprintf(stderr,"job list line %u: want <device> export|import <image>\n",
+	      n);
+      exit(1);
+    }
+    j->image = strdup(word);
+    j->export = !strcmp(op, "export");
+    while ((word = strtok_r(NULL, " \t\n", &save))) {
+      if (j->nopt == BATCH_MAX_OPTS) {
+	fprintf(stderr,"job list line %u: too many options\n", n);
+	exit(1);
+      }
+      j->opt[j->nopt++] = strdup(word);
+    }
+    j->disk = batch_disk(j->dev);
+    j->stage = j->export ? STAGE_ANALYZE : STAGE_COPY;
+    ctx->count++;
+  }
+  free(line);
+}
+
+//writes the index for job J (runs in a worker)
+static int batch_analyze(struct batch_context * ctx, struct batch_job * j)
+{
+  struct multicall_argv a = {{0}};
+  char * idx;
+  uuid_t uuid;
+  FILE * f;
+  int ret;
+
+  if (asprintf(&idx, "%s.idx", j->image) < 0) fatal("failed to allocate");
+  if (!(f = fopen(idx, "w"))) fatal("failed to create index file");
+  if (generate_uuid(&uuid)) fatal("failed to generate UUID");
+  fprintf(f,"%s\nUUID:\t",MAP_V1_SIGNATURE);
+  print_uuid(f,&uuid);
+  fprintf(f,"\n");
+  fflush(f);
+
+  // analyze writes the block list to standard output
+  multicall_arg(&a, "analyze");
+  multicall_arg(&a, "src=%s", j->dev);
+  batch_opts(j, &a);
+  if (dup2(fileno(f), STDOUT_FILENO) < 0)
+    fatal("failed to redirect output to index file");
+  ret = multicall_run_argv(&a);
+  if (fflush(stdout) || fclose(f)) fatal("failed to write index file");
+  return ret;
+}
+
+//copies the data for job J (runs in a worker)
+static int batch_copy(struct batch_context * ctx, struct batch_job * j)
+{
+  struct multicall_argv a = {{0}};
+  char * img;
+
+  if (asprintf(&img, "%s.img", j->image) < 0) fatal("failed to allocate");
+  if (j->export) {
+    // sparsecopy opens its target for update; it must exist
+    FILE * f = fopen(img, "w");
+    if (!f) fatal("failed to create image file");
+    fclose(f);
+  }
+  io_throttle_use(ctx->bw);
+
+  multicall_arg(&a, "sparsecopy");
+  multicall_arg(&a, j->export ? "export" : "import");
+  multicall_arg(&a, "idx=%s.idx", j->image);
+  multicall_arg(&a, "src=%s", j->export ? j->dev : img);
+  multicall_arg(&a, "tgt=%s", j->export ? img : j->dev);
+  batch_opts(j, &a);
+  free(img);
+  return multicall_run_argv(&a);
+}
+
+//starts the next stage of job J in a worker
+static void batch_start(struct batch_context * ctx, struct batch_job * j)
+{
+  char * log;
+
+  if (asprintf(&log, "%s/job%u.log", ctx->logdir, j->line) < 0)
+    fatal("failed to allocate");
+  // all output goes to the job's log (appended to by each stage)
+  j->pid = multicall_fork_logged(log, (j->stage == STAGE_COPY) && j->export);
+  if (j->pid < 0) fatal("failed to start worker");
+  if (!j->pid) {
+    if (j->stage == STAGE_ANALYZE)
+      _exit(batch_analyze(ctx, j) ? 1 : 0);
+    _exit(batch_copy(ctx, j) ? 1 : 0);
+  }
+  fprintf(stderr,"job%u (%s): %s started\n", j->line, j->dev,
+	  (j->stage == STAGE_ANALYZE) ? "analysis" : "copy");
+  free(log);
+}
+
+//return: number of running stages on the disk of job J
+static unsigned int batch_on_disk(struct batch_context * ctx,
+				  struct batch_job * j)
+{
+  unsigned int i, n = 0;
+  for (i = 0; i < ctx->count; i++)
+    if (ctx->job[i].pid && !strcmp(ctx->job[i].disk, j->disk)) n++;
+  return n;
+}
+
+//runs all jobs; returns the number that failed
+static unsigned int batch_run_jobs(struct batch_context * ctx)
+{
+  unsigned int copying = 0, analyzing = 0, left = ctx->count, failed = 0;
+  unsigned int i;
+
+  while (left) {
+    int status = 0, started = 0;
+    pid_t pid;
+
+    // start whatever the limits allow, in job list order
+    for (i = 0; i < ctx->count; i++) {
+      struct batch_job * j = ctx->job + i;
+      if (j->pid || (j->stage >= STAGE_DONE)) continue;
+      if ((j->stage == STAGE_ANALYZE) && (analyzing >= ctx->max_analyze))
+	continue;
+      if ((j->stage == STAGE_COPY) && (copying >= ctx->max_copy))
+	continue;
+      if (batch_on_disk(ctx, j) >= ctx->per_disk) continue;
+      batch_start(ctx, j);
+      if (j->stage == STAGE_ANALYZE) analyzing++; else copying++;
+      started++;
+    }
+    if (!analyzing && !copying) {
+      if (!started) break; // (cannot happen with all limits at least 1)
+      continue;
+    }
+
+    pid = wait(&status);
+    if (pid < 0) fatal("failed to wait for worker");
+    for (i = 0; i < ctx->count; i++)
+      if (ctx->job[i].pid == pid) break;
+    if (i == ctx->count) continue;
+    {
+      struct batch_job * j = ctx->job + i;
+      int ok = WIFEXITED(status) && !WEXITSTATUS(status);
+      j->pid = 0;
+      if (j->stage == STAGE_ANALYZE) analyzing--; else copying--;
+      if (!ok) {
+	fprintf(stderr,"job%u (%s): FAILED (see %s/job%u.log)\n",
+		j->line, j->dev, ctx->logdir, j->line);
+	j->stage = STAGE_FAILED;
+	failed++; left--;
+      } else if (j->stage == STAGE_ANALYZE)
+	j->stage = STAGE_COPY;
+      else {
+	fprintf(stderr,"job%u (%s): done\n", j->line, j->dev);
+	j->stage = STAGE_DONE;
+	left--;
+      }
+    }
+  }
+  return failed;
+}
+
+//return: value of option KEY as a count of at least 1, or DEF
+static unsigned int batch_limit(struct batch_context * ctx, char * key,
+				long def)
+{
+  char * value = keylist_get(ctx->args, key);
+  long n = value ? strtol(value, NULL, 0) : def;
+  return (n < 1) ? 1 : n;
+}
+
+static char usagetext[] =
+  "batch list=<job list> <other options>\n";
+static char helptext[] =
+  "Options:\n"
+  "\tlist   -- job list; one job per line:\n"
+  "\t            <device> export|import <image> [options...]\n"
+  "\t          export makes <image>.idx and <image>.img with analyze and\n"
+  "\t          sparsecopy; import restores them; options are passed on\n"
+  "\tjobs   -- copies to run at once (default 4)\n"
+  "\tanalyses -- analyses to run at once (default: all CPUs)\n"
+  "\tperdisk -- stages to run on one disk at once (default 1)\n"
+  "\tbw     -- total copy bandwidth in MiB/s, shared evenly\n"
+  "\tlogs   -- directory for job logs (default .); jobN.log is the job\n"
+  "\t          on line N\n";
+
+DECLARE_MULTICALL_TABLE(main);
+SUBCALL_MAIN(main, batch, usagetext, helptext,
+	     int argc, char ** argv)
+{
+  struct batch_context ctx = {0};
+  unsigned int failed;
+  FILE * in;
+
+  ctx.args = keylist_parse_args(argc, argv);
+  if (!keylist_get(ctx.args,"list")) print_usage_and_exit(usagetext);
+
+  if (!(in = fopen(keylist_get(ctx.args,"list"), "r")))
+    fatal("failed to open job list");
+  batch_read_jobs(&ctx, in);
+  fclose(in);
+
+  ctx.logdir = keylist_get(ctx.args,"logs");
+  if (!ctx.logdir) ctx.logdir = ".";
+  ctx.max_copy = batch_limit(&ctx, "jobs", 4);
+  ctx.max_analyze = batch_limit(&ctx, "analyses",
+				sysconf(_SC_NPROCESSORS_ONLN));
+  ctx.per_disk = batch_limit(&ctx, "perdisk", 1);
+  if (keylist_get(ctx.args,"bw")) {
+    double mib = strtod(keylist_get(ctx.args,"bw"), NULL);
+    if (!(ctx.bw = io_throttle_new(mib * (1 << 20))))
+      fatal("failed to set up bandwidth sharing");
+  }
+
+  failed = batch_run_jobs(&ctx);
+  fprintf(stderr,"%u jobs; %u failed\n", ctx.count, failed);
+  return failed ? 1 : 0;
+}
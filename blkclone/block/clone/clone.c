@@ -0,0 +1,345 @@
+/*
+ * Clone command: analyze and export in one pass
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  This does the work of "analyze" followed by "sparsecopy export", but
+ *   without the index round trip in between: the analysis module runs in a
+ *   thread and passes its extents through a sink (see analyze/sink.h) to
+ *   the copy loop, which starts on the first extent while the rest of the
+ *   filesystem is still being analyzed.  The index is written at the end,
+ *   when the whole block list (and BlockCount) is known.
+ *  The image and index are the same as sparsecopy and analyze would have
+ *   produced, and are restored with "sparsecopy import".
+ *
+ *  How much overlap there is depends on the module.  Modules with a native
+ *   sink (exFAT, ext, NTFS) pass extents on as they find them; the rest
+ *   are run through their text output, which still saves writing and
+ *   reading the index, but only begins to flow once the module starts
+ *   printing.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "multicall.h"
+
+#include "uuid.h"
+#include "keylist.h"
+#include "analyze/dispatch.h"
+#include "analyze/sink.h"
+#include "block/map-parse-v1.h"
+#include "block/image-v1.h"
+
+#define CLONE_CHUNK	(1 << 20)	/* bytes copied per request */
+
+struct clone_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;	// signalled on every change
+  char ** keys;		// header lines, in the order received
+  unsigned int nkeys;
+  struct v1_extent * ext; // whole block list, for writing the index
+  size_t count;		// extents received
+  size_t alloc;		// extents allocated
+  size_t blocksize;	// 0 until the BlockSize key arrives
+  unsigned long long int blockcount; // from BlockCount key
+  int done;		// TRUE once analysis has returned
+  int result;		// what analysis returned
+};
+
+struct clone_context {
+  struct clone_queue q;
+  struct analysis_module * mod;
+  FILE * fs;		// for the analysis thread
+  char * mnt;		// where FS is mounted, if given
+  int src;		// for the copy loop
+  FILE * image;
+  void * buf;		// copy buffer; a whole number of blocks
+  size_t buflen;
+  unsigned long long int copied; // blocks written to image
+};
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+static int clone_key(struct extent_sink * s, const char * key,
+		     const char * value)
+{
+  struct clone_queue * q = s->arg;
+  char * line = NULL;
+  char ** k;
+
+  if (asprintf(&line, "%s:\t%s", key, value) < 0) return -ENOMEM;
+  pthread_mutex_lock(&q->lock);
+  k = realloc(q->keys, (q->nkeys + 1) * sizeof(char *));
+  if (!k) { pthread_mutex_unlock(&q->lock); free(line); return -ENOMEM; }
+  q->keys = k;
+  q->keys[q->nkeys++] = line;
+  if (!strcmp(key, "BlockSize"))
+    q->blocksize = strtoul(value, NULL, 10);
+  else if (!strcmp(key, "BlockCount"))
+    q->blockcount = strtoull(value, NULL, 10);
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+static int clone_extent(struct extent_sink * s, const struct v1_extent * e)
+{
+  struct clone_queue * q = s->arg;
+  int ret = 0;
+
+  pthread_mutex_lock(&q->lock);
+  if (!q->blocksize)
+    ret = -EINVAL; // extents are meaningless without a block size
+  else if (q->count == q->alloc) {
+    size_t n = q->alloc ? q->alloc * 2 : 256;
+    struct v1_extent * p = realloc(q->ext, n * sizeof(struct v1_extent));
+    if (p) { q->ext = p; q->alloc = n; } else ret = -ENOMEM;
+  }
+  if (!ret) {
+    q->ext[q->count++] = *e;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ret;
+}
+
+static void * clone_analyze(void * arg)
+{
+  struct clone_context * ctx = arg;
+  struct extent_sink sink = { clone_key, clone_extent, &ctx->q };
+  int ret;
+
+  ret = analysis_run_sink(ctx->mod, ctx->fs, ctx->mnt, &sink);
+
+  pthread_mutex_lock(&ctx->q.lock);
+  ctx->q.done = 1; ctx->q.result = ret;
+  pthread_cond_broadcast(&ctx->q.cond);
+  pthread_mutex_unlock(&ctx->q.lock);
+  return NULL;
+}
+
+//copies the blocks of E from source to image
+static void clone_copy(struct clone_context * ctx, const struct v1_extent * e)
+{
+  size_t bsize = ctx->q.blocksize;
+  off_t pos = e->start * bsize;
+  unsigned long long int left = e->length;
+
+  if (!e->length) {
+    // partial block, padded with zero in the image
+    size_t len = bsize * e->num / e->denom;
+    memset(ctx->buf, 0, bsize);
+    if (pread(ctx->src, ctx->buf, len, pos) != len)
+      fatal("failed to read partial block from source");
+    if (fwrite(ctx->buf, bsize, 1, ctx->image) != 1)
+      fatal("failed to write padded block to image stream");
+    ctx->copied++;
+    return;
+  }
+
+  while (left) {
+    size_t n = ctx->buflen / bsize;
+    if (n > left) n = left;
+    if (pread(ctx->src, ctx->buf, n * bsize, pos) != n * bsize)
+      fatal("failed to read block");
+    if (fwrite(ctx->buf, n * bsize, 1, ctx->image) != 1)
+      fatal("failed to write block");
+    pos += n * bsize; left -= n;
+    ctx->copied += n;
+  }
+}
+
+//writes the index for the finished clone to IDX
+static void clone_write_index(struct clone_context * ctx, uuid_t * uuid,
+			      FILE * idx)
+{
+  struct clone_queue * q = &ctx->q;
+  unsigned int i;
+  size_t j;
+
+  fprintf(idx,"%s\n",MAP_V1_SIGNATURE);
+  fprintf(idx,"UUID:\t"); print_uuid(idx,uuid); fprintf(idx,"\n");
+  for (i = 0; i < q->nkeys; i++)
+    fprintf(idx,"%s\n",q->keys[i]);
+  fprintf(idx,"%s\n",MAP_V1_STARTBLOCKS);
+  for (j = 0; j < q->count; j++)
+    if (q->ext[j].length)
+      fprintf(idx,"%llu+%llu\n",q->ext[j].start,q->ext[j].length);
+    else
+      fprintf(idx,"%llu+.%lu/%lu\n",
+	      q->ext[j].start,q->ext[j].num,q->ext[j].denom);
+  fprintf(idx,"%s\n",MAP_V1_ENDBLOCKS);
+  if (fflush(idx) || ferror(idx)) fatal("failed to write index");
+}
+
+static char usagetext[] =
+  "clone src=<filesystem> idx=<index> tgt=<image> <other options>\n";
+static char helptext[] =
+  "Options:\n"
+  "\tsrc   -- filesystem to clone\n"
+  "\tidx   -- index file to write\n"
+  "\ttgt   -- image file to write\n"
+  "\ttype  -- use the named analysis module instead of auto-detection\n"
+  "\tmnt   -- where SRC is mounted (selects the online module)\n"
+  "\tforce -- do it anyway; even if it looks wrong\n"
+  "  Other options are passed to the analysis module, as by analyze.\n"
+  "  The result is restored with \"sparsecopy import\".\n";
+
+DECLARE_MULTICALL_TABLE(main);
+SUBCALL_MAIN(main, clone, usagetext, helptext,
+	     int argc, char ** argv)
+{
+  struct clone_context ctx = {0};
+  struct keylist * args = NULL;
+  struct stat st_src = {0}, st_tgt = {0};
+  FILE * idx = NULL;
+  char * type = NULL;
+  pthread_t tid;
+  size_t next = 0;
+  uuid_t uuid;
+
+  args = keylist_parse_args(argc, argv);
+  analysis_args = args;
+
+  if (!(  (keylist_get(args,"src"))
+	&&(keylist_get(args,"idx"))&&(keylist_get(args,"tgt"))))
+    print_usage_and_exit(usagetext);
+
+  ctx.fs = fopen(keylist_get(args,"src"),"r");
+  if (!ctx.fs) fatal("could not open filesystem");
+  ctx.src = open(keylist_get(args,"src"),O_RDONLY);
+  if (ctx.src < 0) fatal("could not open filesystem");
+
+  type = keylist_get(args,"type");
+  ctx.mnt = keylist_get(args,"mnt");
+  if (!type && ctx.mnt) type = "online";
+
+  ctx.mod = analysis_find_module(ctx.fs, type);
+  if (!ctx.mod) {
+    if (type)
+      fprintf(stderr,"Requested module %s not found.\n",type);
+    else
+      fprintf(stderr,"No module recognizes %s.\n",keylist_get(args,"src"));
+    return 1;
+  }
+  if (ctx.mod->need_mounted_fs && !ctx.mnt) {
+    fprintf(stderr,
+	    "Module %s needs the filesystem mounted; give mnt=<dir>.\n",
+	    ctx.mod->name);
+    return 1;
+  }
+
+  if (!stat(keylist_get(args,"tgt"),&st_tgt) && S_ISBLK(st_tgt.st_mode)
+      && !fstat(ctx.src,&st_src) && S_ISREG(st_src.st_mode)) {
+    fprintf(stderr,
+	    "WARNING:  Imaging source and target appear swapped.\n");
+    if (keylist_get(args,"force")) {
+      fprintf(stderr,
+	      " NOTICE:  Continuing anyway; as per \"force\" option.\n");
+    } else {
+      fprintf(stderr,
+      "  NOTE:   If you REALLY want to store an image from a regular file\n"
+      "           into a block device use the \"force\" option.\n");
+      exit(1);
+    }
+  }
+
+  ctx.image = fopen(keylist_get(args,"tgt"),"w");
+  if (!ctx.image) fatal("failed to open image file");
+  idx = fopen(keylist_get(args,"idx"),"w");
+  if (!idx) fatal("failed to open index file");
+  if (generate_uuid(&uuid)) fatal("failed to generate UUID");
+
+  pthread_mutex_init(&ctx.q.lock, NULL);
+  pthread_cond_init(&ctx.q.cond, NULL);
+  errno = pthread_create(&tid, NULL, clone_analyze, &ctx);
+  if (errno) fatal("failed to start analysis");
+
+  // the image header is one block long, so wait for the block size
+  pthread_mutex_lock(&ctx.q.lock);
+  while (!ctx.q.blocksize && !ctx.q.done)
+    pthread_cond_wait(&ctx.q.cond, &ctx.q.lock);
+  pthread_mutex_unlock(&ctx.q.lock);
+  if (ctx.q.blocksize) {
+    struct image_header_v1 * h;
+    ctx.buflen = (CLONE_CHUNK < ctx.q.blocksize) ? ctx.q.blocksize
+      : CLONE_CHUNK - CLONE_CHUNK % ctx.q.blocksize;
+    ctx.buf = calloc(1, ctx.buflen);
+    if (!ctx.buf) fatal("failed to allocate copy buffer");
+    h = ctx.buf;
+    memcpy(h->sig,IMAGE_V1_SIGNATURE,16);
+    memcpy(h->uuid,uuid,sizeof(uuid_t));
+    h->version = 1;
+    if (fwrite(ctx.buf, ctx.q.blocksize, 1, ctx.image) != 1)
+      fatal("failed to write image stream header");
+    // the header does not count as a block in the image stream
+  }
+
+  for (;;) {
+    struct v1_extent e;
+    pthread_mutex_lock(&ctx.q.lock);
+    while ((next == ctx.q.count) && !ctx.q.done)
+      pthread_cond_wait(&ctx.q.cond, &ctx.q.lock);
+    if (next == ctx.q.count) { pthread_mutex_unlock(&ctx.q.lock); break; }
+    e = ctx.q.ext[next++];
+    pthread_mutex_unlock(&ctx.q.lock);
+    clone_copy(&ctx, &e);
+  }
+  pthread_join(tid, NULL);
+
+  if (ctx.q.result) {
+    if (ctx.q.result < 0) { errno = -ctx.q.result; fatal("analysis failed"); }
+    fprintf(stderr,"Analysis of %s failed.\n",keylist_get(args,"src"));
+    return 1;
+  }
+  if (!ctx.q.blocksize) {
+    fprintf(stderr,"Module %s gave no block size.\n",ctx.mod->name);
+    return 1;
+  }
+  if (fflush(ctx.image) || ferror(ctx.image))
+    fatal("failed to write image");
+  if (ctx.copied != ctx.q.blockcount)
+    fprintf(stderr,"WARNING:  copied %llu blocks, but BlockCount is %llu\n",
+	    ctx.copied, ctx.q.blockcount);
+
+  clone_write_index(&ctx, &uuid, idx);
+  fclose(idx);
+  fclose(ctx.image);
+
+  fprintf(stderr,"%llu blocks of %zu bytes cloned from %s (%s)\n",
+	  ctx.copied, ctx.q.blocksize, keylist_get(args,"src"),
+	  ctx.mod->name);
+
+  return 0;
+}
+
+//EOF
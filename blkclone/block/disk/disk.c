@@ -0,0 +1,659 @@
+/*
+ * Disk-scope imaging: partition table, gaps, and partitions in parallel
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  A disk image is a directory holding:
+ *    disk.idx		-- the disk index (partitions and gaps)
+ *    gaps.idx gaps.img	-- block-level image of all unpartitioned space
+ *    partN.idx partN.img -- image of partition N, as made by analyze and
+ *			    sparsecopy
+ *    *.log		-- output of the worker for each of the above
+ *  The gaps hold the partition tables, EBRs and boot loader, so restoring
+ *   them first recreates the partitions on the target disk.
+ *
+ *  Each image is made or restored by a child process running the usual
+ *   analyze and sparsecopy subprograms; up to "jobs" of them run at once.
+ *  Partitions are reached through the partition devices the kernel makes
+ *   for the disk.  Where there are none (a disk image in a regular file,
+ *   or a kernel that does not read this kind of partition table), a loop
+ *   device is set up over the sectors of the partition instead; it goes
+ *   away by itself when the worker exits.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+#include <linux/loop.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include "multicall.h"
+
+#include "uuid.h"
+#include "keylist.h"
+#include "block/map-parse-v1.h"
+#include "block/partition.h"
+
+#define DISK_INDEX_SIGNATURE	"BLKCLONE DISK INDEX V1"
+#define DISK_INDEX_STARTPARTS	"BEGIN PARTITION LIST"
+#define DISK_INDEX_ENDPARTS	"END PARTITION LIST"
+
+#define DISK_PARTDEV_WAIT	10	/* seconds to wait for udev */
+#define DISK_LOOP_TRIES		8	/* other programs may race for loops */
+
+struct disk_context {
+  struct keylist * args;
+  char * disk;			// disk device (or file)
+  char * dir;			// image directory
+  struct stat st;		// of disk
+  struct disk_layout layout;
+  int rescanned;		// seconds to wait for partition devices
+};
+
+struct disk_job {
+  char name[16];		// "gaps" or "partN"; names the job's files
+  struct disk_partition * part;	// partition, or NULL for the gaps
+  pid_t pid;			// worker process, while running
+};
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+//given: context, job name, and file extension
+//return: path of file in image directory (caller frees)
+static char * disk_path(struct disk_context * ctx, const char * name,
+			const char * ext)
+{
+  char * path = NULL;
+
+  if (asprintf(&path, "%s/%s.%s", ctx->dir, name, ext) < 0)
+    fatal("failed to allocate path");
+  return path;
+}
+
+//writes a UUID key with a new UUID to OUT
+static void disk_new_uuid(FILE * out)
+{
+  uuid_t uuid;
+
+  if (generate_uuid(&uuid)) fatal("failed to generate UUID");
+  fprintf(out,"UUID:\t");
+  print_uuid(out,&uuid);
+  fprintf(out,"\n");
+}
+
+//given: disk, partition number
+//return: path of partition device (caller frees), or NULL if none
+static char * disk_partition_device(struct stat * st, unsigned int number)
+{
+  char sys[64];
+  char * ret = NULL;
+  DIR * dir;
+  struct dirent * de;
+
+  if (!S_ISBLK(st->st_mode)) return NULL;
+  snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u",
+	   major(st->st_rdev), minor(st->st_rdev));
+  dir = opendir(sys);
+  if (!dir) return NULL;
+
+  // each partition is a subdirectory with a "partition" attribute
+  while (!ret && (de = readdir(dir))) {
+    char * attr = NULL;
+    FILE * f;
+    unsigned int n = 0;
+    struct stat pst;
+
+    if (de->d_name[0] == '.') continue;
+    if (asprintf(&attr, "%s/%s/partition", sys, de->d_name) < 0) break;
+    f = fopen(attr, "r");
+    free(attr);
+    if (!f) continue;
+    if ((fscanf(f, "%u", &n) == 1) && (n == number)
+	&& (asprintf(&ret, "/dev/%s", de->d_name) >= 0)
+	&& ((stat(ret, &pst) < 0) || !S_ISBLK(pst.st_mode)))
+      { free(ret); ret = NULL; }
+    fclose(f);
+  }
+  closedir(dir);
+  return ret;
+}
+
+//return: TRUE if the disk reports itself as rotational
+static int disk_rotational(struct stat * st)
+{
+  char sys[64];
+  FILE * f;
+  int rot = 1;
+
+  if (!S_ISBLK(st->st_mode)) return 0;
+  snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/queue/rotational",
+	   major(st->st_rdev), minor(st->st_rdev));
+  f = fopen(sys, "r");
+  if (!f) return 1;
+  if (fscanf(f, "%d", &rot) != 1) rot = 1;
+  fclose(f);
+  return rot;
+}
+
+static int disk_part_cmp(const void * a, const void * b)
+{
+  const struct disk_partition * pa = *(struct disk_partition * const *) a;
+  const struct disk_partition * pb = *(struct disk_partition * const *) b;
+  return (pa->start > pb->start) - (pa->start < pb->start);
+}
+
+//writes the disk index to OUT
+static void disk_write_index(struct disk_context * ctx, FILE * out,
+			     struct extent_list * gaps)
+{
+  struct disk_layout * d = &ctx->layout;
+  struct disk_partition * order[d->count + 1];
+  size_t g = 0;
+  unsigned int i;
+
+  fprintf(out,"%s\n",DISK_INDEX_SIGNATURE);
+  disk_new_uuid(out);
+  fprintf(out,"Label:\t%s\n",d->label);
+  fprintf(out,"SectorSize:\t%u\n",d->sector_size);
+  fprintf(out,"SectorCount:\t%llu\n",(unsigned long long) d->sectors);
+  fprintf(out,"Partitions:\t%u\n",d->count);
+
+  // list partitions and gaps in disk order; the table need not be
+  for (i = 0; i < d->count; i++) order[i] = d->parts + i;
+  qsort(order, d->count, sizeof(order[0]), disk_part_cmp);
+
+  fprintf(out,"%s\n",DISK_INDEX_STARTPARTS);
+  for (i = 0; i < d->count; i++) {
+    while ((g < gaps->count) && (gaps->ext[g].start < order[i]->start)) {
+      fprintf(out,"gap %llu+%llu\n",
+	      (unsigned long long) gaps->ext[g].start,
+	      (unsigned long long) gaps->ext[g].length);
+      g++;
+    }
+    fprintf(out,"part %u %llu+%llu %s\n",order[i]->number,
+	    (unsigned long long) order[i]->start,
+	    (unsigned long long) order[i]->length, order[i]->type);
+  }
+  for (; g < gaps->count; g++)
+    fprintf(out,"gap %llu+%llu\n",
+	    (unsigned long long) gaps->ext[g].start,
+	    (unsigned long long) gaps->ext[g].length);
+  fprintf(out,"%s\n",DISK_INDEX_ENDPARTS);
+}
+
+//reads the disk index from IN into CTX->LAYOUT
+// returns -error code on error
+static int disk_read_index(struct disk_context * ctx, FILE * in)
+{
+  struct disk_layout * d = &ctx->layout;
+  char * line = NULL;
+  size_t linelen = 0;
+  int ret = -EINVAL;
+
+  memset(d, 0, sizeof(*d));
+  if ((getline(&line, &linelen, in) < 0)
+      || strcmp(line, DISK_INDEX_SIGNATURE"\n"))
+    goto out;
+
+  while (getline(&line, &linelen, in) >= 0) {
+    unsigned long long int v = 0;
+    if (!strcmp(line, DISK_INDEX_STARTPARTS"\n")) break;
+    if (sscanf(line, "SectorSize: %llu", &v) == 1) d->sector_size = v;
+    if (sscanf(line, "SectorCount: %llu", &v) == 1) d->sectors = v;
+  }
+  if (!d->sector_size || !d->sectors) goto out;
+
+  while (getline(&line, &linelen, in) >= 0) {
+    struct disk_partition p = {0};
+    unsigned long long int start, length;
+    if (!strcmp(line, DISK_INDEX_ENDPARTS"\n")) { ret = 0; break; }
+    if (sscanf(line, "part %u %llu+%llu %39s",
+	       &p.number, &start, &length, p.type) != 4)
+      continue; // gaps are restored from their own index
+    d->parts = realloc(d->parts, (d->count + 1) * sizeof(p));
+    if (!d->parts) { ret = -ENOMEM; break; }
+    p.start = start; p.length = length;
+    d->parts[d->count++] = p;
+  }
+
+ out:
+  free(line);
+  return ret;
+}
+
+//writes a block list of the gaps, in sectors, to OUT
+static void disk_write_gaps(struct disk_context * ctx, FILE * out,
+			    struct extent_list * gaps)
+{
+  fprintf(out,"%s\n",MAP_V1_SIGNATURE);
+  disk_new_uuid(out);
+  fprintf(out,"Type:\tgaps\n");
+  fprintf(out,"# space outside of partitions; %s partition table\n",
+	  ctx->layout.label);
+  fprintf(out,"BlockSize:\t%u\n",ctx->layout.sector_size);
+  fprintf(out,"BlockCount:\t%llu\n",(unsigned long long) gaps->blocks);
+  fprintf(out,"BlockRange:\t%llu\n",(unsigned long long) ctx->layout.sectors);
+  fprintf(out,"%s\n",MAP_V1_STARTBLOCKS);
+  extent_list_emit(out, gaps);
+  fprintf(out,"%s\n",MAP_V1_ENDBLOCKS);
+}
+
+//writes a block list covering all of partition P to OUT
+// (used when no analysis module recognizes the partition)
+static void disk_write_whole(struct disk_context * ctx, FILE * out,
+			     struct disk_partition * p)
+{
+  unsigned int ss = ctx->layout.sector_size;
+  unsigned int bsize = ss;
+  unsigned long long int n;
+
+  // use 4 KiB blocks when the partition allows it; fewer calls per byte
+  if ((ss < 4096) && !((p->length * ss) % 4096)) bsize = 4096;
+  n = p->length * ss / bsize;
+
+  fprintf(out,"Type:\twhole\n");
+  fprintf(out,"# no module recognized partition %u (type %s)\n",
+	  p->number,p->type);
+  fprintf(out,"BlockSize:\t%u\n",bsize);
+  fprintf(out,"BlockCount:\t%llu\n",n);
+  fprintf(out,"BlockRange:\t%llu\n",n);
+  fprintf(out,"%s\n0+%llu\n%s\n",MAP_V1_STARTBLOCKS,n,MAP_V1_ENDBLOCKS);
+}
+
+//passes option KEY through to A, if it was given
+static void disk_pass(struct disk_context * ctx, struct multicall_argv * a,
+		      char * key)
+{
+  struct keylist * k = keylist_find(ctx->args, key);
+
+  if (!k) return;
+  if (*k->value) multicall_arg(a, "%s=%s", key, k->value);
+  else multicall_arg(a, "%s", key);
+}
+
+//sets up a loop device over partition P of the disk
+//return: path of loop device (caller frees), or NULL on failure
+//side effect: a descriptor on the loop device is left open; the device is
+//  released when the last descriptor on it is closed
+static char * disk_loop_attach(struct disk_context * ctx,
+			       struct disk_partition * p, int writable)
+{
+  struct loop_info64 info = {0};
+  char * path = NULL;
+  int ctl, backing, loop = -1, tries, n;
+
+  ctl = open("/dev/loop-control", O_RDWR);
+  if (ctl < 0) return NULL;
+  backing = open(ctx->disk, writable ? O_RDWR : O_RDONLY);
+  if (backing < 0) { close(ctl); return NULL; }
+
+  for (tries = 0; (loop < 0) && (tries < DISK_LOOP_TRIES); tries++) {
+    if ((n = ioctl(ctl, LOOP_CTL_GET_FREE)) < 0) break;
+    free(path); path = NULL;
+    if (asprintf(&path, "/dev/loop%d", n) < 0) break;
+    loop = open(path, writable ? O_RDWR : O_RDONLY);
+    if (loop < 0) continue;
+    if (ioctl(loop, LOOP_SET_FD, backing) < 0) {
+      // another program took this one first
+      close(loop); loop = -1;
+      if (errno != EBUSY) break;
+    }
+  }
+  close(backing); close(ctl);
+  if (loop < 0) { free(path); return NULL; }
+
+  info.lo_offset = p->start * ctx->layout.sector_size;
+  info.lo_sizelimit = p->length * ctx->layout.sector_size;
+  info.lo_flags = LO_FLAGS_AUTOCLEAR; // (read-only follows the backing fd)
+  if (ioctl(loop, LOOP_SET_STATUS64, &info) < 0) {
+    ioctl(loop, LOOP_CLR_FD, 0);
+    close(loop); free(path);
+    return NULL;
+  }
+  return path;
+}
+
+//finds the device for the partition of job J, waiting for udev if needed
+static char * disk_job_device(struct disk_context * ctx, struct disk_job * j,
+			      int wait, int writable)
+{
+  char * dev = NULL;
+
+  if (S_ISBLK(ctx->st.st_mode))
+    while (!(dev = disk_partition_device(&ctx->st, j->part->number))
+	   && (wait-- > 0))
+      sleep(1);
+  if (!dev && (dev = disk_loop_attach(ctx, j->part, writable)))
+    fprintf(stderr,"partition %u is reached through %s\n",
+	    j->part->number, dev);
+  if (!dev)
+    fprintf(stderr,"no device found for partition %u of %s\n",
+	    j->part->number, ctx->disk);
+  return dev;
+}
+
+//writes the block list for the partition of job J to index IDX
+// (if no module recognizes the partition, all of it is listed)
+static void disk_analyze_part(struct disk_context * ctx, struct disk_job * j,
+			     char * dev, char * idx)
+{
+  struct multicall_argv a = {{0}};
+  FILE * f = fopen(idx, "w");
+  int saved, ret;
+
+  if (!f) fatal("failed to create index file");
+  fprintf(f,"%s\n",MAP_V1_SIGNATURE);
+  disk_new_uuid(f);
+  fflush(f);
+
+  // analyze writes the block list to standard output
+  multicall_arg(&a, "analyze");
+  multicall_arg(&a, "src=%s", dev);
+  disk_pass(ctx, &a, "bridge");
+  disk_pass(ctx, &a, "threads");
+  fflush(stdout);
+  saved = dup(STDOUT_FILENO);
+  if ((saved < 0) || (dup2(fileno(f), STDOUT_FILENO) < 0))
+    fatal("failed to redirect output to index file");
+  ret = multicall_run_argv(&a);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO); close(saved);
+
+  if (ret) {
+    // nothing understands this partition; image all of it
+    fprintf(stderr,"imaging all of partition %u\n",j->part->number);
+    if (fseeko(f, 0, SEEK_SET) || ftruncate(fileno(f), 0))
+      fatal("failed to rewrite index file");
+    fprintf(f,"%s\n",MAP_V1_SIGNATURE);
+    disk_new_uuid(f);
+    disk_write_whole(ctx, f, j->part);
+  }
+  if (fclose(f)) fatal("failed to write index file");
+}
+
+static int disk_export_job(struct disk_context * ctx, struct disk_job * j)
+{
+  struct multicall_argv a = {{0}};
+  char * idx = disk_path(ctx, j->name, "idx");
+  char * img = disk_path(ctx, j->name, "img");
+  char * dev = NULL;
+  FILE * f;
+
+  // sparsecopy opens its target for update; it must exist
+  f = fopen(img, "w");
+  if (!f) fatal("failed to create image file");
+  fclose(f);
+
+  if (j->part) {
+    if (!(dev = disk_job_device(ctx, j, 0, 0))) return 1;
+    disk_analyze_part(ctx, j, dev, idx);
+  }
+
+  multicall_arg(&a, "sparsecopy");
+  multicall_arg(&a, "export");
+  multicall_arg(&a, "idx=%s", idx);
+  multicall_arg(&a, "src=%s", dev ? dev : ctx->disk);
+  multicall_arg(&a, "tgt=%s", img);
+  disk_pass(ctx, &a, "force");
+  return multicall_run_argv(&a);
+}
+
+static int disk_import_job(struct disk_context * ctx, struct disk_job * j)
+{
+  struct multicall_argv a = {{0}};
+  char * dev = NULL;
+
+  if (j->part && !(dev = disk_job_device(ctx, j, ctx->rescanned, 1)))
+    return 1;
+
+  multicall_arg(&a, "sparsecopy");
+  multicall_arg(&a, "import");
+  multicall_arg(&a, "idx=%s/%s.idx", ctx->dir, j->name);
+  multicall_arg(&a, "src=%s/%s.img", ctx->dir, j->name);
+  multicall_arg(&a, "tgt=%s", dev ? dev : ctx->disk);
+  // zerofill of the gaps would write over every partition; never do that
+  if (j->part) disk_pass(ctx, &a, "nuke");
+  disk_pass(ctx, &a, "force");
+  return multicall_run_argv(&a);
+}
+
+//runs JOBS, at most MAX at once, each in a child process
+// returns number of jobs that failed
+static unsigned int disk_run_jobs(struct disk_context * ctx,
+				  struct disk_job * jobs, unsigned int count,
+				  unsigned int max,
+				  int (*fn)(struct disk_context *,
+					    struct disk_job *))
+{
+  unsigned int next = 0, running = 0, failed = 0, i;
+
+  while ((next < count) || running) {
+    int status = 0;
+    pid_t pid;
+
+    if ((next < count) && (running < max)) {
+      struct disk_job * j = jobs + next++;
+      char * log = disk_path(ctx, j->name, "log");
+
+      // all output goes to the job's log
+      j->pid = multicall_fork_logged(log, 0);
+      if (j->pid < 0) fatal("failed to start worker");
+      if (!j->pid)
+	_exit(fn(ctx, j) ? 1 : 0);
+      free(log);
+      fprintf(stderr,"%s: started\n",j->name);
+      running++;
+      continue;
+    }
+
+    pid = wait(&status);
+    if (pid < 0) fatal("failed to wait for worker");
+    for (i = 0; i < count; i++)
+      if (jobs[i].pid == pid) break;
+    if (i == count) continue;
+    running--;
+    if (WIFEXITED(status) && !WEXITSTATUS(status))
+      fprintf(stderr,"%s: done\n",jobs[i].name);
+    else {
+      fprintf(stderr,"%s: FAILED (see %s/%s.log)\n",
+	      jobs[i].name,ctx->dir,jobs[i].name);
+      failed++;
+    }
+  }
+  return failed;
+}
+
+//builds one job for the gaps, then one per partition
+static struct disk_job * disk_make_jobs(struct disk_context * ctx)
+{
+  struct disk_job * jobs;
+  unsigned int i;
+
+  jobs = calloc(ctx->layout.count + 1, sizeof(struct disk_job));
+  if (!jobs) fatal("failed to allocate job list");
+  strcpy(jobs[0].name, "gaps");
+  for (i = 0; i < ctx->layout.count; i++) {
+    jobs[i+1].part = ctx->layout.parts + i;
+    snprintf(jobs[i+1].name, sizeof(jobs[0].name), "part%u",
+	     ctx->layout.parts[i].number);
+  }
+  return jobs;
+}
+
+static unsigned int disk_max_jobs(struct disk_context * ctx)
+{
+  char * value = keylist_get(ctx->args,"jobs");
+  long n;
+
+  if (value) n = strtol(value, NULL, 0);
+  // several streams at once only make a spinning disk seek
+  else if (disk_rotational(&ctx->st)) n = 1;
+  else n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 1) ? 1 : n;
+}
+
+static int do_export(struct disk_context * ctx)
+{
+  struct extent_list gaps = {0};
+  struct disk_job * jobs;
+  unsigned int ssize = 0;
+  char * path;
+  FILE * f;
+  int fd, ret;
+
+  fd = open(ctx->disk, O_RDONLY);
+  if (fd < 0) fatal("failed to open disk");
+  if (fstat(fd, &ctx->st) < 0) fatal("failed to stat disk");
+  if (S_ISBLK(ctx->st.st_mode) && ioctl(fd, BLKSSZGET, &ssize) < 0)
+    fatal("failed to get sector size");
+  ret = disk_read_layout(fd, ssize, &ctx->layout);
+  close(fd);
+  if (ret < 0) { errno = -ret; fatal("failed to read partition table"); }
+  if (disk_find_gaps(&ctx->layout, &gaps)) fatal("failed to find gaps");
+
+  if ((mkdir(ctx->dir, 0777) < 0) && (errno != EEXIST))
+    fatal("failed to create image directory");
+
+  path = disk_path(ctx, "disk", "idx");
+  f = fopen(path, "w");
+  if (!f) fatal("failed to create disk index");
+  disk_write_index(ctx, f, &gaps);
+  if (fclose(f)) fatal("failed to write disk index");
+  free(path);
+
+  path = disk_path(ctx, "gaps", "idx");
+  f = fopen(path, "w");
+  if (!f) fatal("failed to create gap index");
+  disk_write_gaps(ctx, f, &gaps);
+  if (fclose(f)) fatal("failed to write gap index");
+  free(path);
+  extent_list_free(&gaps);
+
+  fprintf(stderr,"%s: %s partition table; %u partitions\n",
+	  ctx->disk,ctx->layout.label,ctx->layout.count);
+  jobs = disk_make_jobs(ctx);
+  ret = disk_run_jobs(ctx, jobs, ctx->layout.count + 1, disk_max_jobs(ctx),
+		      disk_export_job);
+  free(jobs);
+  return ret ? 1 : 0;
+}
+
+static int do_import(struct disk_context * ctx)
+{
+  struct disk_job * jobs;
+  char * path;
+  FILE * f;
+  off_t size;
+  int fd, ret;
+
+  path = disk_path(ctx, "disk", "idx");
+  f = fopen(path, "r");
+  if (!f) fatal("failed to open disk index");
+  ret = disk_read_index(ctx, f);
+  fclose(f);
+  free(path);
+  if (ret < 0) { errno = -ret; fatal("failed to read disk index"); }
+
+  fd = open(ctx->disk, O_RDWR);
+  if (fd < 0) fatal("failed to open disk");
+  if (fstat(fd, &ctx->st) < 0) fatal("failed to stat disk");
+  size = lseek(fd, 0, SEEK_END);
+  if (size < (off_t)(ctx->layout.sectors * ctx->layout.sector_size)) {
+    if (S_ISREG(ctx->st.st_mode)
+	&& !ftruncate(fd, ctx->layout.sectors * ctx->layout.sector_size))
+      ;
+    else {
+      fprintf(stderr,"target disk is smaller than the image\n");
+      return 1;
+    }
+  }
+
+  jobs = disk_make_jobs(ctx);
+  // the gaps hold the partition table, which must be in place first
+  ret = disk_run_jobs(ctx, jobs, 1, 1, disk_import_job);
+  if (!ret) {
+    // the kernel may make partition devices for the new table
+    if (S_ISBLK(ctx->st.st_mode) && !ioctl(fd, BLKRRPART))
+      ctx->rescanned = DISK_PARTDEV_WAIT;
+    ret = disk_run_jobs(ctx, jobs + 1, ctx->layout.count,
+			disk_max_jobs(ctx), disk_import_job);
+  }
+  close(fd);
+  free(jobs);
+  return ret ? 1 : 0;
+}
+
+static char usagetext[] =
+  "disk <mode> src=<source> tgt=<target> <other options>\n";
+static char helptext[] =
+  "Options:\n"
+  "\t<mode> is one of:\n"
+  "\t  export -- image disk SRC into directory TGT\n"
+  "\t  import -- restore image directory SRC onto disk TGT\n"
+  "\tsrc    -- specify source from which to read\n"
+  "\ttgt    -- specify target to which to write\n"
+  "\tjobs   -- number of partitions to image at once\n"
+  "\t          (default: 1 on rotational disks, else all CPUs)\n"
+  "\tbridge, threads -- (export mode only) passed to analyze\n"
+  "\tnuke   -- (import mode only) write zero to unused blocks\n"
+  "\tforce  -- passed to sparsecopy\n";
+
+DECLARE_MULTICALL_TABLE(main);
+SUBCALL_MAIN(main, disk, usagetext, helptext,
+	     int argc, char ** argv)
+{
+  struct disk_context ctx = {0};
+  int ret = 1;
+
+  ctx.args = keylist_parse_args(argc, argv);
+
+  if (!(keylist_get(ctx.args,"src") && keylist_get(ctx.args,"tgt"))
+      || (!keylist_find(ctx.args,"export") == !keylist_find(ctx.args,"import")))
+    print_usage_and_exit(usagetext);
+
+  if (keylist_find(ctx.args,"export")) {
+    ctx.disk = keylist_get(ctx.args,"src");
+    ctx.dir = keylist_get(ctx.args,"tgt");
+    ret = do_export(&ctx);
+  } else {
+    ctx.dir = keylist_get(ctx.args,"src");
+    ctx.disk = keylist_get(ctx.args,"tgt");
+    ret = do_import(&ctx);
+  }
+
+  disk_free_layout(&ctx.layout);
+  keylist_destroy(ctx.args);
+
+  return ret;
+}
@@ -0,0 +1,306 @@
+/* Partition table reading for disk-scope imaging
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+/* PORTABILITY NOTE: this code assumes a little-endian CPU */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block/partition.h"
+
+struct mbr_entry {
+  uint8_t  status;
+  uint8_t  chs_first[3];
+  uint8_t  type;
+  uint8_t  chs_last[3];
+  uint32_t lba_start;
+  uint32_t lba_count;
+} __attribute__((packed));
+
+struct gpt_header {
+  char     sig[8];		// "EFI PART"
+  uint32_t revision;
+  uint32_t hdrsize;
+  uint32_t hdrcrc;
+  uint32_t rsrv_1;
+  uint64_t my_lba;
+  uint64_t alt_lba;
+  uint64_t first_usable;
+  uint64_t last_usable;
+  uint8_t  disk_guid[16];
+  uint64_t entries_lba;		// first sector of partition entry array
+  uint32_t entries;		// number of entries
+  uint32_t entry_size;		// bytes per entry
+  uint32_t entries_crc;
+} __attribute__((packed));
+
+struct gpt_entry {
+  uint8_t  type[16];		// all zero if unused
+  uint8_t  guid[16];
+  uint64_t first_lba;
+  uint64_t last_lba;		// inclusive
+  uint64_t attributes;
+  uint16_t name[36];
+} __attribute__((packed));
+
+#define MBR_TABLE_OFFSET 0x1BE
+#define MBR_LOGICAL_FIRST 5
+#define MBR_MAX_LOGICAL	128	/* bound on EBR chain; guards against loops */
+#define GPT_MAX_ENTRIES	1024
+
+static inline int mbr_is_extended(uint8_t type)
+{ return (type == 0x05) || (type == 0x0F) || (type == 0x85); }
+
+//given: layout, partition number, start and length in sectors
+//return: 0 on success, -error code on error
+static int disk_add_part(struct disk_layout * d, unsigned int number,
+			 uint64_t start, uint64_t length)
+{
+  struct disk_partition * p;
+
+  if (!length) return 0; // unused slot
+  if ((start + length < start) || (start + length > d->sectors))
+    return -EINVAL; // partition runs off the end of the disk
+  p = realloc(d->parts, (d->count + 1) * sizeof(struct disk_partition));
+  if (!p) return -ENOMEM;
+  d->parts = p;
+  p += d->count++;
+  memset(p, 0, sizeof(*p));
+  p->number = number; p->start = start; p->length = length;
+  return 0;
+}
+
+//reads one sector at LBA into BUF; returns -error code on error
+static inline int disk_read_sector(int fd, struct disk_layout * d,
+				   uint64_t lba, void * buf)
+{
+  return (pread(fd, buf, d->sector_size, lba * d->sector_size)
+	  == d->sector_size) ? 0 : -EIO;
+}
+
+//follows the EBR chain of the extended partition at BASE
+// returns -error code on error
+static int mbr_read_logical(int fd, struct disk_layout * d, uint64_t base,
+			    uint64_t size)
+{
+  uint8_t buf[d->sector_size];
+  struct mbr_entry * e = (struct mbr_entry *)(buf + MBR_TABLE_OFFSET);
+  uint64_t ebr = base;
+  unsigned int number = MBR_LOGICAL_FIRST;
+  int ret;
+
+  while (number < MBR_LOGICAL_FIRST + MBR_MAX_LOGICAL) {
+    if ((ret = disk_read_sector(fd, d, ebr, buf)) < 0) return ret;
+    if ((buf[510] != 0x55) || (buf[511] != 0xAA)) return -EINVAL;
+    // first entry is the logical partition, relative to this EBR
+    if (e[0].lba_count) {
+      ret = disk_add_part(d, number++, ebr + e[0].lba_start, e[0].lba_count);
+      if (ret < 0) return ret;
+      snprintf(d->parts[d->count-1].type, sizeof(d->parts[0].type),
+	       "0x%02x", e[0].type);
+    }
+    // second entry links to the next EBR, relative to the extended partition
+    if (!e[1].lba_count || !mbr_is_extended(e[1].type)) return 0;
+    if (e[1].lba_start >= size) return -EINVAL;
+    ebr = base + e[1].lba_start;
+  }
+  return -ELOOP;
+}
+
+//formats a GPT GUID (first three fields are little-endian)
+static void gpt_format_guid(char * out, size_t len, const uint8_t * g)
+{
+  snprintf(out, len,
+	   "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+	   "%02x%02x%02x%02x%02x%02x",
+	   g[3],g[2],g[1],g[0], g[5],g[4], g[7],g[6],
+	   g[8],g[9], g[10],g[11],g[12],g[13],g[14],g[15]);
+}
+
+//return: CRC-32 (as in zlib and the UEFI specification) of LEN bytes at P
+static uint32_t gpt_crc32(const void * p, size_t len)
+{
+  const uint8_t * b = p;
+  uint32_t crc = 0xFFFFFFFF;
+  int k;
+
+  while (len--) {
+    crc ^= *b++;
+    for (k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+//reads the GPT header at LBA into HBUF and its entries into *EBUF
+// (caller frees); both checksums must match
+// returns -error code on error
+static int gpt_read_table(int fd, struct disk_layout * d, uint64_t lba,
+			  uint8_t * hbuf, uint8_t ** ebuf)
+{
+  struct gpt_header * h = (struct gpt_header *) hbuf;
+  uint32_t crc;
+  size_t elen;
+  int ret;
+
+  *ebuf = NULL;
+  if ((ret = disk_read_sector(fd, d, lba, hbuf)) < 0) return ret;
+  if (memcmp(h->sig, "EFI PART", 8)
+      || (h->hdrsize < sizeof(struct gpt_header))
+      || (h->hdrsize > d->sector_size)
+      || (h->my_lba != lba)
+      || (h->entry_size < sizeof(struct gpt_entry))
+      || (h->entries > GPT_MAX_ENTRIES))
+    return -EINVAL;
+  crc = h->hdrcrc;
+  h->hdrcrc = 0;
+  if (gpt_crc32(hbuf, h->hdrsize) != crc) return -EINVAL;
+  h->hdrcrc = crc;
+
+  elen = (size_t) h->entries * h->entry_size;
+  *ebuf = malloc(elen ? elen : 1);
+  if (!*ebuf) return -ENOMEM;
+  if (pread(fd, *ebuf, elen, h->entries_lba * d->sector_size) != elen)
+    return -EIO;
+  if (gpt_crc32(*ebuf, elen) != h->entries_crc) return -EINVAL;
+  return 0;
+}
+
+//reads GPT partition entries; returns -error code on error
+// A primary table that fails its checks is passed over for the backup
+//  at the last LBA; if neither is good, the layout is not read.
+static int gpt_read(int fd, struct disk_layout * d)
+{
+  uint8_t hbuf[d->sector_size];
+  struct gpt_header * h = (struct gpt_header *) hbuf;
+  uint8_t * ebuf = NULL;
+  unsigned int i;
+  int ret;
+
+  ret = gpt_read_table(fd, d, 1, hbuf, &ebuf);
+  if ((ret < 0) && (ret != -ENOMEM)) {
+    free(ebuf);
+    ret = gpt_read_table(fd, d, d->sectors - 1, hbuf, &ebuf);
+    if (!ret)
+      fprintf(stderr,"primary GPT is damaged; using the backup at LBA %llu\n",
+	      (unsigned long long) d->sectors - 1);
+  }
+  if (ret < 0) goto out;
+
+  for (i = 0; i < h->entries; i++) {
+    struct gpt_entry * e = (struct gpt_entry *)(ebuf + i * h->entry_size);
+    static const uint8_t unused[16];
+    if (!memcmp(e->type, unused, 16)) continue;
+    if (e->last_lba < e->first_lba) { ret = -EINVAL; goto out; }
+    ret = disk_add_part(d, i + 1, e->first_lba,
+			e->last_lba - e->first_lba + 1);
+    if (ret < 0) goto out;
+    gpt_format_guid(d->parts[d->count-1].type, sizeof(d->parts[0].type),
+		    e->type);
+  }
+  ret = 0;
+
+ out:
+  free(ebuf);
+  return ret;
+}
+
+int disk_read_layout(int fd, unsigned int sector_size,
+		     struct disk_layout * d)
+{
+  uint8_t mbr[512];
+  struct mbr_entry * e = (struct mbr_entry *)(mbr + MBR_TABLE_OFFSET);
+  off_t size;
+  int i, ret;
+
+  memset(d, 0, sizeof(*d));
+  if (pread(fd, mbr, sizeof(mbr), 0) != sizeof(mbr)) return -EIO;
+  if ((mbr[510] != 0x55) || (mbr[511] != 0xAA)) return -EINVAL;
+  size = lseek(fd, 0, SEEK_END);
+  if (size < 0) return -errno;
+
+  // a protective MBR entry means the real table is a GPT
+  for (i = 0; i < 4; i++)
+    if (e[i].type == 0xEE) break;
+  if (i < 4) {
+    static const unsigned int guess[] = { 512, 4096, 0 };
+    const unsigned int * s = guess;
+    d->label = "gpt";
+    // without a sector size, look for the GPT header where each would put it
+    for (;; s++) {
+      d->sector_size = sector_size ? sector_size : *s;
+      d->sectors = size / d->sector_size;
+      ret = gpt_read(fd, d);
+      if (ret < 0) disk_free_layout(d);
+      if (!ret || sector_size || !s[1]) return ret;
+    }
+  }
+
+  d->label = "mbr";
+  d->sector_size = sector_size ? sector_size : 512;
+  d->sectors = size / d->sector_size;
+  for (i = 0; i < 4; i++) {
+    if (!e[i].lba_count) continue;
+    if (mbr_is_extended(e[i].type))
+      ret = mbr_read_logical(fd, d, e[i].lba_start, e[i].lba_count);
+    else {
+      ret = disk_add_part(d, i + 1, e[i].lba_start, e[i].lba_count);
+      if (!ret)
+	snprintf(d->parts[d->count-1].type, sizeof(d->parts[0].type),
+		 "0x%02x", e[i].type);
+    }
+    if (ret < 0) { disk_free_layout(d); return ret; }
+  }
+  return 0;
+}
+
+void disk_free_layout(struct disk_layout * d)
+{
+  free(d->parts);
+  d->parts = NULL; d->count = 0;
+}
+
+int disk_find_gaps(struct disk_layout * d, struct extent_list * gaps)
+{
+  struct extent_list used = {0};
+  unsigned int i;
+  int ret = -ENOMEM;
+
+  memset(gaps, 0, sizeof(*gaps));
+  if (extent_list_append(gaps, 0, d->sectors)) goto out;
+  for (i = 0; i < d->count; i++)
+    if (extent_list_add(&used, d->parts[i].start, d->parts[i].length))
+      goto out;
+  extent_list_sort(&used);
+  if (extent_list_subtract(gaps, &used)) goto out;
+  ret = 0;
+
+ out:
+  if (ret) extent_list_free(gaps);
+  extent_list_free(&used);
+  return ret;
+}
@@ -0,0 +1,625 @@
+/*
+ * Live imaging of a mounted filesystem
+ *
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  This images a filesystem while it stays in use, in the manner of live
+ *   migration of a virtual machine: copy everything once, then copy again
+ *   only what changed, until what changes between passes is small; then
+ *   freeze the filesystem (FIFREEZE) for one last pass and thaw it.
+ *
+ *  Each pass maps the filesystem with the online analysis module and
+ *   copies into a shadow file, which holds every block at its own offset
+ *   (a sparse file next to the image).  The device is compared in chunks
+ *   against a hash of what the shadow holds, and only chunks that differ
+ *   are written.  When the last pass is done, the image stream and index
+ *   are written from the shadow, and the shadow is removed.
+ *
+ *  To keep the freeze short, a pass does not read the whole map.  A walk
+ *   of the directory tree finds regular files whose ctime is older than
+ *   the start of the previous pass, and FIEMAP gives their data extents;
+ *   that data cannot have changed since the previous pass read it.  All
+ *   else in the map -- metadata, directories, the journal, and the data of
+ *   files that changed -- is compared every pass, so the last pass reads
+ *   the metadata and the final delta, not the volume.
+ *  On btrfs, FIEMAP reports addresses in the filesystem's own logical
+ *   space rather than on the device, so no data is taken as cold there
+ *   and every pass compares the whole map.
+ *  The previous pass read its blocks after it started, and the filesystem
+ *   is synced at the start of each pass, so any write to a file after a
+ *   pass read it leaves a ctime that puts the file in the next pass.
+ *   Writes that do not touch ctime (to the raw device, or by tools that
+ *   fake timestamps through the device) are not seen.
+ *
+ *  The filesystem is thawed if this program exits or is killed by a
+ *   catchable signal while it is frozen; the shadow, image and index must
+ *   be on some other filesystem, or the last pass would deadlock.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/magic.h>
+
+#include "multicall.h"
+
+#include "uuid.h"
+#include "keylist.h"
+#include "analyze/dispatch.h"
+#include "analyze/extents.h"
+#include "analyze/mounted.h"
+#include "analyze/sink.h"
+#include "block/map-parse-v1.h"
+#include "block/image-v1.h"
+
+#define LIVE_CHUNK	(64 << 10)	/* bytes compared as one */
+#define LIVE_IO		(1 << 20)	/* bytes read per request */
+#define LIVE_FIEMAP_EXTENTS 256		/* extents per FIEMAP call */
+#define LIVE_PASSES	8		/* default limit on passes before freeze */
+#define LIVE_DELTA	64		/* default MiB changed to stop at */
+
+struct live_map {	// block list of one pass, as the module sent it
+  char ** keys;		// header lines, in the order received
+  unsigned int nkeys;
+  struct v1_extent * ext;
+  size_t count;
+  size_t alloc;
+  struct extent_list blocks; // the same, partial blocks as whole
+  uint64_t bsize;	// from BlockSize key
+  uint64_t range;	// from BlockRange key, or 0
+};
+
+struct live_context {
+  struct analysis_module * mod;
+  FILE * fs;		// for the analysis module
+  char * mnt;
+  int src;		// for reading blocks
+  int mfd;		// mount point
+  dev_t dev;		// device of the filesystem, for the walk
+  int shadow;
+  off_t size;		// bytes on device
+  struct live_map map;	// from the latest pass
+  uint64_t cbytes;	// bytes per chunk; a multiple of the block size
+  uint64_t nchunks;
+  uint64_t * hash;	// per chunk; 0 if never copied
+  uint8_t * mark;	// bitmap of chunks to compare in this pass
+  struct extent_list cold; // data of files unchanged since SINCE
+  int nocold;		// FIEMAP addresses are not device offsets here
+  struct timespec since;
+  void * buf;		// LIVE_IO bytes
+};
+
+struct live_stats {
+  uint64_t compared;	// chunks read and hashed
+  uint64_t written;	// chunks that differed
+};
+
+static int live_frozen = -1;	// mount point fd while frozen
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+static void live_thaw(void)
+{
+  if (live_frozen < 0) return;
+  if (ioctl(live_frozen, FITHAW, 0) < 0) perror("failed to thaw filesystem");
+  live_frozen = -1;
+}
+
+static void live_thaw_on_signal(int sig)
+{
+  if (live_frozen >= 0) ioctl(live_frozen, FITHAW, 0);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+//a 64-bit hash of LEN bytes (a multiple of 8) at P; never 0
+static uint64_t live_hash(const void * p, size_t len)
+{
+  const uint64_t * w = p;
+  uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+  size_t i;
+
+  for (i = 0; i < len / 8; i++) {
+    h ^= w[i] * 0xC2B2AE3D27D4EB4FULL;
+    h = ((h << 31) | (h >> 33)) * 0x9E3779B185EBCA87ULL;
+  }
+  h ^= h >> 33; h *= 0xFF51AFD7ED558CCDULL; h ^= h >> 33;
+  return h ? h : 1;
+}
+
+static int live_map_key(struct extent_sink * s, const char * key,
+			const char * value)
+{
+  struct live_map * m = s->arg;
+  char ** k = realloc(m->keys, (m->nkeys + 1) * sizeof(char *));
+
+  if (!k) return -ENOMEM;
+  m->keys = k;
+  if (asprintf(m->keys + m->nkeys, "%s:\t%s", key, value) < 0)
+    return -ENOMEM;
+  m->nkeys++;
+  if (!strcmp(key, "BlockSize")) m->bsize = strtoull(value, NULL, 10);
+  if (!strcmp(key, "BlockRange")) m->range = strtoull(value, NULL, 10);
+  return 0;
+}
+
+static int live_map_extent(struct extent_sink * s, const struct v1_extent * e)
+{
+  struct live_map * m = s->arg;
+
+  if (m->count == m->alloc) {
+    size_t n = m->alloc ? m->alloc * 2 : 256;
+    struct v1_extent * p = realloc(m->ext, n * sizeof(struct v1_extent));
+    if (!p) return -ENOMEM;
+    m->ext = p; m->alloc = n;
+  }
+  m->ext[m->count++] = *e;
+  return extent_list_add(&m->blocks, e->start, e->length ? e->length : 1)
+    ? -ENOMEM : 0;
+}
+
+static void live_map_free(struct live_map * m)
+{
+  while (m->nkeys) free(m->keys[--m->nkeys]);
+  free(m->keys);
+  free(m->ext);
+  extent_list_free(&m->blocks);
+  memset(m, 0, sizeof(*m));
+}
+
+//adds the whole blocks of the data of the file open on FD to the cold list
+// returns -error code on error
+static int live_cold_file(struct live_context * ctx, int fd)
+{
+  char buf[sizeof(struct fiemap)
+	   + LIVE_FIEMAP_EXTENTS * sizeof(struct fiemap_extent)];
+  struct fiemap * fm = (struct fiemap *) buf;
+  uint64_t bsize = ctx->map.bsize;
+  uint64_t range = ctx->map.range ? ctx->map.range : ctx->size / bsize;
+  uint64_t pos = 0;
+  unsigned int i;
+
+  for (;;) {
+    memset(fm, 0, sizeof(struct fiemap));
+    fm->fm_start = pos;
+    fm->fm_length = FIEMAP_MAX_OFFSET - pos;
+    fm->fm_extent_count = LIVE_FIEMAP_EXTENTS;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) return -errno;
+    if (!fm->fm_mapped_extents) return 0;
+    for (i = 0; i < fm->fm_mapped_extents; i++) {
+      struct fiemap_extent * e = fm->fm_extents + i;
+      uint64_t first = (e->fe_physical + bsize - 1) / bsize;
+      uint64_t end = (e->fe_physical + e->fe_length) / bsize;
+      if (end > range) end = range; // not on this filesystem
+      // data kept inside metadata must be compared with the metadata
+      if (!(e->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE
+			   | FIEMAP_EXTENT_NOT_ALIGNED))
+	  && (end > first) && extent_list_add(&ctx->cold, first, end - first))
+	return -ENOMEM;
+      if (e->fe_flags & FIEMAP_EXTENT_LAST) return 0;
+      pos = e->fe_logical + e->fe_length;
+    }
+  }
+}
+
+//walks the directory open on DFD (and closes it), finding cold data
+// returns -error code on error
+static int live_walk(struct live_context * ctx, int dfd)
+{
+  struct dirent * d;
+  DIR * dh = fdopendir(dfd);
+  int ret = 0;
+
+  if (!dh) { ret = -errno; close(dfd); return ret; }
+  while (!ret && (d = readdir(dh))) {
+    struct stat st;
+    int fd;
+    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+    if (fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      if (errno != ENOENT) ret = -errno; // files come and go meanwhile
+      continue;
+    }
+    if (st.st_dev != ctx->dev) continue; // not this filesystem
+    if (S_ISDIR(st.st_mode)) {
+      fd = openat(dfd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOATIME);
+      if (fd < 0) { if (errno != ENOENT) ret = -errno; continue; }
+      ret = live_walk(ctx, fd);
+    } else if (S_ISREG(st.st_mode)
+	       && ((st.st_ctim.tv_sec < ctx->since.tv_sec)
+		   || ((st.st_ctim.tv_sec == ctx->since.tv_sec)
+		       && (st.st_ctim.tv_nsec < ctx->since.tv_nsec)))) {
+      fd = openat(dfd, d->d_name, O_RDONLY | O_NOFOLLOW | O_NOATIME);
+      if (fd < 0) { if (errno != ENOENT) ret = -errno; continue; }
+      ret = live_cold_file(ctx, fd);
+      close(fd);
+    }
+  }
+  closedir(dh);
+  return ret;
+}
+
+static inline void live_mark(struct live_context * ctx, uint64_t c)
+{ ctx->mark[c / 8] |= 1 << (c % 8); }
+static inline int live_marked(struct live_context * ctx, uint64_t c)
+{ return ctx->mark[c / 8] & (1 << (c % 8)); }
+
+//marks the chunks holding blocks START+LENGTH; all of them if ALL,
+// otherwise only those never copied
+static void live_mark_blocks(struct live_context * ctx, uint64_t start,
+			     uint64_t length, int all)
+{
+  uint64_t c = start * ctx->map.bsize / ctx->cbytes;
+  uint64_t end = ((start + length) * ctx->map.bsize + ctx->cbytes - 1)
+    / ctx->cbytes;
+
+  for (; (c < end) && (c < ctx->nchunks); c++)
+    if (all || !ctx->hash[c]) live_mark(ctx, c);
+}
+
+//reads the marked chunks and writes those that changed to the shadow
+// returns -error code on error
+static int live_copy(struct live_context * ctx, struct live_stats * st)
+{
+  uint64_t per = LIVE_IO / ctx->cbytes;
+  uint64_t c = 0, n, i;
+
+  if (!per) per = 1;
+  while (c < ctx->nchunks) {
+    off_t off = c * ctx->cbytes;
+    size_t len;
+    if (!live_marked(ctx, c)) { c++; continue; }
+    for (n = 1; (c + n < ctx->nchunks) && (n < per) && live_marked(ctx, c + n);
+	 n++);
+    len = n * ctx->cbytes;
+    if (off + len > ctx->size) len = ctx->size - off;
+    if (pread(ctx->src, ctx->buf, len, off) != len) return -EIO;
+    memset((char *) ctx->buf + len, 0, n * ctx->cbytes - len);
+    for (i = 0; i < n; i++, off += ctx->cbytes) {
+      char * p = (char *) ctx->buf + i * ctx->cbytes;
+      uint64_t h = live_hash(p, ctx->cbytes);
+      size_t w = (off + ctx->cbytes > ctx->size) ? ctx->size - off
+	: ctx->cbytes;
+      if (h == ctx->hash[c + i]) continue;
+      if (pwrite(ctx->shadow, p, w, off) != w) return -EIO;
+      ctx->hash[c + i] = h;
+      st->written++;
+    }
+    st->compared += n;
+    c += n;
+  }
+  return 0;
+}
+
+//sets up chunk tables once the block size is known
+static void live_setup(struct live_context * ctx)
+{
+  uint64_t bsize = ctx->map.bsize;
+
+  ctx->cbytes = (LIVE_CHUNK < bsize) ? bsize : LIVE_CHUNK - LIVE_CHUNK % bsize;
+  ctx->nchunks = (ctx->size + ctx->cbytes - 1) / ctx->cbytes;
+  // untouched pages of these cost nothing
+  ctx->hash = calloc(ctx->nchunks, sizeof(uint64_t));
+  ctx->mark = calloc((ctx->nchunks + 7) / 8, 1);
+  ctx->buf = malloc((LIVE_IO < ctx->cbytes) ? ctx->cbytes : LIVE_IO);
+  if (!ctx->hash || !ctx->mark || !ctx->buf)
+    fatal("failed to allocate chunk tables");
+}
+
+//runs one pass; the filesystem is already frozen if FROZEN
+// returns -error code on error
+static int live_pass(struct live_context * ctx, int frozen,
+		     struct live_stats * st)
+{
+  struct extent_sink sink = { live_map_key, live_map_extent, &ctx->map };
+  struct extent_list hot = {0};
+  struct timespec start;
+  uint64_t bsize = ctx->map.bsize;
+  size_t i;
+  int fd, ret;
+
+  memset(st, 0, sizeof(*st));
+  clock_gettime(CLOCK_REALTIME, &start);
+  // put everything written so far on the disk (freezing did this already)
+  if (!frozen && (syncfs(ctx->mfd) < 0)) return -errno;
+  // the filesystem writes data around the block device's cache, so drop
+  //  anything an earlier pass left there
+  posix_fadvise(ctx->src, 0, 0, POSIX_FADV_DONTNEED);
+
+  live_map_free(&ctx->map);
+  rewind(ctx->fs);
+  ret = analysis_run_sink(ctx->mod, ctx->fs, ctx->mnt, &sink);
+  if (ret > 0) ret = -EIO;
+  if (ret) return ret;
+  if (!ctx->map.bsize || (bsize && (bsize != ctx->map.bsize)))
+    return -EINVAL;
+  if (!ctx->hash) live_setup(ctx);
+
+  extent_list_free(&ctx->cold);
+  if (!ctx->nocold) {
+    fd = open(ctx->mnt, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return -errno;
+    if ((ret = live_walk(ctx, fd))) return ret;
+    extent_list_sort(&ctx->cold);
+  }
+
+  // compare all but the cold data, and whatever was never copied
+  memset(ctx->mark, 0, (ctx->nchunks + 7) / 8);
+  for (i = 0; i < ctx->map.blocks.count; i++)
+    if (extent_list_append(&hot, ctx->map.blocks.ext[i].start,
+			   ctx->map.blocks.ext[i].length))
+      { extent_list_free(&hot); return -ENOMEM; }
+  if (extent_list_subtract(&hot, &ctx->cold))
+    { extent_list_free(&hot); return -ENOMEM; }
+  for (i = 0; i < hot.count; i++)
+    live_mark_blocks(ctx, hot.ext[i].start, hot.ext[i].length, 1);
+  for (i = 0; i < ctx->map.blocks.count; i++)
+    live_mark_blocks(ctx, ctx->map.blocks.ext[i].start,
+		     ctx->map.blocks.ext[i].length, 0);
+  extent_list_free(&hot);
+
+  if ((ret = live_copy(ctx, st))) return ret;
+  // files changed after this point are read again next pass
+  ctx->since = start;
+  ctx->since.tv_sec -= 1; // slack for coarse filesystem timestamps
+  return 0;
+}
+
+//writes the image stream and index from the shadow
+static void live_write_image(struct live_context * ctx, FILE * image,
+			     FILE * idx)
+{
+  struct live_map * m = &ctx->map;
+  struct image_header_v1 * h = ctx->buf;
+  size_t bsize = m->bsize, per = LIVE_IO / bsize;
+  uuid_t uuid;
+  unsigned int i;
+  size_t j;
+
+  if (!per) per = 1;
+  if (generate_uuid(&uuid)) fatal("failed to generate UUID");
+  memset(ctx->buf, 0, bsize);
+  memcpy(h->sig,IMAGE_V1_SIGNATURE,16);
+  memcpy(h->uuid,uuid,sizeof(uuid_t));
+  h->version = 1;
+  if (fwrite(ctx->buf, bsize, 1, image) != 1)
+    fatal("failed to write image stream header");
+
+  for (j = 0; j < m->count; j++) {
+    off_t pos = m->ext[j].start * bsize;
+    unsigned long long int left = m->ext[j].length;
+    if (!left) {
+      // partial block, padded with zero in the image
+      size_t len = bsize * m->ext[j].num / m->ext[j].denom;
+      memset(ctx->buf, 0, bsize);
+      if (pread(ctx->shadow, ctx->buf, len, pos) != len)
+	fatal("failed to read shadow");
+      if (fwrite(ctx->buf, bsize, 1, image) != 1)
+	fatal("failed to write padded block to image stream");
+    }
+    while (left) {
+      size_t n = (left < per) ? left : per;
+      if (pread(ctx->shadow, ctx->buf, n * bsize, pos) != n * bsize)
+	fatal("failed to read shadow");
+      if (fwrite(ctx->buf, n * bsize, 1, image) != 1)
+	fatal("failed to write block");
+      pos += n * bsize; left -= n;
+    }
+  }
+  if (fflush(image) || ferror(image)) fatal("failed to write image");
+
+  fprintf(idx,"%s\n",MAP_V1_SIGNATURE);
+  fprintf(idx,"UUID:\t"); print_uuid(idx,&uuid); fprintf(idx,"\n");
+  for (i = 0; i < m->nkeys; i++)
+    fprintf(idx,"%s\n",m->keys[i]);
+  fprintf(idx,"%s\n",MAP_V1_STARTBLOCKS);
+  for (j = 0; j < m->count; j++)
+    if (m->ext[j].length)
+      fprintf(idx,"%llu+%llu\n",m->ext[j].start,m->ext[j].length);
+    else
+      fprintf(idx,"%llu+.%lu/%lu\n",
+	      m->ext[j].start,m->ext[j].num,m->ext[j].denom);
+  fprintf(idx,"%s\n",MAP_V1_ENDBLOCKS);
+  if (fflush(idx) || ferror(idx)) fatal("failed to write index");
+}
+
+static inline double live_elapsed(const struct timespec * t0)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec - t0->tv_sec) + (t.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void live_report(struct live_context * ctx, const char * what,
+			struct live_stats * st, const struct timespec * t0)
+{
+  fprintf(stderr,"%s: compared %llu MiB, copied %llu MiB in %.3f s\n",
+	  what,
+	  (unsigned long long) (st->compared * ctx->cbytes >> 20),
+	  (unsigned long long) (st->written * ctx->cbytes >> 20),
+	  live_elapsed(t0));
+}
+
+//given: path of a file to be written
+//return: TRUE if it would be on the filesystem to be frozen
+static int live_on_fs(struct live_context * ctx, const char * path)
+{
+  char * dir = strdup(path);
+  struct stat st;
+  int ret;
+
+  if (!dir) fatal("failed to allocate");
+  ret = !stat(dirname(dir), &st) && (st.st_dev == ctx->dev);
+  free(dir);
+  return ret;
+}
+
+static char usagetext[] =
+  "live src=<device> mnt=<mountpoint> idx=<index> tgt=<image> <options>\n";
+static char helptext[] =
+  "Options:\n"
+  "\tsrc    -- device (or image file) holding the filesystem\n"
+  "\tmnt    -- where it is mounted; it stays in use while imaged\n"
+  "\tidx    -- index file to write\n"
+  "\ttgt    -- image file to write; TGT.live holds the copy meanwhile\n"
+  "\tpasses -- most passes before freezing (default 8)\n"
+  "\tdelta  -- freeze once a pass copies at most this many MiB\n"
+  "\t          (default 64)\n"
+  "\tkeep   -- keep TGT.live, a sparse raw copy, when done\n"
+  "  Other options are passed to the online analysis module.\n"
+  "  The filesystem is frozen for the last pass only.\n"
+  "  The result is restored with \"sparsecopy import\".\n";
+
+DECLARE_MULTICALL_TABLE(main);
+SUBCALL_MAIN(main, live, usagetext, helptext,
+	     int argc, char ** argv)
+{
+  struct live_context ctx = {0};
+  struct keylist * args = NULL;
+  struct live_stats st, prev = {0};
+  struct timespec t0;
+  struct stat mst;
+  struct statfs sf;
+  FILE * image = NULL;
+  FILE * idx = NULL;
+  FILE * shadow = NULL;
+  char * shadow_path = NULL;
+  long passes = LIVE_PASSES;
+  unsigned long long int delta = LIVE_DELTA;
+  char label[32];
+  int pass, ret;
+
+  args = keylist_parse_args(argc, argv);
+  analysis_args = args;
+
+  if (!(  (keylist_get(args,"src"))&&(keylist_get(args,"mnt"))
+	&&(keylist_get(args,"idx"))&&(keylist_get(args,"tgt"))))
+    print_usage_and_exit(usagetext);
+  if (keylist_get(args,"passes"))
+    passes = strtol(keylist_get(args,"passes"),NULL,0);
+  if (passes < 1) passes = 1;
+  if (keylist_get(args,"delta"))
+    delta = strtoull(keylist_get(args,"delta"),NULL,0);
+  delta <<= 20;
+
+  ctx.mnt = keylist_get(args,"mnt");
+  ctx.fs = fopen(keylist_get(args,"src"),"r");
+  if (!ctx.fs) fatal("could not open filesystem");
+  ctx.src = open(keylist_get(args,"src"),O_RDONLY);
+  if (ctx.src < 0) fatal("could not open filesystem");
+  if ((ctx.size = lseek(ctx.src, 0, SEEK_END)) <= 0)
+    fatal("could not find size of filesystem");
+  ctx.mfd = open(ctx.mnt, O_RDONLY | O_DIRECTORY);
+  if ((ctx.mfd < 0) || (fstat(ctx.mfd, &mst) < 0))
+    fatal("could not open mount point");
+  ctx.dev = mst.st_dev;
+  // FIEMAP gives btrfs logical addresses, not places on this device;
+  //  there, every pass compares the whole map
+  if (!fstatfs(ctx.mfd, &sf) && (sf.f_type == BTRFS_SUPER_MAGIC)) {
+    fprintf(stderr,"btrfs: comparing all blocks in every pass\n");
+    ctx.nocold = 1;
+  }
+  ret = mounted_check_source(ctx.src, &mst);
+  if (ret == -EXDEV) {
+    fprintf(stderr,"%s is not where %s is mounted\n",
+	    ctx.mnt,keylist_get(args,"src"));
+    return 1;
+  } else if (ret < 0) { errno = -ret; fatal("could not stat source"); }
+  ctx.mod = analysis_find_module(ctx.fs, "online");
+  if (!ctx.mod) { fprintf(stderr,"online module not found\n"); return 1; }
+
+  if (asprintf(&shadow_path,"%s.live",keylist_get(args,"tgt")) < 0)
+    fatal("failed to allocate");
+  if (live_on_fs(&ctx, keylist_get(args,"tgt"))
+      || live_on_fs(&ctx, keylist_get(args,"idx"))) {
+    fprintf(stderr,
+	    "The image, index and %s cannot be on the filesystem being\n"
+	    " imaged; it will be frozen while they are written.\n",
+	    shadow_path);
+    return 1;
+  }
+  image = fopen(keylist_get(args,"tgt"),"w");
+  if (!image) fatal("failed to open image file");
+  idx = fopen(keylist_get(args,"idx"),"w");
+  if (!idx) fatal("failed to open index file");
+  shadow = fopen(shadow_path,"w+");
+  if (!shadow) fatal("failed to open shadow file");
+  ctx.shadow = fileno(shadow);
+  if (ftruncate(ctx.shadow, ctx.size) < 0) fatal("failed to size shadow file");
+
+  // copy, then copy again what changed while it was being copied
+  for (pass = 1;; pass++) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ((ret = live_pass(&ctx, 0, &st)))
+      { errno = -ret; fatal("live pass failed"); }
+    snprintf(label, sizeof(label), "pass %d", pass);
+    live_report(&ctx, label, &st, &t0);
+    if (pass >= passes) break;
+    // stop once small, or once the changes come as fast as they are copied
+    if ((pass > 1) && ((st.written * ctx.cbytes <= delta)
+		       || (st.written >= prev.written)))
+      break;
+    prev = st;
+  }
+
+  atexit(live_thaw);
+  signal(SIGINT, live_thaw_on_signal);
+  signal(SIGTERM, live_thaw_on_signal);
+  signal(SIGHUP, live_thaw_on_signal);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (ioctl(ctx.mfd, FIFREEZE, 0) < 0) fatal("failed to freeze filesystem");
+  live_frozen = ctx.mfd;
+  ret = live_pass(&ctx, 1, &st);
+  live_thaw();
+  if (ret) { errno = -ret; fatal("frozen pass failed"); }
+  live_report(&ctx, "frozen", &st, &t0);
+
+  live_write_image(&ctx, image, idx);
+  fclose(image);
+  fclose(idx);
+  if (keylist_get(args,"keep")) fclose(shadow);
+  else { unlink(shadow_path); fclose(shadow); }
+
+  fprintf(stderr,"%llu blocks of %llu bytes imaged from %s in %d passes\n",
+	  (unsigned long long) ctx.map.blocks.blocks,
+	  (unsigned long long) ctx.map.bsize,
+	  keylist_get(args,"src"), pass + 1);
+  return 0;
+}
+
+//EOF
@@ -0,0 +1,624 @@
+/* Image repository: images stored as chunks shared between them
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  Many images of near-identical machines hold mostly the same data.  A
+ *   repository keeps each distinct piece once: export cuts the data stream
+ *   of an image into chunks at boundaries chosen by content (so data that
+ *   shifts within the stream still cuts the same way), stores each chunk
+ *   under its SHA-256 in a chunk store (see block/chunkstore.h) shared by
+ *   every image, and writes a manifest listing the chunks in order.
+ *  A manifest is an ordinary block list, copied from the image's index,
+ *   with the chunk list appended after it; import walks both at once,
+ *   fetching and verifying chunks in several threads ahead of writing.
+ *  Deleting a manifest deletes the image; gc then reclaims its chunks.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "multicall.h"
+
+#include "keylist.h"
+#include "sha256.h"
+#include "block/chunkstore.h"
+#include "block/map-parse-v1.h"
+
+#define MANIFEST_STARTCHUNKS	"BEGIN CHUNK LIST"
+#define MANIFEST_ENDCHUNKS	"END CHUNK LIST"
+
+/* Chunk boundaries are found with a gear hash, as in FastCDC: a cut is
+ *  made where the top bits of the hash are zero, with more bits required
+ *  before the average size and fewer after it, which keeps chunk sizes
+ *  close to the average.  The gear table is part of the format; changing
+ *  it (or the sizes) changes every boundary and defeats sharing with
+ *  chunks already stored.
+ */
+#define CHUNK_MIN	(16 << 10)
+#define CHUNK_AVG	(64 << 10)
+#define CHUNK_MASK_S	(~0ULL << (64 - 18))	/* before CHUNK_AVG */
+#define CHUNK_MASK_L	(~0ULL << (64 - 14))	/* after CHUNK_AVG */
+
+#define STREAM_BUF	(8 << 20)	/* data stream read ahead in export */
+#define FETCH_THREADS	4	/* default threads fetching chunks */
+
+struct manifest_chunk {
+  uint8_t hash[SHA256_LEN];
+  uint32_t len;
+  const struct chunk_loc * loc;	// (import)
+};
+
+struct fetch_slot {
+  uint8_t * buf;	// CHUNK_MAX bytes
+  size_t seq;		// chunk held, plus one; 0 while being filled
+  int err;		// negative errno, if fetching failed
+};
+
+struct fetch_ring {
+  struct chunk_store * store;
+  struct manifest_chunk * chunk;
+  size_t count;		// chunks in the manifest
+  size_t next;		// next chunk to fetch
+  size_t used;		// chunks consumed
+  struct fetch_slot * slot;
+  size_t depth;		// slots
+  pthread_mutex_t lock;
+  pthread_cond_t cond;	// signalled on every change
+};
+
+static uint64_t gear[256];
+
+static char usagetext[] =
+  "repo <mode> dir=<repository> name=<image> <other options>\n";
+static char helptext[] =
+  "Options:\n"
+  "\t<mode> is one of:\n"
+  "\t  export -- store the blocks of SRC listed in IDX as image NAME\n"
+  "\t  import -- write image NAME to TGT\n"
+  "\t  gc     -- reclaim chunks no image refers to (no NAME needed)\n"
+  "\tdir   -- repository directory; created by the first export\n"
+  "\tname  -- image name; the manifest is DIR/manifests/NAME\n"
+  "\tidx   -- (export mode only) index of the blocks to store\n"
+  "\tsrc   -- (export mode only) disk or partition to read\n"
+  "\ttgt   -- (import mode only) disk or partition to write\n"
+  "\tthreads -- (import mode only) chunks fetched at once (default 4)\n"
+  "  An image is deleted by removing its manifest, then running gc.\n"
+  "  A manifest is also an index, for use with other subprograms.\n";
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+static void gear_init(void)
+{
+  uint64_t x = 0x626c6b636c6f6e65ULL; // "blkclone"
+  int i;
+
+  // splitmix64; fixed forever, see above
+  for (i = 0; i < 256; i++) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+}
+
+//return: length of the chunk at the start of the LEN bytes at P
+// the caller must pass at least CHUNK_MAX bytes, unless at end of stream
+static size_t cdc_cut(const uint8_t * p, size_t len)
+{
+  uint64_t h = 0;
+  size_t i, avg = CHUNK_AVG;
+
+  if (len <= CHUNK_MIN) return len;
+  if (len > CHUNK_MAX) len = CHUNK_MAX;
+  if (avg > len) avg = len;
+  for (i = CHUNK_MIN; i < avg; i++)
+    if (!((h = (h << 1) + gear[p[i]]) & CHUNK_MASK_S)) return i + 1;
+  for (; i < len; i++)
+    if (!((h = (h << 1) + gear[p[i]]) & CHUNK_MASK_L)) return i + 1;
+  return len;
+}
+
+static void hex_hash(char * out, const uint8_t * hash)
+{
+  int i;
+  for (i = 0; i < SHA256_LEN; i++)
+    sprintf(out + 2*i, "%02x", hash[i]);
+}
+
+static int parse_hash(const char * text, uint8_t * hash)
+{
+  int i;
+  for (i = 0; i < SHA256_LEN; i++)
+    if (sscanf(text + 2*i, "%2hhx", hash + i) != 1) return -1;
+  return 0;
+}
+
+//return: malloc'd path of manifest NAME in repository DIR, or NULL
+static char * manifest_path(const char * dir, const char * name,
+			    const char * suffix)
+{
+  char * path;
+  if (!*name || strchr(name, '/') || (*name == '.')) {
+    fprintf(stderr, "bad image name \"%s\"\n", name);
+    exit(1);
+  }
+  if (asprintf(&path, "%s/manifests/%s%s", dir, name, suffix) < 0)
+    return NULL;
+  return path;
+}
+
+//reads the chunk list of the manifest open on IN
+//return: number of chunks, or -1 on error; *CHUNK is malloc'd
+static ssize_t manifest_read_chunks(FILE * in, struct manifest_chunk ** chunk)
+{
+  char * line = NULL;
+  size_t linelen = 0, n = 0, alloc = 0;
+  int in_list = 0;
+
+  *chunk = NULL;
+  while (getline(&line, &linelen, in) != -1) {
+    char hex[2*SHA256_LEN+1];
+    unsigned long len;
+    if (!in_list) {
+      in_list = !strcmp(line, MANIFEST_STARTCHUNKS "\n");
+      continue;
+    }
+    if (!strcmp(line, MANIFEST_ENDCHUNKS "\n")) { free(line); return n; }
+    if (n == alloc) {
+      struct manifest_chunk * c;
+      alloc = alloc ? alloc * 2 : 4096;
+      c = realloc(*chunk, alloc * sizeof(struct manifest_chunk));
+      if (!c) break;
+      *chunk = c;
+    }
+    if ((sscanf(line, "%64s %lu", hex, &len) != 2) || (strlen(hex) != 64)
+	|| parse_hash(hex, (*chunk)[n].hash) || !len || (len > CHUNK_MAX)) {
+      fprintf(stderr, "syntax error in chunk list at \"%s\"\n", line);
+      break;
+    }
+    (*chunk)[n].len = len; (*chunk)[n].loc = NULL;
+    n++;
+  }
+  free(line);
+  free(*chunk); *chunk = NULL;
+  return -1;
+}
+
+/* the data stream of an image, read from disk as the index lists it */
+struct export_reader {
+  FILE * map;
+  int fd;
+  size_t bs;
+  struct v1_extent e;	// current cell
+  uint64_t done;	// blocks of E already read
+  int end;		// end of block list reached
+};
+
+//fills BUF with up to ROOM bytes (a whole number of blocks) of the stream
+//return: bytes filled; 0 at end of stream
+static size_t export_fill(struct export_reader * r, uint8_t * buf, size_t room)
+{
+  size_t have = 0;
+
+  while ((room - have >= r->bs) && !r->end) {
+    if (!r->e.length && !r->e.num) {
+      int ret = map_v1_readcell(r->map, &r->e);
+      if (ret == -2) fatal("failed to read block list");
+      if (ret == -1) { r->end = 1; break; }
+      r->done = 0;
+      continue;
+    }
+    if (r->e.length) {
+      uint64_t n = (room - have) / r->bs;
+      if (n > r->e.length - r->done) n = r->e.length - r->done;
+      if (pread(r->fd, buf + have, n * r->bs, (r->e.start + r->done) * r->bs)
+	  != n * r->bs)
+	fatal("failed to read block");
+      have += n * r->bs;
+      if ((r->done += n) == r->e.length) r->e.length = 0;
+    } else {
+      // partial block, padded with zero as in an image stream
+      size_t len = r->bs * r->e.num / r->e.denom;
+      memset(buf + have, 0, r->bs);
+      if (pread(r->fd, buf + have, len, r->e.start * r->bs) != len)
+	fatal("failed to read partial block");
+      have += r->bs;
+      r->e.num = 0;
+    }
+  }
+  return have;
+}
+
+//writes the manifest: the index at IDX with the chunk list appended
+static void manifest_write(const char * path, const char * idx,
+			   struct manifest_chunk * chunk, size_t count,
+			   unsigned long long streamlen)
+{
+  char * tmp, * line = NULL;
+  size_t linelen = 0, i;
+  FILE * in, * out;
+  int first = 1;
+
+  if (asprintf(&tmp, "%s.tmp", path) < 0) fatal("failed to allocate");
+  if (!(in = fopen(idx, "r"))) fatal("failed to reopen index");
+  if (!(out = fopen(tmp, "w"))) fatal("failed to create manifest");
+  while (getline(&line, &linelen, in) != -1) {
+    fputs(line, out);
+    if (first) {
+      fprintf(out, "# image repository manifest\n");
+      fprintf(out, "Chunks:\t%zu\n", count);
+      fprintf(out, "StreamLength:\t%llu\n", streamlen);
+      first = 0;
+    }
+    if (!strcmp(line, MAP_V1_ENDBLOCKS "\n")) break;
+  }
+  free(line);
+  fclose(in);
+  fprintf(out, "%s\n", MANIFEST_STARTCHUNKS);
+  for (i = 0; i < count; i++) {
+    char hex[2*SHA256_LEN+1];
+    hex_hash(hex, chunk[i].hash);
+    fprintf(out, "%s %u\n", hex, chunk[i].len);
+  }
+  fprintf(out, "%s\n", MANIFEST_ENDCHUNKS);
+  if (fflush(out) || fdatasync(fileno(out)) || fclose(out))
+    fatal("failed to write manifest");
+  if (rename(tmp, path)) fatal("failed to install manifest");
+  free(tmp);
+}
+
+static int do_export(struct keylist * args, const char * dir,
+		     const char * name)
+{
+  struct export_reader r = {0};
+  struct manifest_chunk * chunk = NULL;
+  struct chunk_store * store;
+  struct keylist * keys;
+  size_t count = 0, alloc = 0, have = 0, pos = 0;
+  unsigned long long streamlen = 0, fresh = 0, freshlen = 0;
+  char * path;
+  uint8_t * buf;
+  int eof = 0;
+
+  if (!keylist_get(args,"idx") || !keylist_get(args,"src"))
+    print_usage_and_exit(usagetext);
+  if (!(path = manifest_path(dir, name, ""))) fatal("failed to allocate");
+  if (!access(path, F_OK)) {
+    fprintf(stderr, "image %s already exists in %s\n", name, dir);
+    return 1;
+  }
+
+  if (!(r.map = fopen(keylist_get(args,"idx"), "r")))
+    fatal("failed to open index file");
+  if (!(keys = map_v1_parsekeys(r.map))) fatal("failed to read map");
+  if (!keylist_get(keys,"BlockSize") || !keylist_get(keys,"UUID")) {
+    fprintf(stderr, "map missing required keys\n");
+    return 1;
+  }
+  r.bs = strtoul(keylist_get(keys,"BlockSize"), NULL, 0);
+  if (!r.bs || (r.bs > STREAM_BUF / 2)) {
+    fprintf(stderr, "unusable block size %zu\n", r.bs);
+    return 1;
+  }
+  if ((r.fd = open(keylist_get(args,"src"), O_RDONLY)) < 0)
+    fatal("failed to open source");
+  posix_fadvise(r.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  if (!(store = chunk_store_open(dir, 1, 0))) fatal("failed to open repository");
+  if (!(buf = malloc(STREAM_BUF))) fatal("failed to allocate stream buffer");
+
+  for (;;) {
+    size_t len;
+    if (!eof && (have - pos < CHUNK_MAX)) {
+      size_t n;
+      memmove(buf, buf + pos, have - pos);
+      have -= pos; pos = 0;
+      n = export_fill(&r, buf + have, (STREAM_BUF - have) / r.bs * r.bs);
+      if (!n) eof = 1;
+      have += n;
+      continue;
+    }
+    if (pos == have) break;
+
+    len = cdc_cut(buf + pos, have - pos);
+    if (count == alloc) {
+      alloc = alloc ? alloc * 2 : 4096;
+      chunk = realloc(chunk, alloc * sizeof(struct manifest_chunk));
+      if (!chunk) fatal("failed to allocate chunk list");
+    }
+    sha256(buf + pos, len, chunk[count].hash);
+    chunk[count].len = len;
+    switch (chunk_store_put(store, chunk[count].hash, buf + pos, len)) {
+    case 1: fresh++; freshlen += len; break;
+    case 0: break;
+    default: fatal("failed to store chunk");
+    }
+    count++; pos += len; streamlen += len;
+    if (!(count & 255))
+      fprintf(stderr, "  %llu MiB, %llu MiB new\r",
+	      streamlen >> 20, freshlen >> 20);
+  }
+  if (chunk_store_commit(store)) fatal("failed to commit chunks");
+
+  manifest_write(path, keylist_get(args,"idx"), chunk, count, streamlen);
+  fprintf(stderr, "%s: %llu bytes in %zu chunks; %llu new (%llu bytes)\n",
+	  name, streamlen, count, fresh, freshlen);
+
+  chunk_store_close(store);
+  keylist_destroy(keys);
+  free(buf); free(chunk); free(path);
+  fclose(r.map); close(r.fd);
+  return 0;
+}
+
+static void * fetch_worker(void * arg)
+{
+  struct fetch_ring * f = arg;
+
+  for (;;) {
+    struct fetch_slot * s;
+    struct manifest_chunk * c;
+    uint8_t hash[SHA256_LEN];
+    size_t seq;
+    int err;
+
+    pthread_mutex_lock(&f->lock);
+    if (f->next == f->count) { pthread_mutex_unlock(&f->lock); return NULL; }
+    seq = f->next++;
+    while (seq >= f->used + f->depth)
+      pthread_cond_wait(&f->cond, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+
+    s = f->slot + seq % f->depth;
+    c = f->chunk + seq;
+    err = chunk_store_read(f->store, c->loc, s->buf);
+    if (!err) {
+      sha256(s->buf, c->len, hash);
+      if (memcmp(hash, c->hash, SHA256_LEN)) err = -EBADMSG;
+    }
+
+    pthread_mutex_lock(&f->lock);
+    s->err = err; s->seq = seq + 1;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+  }
+}
+
+/* the data stream written to disk as the index lists it */
+struct import_writer {
+  FILE * map;
+  int fd;
+  size_t bs;
+  struct v1_extent e;	// current cell
+  uint64_t off;		// byte position on disk for the next stream byte
+  uint64_t left;	// stream bytes left in E
+  uint64_t disk;	// of those, bytes that go to disk (partial blocks)
+  int end;
+};
+
+//writes LEN bytes of the stream at P to the places the index gives
+static void import_feed(struct import_writer * w, const uint8_t * p,
+			size_t len)
+{
+  while (len) {
+    size_t n;
+    if (!w->left) {
+      int ret;
+      if (w->end) break;
+      ret = map_v1_readcell(w->map, &w->e);
+      if (ret == -2) fatal("failed to read block list");
+      if (ret == -1) { w->end = 1; break; }
+      w->off = w->e.start * w->bs;
+      if (w->e.length)
+	w->left = w->disk = w->e.length * w->bs;
+      else {
+	w->left = w->bs;
+	w->disk = w->bs * w->e.num / w->e.denom;
+      }
+      continue;
+    }
+    n = (len < w->left) ? len : w->left;
+    if (w->disk) {
+      size_t k = (n < w->disk) ? n : w->disk;
+      if (pwrite(w->fd, p, k, w->off) != k) fatal("failed to write block");
+      w->disk -= k;
+    }
+    // (the padding of a partial block is skipped)
+    p += n; len -= n; w->off += n; w->left -= n;
+  }
+  if (len) {
+    fprintf(stderr, "image data runs past the end of its block list\n");
+    exit(1);
+  }
+}
+
+static int do_import(struct keylist * args, const char * dir,
+		     const char * name)
+{
+  struct import_writer w = {0};
+  struct fetch_ring f = { .lock = PTHREAD_MUTEX_INITIALIZER,
+			  .cond = PTHREAD_COND_INITIALIZER };
+  struct manifest_chunk * chunk;
+  struct keylist * keys;
+  pthread_t * tid;
+  long threads = FETCH_THREADS, i;
+  ssize_t count;
+  size_t seq;
+  char * path;
+  FILE * in;
+
+  if (!keylist_get(args,"tgt")) print_usage_and_exit(usagetext);
+  if (keylist_get(args,"threads"))
+    threads = strtol(keylist_get(args,"threads"), NULL, 0);
+  if (threads < 1) threads = 1;
+
+  if (!(path = manifest_path(dir, name, ""))) fatal("failed to allocate");
+  if (!(w.map = fopen(path, "r")) || !(in = fopen(path, "r")))
+    fatal("failed to open manifest");
+  if (!(keys = map_v1_parsekeys(w.map))) fatal("failed to read manifest");
+  if (!keylist_get(keys,"BlockSize")) {
+    fprintf(stderr, "manifest missing BlockSize\n");
+    return 1;
+  }
+  w.bs = strtoul(keylist_get(keys,"BlockSize"), NULL, 0);
+  if ((count = manifest_read_chunks(in, &chunk)) < 0)
+    fatal("failed to read chunk list");
+  fclose(in);
+
+  if (!(f.store = chunk_store_open(dir, 0, 0)))
+    fatal("failed to open repository");
+  for (i = 0; i < count; i++)
+    if (!(chunk[i].loc = chunk_store_find(f.store, chunk[i].hash))) {
+      char hex[2*SHA256_LEN+1];
+      hex_hash(hex, chunk[i].hash);
+      fprintf(stderr, "chunk %s missing from repository\n", hex);
+      return 1;
+    }
+
+  if ((w.fd = open(keylist_get(args,"tgt"), O_WRONLY)) < 0)
+    fatal("failed to open target");
+
+  f.chunk = chunk; f.count = count;
+  f.depth = threads * 2 + 2;
+  if (!(f.slot = calloc(f.depth, sizeof(struct fetch_slot))))
+    fatal("failed to allocate");
+  for (i = 0; i < f.depth; i++)
+    if (!(f.slot[i].buf = malloc(CHUNK_MAX))) fatal("failed to allocate");
+  if (!(tid = calloc(threads, sizeof(pthread_t)))) fatal("failed to allocate");
+  for (i = 0; i < threads; i++)
+    if ((errno = pthread_create(tid + i, NULL, fetch_worker, &f)))
+      fatal("failed to start fetch thread");
+
+  for (seq = 0; seq < count; seq++) {
+    struct fetch_slot * s = f.slot + seq % f.depth;
+    pthread_mutex_lock(&f.lock);
+    while (s->seq != seq + 1)
+      pthread_cond_wait(&f.cond, &f.lock);
+    pthread_mutex_unlock(&f.lock);
+    if (s->err) {
+      char hex[2*SHA256_LEN+1];
+      hex_hash(hex, chunk[seq].hash);
+      fprintf(stderr, "chunk %s: %s\n", hex,
+	      (s->err == -EBADMSG) ? "corrupt" : strerror(-s->err));
+      exit(1);
+    }
+    import_feed(&w, s->buf, chunk[seq].len);
+    pthread_mutex_lock(&f.lock);
+    s->seq = 0; f.used++;
+    pthread_cond_broadcast(&f.cond);
+    pthread_mutex_unlock(&f.lock);
+    if (!(seq & 255))
+      fprintf(stderr, "  %zu of %zd chunks\r", seq, count);
+  }
+  for (i = 0; i < threads; i++)
+    pthread_join(tid[i], NULL);
+
+  if (w.left || (!w.end && (map_v1_readcell(w.map, &w.e) != -1))) {
+    fprintf(stderr, "image data ends before its block list\n");
+    return 1;
+  }
+  if (fdatasync(w.fd)) fatal("failed to sync target");
+  fprintf(stderr, "%s: %zd chunks written\n", name, count);
+
+  chunk_store_close(f.store);
+  for (i = 0; i < f.depth; i++) free(f.slot[i].buf);
+  free(f.slot); free(tid); free(chunk); free(path);
+  keylist_destroy(keys);
+  fclose(w.map); close(w.fd);
+  return 0;
+}
+
+static int do_gc(struct keylist * args, const char * dir)
+{
+  struct chunk_store * store;
+  struct dirent * d;
+  long long freed;
+  char * path;
+  DIR * mdir;
+  size_t images = 0;
+
+  if (!(store = chunk_store_open(dir, 0, 1)))
+    fatal("failed to open repository");
+  if (asprintf(&path, "%s/manifests", dir) < 0) fatal("failed to allocate");
+  if (!(mdir = opendir(path))) fatal("failed to read manifests");
+  free(path);
+
+  while ((d = readdir(mdir))) {
+    struct manifest_chunk * chunk;
+    ssize_t count, i;
+    FILE * in;
+    if (d->d_name[0] == '.') continue;
+    if (strstr(d->d_name, ".tmp")) continue;
+    if (!(path = manifest_path(dir, d->d_name, ""))) fatal("failed to allocate");
+    if (!(in = fopen(path, "r"))) fatal("failed to open manifest");
+    if ((count = manifest_read_chunks(in, &chunk)) < 0) {
+      // never reclaim what an unreadable manifest might need
+      fprintf(stderr, "manifest %s unreadable; not collecting\n", d->d_name);
+      return 1;
+    }
+    for (i = 0; i < count; i++)
+      if (chunk_store_mark(store, chunk[i].hash) == -ENOENT)
+	fprintf(stderr, "%s: chunk %zd missing\n", d->d_name, i);
+    fclose(in); free(chunk); free(path);
+    images++;
+  }
+  closedir(mdir);
+
+  if ((freed = chunk_store_sweep(store)) < 0) {
+    errno = -freed;
+    fatal("failed to collect garbage");
+  }
+  fprintf(stderr, "%zu images; %lld bytes reclaimed\n", images, freed);
+  chunk_store_close(store);
+  return 0;
+}
+
+DECLARE_MULTICALL_TABLE(main);
+//int main(int argc, char ** argv)
+SUBCALL_MAIN(main, repo, usagetext, helptext,
+	     int argc, char ** argv)
+{
+  struct keylist * args = keylist_parse_args(argc, argv);
+  char * dir = keylist_get(args,"dir");
+  char * name = keylist_get(args,"name");
+
+  if (!dir) print_usage_and_exit(usagetext);
+  gear_init();
+
+  if (keylist_get(args,"gc"))
+    return do_gc(args, dir);
+  if (!name) print_usage_and_exit(usagetext);
+  if (keylist_get(args,"export"))
+    return do_export(args, dir, name);
+  if (keylist_get(args,"import"))
+    return do_import(args, dir, name);
+  print_usage_and_exit(usagetext);
+  return 1;
+}
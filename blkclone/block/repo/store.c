@@ -0,0 +1,488 @@
+/* Content-addressed chunk store for image repositories
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  The store is a directory of packs, each a file of chunks back to back
+ *   with a binary index beside it.  A pack is written once and never
+ *   changed; it becomes part of the store when its index is renamed into
+ *   place, so a crash leaves at worst an orphan pack for gc to remove.
+ *  All pack indexes are loaded into one open-addressed hash table when
+ *   the store is opened, keyed on the chunk hash itself.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "uuid.h"
+#include "block/chunkstore.h"
+
+struct chunk_pack {
+  char name[17];	// 16 hex digits
+  int fd;
+  uint64_t total;	// bytes of chunks (gc)
+  uint64_t live;	// bytes of marked chunks (gc)
+  int gone;		// deleted or repacked by the sweep
+};
+
+struct chunk_store {
+  char * dir;
+  int lockfd;		// REPOSITORY, flocked
+
+  struct chunk_pack * pack;
+  size_t npack, apack;
+
+  struct chunk_loc * table;
+  size_t mask;		// table size - 1
+  size_t used;
+  uint8_t * mark;	// per table slot (gc)
+
+  // the pack being written, if any
+  int out;		// index into PACK, or -1
+  uint64_t outsize;
+  struct chunk_pidx_entry * fresh;
+  size_t nfresh, afresh;
+};
+
+static char * store_path(struct chunk_store * s, const char * name,
+			 const char * suffix)
+{
+  char * path;
+  if (asprintf(&path, "%s/packs/%s%s", s->dir, name, suffix) < 0)
+    return NULL;
+  return path;
+}
+
+static inline size_t store_slot(struct chunk_store * s, const uint8_t * hash)
+{
+  uint64_t k;
+  memcpy(&k, hash, sizeof(k));
+  return k & s->mask;
+}
+
+static int store_grow(struct chunk_store * s)
+{
+  struct chunk_loc * old = s->table;
+  size_t n = s->mask + 1, i;
+
+  s->table = calloc(n * 2, sizeof(struct chunk_loc));
+  if (!s->table) { s->table = old; return -ENOMEM; }
+  s->mask = n * 2 - 1;
+  for (i = 0; i < n; i++)
+    if (old[i].len) {
+      size_t j = store_slot(s, old[i].hash);
+      while (s->table[j].len) j = (j + 1) & s->mask;
+      s->table[j] = old[i];
+    }
+  free(old);
+  return 0;
+}
+
+//adds a chunk to the table, unless already there
+//return: the table entry for HASH, or NULL if out of memory
+static struct chunk_loc * store_insert(struct chunk_store * s,
+				       const uint8_t * hash, uint32_t pack,
+				       uint64_t off, uint32_t len)
+{
+  size_t i;
+
+  if ((s->used + 1) * 2 > s->mask + 1)
+    if (store_grow(s)) return NULL;
+  for (i = store_slot(s, hash); s->table[i].len; i = (i + 1) & s->mask)
+    if (!memcmp(s->table[i].hash, hash, SHA256_LEN))
+      return s->table + i;
+  memcpy(s->table[i].hash, hash, SHA256_LEN);
+  s->table[i].pack = pack; s->table[i].off = off; s->table[i].len = len;
+  s->used++;
+  return s->table + i;
+}
+
+static int store_add_pack(struct chunk_store * s, const char * name, int fd)
+{
+  if (s->npack == s->apack) {
+    size_t n = s->apack ? s->apack * 2 : 16;
+    struct chunk_pack * p = realloc(s->pack, n * sizeof(struct chunk_pack));
+    if (!p) return -ENOMEM;
+    s->pack = p; s->apack = n;
+  }
+  memset(s->pack + s->npack, 0, sizeof(struct chunk_pack));
+  strncpy(s->pack[s->npack].name, name, 16);
+  s->pack[s->npack].fd = fd;
+  return s->npack++;
+}
+
+//loads the index of pack NAME
+static int store_load(struct chunk_store * s, const char * name)
+{
+  struct chunk_pidx_header h;
+  struct chunk_pidx_entry e;
+  char * path;
+  FILE * f;
+  int fd, p, ret = -EINVAL;
+  uint64_t i;
+
+  if (!(path = store_path(s, name, ".pack"))) return -ENOMEM;
+  fd = open(path, O_RDONLY);
+  free(path);
+  if (fd < 0) return -errno;
+  if (!(path = store_path(s, name, ".idx"))) { close(fd); return -ENOMEM; }
+  f = fopen(path, "r");
+  free(path);
+  if (!f) { close(fd); return -errno; }
+
+  if ((fread(&h, sizeof(h), 1, f) != 1)
+      || memcmp(h.sig, CHUNK_PIDX_SIGNATURE, 16))
+    goto out;
+  if ((p = store_add_pack(s, name, fd)) < 0) { ret = p; goto out; }
+  fd = -1; // the pack owns it now
+  for (i = 0; i < h.count; i++) {
+    if (fread(&e, sizeof(e), 1, f) != 1) goto out;
+    if (!e.len || (e.len > CHUNK_MAX)) goto out;
+    if (!store_insert(s, e.hash, p, e.off, e.len)) { ret = -ENOMEM; goto out; }
+  }
+  ret = 0;
+
+ out:
+  if (fd >= 0) close(fd);
+  fclose(f);
+  return ret;
+}
+
+struct chunk_store * chunk_store_open(const char * dir, int create,
+				      int exclusive)
+{
+  struct chunk_store * s = calloc(1, sizeof(struct chunk_store));
+  char sig[sizeof(CHUNK_REPO_SIGNATURE) + 1] = {0};
+  char * path = NULL;
+  struct dirent * d;
+  DIR * packs;
+  int err;
+
+  if (!s) return NULL;
+  s->out = -1; s->lockfd = -1;
+  if (!(s->dir = strdup(dir))) goto fail_errno;
+  s->mask = 1023;
+  if (!(s->table = calloc(s->mask + 1, sizeof(struct chunk_loc))))
+    goto fail_errno;
+
+  if (create) {
+    if (mkdir(dir, 0777) && (errno != EEXIST)) goto fail_errno;
+    if (asprintf(&path, "%s/packs", dir) < 0) goto fail_errno;
+    if (mkdir(path, 0777) && (errno != EEXIST)) goto fail_errno;
+    free(path); path = NULL;
+    if (asprintf(&path, "%s/manifests", dir) < 0) goto fail_errno;
+    if (mkdir(path, 0777) && (errno != EEXIST)) goto fail_errno;
+    free(path); path = NULL;
+  }
+
+  if (asprintf(&path, "%s/REPOSITORY", dir) < 0) goto fail_errno;
+  s->lockfd = open(path, O_RDWR | (create ? O_CREAT : 0), 0666);
+  if (s->lockfd < 0) goto fail_errno;
+  if (flock(s->lockfd, exclusive ? LOCK_EX : LOCK_SH)) goto fail_errno;
+  if (!pread(s->lockfd, sig, sizeof(sig) - 1, 0) && create) {
+    // new repository
+    snprintf(sig, sizeof(sig), "%s\n", CHUNK_REPO_SIGNATURE);
+    if (pwrite(s->lockfd, sig, strlen(sig), 0) != strlen(sig))
+      goto fail_errno;
+  }
+  if (strcmp(sig, CHUNK_REPO_SIGNATURE "\n"))
+    { errno = EINVAL; goto fail; }
+  free(path); path = NULL;
+
+  if (asprintf(&path, "%s/packs", dir) < 0) goto fail_errno;
+  if (!(packs = opendir(path))) goto fail_errno;
+  while ((d = readdir(packs))) {
+    char * dot = strchr(d->d_name, '.');
+    if (!dot || strcmp(dot, ".idx") || (dot - d->d_name != 16)) continue;
+    *dot = '\0';
+    if ((err = store_load(s, d->d_name))) {
+      fprintf(stderr, "pack %s: %s\n", d->d_name, strerror(-err));
+      closedir(packs);
+      errno = -err; goto fail;
+    }
+  }
+  closedir(packs);
+  free(path);
+  return s;
+
+ fail_errno:
+ fail:
+  err = errno;
+  free(path);
+  chunk_store_close(s);
+  errno = err;
+  return NULL;
+}
+
+const struct chunk_loc * chunk_store_find(struct chunk_store * s,
+					  const uint8_t * hash)
+{
+  size_t i;
+
+  for (i = store_slot(s, hash); s->table[i].len; i = (i + 1) & s->mask)
+    if (!memcmp(s->table[i].hash, hash, SHA256_LEN))
+      return s->table + i;
+  return NULL;
+}
+
+//starts a new pack for writing
+static int store_start_pack(struct chunk_store * s)
+{
+  char name[17];
+  uuid_t u;
+  char * path;
+  int fd, p, i;
+
+  if (generate_uuid(&u)) return -EIO;
+  for (i = 0; i < 8; i++)
+    sprintf(name + 2*i, "%02x", u[i]);
+  if (!(path = store_path(s, name, ".pack"))) return -ENOMEM;
+  fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+  free(path);
+  if (fd < 0) return -errno;
+  if (write(fd, CHUNK_PACK_SIGNATURE, 16) != 16)
+    { close(fd); return -EIO; }
+  if ((p = store_add_pack(s, name, fd)) < 0) { close(fd); return p; }
+  s->out = p; s->outsize = 16; s->nfresh = 0;
+  return 0;
+}
+
+//appends a chunk to the pack being written
+//return: the chunk's byte offset in the pack, or negative errno
+static long long store_append(struct chunk_store * s, const uint8_t * hash,
+			      const void * data, size_t len)
+{
+  struct chunk_pidx_entry * e;
+  uint64_t off;
+  int ret;
+
+  if ((s->out >= 0) && (s->outsize + len > CHUNK_PACK_MAX))
+    if ((ret = chunk_store_commit(s))) return ret;
+  if ((s->out < 0) && (ret = store_start_pack(s))) return ret;
+
+  if (s->nfresh == s->afresh) {
+    size_t n = s->afresh ? s->afresh * 2 : 1024;
+    e = realloc(s->fresh, n * sizeof(struct chunk_pidx_entry));
+    if (!e) return -ENOMEM;
+    s->fresh = e; s->afresh = n;
+  }
+  off = s->outsize;
+  if (pwrite(s->pack[s->out].fd, data, len, off) != len)
+    return errno ? -errno : -EIO;
+  s->outsize += len;
+
+  e = s->fresh + s->nfresh++;
+  memcpy(e->hash, hash, SHA256_LEN);
+  e->off = off; e->len = len; e->reserved = 0;
+  return off;
+}
+
+int chunk_store_put(struct chunk_store * s, const uint8_t * hash,
+		    const void * data, size_t len)
+{
+  long long off;
+
+  if (!len || (len > CHUNK_MAX)) return -EINVAL;
+  if (chunk_store_find(s, hash)) return 0;
+  if ((off = store_append(s, hash, data, len)) < 0) return off;
+  if (!store_insert(s, hash, s->out, off, len)) return -ENOMEM;
+  return 1;
+}
+
+int chunk_store_read(struct chunk_store * s, const struct chunk_loc * loc,
+		     void * buf)
+{
+  ssize_t got = pread(s->pack[loc->pack].fd, buf, loc->len, loc->off);
+  if (got < 0) return -errno;
+  return (got == loc->len) ? 0 : -EIO;
+}
+
+static int pidx_cmp(const void * a, const void * b)
+{
+  return memcmp(a, b, SHA256_LEN);
+}
+
+int chunk_store_commit(struct chunk_store * s)
+{
+  struct chunk_pidx_header h = {{0}};
+  struct chunk_pack * p;
+  char * tmp, * path;
+  FILE * f;
+  int fd, ret = 0;
+
+  if (s->out < 0) return 0;
+  p = s->pack + s->out;
+  if (fdatasync(p->fd)) return -errno;
+
+  qsort(s->fresh, s->nfresh, sizeof(struct chunk_pidx_entry), pidx_cmp);
+  memcpy(h.sig, CHUNK_PIDX_SIGNATURE, 16);
+  h.count = s->nfresh;
+  if (!(tmp = store_path(s, p->name, ".idx.tmp"))) return -ENOMEM;
+  if (!(path = store_path(s, p->name, ".idx"))) { free(tmp); return -ENOMEM; }
+  if (!(f = fopen(tmp, "w"))) { ret = -errno; goto out; }
+  fwrite(&h, sizeof(h), 1, f);
+  fwrite(s->fresh, sizeof(struct chunk_pidx_entry), s->nfresh, f);
+  if (fflush(f) || fdatasync(fileno(f))) ret = -errno;
+  if (fclose(f) && !ret) ret = -errno;
+  if (!ret && rename(tmp, path)) ret = -errno;
+  if (!ret) {
+    // make the rename itself durable
+    char * dir;
+    if (asprintf(&dir, "%s/packs", s->dir) >= 0) {
+      if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0)
+	{ fsync(fd); close(fd); }
+      free(dir);
+    }
+    s->out = -1; s->nfresh = 0;
+  }
+
+ out:
+  free(tmp); free(path);
+  return ret;
+}
+
+int chunk_store_mark(struct chunk_store * s, const uint8_t * hash)
+{
+  const struct chunk_loc * l = chunk_store_find(s, hash);
+
+  if (!l) return -ENOENT;
+  if (!s->mark && !(s->mark = calloc(s->mask + 1, 1))) return -ENOMEM;
+  s->mark[l - s->table] = 1;
+  return 0;
+}
+
+//removes pack P and its index; the index first, so no reader sees the pack
+static void store_unlink_pack(struct chunk_store * s, struct chunk_pack * p)
+{
+  char * path;
+
+  if ((path = store_path(s, p->name, ".idx"))) { unlink(path); free(path); }
+  if ((path = store_path(s, p->name, ".pack"))) { unlink(path); free(path); }
+  p->gone = 1;
+}
+
+//removes pack files that have no index, left by a crash
+static long long store_sweep_orphans(struct chunk_store * s)
+{
+  long long freed = 0;
+  struct dirent * d;
+  struct stat st;
+  char * path;
+  DIR * packs;
+
+  if (asprintf(&path, "%s/packs", s->dir) < 0) return 0;
+  packs = opendir(path);
+  free(path);
+  if (!packs) return 0;
+  while ((d = readdir(packs))) {
+    char * dot = strchr(d->d_name, '.');
+    char name[17];
+    size_t i;
+    if (!dot || (dot - d->d_name != 16)) continue;
+    memcpy(name, d->d_name, 16); name[16] = '\0';
+    for (i = 0; i < s->npack; i++)
+      if (!strcmp(s->pack[i].name, name)) break;
+    if ((i < s->npack) && strcmp(dot, ".idx.tmp")) continue;
+    if (!(path = store_path(s, d->d_name, ""))) continue;
+    if (!stat(path, &st)) freed += st.st_size;
+    unlink(path);
+    free(path);
+  }
+  closedir(packs);
+  return freed;
+}
+
+long long chunk_store_sweep(struct chunk_store * s)
+{
+  uint8_t * buf = NULL;
+  long long freed = 0;
+  size_t old = s->npack;	// packs from before the sweep
+  size_t i;
+  int ret;
+
+  if (!s->mark && !(s->mark = calloc(s->mask + 1, 1))) return -ENOMEM;
+  for (i = 0; i < s->npack; i++)
+    s->pack[i].total = s->pack[i].live = 0;
+  for (i = 0; i <= s->mask; i++)
+    if (s->table[i].len) {
+      s->pack[s->table[i].pack].total += s->table[i].len;
+      if (s->mark[i]) s->pack[s->table[i].pack].live += s->table[i].len;
+    }
+
+  // move the live chunks out of packs that are mostly dead
+  for (i = 0; i <= s->mask; i++) {
+    struct chunk_loc * l = s->table + i;
+    struct chunk_pack * p = s->pack + l->pack;
+    long long off;
+    if (!l->len || !s->mark[i] || ((int) l->pack == s->out)
+	|| ((p->total - p->live) * 4 <= p->total))
+      continue;
+    if (!buf && !(buf = malloc(CHUNK_MAX))) return -ENOMEM;
+    if ((ret = chunk_store_read(s, l, buf))) goto fail;
+    if ((off = store_append(s, l->hash, buf, l->len)) < 0)
+      { ret = off; goto fail; }
+    l->pack = s->out; l->off = off;
+    freed -= l->len;
+  }
+  free(buf);
+  // the moved chunks must be safe before their old copies go
+  if ((ret = chunk_store_commit(s))) return ret;
+
+  // (a pack with no chunks in the table held only duplicates)
+  for (i = 0; i < old; i++) {
+    struct chunk_pack * p = s->pack + i;
+    struct stat st;
+    if ((int) i == s->out) continue;
+    if (!p->total || ((p->total - p->live) * 4 > p->total)) {
+      if (!fstat(p->fd, &st)) freed += st.st_size;
+      store_unlink_pack(s, p);
+    }
+  }
+  return freed + store_sweep_orphans(s);
+
+ fail:
+  free(buf);
+  return ret;
+}
+
+void chunk_store_close(struct chunk_store * s)
+{
+  size_t i;
+
+  if (!s) return;
+  if (s->out >= 0) {
+    // never committed; nothing refers to it
+    store_unlink_pack(s, s->pack + s->out);
+  }
+  for (i = 0; i < s->npack; i++)
+    close(s->pack[i].fd);
+  if (s->lockfd >= 0) close(s->lockfd);
+  free(s->pack); free(s->table); free(s->mark); free(s->fresh);
+  free(s->dir);
+  free(s);
+}
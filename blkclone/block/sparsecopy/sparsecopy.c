@@ -40,20 +40,39 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <linux/fs.h>
 
 #include "multicall.h"
 
 #include "uuid.h"
 #include "keylist.h"
+#include "throttle.h"
 #include "block/map-parse-v1.h"
+#include "block/image-v1.h"
+#include "block/tune.h"
 
-/* v1 image header */
-struct image_header_v1 {
-  char    sig[16];	//signature: "BLKCLONEDATA\r\n\004\000"
-  uint8_t uuid[16];	//UUID
-  uint8_t version;	// == 1
+/* Import writes through the page cache, which would otherwise hold
+ *  gigabytes of dirty data and leave all of it to be written at the end,
+ *  starving other I/O on the way.  Instead, writeback of each step of the
+ *  target (a quarter of the dirty budget) is started as soon as it is
+ *  written, and import waits for the step 4 behind, so that no more than
+ *  the budget is ever dirty or in flight.
+ */
+
+#define WRITEBACK_BUDGET	64	/* MiB dirty at most, by default */
+#define WRITEBACK_STEPS		4	/* steps in the budget */
+
+struct writeback {
+  int fd;		// target
+  off_t step;		// bytes per step
+  off_t budget;		// bytes dirty or under writeback at most
+  off_t issued;		// writeback started for all before this offset
+  off_t waited;		// writeback done for all before this offset
 };
 
 struct imaging_context {
@@ -65,6 +84,11 @@ struct imaging_context {
   uint64_t blockrange;	// number of blocks on disk
   uint64_t diskcnt;	// count of blocks processed from/to disk
   uuid_t uuid;		// image data UUID
+  struct writeback * wb; // writeback pacing for target, or NULL
+  struct io_profile io;	// how to read or write the device
+  off_t ra;		// bytes to read ahead of the source, or 0
+  off_t ra_next;	// readahead requested for all before this offset...
+  off_t ra_end;		// ...in the extent ending here
 };
 
 struct progress {
@@ -82,6 +106,7 @@ enum sparsecopy_mode {
   MODE_EXPORT,		// copy data to image
   MODE_IMPORT,		// copy data from image
   MODE_NUKE_AND_IMPORT,	// copy data from image, zeroing out all else
+  MODE_EXPORT_RAW,	// copy data to a sparse file, at the same offsets
   MODE_COUNT };
 
 static inline void fatal(char * msg)
@@ -108,10 +133,92 @@ static struct {
   {"import",do_import},
   {NULL,NULL}};
 
+/* A raw image is the disk itself, as a sparse file: each extent in the index
+ *  at its own offset and a hole for everything else, so that it can be
+ *  loop-mounted or given to a virtual machine as it is.  It carries no
+ *  header; the index is still needed to import it, for the block size.
+ *  Import copies only what SEEK_DATA finds in the image, whatever wrote it.
+ */
+
+#define RAW_IO		(1 << 20) /* bytes copied at once by raw import */
+
+/* Rescue mode (export only) works like ddrescue.  The first pass reads in
+ *  large pieces; at a read error it writes zero for a stretch of blocks
+ *  and skips past them, doubling the stretch at each further error, so a
+ *  damaged region costs few slow failing reads and healthy regions go at
+ *  full speed.  Each later pass goes back over the stretches still missing,
+ *  one block at a time and then one sector at a time (with O_DIRECT where
+ *  possible, so one bad sector does not cost a whole page), and writes what
+ *  it recovers into its place in the image stream.  Blocks that are still
+ *  unreadable stay zero in the image and are listed in a bad block map
+ *  (IDX.bad unless badmap= is given), which is written like an index.
+ */
+
+#define RESCUE_IO	(1 << 20) /* bytes read at once in the first pass */
+#define RESCUE_RETRIES	2	/* default number of passes after the first */
+#define RESCUE_SKIP_MIN	16	/* blocks; least limit on the skip stretch */
+#define RESCUE_SKIP_DIV	1024	/* skip at most BlockRange/this blocks */
+
+struct rescue_range {
+  uint64_t phypos;	// first block on disk
+  uint64_t logpos;	// first block in data stream
+  uint64_t length;	// length in blocks (1 for a partial block)
+  unsigned long int num; // fraction of a partial block, as in the index;
+  unsigned long int denom; //  DENOM is 0 for whole blocks
+};
+
+struct rescue_list {
+  struct rescue_range * r;
+  size_t count;
+  size_t alloc;
+  uint64_t blocks;	// total blocks in all ranges
+};
+
+struct rescue_source {
+  int fd;		// buffered
+  int dfd;		// O_DIRECT, or -1
+  size_t ssize;		// logical sector size
+  void * buf;		// one block; aligned for O_DIRECT
+  uint64_t lost;	// sectors unreadable after the last pass
+};
+
+/* Refresh import is for targets that already hold most of the image, as
+ *  when re-imaging a machine that has barely changed.  It reads the target
+ *  as well as the image and writes only the blocks that differ.  A reader
+ *  thread walks the index and reads the target ahead into a ring of
+ *  buffers while the main thread reads the image stream and compares, so
+ *  a refresh with little to write goes at the speed of reading.
+ */
+
+#define REFRESH_IO	(1 << 20) /* bytes in each piece read */
+#define REFRESH_DEPTH	8	/* pieces of the target read ahead */
+
+struct refresh_piece {
+  off_t off;		// byte offset on target
+  size_t len;		// bytes on target (less than a block if partial)
+  size_t blocks;	// blocks from image stream (0 for a gap to zero)
+  size_t valid;		// bytes actually read from target
+  int err;		// errno from reading target, or 0
+  char * buf;
+};
+
+struct refresh_ring {
+  struct imaging_context * ctx;
+  FILE * map;
+  int fd;		// target
+  int nuke;		// also zero the gaps between extents
+  size_t per;		// blocks in each piece
+  struct refresh_piece piece[REFRESH_DEPTH];
+  unsigned int head;	// pieces read
+  unsigned int tail;	// pieces compared
+  int done;		// reader is finished
+  pthread_mutex_t lock;
+  pthread_cond_t cond;	// signalled on every change
+};
+
 static char baton[] = "|/-\\";
 
 // suggest stepping baton every 2048 blocks copied
-//	and blocking on sync every 4 steps
 static inline void show_progress(FILE * s, struct progress * p)
 {
   fprintf(s,"  %2d.%d%% %c -> %2d.%d%% %c\r",
@@ -120,6 +227,38 @@ static inline void show_progress(FILE * s, struct progress * p)
   fflush(s);
 }
 
+//given: target written up to byte END, in increasing order
+static void writeback_advance(struct writeback * wb, FILE * target, off_t end)
+{
+  if (end - wb->issued < wb->step) return;
+
+  if (fflush(target)) fatal("failed to write target");
+  if (sync_file_range(wb->fd, wb->issued, end - wb->issued,
+		      SYNC_FILE_RANGE_WRITE))
+    fatal("failed to start writeback");
+  wb->issued = end;
+  if (wb->issued - wb->waited >= wb->budget) {
+    off_t upto = wb->issued - wb->budget + wb->step;
+    if (sync_file_range(wb->fd, wb->waited, upto - wb->waited,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+			| SYNC_FILE_RANGE_WAIT_AFTER))
+      fatal("failed to wait for writeback");
+    wb->waited = upto;
+  }
+}
+
+//given: target completely written
+static void writeback_finish(struct writeback * wb, FILE * target)
+{
+  if (fflush(target)) fatal("failed to write target");
+  // a length of zero reaches to the end of the file
+  if (sync_file_range(wb->fd, wb->waited, 0,
+		      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+		      | SYNC_FILE_RANGE_WAIT_AFTER))
+    fatal("failed to wait for writeback");
+  if (fdatasync(wb->fd)) fatal("failed to sync target");
+}
+
 static int do_copy_internal(struct imaging_context * ctx,
 			    enum sparsecopy_mode mode,
 			    FILE * map, FILE * source, FILE * target)
@@ -129,8 +268,10 @@ static int do_copy_internal(struct imaging_context * ctx,
   struct v1_extent e = {0};
   unsigned int phy_frac, log_frac; //progress in 1/10ths percent
   int ret;
+  off_t rawend = 0;	// end of a partial block written to a raw image
   struct {
     int zerofill : 1;	//write blocks of zero instead of seeking
+    int raw : 1;	//seek the target too, leaving holes for gaps
   } flags = {0};
 
   void progress(void) { //update progress
@@ -140,6 +281,17 @@ static int do_copy_internal(struct imaging_context * ctx,
     p.log_pct = log_frac / 10; p.log_pct_f = log_frac % 10;
     p.phy_pct = phy_frac / 10; p.phy_pct_f = phy_frac % 10;
 
+    if (ctx->wb)
+      writeback_advance(ctx->wb, target, ctx->phypos * ctx->blocklen);
+    io_throttle(ctx->blocklen); // (when run from batch)
+    // keep DEPTH requests of readahead in flight within the extent
+    while (ctx->ra && (ctx->ra_next < ctx->ra_end)
+	   && (ctx->ra_next < (off_t) (ctx->phypos * ctx->blocklen) + ctx->ra)) {
+      posix_fadvise(fileno(source), ctx->ra_next, ctx->io.iosize,
+		    POSIX_FADV_WILLNEED);
+      ctx->ra_next += ctx->io.iosize;
+    }
+
     p.log_baton = ctx->logpos >> 8;
     p.phy_baton = ctx->diskcnt >> 8;
 
@@ -156,6 +308,13 @@ static int do_copy_internal(struct imaging_context * ctx,
     seek = target; break;
   case MODE_NUKE_AND_IMPORT:
     seek = NULL; flags.zerofill = 1; break;
+  case MODE_EXPORT_RAW:
+    seek = source; flags.raw = 1;
+    // start from nothing but one hole the size of the disk
+    if (fflush(target) || ftruncate(fileno(target), 0)
+	|| ftruncate(fileno(target), ctx->blockrange * ctx->blocklen))
+      fatal("failed to size raw image");
+    break;
   default:
     return -1;
   }
@@ -167,6 +326,15 @@ static int do_copy_internal(struct imaging_context * ctx,
 	fatal("failed to seek");
       if (ftello(seek) != (e.start * ctx->blocklen))
 	fatal("seek did not move file pointer as expected");
+      if (flags.raw && (e.length || e.num)) {
+	off_t len = e.length ? e.length * ctx->blocklen
+			     : ctx->blocklen * e.num / e.denom;
+	if (fseeko(target, e.start * ctx->blocklen, SEEK_SET))
+	  fatal("failed to seek in raw image");
+	// allocate the extent in one piece; failure only costs layout
+	fallocate(fileno(target), FALLOC_FL_KEEP_SIZE,
+		  e.start * ctx->blocklen, len);
+      }
     }
     else if (flags.zerofill && e.start) {
       off_t gap = (e.start * ctx->blocklen) - ftello(target);
@@ -210,6 +378,10 @@ static int do_copy_internal(struct imaging_context * ctx,
       }
     }
     ctx->phypos = e.start;
+    if (ctx->ra && (seek == source)) {
+      ctx->ra_next = e.start * ctx->blocklen;
+      ctx->ra_end = (e.start + e.length) * ctx->blocklen;
+    }
     if (e.length)
       //copy whole blocks
       while (e.length--) {
@@ -233,6 +405,13 @@ static int do_copy_internal(struct imaging_context * ctx,
 	if (fwrite(ctx->block, ctx->blocklen, 1, target) != 1)
 	  fatal("failed to write padded block to image stream");
 	break;
+      case MODE_EXPORT_RAW:
+	if (fread(ctx->block, len, 1, source) != 1)
+	  fatal("failed to read partial block from source");
+	if (fwrite(ctx->block, len, 1, target) != 1)
+	  fatal("failed to write partial block to raw image");
+	rawend = ftello(target);
+	break;
       case MODE_IMPORT:
       case MODE_NUKE_AND_IMPORT:
 	if (fread(ctx->block, ctx->blocklen, 1, source) != 1)
@@ -249,7 +428,490 @@ static int do_copy_internal(struct imaging_context * ctx,
       progress();
     }
   } while (!(ret<0));
+  if (ctx->wb) writeback_finish(ctx->wb, target);
+  if (rawend && (fflush(target) || ftruncate(fileno(target), rawend)))
+    fatal("failed to size raw image");
+  show_progress(stderr, &p); // force showing final progress report
+  return 0;
+}
+
+//reads the next piece of the target into the ring
+static void refresh_put(struct refresh_ring * r, off_t off, size_t len,
+			size_t blocks)
+{
+  struct refresh_piece * p = r->piece + r->head % REFRESH_DEPTH;
+  ssize_t got;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->head - r->tail == REFRESH_DEPTH)
+    pthread_cond_wait(&r->cond, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+
+  p->off = off; p->len = len; p->blocks = blocks; p->valid = 0; p->err = 0;
+  while (p->valid < len) {
+    got = pread(r->fd, p->buf + p->valid, len - p->valid, off + p->valid);
+    if (got < 0) { p->err = errno; break; }
+    if (!got) break; // target ends here; the rest differs
+    p->valid += got;
+  }
+
+  pthread_mutex_lock(&r->lock);
+  r->head++;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+//walks the index, reading the target ahead of the comparison
+static void * refresh_reader(void * arg)
+{
+  struct refresh_ring * r = arg;
+  size_t bs = r->ctx->blocklen;
+  struct v1_extent e = {0};
+  uint64_t next = 0;	// block after the last extent
+  int ret;
+
+  do {
+    ret = map_v1_readcell(r->map, &e);
+    if (r->nuke)
+      while (next < e.start) {
+	uint64_t n = e.start - next;
+	if (n > r->per) n = r->per;
+	refresh_put(r, next * bs, n * bs, 0);
+	next += n;
+      }
+    if (e.length) {
+      uint64_t pos = e.start, left = e.length;
+      while (left) {
+	uint64_t n = (left < r->per) ? left : r->per;
+	refresh_put(r, pos * bs, n * bs, n);
+	pos += n; left -= n;
+      }
+      next = e.start + e.length;
+    } else if (e.num) {
+      refresh_put(r, e.start * bs, bs * e.num / e.denom, 1);
+      next = e.start + 1;
+    }
+  } while (!(ret<0));
+
+  pthread_mutex_lock(&r->lock);
+  r->done = 1;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+//return: nonzero if block B of piece C differs from WANT
+static inline int refresh_differs(struct refresh_piece * c, const char * want,
+				  size_t b, size_t bs)
+{
+  size_t at = b * bs, n = (c->len - at < bs) ? c->len - at : bs;
+  return (at + n > c->valid) || memcmp(c->buf + at, want + at, n);
+}
+
+static int do_refresh(struct imaging_context * ctx, int nuke,
+		      FILE * map, FILE * image, FILE * target)
+{
+  struct refresh_ring r = { .ctx = ctx, .map = map, .nuke = nuke,
+			    .fd = fileno(target),
+			    .lock = PTHREAD_MUTEX_INITIALIZER,
+			    .cond = PTHREAD_COND_INITIALIZER };
+  struct progress p = {0};
+  size_t bs = ctx->blocklen;
+  uint64_t written = 0, compared = 0;
+  char * img, * zero;
+  pthread_t reader;
+  unsigned int i;
+
+  r.per = REFRESH_IO / bs; if (!r.per) r.per = 1;
+  for (i = 0; i < REFRESH_DEPTH; i++)
+    if (!(r.piece[i].buf = malloc(r.per * bs)))
+      fatal("failed to allocate refresh buffer");
+  img = malloc(r.per * bs);
+  zero = calloc(r.per, bs);
+  if (!img || !zero) fatal("failed to allocate refresh buffer");
+
+  posix_fadvise(fileno(image), 0, 0, POSIX_FADV_SEQUENTIAL);
+  if ((errno = pthread_create(&reader, NULL, refresh_reader, &r)))
+    fatal("failed to start target reader");
+
+  for (;;) {
+    struct refresh_piece * c;
+    char * want;
+    size_t b, end;
+
+    pthread_mutex_lock(&r.lock);
+    while ((r.head == r.tail) && !r.done)
+      pthread_cond_wait(&r.cond, &r.lock);
+    if (r.head == r.tail) { pthread_mutex_unlock(&r.lock); break; }
+    pthread_mutex_unlock(&r.lock);
+    c = r.piece + r.tail % REFRESH_DEPTH;
+    if (c->err) { errno = c->err; fatal("failed to read target"); }
+
+    if (c->blocks) {
+      if (fread(img, bs, c->blocks, image) != c->blocks)
+	fatal("failed to read block from image stream");
+      want = img;
+    } else
+      want = zero;
+
+    // write each run of blocks that differ
+    for (b = 0; b * bs < c->len; b = end) {
+      size_t at, n;
+      while ((b * bs < c->len) && !refresh_differs(c, want, b, bs)) b++;
+      for (end = b; (end * bs < c->len) && refresh_differs(c, want, end, bs);
+	   end++);
+      if (end == b) break;
+      at = b * bs;
+      n = ((end * bs < c->len) ? end * bs : c->len) - at;
+      if (pwrite(r.fd, want + at, n, c->off + at) != n)
+	fatal("failed to write block");
+      written += end - b;
+    }
+    compared += (c->len + bs - 1) / bs;
+    io_throttle(c->blocks * bs);
+
+    ctx->logpos += c->blocks;
+    ctx->phypos = (c->off + c->len + bs - 1) / bs;
+    ctx->diskcnt += (c->len + bs - 1) / bs;
+    if (ctx->wb) writeback_advance(ctx->wb, target, c->off + c->len);
+    { unsigned int log_frac = ctx->logpos * 1000 / ctx->blockcount;
+      unsigned int phy_frac = ctx->phypos * 1000 / ctx->blockrange;
+      p.log_pct = log_frac / 10; p.log_pct_f = log_frac % 10;
+      p.phy_pct = phy_frac / 10; p.phy_pct_f = phy_frac % 10;
+      p.log_baton = ctx->logpos >> 8; p.phy_baton = ctx->diskcnt >> 8;
+      show_progress(stderr, &p); }
+
+    pthread_mutex_lock(&r.lock);
+    r.tail++;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.lock);
+  }
+  pthread_join(reader, NULL);
+  if (ctx->wb) writeback_finish(ctx->wb, target);
+  fprintf(stderr,"\nrefresh: %llu of %llu blocks differed and were written\n",
+	  (unsigned long long) written, (unsigned long long) compared);
+
+  for (i = 0; i < REFRESH_DEPTH; i++) free(r.piece[i].buf);
+  free(img); free(zero);
+  return 0;
+}
+
+//copies what holds data in raw image IMAGE to the same place in TARGET
+// (and zero to all the rest of TARGET, if NUKE)
+static int do_raw_import(struct imaging_context * ctx, int nuke,
+			 FILE * image, FILE * target)
+{
+  struct progress p = {0};
+  struct stat st;
+  size_t bs = ctx->blocklen;
+  int fd = fileno(image);
+  off_t pos = 0, data, hole, end, copied = 0, written = 0;
+  char * buf = malloc(RAW_IO), * zero = calloc(1, RAW_IO);
+
+  void put(off_t off, const char * b, size_t len) { //write and report
+    if ((ftello(target) != off) && fseeko(target, off, SEEK_SET))
+      fatal("failed to seek in target");
+    if (fwrite(b, len, 1, target) != 1)
+      fatal("failed to write block");
+    written += len;
+    io_throttle(len);
+    if (ctx->wb) writeback_advance(ctx->wb, target, off + len);
+
+    ctx->logpos = copied / bs;
+    ctx->phypos = (off + len) / bs;
+    ctx->diskcnt = written / bs;
+    { unsigned int log_frac = ctx->logpos * 1000 / ctx->blockcount;
+      unsigned int phy_frac = ctx->phypos * 1000 / ctx->blockrange;
+      p.log_pct = log_frac / 10; p.log_pct_f = log_frac % 10;
+      p.phy_pct = phy_frac / 10; p.phy_pct_f = phy_frac % 10;
+      p.log_baton = ctx->logpos >> 8; p.phy_baton = ctx->diskcnt >> 8;
+      show_progress(stderr, &p); }
+  }
+
+  void fill(off_t from, off_t to) { //write zero to FROM..TO
+    while (from < to) {
+      size_t len = (to - from < RAW_IO) ? to - from : RAW_IO;
+      put(from, zero, len);
+      from += len;
+    }
+  }
+
+  if (!buf || !zero) fatal("allocate raw import buffers");
+  if (fstat(fd, &st)) fatal("failed to stat raw image");
+  end = st.st_size;
+
+  while (pos < end) {
+    // a filesystem without holes reports all of the file as data
+    if ((data = lseek(fd, pos, SEEK_DATA)) < 0) {
+      if (errno != ENXIO) fatal("failed to find data in raw image");
+      data = end; // nothing but a hole remains
+    }
+    if (data < end) {
+      if ((hole = lseek(fd, data, SEEK_HOLE)) < 0)
+	fatal("failed to find hole in raw image");
+    } else hole = end;
+    if (nuke) fill(pos, data);
+
+    for (pos = data; pos < hole; ) {
+      size_t len = (hole - pos < RAW_IO) ? hole - pos : RAW_IO;
+      ssize_t got = pread(fd, buf, len, pos);
+      if (got <= 0) fatal("failed to read raw image");
+      copied += got;
+      put(pos, buf, got);
+      pos += got;
+    }
+    pos = hole;
+  }
+  if (nuke) fill(pos, ctx->blockrange * bs);
+
+  if (ctx->wb) writeback_finish(ctx->wb, target);
   show_progress(stderr, &p); // force showing final progress report
+  free(buf); free(zero);
+  return 0;
+}
+
+//adds blocks PHYPOS+LENGTH (at LOGPOS in the stream) to L
+static void rescue_add(struct rescue_list * l, uint64_t phypos,
+		       uint64_t logpos, uint64_t length,
+		       unsigned long int num, unsigned long int denom)
+{
+  struct rescue_range * r = l->count ? l->r + l->count - 1 : NULL;
+
+  l->blocks += length;
+  if (r && !denom && !r->denom && (r->phypos + r->length == phypos)
+      && (r->logpos + r->length == logpos))
+    { r->length += length; return; }
+  if (l->count == l->alloc) {
+    l->alloc = l->alloc ? l->alloc * 2 : 64;
+    l->r = realloc(l->r, l->alloc * sizeof(struct rescue_range));
+    if (!l->r) fatal("failed to allocate bad block list");
+  }
+  r = l->r + l->count++;
+  r->phypos = phypos; r->logpos = logpos; r->length = length;
+  r->num = num; r->denom = denom;
+}
+
+//writes N blocks of zero to IMAGE, using BUF (PER blocks long)
+static void rescue_zero(struct imaging_context * ctx, FILE * image,
+			void * buf, size_t per, uint64_t n)
+{
+  memset(buf, 0, per * ctx->blocklen);
+  while (n) {
+    size_t k = (n < per) ? n : per;
+    if (fwrite(buf, ctx->blocklen, k, image) != k)
+      fatal("failed to write zero blocks");
+    n -= k;
+  }
+}
+
+//copies the blocks in MAP, skipping ahead over read errors
+// stretches skipped are zero in the image and are added to BAD
+static void rescue_first_pass(struct imaging_context * ctx, FILE * map,
+			      int fd, FILE * image, struct rescue_list * bad)
+{
+  size_t bs = ctx->blocklen, per = RESCUE_IO / bs;
+  uint64_t skip = 1, maxskip = ctx->blockrange / RESCUE_SKIP_DIV;
+  struct v1_extent e;
+  char * buf;
+  int ret;
+
+  if (!per) per = 1;
+  if (maxskip < RESCUE_SKIP_MIN) maxskip = RESCUE_SKIP_MIN;
+  buf = malloc(per * bs);
+  if (!buf) fatal("failed to allocate rescue buffer");
+
+  while (!(ret = map_v1_readcell(map, &e))) {
+    uint64_t pos = e.start, left = e.length;
+    if (!e.length) {
+      // partial block, padded with zero in the image
+      size_t len = bs * e.num / e.denom;
+      memset(buf, 0, bs);
+      if (pread(fd, buf, len, pos * bs) != len) {
+	memset(buf, 0, bs);
+	rescue_add(bad, pos, ctx->logpos, 1, e.num, e.denom);
+      }
+      if (fwrite(buf, bs, 1, image) != 1)
+	fatal("failed to write padded block to image stream");
+      ctx->logpos++; ctx->diskcnt++;
+      continue;
+    }
+    while (left) {
+      size_t n = (left < per) ? left : per;
+      ssize_t got = pread(fd, buf, n * bs, pos * bs);
+      size_t good = (got > 0) ? got / bs : 0;
+      io_throttle(n * bs);
+      if (good) {
+	if (fwrite(buf, bs, good, image) != good)
+	  fatal("failed to write block");
+	pos += good; left -= good;
+	ctx->logpos += good; ctx->diskcnt += good;
+      }
+      if (good == n) { skip = 1; continue; }
+      // read error at POS: zero a stretch and skip it, for now
+      n = (left < skip) ? left : skip;
+      rescue_zero(ctx, image, buf, per, n);
+      rescue_add(bad, pos, ctx->logpos, n, 0, 0);
+      pos += n; left -= n; ctx->logpos += n;
+      if (skip < maxskip) skip *= 2;
+    }
+  }
+  if (ret != -1) fatal("failed to read block list");
+  free(buf);
+}
+
+//reads LEN bytes at OFF into S->buf, a sector at a time if need be
+//return: number of sectors that could not be read (they are zero in buf)
+static unsigned int rescue_read(struct rescue_source * s, off_t off,
+				size_t len)
+{
+  unsigned int lost = 0;
+  size_t i;
+
+  for (;;) {
+    int fd = ((s->dfd >= 0) && !(off % s->ssize) && !(len % s->ssize))
+      ? s->dfd : s->fd;
+    ssize_t got = pread(fd, s->buf, len, off);
+    if (got == len) return 0;
+    if ((got < 0) && (errno == EINVAL) && (fd == s->dfd)) {
+      // the device will not do O_DIRECT at this size; go without
+      close(s->dfd); s->dfd = -1;
+      continue;
+    }
+    break;
+  }
+  for (i = 0; i < len; i += s->ssize) {
+    size_t n = (len - i < s->ssize) ? len - i : s->ssize;
+    int fd = ((s->dfd >= 0) && (n == s->ssize)) ? s->dfd : s->fd;
+    if (pread(fd, (char *) s->buf + i, n, off + i) != n) {
+      memset((char *) s->buf + i, 0, n);
+      lost++;
+    }
+  }
+  return lost;
+}
+
+//goes back over the blocks in BAD, writing what can be read into IMAGE
+// BAD is left holding the blocks that still could not be read in full
+static void rescue_backfill(struct imaging_context * ctx,
+			    struct rescue_source * s, FILE * image,
+			    struct rescue_list * bad)
+{
+  struct rescue_list still = {0};
+  size_t bs = ctx->blocklen;
+  size_t i;
+  uint64_t j;
+
+  s->lost = 0;
+  for (i = 0; i < bad->count; i++) {
+    struct rescue_range * r = bad->r + i;
+    size_t len = r->denom ? bs * r->num / r->denom : bs;
+    for (j = 0; j < r->length; j++) {
+      unsigned int lost = rescue_read(s, (r->phypos + j) * bs, len);
+      if (lost * s->ssize < len) {
+	// something was read; the header is one block before the stream
+	memset((char *) s->buf + len, 0, bs - len);
+	if (fseeko(image, (r->logpos + j + 1) * bs, SEEK_SET)
+	    || (fwrite(s->buf, bs, 1, image) != 1))
+	  fatal("failed to write recovered block");
+      }
+      if (lost) {
+	rescue_add(&still, r->phypos + j, r->logpos + j, 1, r->num, r->denom);
+	s->lost += lost;
+      }
+    }
+  }
+  free(bad->r);
+  *bad = still;
+}
+
+//writes the bad block map for the blocks in BAD
+static void rescue_write_map(struct imaging_context * ctx, const char * path,
+			     struct rescue_list * bad, struct rescue_source * s)
+{
+  FILE * out = fopen(path, "w");
+  size_t i;
+
+  if (!out) fatal("failed to open bad block map");
+  fprintf(out,"%s\n",MAP_V1_SIGNATURE);
+  fprintf(out,"UUID:\t"); print_uuid(out,&ctx->uuid); fprintf(out,"\n");
+  fprintf(out,"Type:\tbadblocks\n");
+  fprintf(out,"# blocks not read in full; unread parts are zero in the image\n");
+  if (s->lost)
+    fprintf(out,"# %llu sectors of %zu bytes unreadable\n",
+	    (unsigned long long) s->lost, s->ssize);
+  fprintf(out,"BlockSize:\t%zu\n",ctx->blocklen);
+  fprintf(out,"BlockCount:\t%llu\n",(unsigned long long) bad->blocks);
+  fprintf(out,"BlockRange:\t%llu\n",(unsigned long long) ctx->blockrange);
+  fprintf(out,"%s\n",MAP_V1_STARTBLOCKS);
+  for (i = 0; i < bad->count; i++)
+    if (bad->r[i].denom)
+      fprintf(out,"%llu+.%lu/%lu\n",(unsigned long long) bad->r[i].phypos,
+	      bad->r[i].num,bad->r[i].denom);
+    else
+      fprintf(out,"%llu+%llu\n",(unsigned long long) bad->r[i].phypos,
+	      (unsigned long long) bad->r[i].length);
+  fprintf(out,"%s\n",MAP_V1_ENDBLOCKS);
+  if (fclose(out)) fatal("failed to write bad block map");
+}
+
+static int do_rescue(struct keylist * args,
+		     struct imaging_context * ctx,
+		     FILE * map, FILE * source, FILE * image)
+{
+  struct rescue_list bad = {0};
+  struct rescue_source s = { .fd = fileno(source), .dfd = -1, .ssize = 512 };
+  struct stat st;
+  long retries = RESCUE_RETRIES;
+  char * badmap = keylist_get(args,"badmap");
+  char * path = NULL;
+  int pass, seekable;
+
+  if (keylist_get(args,"retries"))
+    retries = strtol(keylist_get(args,"retries"),NULL,0);
+  seekable = !fstat(fileno(image),&st)
+    && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+
+  rescue_first_pass(ctx, map, s.fd, image, &bad);
+  fprintf(stderr,"rescue pass 1: %llu blocks skipped\n",
+	  (unsigned long long) bad.blocks);
+
+  if (bad.count && !seekable) {
+    fprintf(stderr,"image stream is not seekable;"
+	    " skipped blocks cannot be filled in\n");
+    retries = 0;
+  }
+  if (bad.count && retries) {
+    unsigned int ssize = 0;
+    if (!fstat(s.fd,&st) && S_ISBLK(st.st_mode)
+	&& !ioctl(s.fd, BLKSSZGET, &ssize) && ssize)
+      s.ssize = ssize;
+    if (posix_memalign(&s.buf, 4096, ctx->blocklen))
+      fatal("failed to allocate rescue buffer");
+    s.dfd = open(keylist_get(args,"src"), O_RDONLY | O_DIRECT);
+  }
+  for (pass = 2; bad.count && (pass < retries + 2); pass++) {
+    rescue_backfill(ctx, &s, image, &bad);
+    fprintf(stderr,"rescue pass %d: %llu blocks still unreadable\n",
+	    pass, (unsigned long long) bad.blocks);
+  }
+  if (fflush(image) || ferror(image)) fatal("failed to write image");
+
+  if (!badmap) {
+    if (asprintf(&path,"%s.bad",keylist_get(args,"idx")) < 0)
+      fatal("failed to allocate");
+    badmap = path;
+  }
+  if (bad.count) {
+    rescue_write_map(ctx, badmap, &bad, &s);
+    fprintf(stderr,"%llu unreadable blocks listed in %s\n",
+	    (unsigned long long) bad.blocks, badmap);
+  } else
+    unlink(badmap); // none left over from an earlier attempt
+
+  if (s.dfd >= 0) close(s.dfd);
+  free(s.buf);
+  free(bad.r);
+  free(path);
   return 0;
 }
 
@@ -257,6 +919,8 @@ static int do_export(struct keylist * args,
 		     struct imaging_context * ctx,
 		     FILE * map, FILE * source, FILE * image)
 {
+  enum sparsecopy_mode mode = MODE_EXPORT;
+
   { //verify files
     struct stat stbuf_src = {0}, stbuf_tgt = {0};
 
@@ -286,20 +950,47 @@ static int do_export(struct keylist * args,
 	exit(1);
       }
     }
+
+    if (keylist_get(args,"raw") && !S_ISREG(stbuf_tgt.st_mode)) {
+      fprintf(stderr, "raw image must be a regular file\n");
+      exit(1);
+    }
+  }
+
+  if (keylist_get(args,"raw")) {
+    if (keylist_get(args,"rescue")) {
+      fprintf(stderr, "rescue cannot write a raw image\n");
+      exit(1);
+    }
+    mode = MODE_EXPORT_RAW;
   }
 
   { //prep image stream header
     struct image_header_v1 * h = ctx->block;
-    memcpy(h->sig,"BLKCLONEDATA\r\n\004\000",16);
+    memcpy(h->sig,IMAGE_V1_SIGNATURE,16);
     memcpy(h->uuid,ctx->uuid,sizeof(uuid_t));
     h->version = 1;
   }
 
   //write image stream header
-  fwrite(ctx->block, ctx->blocklen, 1, image);
+  if (mode == MODE_EXPORT)
+    fwrite(ctx->block, ctx->blocklen, 1, image);
   // the header does not count as a block in the image stream
 
-  return do_copy_internal(ctx, MODE_EXPORT, map, source, image);
+  if (keylist_get(args,"rescue"))
+    return do_rescue(args, ctx, map, source, image);
+  if (ctx->io.direct) {
+    FILE * direct = io_direct_open(keylist_get(args,"src"),
+				   ctx->io.iosize * ctx->io.depth, 4096);
+    if (direct) {
+      int ret = do_copy_internal(ctx, mode, map, direct, image);
+      fclose(direct);
+      return ret;
+    }
+    fprintf(stderr, "tuning: O_DIRECT refused; reading buffered\n");
+  }
+  ctx->ra = ctx->io.iosize * ctx->io.depth;
+  return do_copy_internal(ctx, mode, map, source, image);
 }
 
 static int do_import(struct keylist * args,
@@ -335,8 +1026,30 @@ static int do_import(struct keylist * args,
 	exit(1);
       }
     }
+
+    if (keylist_get(args,"raw") && S_ISREG(stbuf_src.st_mode)
+	&& (stbuf_src.st_size > ctx->blockrange * ctx->blocklen)
+	&& !keylist_get(args,"force")) {
+      fprintf(stderr, "raw image is larger than the disk in the index\n");
+      exit(1);
+    }
+  }
+
+  { //set up writeback pacing, unless the target cannot do it
+    static struct writeback wb;
+    long budget = WRITEBACK_BUDGET;
+    if (keylist_get(args,"dirty"))
+      budget = strtol(keylist_get(args,"dirty"),NULL,0);
+    wb.fd = fileno(target);
+    wb.budget = (off_t) budget << 20;
+    wb.step = wb.budget / WRITEBACK_STEPS;
+    if ((budget > 0) && !sync_file_range(wb.fd, 0, 0, 0))
+      ctx->wb = &wb;
   }
 
+  if (keylist_get(args,"raw"))
+    return do_raw_import(ctx, !!keylist_get(args,"nuke"), image, target);
+
   //read image stream header
   fread(ctx->block, ctx->blocklen, 1, image);
   // the header does not count as a block in the image stream
@@ -344,7 +1057,7 @@ static int do_import(struct keylist * args,
 #ifndef BYPASS_UUID_CHECK /* to enable /dev/zero->/dev/null tests */
   { //verify image stream header
     struct image_header_v1 * h = ctx->block;
-    if (memcmp(h->sig,"BLKCLONEDATA\r\n\004\000",16)) {
+    if (memcmp(h->sig,IMAGE_V1_SIGNATURE,16)) {
       fprintf(stderr, "Image stream header missing.\n");
       exit(1);
     }
@@ -355,6 +1068,8 @@ static int do_import(struct keylist * args,
   }
 #endif
 
+  if (keylist_get(args,"refresh"))
+    return do_refresh(ctx, !!keylist_get(args,"nuke"), map, image, target);
   if (keylist_get(args,"nuke"))
     return do_copy_internal(ctx, MODE_NUKE_AND_IMPORT, map, image, target);
   else
@@ -372,7 +1087,23 @@ static char helptext[] =
   "\tsrc   -- specify source from which to read\n"
   "\ttgt   -- specfiy target to which to write\n"
   "\tnuke  -- (import mode only) write zero to unused blocks\n"
-  "\tforce -- do it anyway; even if it looks wrong\n";
+  "\traw   -- the image is a sparse file laid out as the disk, with holes\n"
+  "\t          for unused blocks (no header); import copies what holds data\n"
+  "\tforce -- do it anyway; even if it looks wrong\n"
+  "\trefresh -- (import mode only) read the target and write only the\n"
+  "\t          blocks that differ from the image\n"
+  "\tdirty -- (import mode only) MiB of target to leave dirty in cache\n"
+  "\t          at most (default 64; 0 to leave writeback to the kernel)\n"
+  "\trescue -- (export mode only) go on past read errors, as ddrescue\n"
+  "\t  retries -- passes over unread blocks after the first (default 2)\n"
+  "\t  badmap  -- where to list unreadable blocks (default <index>.bad)\n"
+  "\tThe device is probed and, the first time a model is seen, a few of\n"
+  "\t its blocks are read to choose how to transfer; these override that:\n"
+  "\t  iosize -- KiB in each request\n"
+  "\t  depth  -- requests in flight\n"
+  "\t  direct -- (export mode only) 1 to read with O_DIRECT, 0 not to\n"
+  "\t  retune -- measure again rather than use the cached profile\n"
+  "\t  tune=0 -- keep the stdio defaults\n";
 
 DECLARE_MULTICALL_TABLE(main);
 //int main(int argc, char ** argv)
@@ -438,6 +1169,21 @@ SUBCALL_MAIN(main, sparsecopy, usagetext, helptext,
 
   for (mode_ptr=mode_list; mode_ptr->name; mode_ptr++)
     if (keylist_get(args,mode_ptr->name)) break;
+
+  if (!keylist_get(args,"tune") || strtol(keylist_get(args,"tune"),NULL,0)) {
+    //choose transfer size for the device; set buffers before any I/O
+    FILE * dev = (mode_ptr->func == do_export) ? source : target;
+    struct io_device d;
+
+    io_probe(fileno(dev), &d);
+    io_tune(fileno(dev), &d, map, ctx.blocklen, args, &ctx.io);
+    if (mode_ptr->func != do_export) ctx.io.direct = 0;
+    setvbuf(dev, NULL, _IOFBF, ctx.io.iosize);
+    if (d.blockdev)
+      fprintf(stderr, "tuning: %s: io %zu KiB x %u, %s (%s)\n", d.model,
+	      ctx.io.iosize >> 10, ctx.io.depth,
+	      ctx.io.direct ? "direct" : "buffered", ctx.io.how);
+  }
   if (mode_ptr->name)
     ret = (mode_ptr->func)(args, &ctx, map, source, target);
 
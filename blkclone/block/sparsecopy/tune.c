@@ -0,0 +1,465 @@
+/* Choosing transfer size, queue depth and O_DIRECT for a device
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  USB sticks, SATA disks and NVMe drives want very different requests.
+ *   The probe reads what the kernel knows (sector sizes, BLKIOOPT, and
+ *   from sysfs the largest request, queue length and rotational flag);
+ *   calibration then times O_DIRECT reads of the first blocks in the map
+ *   at several request sizes, and the best of them buffered, and keeps
+ *   the fastest.
+ *  A request larger than the device's largest is split by the block layer
+ *   into requests that are all in flight at once, so a request size is
+ *   also a queue depth: DEPTH requests of IOSIZE each.  Buffered reads get
+ *   the same depth by readahead of IOSIZE * DEPTH bytes.
+ *  Calibrated profiles are cached by device model in
+ *   $XDG_CACHE_HOME/blkclone/devices (or ~/.cache/...), one per line:
+ *	<model> TAB <iosize> TAB <depth> TAB <direct>
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "keylist.h"
+#include "block/map-parse-v1.h"
+#include "block/tune.h"
+
+#define TUNE_SLICE	(8 << 20)	/* bytes read for each trial */
+#define TUNE_DEFAULT_IO	(1 << 20)	/* request size without calibration */
+#define TUNE_DIRECT_MARGIN 0.9	/* O_DIRECT kept unless this much slower */
+
+static const size_t tune_sizes[] = { 128 << 10, 512 << 10, 2 << 20, 8 << 20 };
+#define TUNE_NSIZES	(sizeof(tune_sizes) / sizeof(tune_sizes[0]))
+
+struct tune_range {
+  off_t off;
+  off_t len;
+};
+
+//reads a number from sysfs file DIR/NAME; returns 0 if there is none
+static unsigned int sysfs_uint(const char * dir, const char * name)
+{
+  unsigned int v = 0;
+  char * path;
+  FILE * f;
+
+  if (asprintf(&path, "%s/%s", dir, name) < 0) return 0;
+  if ((f = fopen(path, "r"))) {
+    if (fscanf(f, "%u", &v) != 1) v = 0;
+    fclose(f);
+  }
+  free(path);
+  return v;
+}
+
+//appends the trimmed contents of sysfs file DIR/NAME to BUF
+static void sysfs_append(char * buf, size_t len, const char * dir,
+			 const char * name)
+{
+  char line[64] = "", * path, * p;
+  FILE * f;
+
+  if (asprintf(&path, "%s/%s", dir, name) < 0) return;
+  f = fopen(path, "r");
+  free(path);
+  if (!f) return;
+  if (fgets(line, sizeof(line), f)) {
+    for (p = line + strlen(line); (p > line) && (p[-1] <= ' '); p--) ;
+    *p = '\0';
+    for (p = line; *p == ' '; p++) ;
+    if (*p) {
+      if (*buf) strncat(buf, " ", len - strlen(buf) - 1);
+      strncat(buf, p, len - strlen(buf) - 1);
+    }
+  }
+  fclose(f);
+}
+
+void io_probe(int fd, struct io_device * d)
+{
+  struct stat st;
+  char sys[64], * dev, * part;
+  int lss = 0;
+
+  memset(d, 0, sizeof(struct io_device));
+  d->lss = d->pbs = 512;
+  if (fstat(fd, &st) || !S_ISBLK(st.st_mode)) return;
+  d->blockdev = 1;
+
+  if (!ioctl(fd, BLKSSZGET, &lss)) d->lss = lss;
+  ioctl(fd, BLKPBSZGET, &d->pbs);
+  ioctl(fd, BLKIOOPT, &d->io_opt);
+  if (d->pbs < d->lss) d->pbs = d->lss;
+
+  // the queue and model belong to the whole disk, not a partition
+  snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u",
+	   major(st.st_rdev), minor(st.st_rdev));
+  if (!(dev = realpath(sys, NULL))) return;
+  if (asprintf(&part, "%s/partition", dev) >= 0) {
+    if (!access(part, F_OK)) dirname(dev);
+    free(part);
+  }
+  {
+    char q[strlen(dev) + 8], * name;
+    snprintf(q, sizeof(q), "%s/queue", dev);
+    d->rotational = sysfs_uint(q, "rotational");
+    d->max_kb = sysfs_uint(q, "max_sectors_kb");
+    d->nr_requests = sysfs_uint(q, "nr_requests");
+
+    snprintf(q, sizeof(q), "%s/device", dev);
+    sysfs_append(d->model, sizeof(d->model), q, "vendor");
+    sysfs_append(d->model, sizeof(d->model), q, "model");
+    if (!*d->model) {
+      // no model (loop, virtio, ...); use the driver's name for the disk
+      name = strrchr(dev, '/') ? strrchr(dev, '/') + 1 : dev;
+      snprintf(d->model, sizeof(d->model), "%.*s",
+	       (int) strcspn(name, "0123456789"), name);
+    }
+    for (name = d->model; *name; name++)
+      if (*name == '\t') *name = ' ';
+  }
+  free(dev);
+}
+
+//the profile to use when there is nothing better
+static void tune_defaults(const struct io_device * d, size_t blocklen,
+			  struct io_profile * p)
+{
+  size_t max = d->max_kb ? (size_t) d->max_kb << 10 : TUNE_DEFAULT_IO;
+
+  p->iosize = (d->io_opt > TUNE_DEFAULT_IO) ? d->io_opt : TUNE_DEFAULT_IO;
+  if (p->iosize > max) p->iosize = max;
+  if (p->iosize < blocklen) p->iosize = blocklen;
+  // a spinning disk only seeks if given more; a flash queue wants more
+  if (d->rotational) p->depth = 1;
+  else if (d->nr_requests >= 256) p->depth = 8;
+  else if (d->nr_requests >= 8) p->depth = 4;
+  else p->depth = 1;
+  p->direct = 0;
+  p->how = "defaults";
+}
+
+//splits request size SIZE into a profile for D
+static void tune_split(const struct io_device * d, size_t size,
+		       struct io_profile * p)
+{
+  size_t max = d->max_kb ? (size_t) d->max_kb << 10 : size;
+
+  p->iosize = (size < max) ? size : max;
+  p->depth = size / p->iosize;
+  if (!p->depth) p->depth = 1;
+}
+
+static char * tune_cache_path(void)
+{
+  char * base = getenv("XDG_CACHE_HOME"), * path = NULL;
+
+  if (base && *base) {
+    if (asprintf(&path, "%s/blkclone/devices", base) < 0) return NULL;
+  } else if ((base = getenv("HOME")) && *base) {
+    if (asprintf(&path, "%s/.cache/blkclone/devices", base) < 0) return NULL;
+  }
+  return path;
+}
+
+//looks up MODEL in the profile cache
+//return: TRUE if found (P filled out)
+static int tune_cache_get(const char * model, struct io_profile * p)
+{
+  char * path = tune_cache_path(), * line = NULL;
+  size_t linelen = 0, n = strlen(model);
+  int found = 0;
+  FILE * f;
+
+  if (!path) return 0;
+  f = fopen(path, "r");
+  free(path);
+  if (!f) return 0;
+  while (!found && (getline(&line, &linelen, f) != -1)) {
+    unsigned long io; unsigned int depth; int direct;
+    if (strncmp(line, model, n) || (line[n] != '\t')) continue;
+    if ((sscanf(line + n + 1, "%lu\t%u\t%d", &io, &depth, &direct) == 3)
+	&& io && depth) {
+      p->iosize = io; p->depth = depth; p->direct = direct;
+      p->how = "cached";
+      found = 1;
+    }
+  }
+  free(line);
+  fclose(f);
+  return found;
+}
+
+//saves P in the profile cache for MODEL, replacing any older profile
+static void tune_cache_put(const char * model, const struct io_profile * p)
+{
+  char * path = tune_cache_path(), * tmp = NULL, * line = NULL, * dir;
+  size_t linelen = 0, n = strlen(model);
+  FILE * in, * out;
+
+  if (!path) return;
+  // make the directories, as far as needed
+  dir = strdup(path);
+  if (dir) {
+    char * s;
+    for (s = strchr(dir + 1, '/'); s; s = strchr(s + 1, '/')) {
+      *s = '\0'; mkdir(dir, 0777); *s = '/';
+    }
+    free(dir);
+  }
+  if ((asprintf(&tmp, "%s.%d", path, getpid()) < 0)
+      || !(out = fopen(tmp, "w"))) {
+    free(path); free(tmp);
+    return;
+  }
+  if ((in = fopen(path, "r"))) {
+    while (getline(&line, &linelen, in) != -1)
+      if (strncmp(line, model, n) || (line[n] != '\t'))
+	fputs(line, out);
+    free(line);
+    fclose(in);
+  }
+  fprintf(out, "%s\t%zu\t%u\t%d\n", model, p->iosize, p->depth, p->direct);
+  if (!fclose(out)) rename(tmp, path);
+  else unlink(tmp);
+  free(path); free(tmp);
+}
+
+//collects up to WANT bytes of whole-block extents from the start of MAP
+//return: number of ranges in R (at most MAX); MAP is left where it was
+// A map that cannot be rewound (a pipe) is not read at all, and gives 0.
+static size_t tune_ranges(FILE * map, size_t blocklen, off_t want,
+			  struct tune_range * r, size_t max)
+{
+  off_t pos = ftello(map), have = 0;
+  struct v1_extent e;
+  size_t n = 0;
+
+  if ((pos < 0) || fseeko(map, pos, SEEK_SET)) return 0;
+  while ((have < want) && (n < max) && !map_v1_readcell(map, &e)) {
+    if (!e.length) continue;
+    r[n].off = e.start * blocklen;
+    r[n].len = e.length * blocklen;
+    if (r[n].len > want - have) r[n].len = want - have;
+    have += r[n++].len;
+  }
+  if (fseeko(map, pos, SEEK_SET)) {
+    // (cannot happen after the check above) the copy would skip these
+    perror("failed to rewind block list after calibration");
+    exit(1);
+  }
+  return n;
+}
+
+//reads bytes SKIP to SKIP+TUNE_SLICE of ranges R in requests of SIZE
+//return: bytes per second, or 0 on failure
+static double tune_time(int fd, const struct tune_range * r, size_t n,
+			off_t skip, size_t size, unsigned int align,
+			void * buf)
+{
+  struct timespec t0, t1;
+  off_t left = TUNE_SLICE;
+  double secs;
+  size_t i;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; (i < n) && left; i++) {
+    off_t off = r[i].off, end = r[i].off + r[i].len;
+    if (skip >= r[i].len) { skip -= r[i].len; continue; }
+    off += skip; skip = 0;
+    while ((off < end) && left) {
+      off_t a = off & ~((off_t) align - 1);
+      size_t k = size;
+      ssize_t got;
+      if (k > left) k = (left + align - 1) & ~((off_t) align - 1);
+      got = pread(fd, buf, k, a);
+      if (got <= 0) return 0;
+      off = a + got; left -= (got < left) ? got : left;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  return (TUNE_SLICE - left) / ((secs > 1e-6) ? secs : 1e-6);
+}
+
+//times reads of the first blocks in MAP
+//return: TRUE if P was calibrated
+static int tune_calibrate(int fd, const struct io_device * d, FILE * map,
+			  size_t blocklen, struct io_profile * p)
+{
+  struct tune_range r[256];
+  double rate, best = 0, buffered;
+  size_t n, i, size = 0;
+  off_t total = 0;
+  char path[32];
+  void * buf;
+  int dfd;
+
+  n = tune_ranges(map, blocklen, (TUNE_NSIZES + 1) * (off_t) TUNE_SLICE,
+		  r, sizeof(r) / sizeof(r[0]));
+  for (i = 0; i < n; i++) total += r[i].len;
+  if (total < (TUNE_NSIZES + 1) * (off_t) TUNE_SLICE)
+    return 0; // too little to measure; a small image needs no tuning
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  if ((dfd = open(path, O_RDONLY | O_DIRECT)) < 0) return 0;
+  if (posix_memalign(&buf, 4096, tune_sizes[TUNE_NSIZES-1]))
+    { close(dfd); return 0; }
+
+  // each trial reads a different slice, so none is served from a cache
+  for (i = 0; i < TUNE_NSIZES; i++) {
+    if (tune_sizes[i] < blocklen) continue;
+    rate = tune_time(dfd, r, n, i * (off_t) TUNE_SLICE, tune_sizes[i],
+		     d->lss, buf);
+    if (rate > best) { best = rate; size = tune_sizes[i]; }
+  }
+  if (!size) { free(buf); close(dfd); return 0; }
+
+  for (i = 0; i < n; i++)
+    posix_fadvise(fd, r[i].off, r[i].len, POSIX_FADV_DONTNEED);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  buffered = tune_time(fd, r, n, TUNE_NSIZES * (off_t) TUNE_SLICE, size,
+		       d->lss, buf);
+  for (i = 0; i < n; i++)
+    posix_fadvise(fd, r[i].off, r[i].len, POSIX_FADV_DONTNEED);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+  free(buf); close(dfd);
+
+  tune_split(d, size, p);
+  // O_DIRECT also spares the page cache; keep it unless clearly slower
+  p->direct = (best >= buffered * TUNE_DIRECT_MARGIN);
+  p->how = "calibrated";
+  return 1;
+}
+
+void io_tune(int fd, const struct io_device * d, FILE * map, size_t blocklen,
+	     struct keylist * args, struct io_profile * p)
+{
+  char * v;
+
+  tune_defaults(d, blocklen, p);
+  if (d->blockdev) {
+    if (!keylist_get(args,"retune") && tune_cache_get(d->model, p))
+      ;
+    else if (tune_calibrate(fd, d, map, blocklen, p))
+      tune_cache_put(d->model, p);
+  }
+
+  // options given override all of the above
+  if ((v = keylist_get(args,"iosize")))
+    { p->iosize = strtoul(v, NULL, 0) << 10; p->how = "given"; }
+  if ((v = keylist_get(args,"depth")))
+    { p->depth = strtoul(v, NULL, 0); p->how = "given"; }
+  if ((v = keylist_get(args,"direct")))
+    { p->direct = !!strtol(v, NULL, 0); p->how = "given"; }
+  if (p->iosize < blocklen) p->iosize = blocklen;
+  if (p->iosize % d->lss) p->iosize -= p->iosize % d->lss;
+  if (!p->depth) p->depth = 1;
+}
+
+/* O_DIRECT stream: reads whole aligned requests into a bounce buffer */
+struct direct_stream {
+  int fd;
+  off_t pos;		// stream position
+  off_t bufoff;		// file offset of BUF
+  size_t buflen;	// bytes valid in BUF
+  size_t size;		// request size
+  unsigned int align;
+  char * buf;
+};
+
+static ssize_t direct_read(void * cookie, char * out, size_t n)
+{
+  struct direct_stream * s = cookie;
+  size_t done = 0;
+
+  while (done < n) {
+    size_t k;
+    if ((s->pos < s->bufoff) || (s->pos >= s->bufoff + (off_t) s->buflen)) {
+      off_t a = s->pos & ~((off_t) s->align - 1);
+      ssize_t got = pread(s->fd, s->buf, s->size, a);
+      if (got < 0) return done ? (ssize_t) done : -1;
+      s->bufoff = a; s->buflen = got;
+      if (s->pos >= a + got) break; // end of device
+    }
+    k = s->bufoff + s->buflen - s->pos;
+    if (k > n - done) k = n - done;
+    memcpy(out + done, s->buf + (s->pos - s->bufoff), k);
+    s->pos += k; done += k;
+  }
+  return done;
+}
+
+static int direct_seek(void * cookie, off64_t * off, int whence)
+{
+  struct direct_stream * s = cookie;
+
+  switch (whence) {
+  case SEEK_SET: s->pos = *off; break;
+  case SEEK_CUR: s->pos += *off; break;
+  default: errno = EINVAL; return -1;
+  }
+  *off = s->pos;
+  return 0;
+}
+
+static int direct_close(void * cookie)
+{
+  struct direct_stream * s = cookie;
+
+  close(s->fd);
+  free(s->buf);
+  free(s);
+  return 0;
+}
+
+FILE * io_direct_open(const char * path, size_t size, unsigned int align)
+{
+  cookie_io_functions_t io = { .read = direct_read, .seek = direct_seek,
+			       .close = direct_close };
+  struct direct_stream * s = calloc(1, sizeof(struct direct_stream));
+  FILE * f;
+
+  if (!s) return NULL;
+  s->size = size; s->align = align ? align : 512;
+  if (posix_memalign((void **) &s->buf, 4096, size)) { free(s); return NULL; }
+  if ((s->fd = open(path, O_RDONLY | O_DIRECT)) < 0) {
+    free(s->buf); free(s);
+    return NULL;
+  }
+  if (!(f = fopencookie(s, "r", io))) { direct_close(s); return NULL; }
+  // the bounce buffer is all the buffering wanted
+  setvbuf(f, NULL, _IONBF, 0);
+  return f;
+}
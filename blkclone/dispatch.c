@@ -25,7 +25,11 @@
 
 #define _GNU_SOURCE
 
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "multicall.h"
 
@@ -33,6 +37,58 @@ DECLARE_MULTICALL_TABLE(main);
 
 REGISTER_MULTICALL_TABLE(main);
 
+int multicall_run(char * name, int argc, char ** argv)
+{
+  LDTABLE_ITERATOR(MULTICALL_LDTABLE_NAME(main), i);
+
+  LDTABLE_FOREACH(MULTICALL_LDTABLE_NAME(main), i)
+    if (!strcmp(name,i->name)) return i->func(argc, argv);
+
+  return -1;
+}
+
+static inline void fatal(char * msg)
+{ perror(msg); exit (1); }
+
+void multicall_arg(struct multicall_argv * a, const char * fmt, ...)
+{
+  va_list ap;
+  int ret;
+
+  if (a->c >= (sizeof(a->v) / sizeof(a->v[0])) - 1) {
+    fprintf(stderr,"too many arguments for %s\n",a->v[0]);
+    exit(1);
+  }
+  va_start(ap, fmt);
+  ret = vasprintf(&a->v[a->c], fmt, ap);
+  va_end(ap);
+  if (ret < 0) fatal("failed to allocate argument");
+  a->v[++a->c] = NULL;
+}
+
+int multicall_run_argv(struct multicall_argv * a)
+{
+  int ret;
+
+  fflush(stdout); fflush(stderr);
+  ret = multicall_run(a->v[0], a->c, a->v);
+  while (a->c) free(a->v[--a->c]);
+  return ret;
+}
+
+pid_t multicall_fork_logged(const char * log, int append)
+{
+  pid_t pid;
+
+  fflush(stdout); fflush(stderr);
+  pid = fork();
+  if (pid) return pid;
+  if (!freopen(log, append ? "a" : "w", stdout))
+    fatal("failed to create log file");
+  dup2(fileno(stdout), STDERR_FILENO);
+  return 0;
+}
+
 int main(int argc, char ** argv)
 {
   LDTABLE_ITERATOR(MULTICALL_LDTABLE_NAME(main), i);
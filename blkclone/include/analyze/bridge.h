@@ -0,0 +1,43 @@
+#ifndef ANALYZE_BRIDGE_H
+#define ANALYZE_BRIDGE_H
+
+/* Block list gap bridging
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+
+struct bridge_stats {
+  unsigned long long int blocksize;	// BlockSize from the block list
+  unsigned long long int blockcount;	// BlockCount after bridging
+  unsigned long long int gaps;		// number of gaps bridged (seeks saved)
+  unsigned long long int blocks;	// number of free blocks added
+};
+
+/* copy a block list from IN to OUT, merging extents that are separated
+ *  by no more than THRESHOLD free blocks
+ *  IN must be positioned at the first header key, as written by an
+ *   analysis module; the BlockCount key is adjusted to match the output
+ *  returns 0 on success; -1 on failure
+ *  fills in STATS if it is non-NULL
+ */
+int map_bridge_gaps(FILE * in, FILE * out, unsigned long long int threshold,
+		    struct bridge_stats * stats);
+
+#endif
@@ -23,6 +23,8 @@
 
 #include "ldtable.h"
 
+struct extent_sink;
+
 #define DECLARE_ANALYSIS_MODULE(tag)		\
   MAKE_LDTABLE_ENTRY(analysis_modules, tag)
 
@@ -38,14 +40,42 @@ struct analysis_module {
   // performs analysis of the filesystem
   //  FS is a stdio handle open on the filesystem
   //  OUT is a stdio handle where the block list should be written
-  //  MNTPNT is a location where the filesystem has been mounted read-only
+  //  MNTPNT is a location where the filesystem is mounted (from mnt=)
   //   or NULL if the module does not set the NEED_MOUNTED_FS flag
   int (*analyze) (FILE * fs, FILE * out, char * mntpnt);
   /* flags */
   // if set, analysis of this filesystem type requires that it be mounted
   unsigned int need_mounted_fs:1;
+  // if set, auto-detection picks this module only when no other module
+  //  recognizes the filesystem (its signature can outlive it, as a swap
+  //  signature does when another filesystem is made over the partition)
+  unsigned int weak_signature:1;
+  /* optional */
+  // performs analysis, passing the block list to SINK as it is found
+  //  (see analyze/sink.h); modules without this are run through ANALYZE
+  //  with a stream that parses the text
+  int (*analyze_sink) (FILE * fs, struct extent_sink * sink, char * mntpnt);
 };
 
 DECLARE_LDTABLE(analysis_modules, struct analysis_module);
 
+// options given to the analyze command, for modules that accept any
+//  (may be NULL; look up values with keylist_get)
+struct keylist;
+extern struct keylist * analysis_args;
+
+/* find the module for the filesystem open on FS
+ *  TYPE names a module (case-insensitive), or is NULL for auto-detection
+ *  leaves FS rewound; returns NULL if no module fits
+ */
+struct analysis_module * analysis_find_module(FILE * fs, const char * type);
+
+/* run MOD on FS, passing the block list to SINK
+ *  MNTPNT is where FS is mounted; only passed on if MOD needs it
+ *  returns the module's result, or -error code if the text from a module
+ *   without ANALYZE_SINK could not be passed on
+ */
+int analysis_run_sink(struct analysis_module * mod, FILE * fs,
+		      char * mntpnt, struct extent_sink * sink);
+
 #endif
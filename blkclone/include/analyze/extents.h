@@ -0,0 +1,105 @@
+#ifndef ANALYZE_EXTENTS_H
+#define ANALYZE_EXTENTS_H
+
+/* In-memory extent lists for analysis modules
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  The block list header carries BlockCount ahead of the extents, so a
+ *   module that scans its allocation data only once must hold the extents
+ *   until the scan is complete.  These lists do that.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct extent_sink;
+
+struct extent {
+  uint64_t start;	// first block in run
+  uint64_t length;	// length of run in blocks
+};
+
+struct extent_list {
+  struct extent * ext;	// extents, in ascending order
+  size_t count;		// number of extents in use
+  size_t alloc;		// number of extents allocated
+  uint64_t blocks;	// total number of blocks in all extents
+  // if set, extents are passed here as soon as they can no longer grow,
+  //  instead of being kept; only extent_list_append (and functions built
+  //  on it) may then be used, followed by extent_list_flush
+  struct extent_sink * sink;
+};
+
+/* add the run START+LENGTH to the end of L
+ *  a run that begins where the last extent ends is merged into it
+ *  returns 0 on success; -ENOMEM or the sink's error code on failure
+ */
+int extent_list_append(struct extent_list * l, uint64_t start, uint64_t length);
+
+/* append the runs of set bits in BITMAP to L
+ *  BITMAP holds NBITS bits, least significant bit of each byte first,
+ *   and bit 0 stands for block BASE; bits past NBITS are ignored
+ *  the bitmap is scanned a 64-bit word at a time; all-clear and all-set
+ *   words cost one comparison and run edges are found with
+ *   count-trailing-zeros, so sparse or dense regions scan quickly
+ *  a large bitmap may be passed in pieces; runs that cross from one
+ *   piece to the next are joined by extent_list_append
+ *  returns 0 on success; -ENOMEM or the sink's error code on failure
+ */
+int extent_list_add_bitmap(struct extent_list * l, const void * bitmap,
+			   uint64_t nbits, uint64_t base);
+
+/* add the run START+LENGTH to L without regard to order
+ *  (call extent_list_sort before using L in any other way)
+ *  returns 0 on success; -ENOMEM on failure
+ */
+int extent_list_add(struct extent_list * l, uint64_t start, uint64_t length);
+
+/* sort the extents in L and merge any that overlap or touch */
+void extent_list_sort(struct extent_list * l);
+
+/* remove from L every block that is also in SUB
+ *  both lists must be in ascending order
+ *  returns 0 on success; -ENOMEM on failure (L is unchanged)
+ */
+int extent_list_subtract(struct extent_list * l,
+			 const struct extent_list * sub);
+
+/* remove from L every block that is not also in WITH
+ *  both lists must be in ascending order
+ *  returns 0 on success; -ENOMEM on failure (L is unchanged)
+ */
+int extent_list_intersect(struct extent_list * l,
+			  const struct extent_list * with);
+
+/* pass the extent still held by L, if any, to its sink
+ *  returns 0 on success; the sink's error code on failure
+ */
+int extent_list_flush(struct extent_list * l);
+
+/* write the extents in L to OUT in v1 block list format
+ *  (only the extents; the BEGIN and END markers are the caller's job)
+ */
+void extent_list_emit(FILE * out, const struct extent_list * l);
+
+/* release storage held by L and reset it to empty */
+void extent_list_free(struct extent_list * l);
+
+#endif
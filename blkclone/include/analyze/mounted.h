@@ -0,0 +1,59 @@
+#ifndef ANALYZE_MOUNTED_H
+#define ANALYZE_MOUNTED_H
+
+/* Helpers for mapping mounted filesystems
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <linux/fsmap.h>
+
+#include "analyze/extents.h"
+
+/* check that the device or image file open on SRCFD is what is mounted
+ *  where MST (from stat of the mount point) was taken
+ *  an image file must be mounted through a loop device
+ *  returns 0 if so, -EXDEV if not, or -error code
+ */
+int mounted_check_source(int srcfd, const struct stat * mst);
+
+/* return the type of the filesystem mounted at MNTPNT, from the mount
+ *  table, or NULL if not found; the result must be freed
+ */
+char * mounted_fstype(const char * mntpnt);
+
+/* call FN with each FS_IOC_GETFSMAP record for device DEV of the
+ *  filesystem open on MFD (any file or directory in it), in order
+ *  records for other devices (external logs, realtime) are skipped
+ *  returns 0 on success, FN's nonzero result, or -error code;
+ *   -ENOTTY or -EOPNOTSUPP means the filesystem has no GETFSMAP
+ */
+int mounted_fsmap(int mfd, dev_t dev,
+		  int (*fn)(void * arg, const struct fsmap * r), void * arg);
+
+/* fill L with the blocks of BSIZE bytes on device DEV that GETFSMAP does
+ *  not report free, up to the end of the highest range it reports
+ *  a block that is only partly free is kept
+ *  returns as mounted_fsmap, or -ENODATA if nothing was reported
+ */
+int mounted_fsmap_used(int mfd, dev_t dev, uint64_t bsize,
+		       struct extent_list * l);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef ANALYZE_POOL_H
+#define ANALYZE_POOL_H
+
+/* Thread pools for analysis modules
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stddef.h>
+
+#define ANALYSIS_MAX_THREADS	64
+
+/* return the number of threads to use for WORK independent pieces of
+ *  work: the threads= analysis option, or else the number of CPUs, but
+ *  no more than WORK (if nonzero) or ANALYSIS_MAX_THREADS and at least 1
+ */
+unsigned int analysis_threads(unsigned long work);
+
+/* run WORKER in NTHREADS threads and wait for all of them
+ *  thread I is passed ARG + I * ARGSIZE; with ARGSIZE 0 all get ARG
+ *  if no thread can be started, WORKER is called here with ARG instead
+ *  returns the number of workers that ran (at least 1)
+ */
+unsigned int analysis_pool_run(unsigned int nthreads,
+			       void * (*worker)(void *),
+			       void * arg, size_t argsize);
+
+#endif
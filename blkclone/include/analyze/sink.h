@@ -0,0 +1,60 @@
+#ifndef ANALYZE_SINK_H
+#define ANALYZE_SINK_H
+
+/* Extent sinks: receiving a block list without going through text
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  A sink receives the same things a block list holds -- the header keys
+ *   and then the extents in list order -- as calls instead of as text.
+ *  BlockSize always arrives before the first extent, so a consumer can
+ *   start copying at once; BlockCount may arrive after the last extent,
+ *   since a module that streams its extents does not know it any sooner.
+ */
+
+#include <stdio.h>
+
+struct v1_extent;
+
+struct extent_sink {
+  // a header key; VALUE is only valid during the call
+  int (*key)(struct extent_sink * s, const char * key, const char * value);
+  // the next extent in the list
+  int (*extent)(struct extent_sink * s, const struct v1_extent * e);
+  // for use by the owner of the sink
+  void * arg;
+};
+
+/* open a stream that parses block list text written to it, as by the
+ *  analyze function of a module, and passes it on to SINK
+ *  comments and the list markers are dropped
+ *  the stream must be closed with fclose, which returns EOF if the text
+ *   was malformed or SINK returned an error
+ *  returns NULL on failure
+ */
+FILE * extent_sink_open(struct extent_sink * sink);
+
+/* pass KEY to SINK with a value formatted as by printf
+ *  returns the result of SINK's key function, or -ENOMEM
+ */
+int extent_sink_keyf(struct extent_sink * sink, const char * key,
+		     const char * fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef BLOCK_CHUNKSTORE_H
+#define BLOCK_CHUNKSTORE_H
+
+/* Content-addressed chunk store for image repositories
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* see Documentation/block/repository-v1.txt */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+#define CHUNK_REPO_SIGNATURE	"BLKCLONE CHUNK REPOSITORY V1"
+#define CHUNK_PACK_SIGNATURE	"BLKCLONEPACK\r\n\004\001"
+#define CHUNK_PIDX_SIGNATURE	"BLKCLONEPIDX\r\n\004\001"
+
+#define CHUNK_MAX	(256 << 10)	/* largest chunk stored */
+#define CHUNK_PACK_MAX	(1ULL << 30)	/* a pack is closed after this */
+
+/* pack index: header, then entries sorted by hash */
+/* PORTABILITY NOTE: both are stored in the byte order of the CPU, which
+ *			 is assumed to be little-endian
+ */
+struct chunk_pidx_header {
+  char sig[16];		// CHUNK_PIDX_SIGNATURE
+  uint64_t count;	// entries following
+  uint64_t reserved;
+};
+
+struct chunk_pidx_entry {
+  uint8_t hash[SHA256_LEN];
+  uint64_t off;		// byte offset in pack
+  uint32_t len;		// length in bytes
+  uint32_t reserved;
+};
+
+struct chunk_loc {
+  uint8_t hash[SHA256_LEN];
+  uint64_t off;		// byte offset in pack
+  uint32_t len;		// length in bytes; 0 for an empty table slot
+  uint32_t pack;	// index into chunk_store.pack
+};
+
+struct chunk_store;
+
+/* opens the repository at DIR, creating it if CREATE is set
+ *  EXCLUSIVE locks out all other users (for gc); otherwise the lock is
+ *   shared with other exports and imports
+ *  returns NULL on failure, with errno set
+ */
+struct chunk_store * chunk_store_open(const char * dir, int create,
+				      int exclusive);
+
+//return: location of the chunk with HASH, or NULL if not stored
+const struct chunk_loc * chunk_store_find(struct chunk_store * s,
+					  const uint8_t * hash);
+
+/* stores the chunk with HASH unless it is already stored
+ *  returns 1 if stored, 0 if already present, negative errno on failure
+ *  nothing stored is visible to other users until chunk_store_commit
+ */
+int chunk_store_put(struct chunk_store * s, const uint8_t * hash,
+		    const void * data, size_t len);
+
+/* reads the chunk at LOC into BUF, which holds at least LOC->len bytes
+ *  may be called from several threads at once
+ *  returns 0 on success, negative errno on failure
+ */
+int chunk_store_read(struct chunk_store * s, const struct chunk_loc * loc,
+		     void * buf);
+
+//writes out the index for the pack being written, making its chunks visible
+// returns 0 on success, negative errno on failure
+int chunk_store_commit(struct chunk_store * s);
+
+/* garbage collection: mark every chunk still referenced, then sweep
+ *  the sweep deletes packs holding no marked chunk and repacks those in
+ *   which more than a quarter of the bytes are unmarked
+ *  needs the store opened EXCLUSIVE
+ */
+//return: 0 if marked, -ENOENT if no chunk has HASH
+int chunk_store_mark(struct chunk_store * s, const uint8_t * hash);
+//return: bytes reclaimed, or negative errno on failure
+long long chunk_store_sweep(struct chunk_store * s);
+
+void chunk_store_close(struct chunk_store * s);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef BLOCK_IMAGE_V1_H
+#define BLOCK_IMAGE_V1_H
+
+/* V1 image data stream header
+ * Copyright (C) 2009, 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* see Documentation/block/image-format-v1.txt */
+
+#include <stdint.h>
+
+#define IMAGE_V1_SIGNATURE "BLKCLONEDATA\r\n\004\000"
+
+/* v1 image header */
+struct image_header_v1 {
+  char    sig[16];	//signature: "BLKCLONEDATA\r\n\004\000"
+  uint8_t uuid[16];	//UUID
+  uint8_t version;	// == 1
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef BLOCK_PARTITION_H
+#define BLOCK_PARTITION_H
+
+/* Partition table reading for disk-scope imaging
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  Only partitions that hold data are listed; MBR extended partitions are
+ *   containers and appear only through the logical partitions inside them.
+ *  Everything else on the disk (partition tables, boot loaders, EBRs, the
+ *   GPT backup) falls into the gaps between partitions.
+ */
+
+#include <stdint.h>
+
+#include "analyze/extents.h"
+
+struct disk_partition {
+  unsigned int number;	// as numbered by Linux (logical partitions from 5)
+  uint64_t start;	// first sector
+  uint64_t length;	// length in sectors
+  char type[40];	// MBR type ("0x83") or GPT type GUID
+};
+
+struct disk_layout {
+  char * label;		// "mbr" or "gpt"
+  unsigned int sector_size; // bytes per sector
+  uint64_t sectors;	// size of disk in sectors
+  struct disk_partition * parts; // in table order
+  unsigned int count;	// number of partitions
+};
+
+/* read the partition table of the disk open on FD into D
+ *  SECTOR_SIZE is the logical sector size, or 0 to guess
+ *  returns 0 on success, -error code on error
+ *  D must be released with disk_free_layout
+ */
+int disk_read_layout(int fd, unsigned int sector_size,
+		     struct disk_layout * d);
+
+void disk_free_layout(struct disk_layout * d);
+
+/* fill GAPS (in sectors) with all space on D outside of partitions
+ *  returns 0 on success, -ENOMEM on failure
+ */
+int disk_find_gaps(struct disk_layout * d, struct extent_list * gaps);
+
+#endif
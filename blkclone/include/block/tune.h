@@ -0,0 +1,65 @@
+#ifndef BLOCK_TUNE_H
+#define BLOCK_TUNE_H
+
+/* Choosing transfer size, queue depth and O_DIRECT for a device
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct keylist;
+
+/* what the kernel says about a device */
+struct io_device {
+  int blockdev;			// FALSE for anything but a block device
+  unsigned int lss;		// logical sector size
+  unsigned int pbs;		// physical block size (BLKPBSZGET)
+  unsigned int io_opt;		// optimal I/O size, or 0 (BLKIOOPT)
+  unsigned int max_kb;		// largest request, or 0 (max_sectors_kb)
+  unsigned int nr_requests;	// queue length, or 0
+  int rotational;
+  char model[128];		// vendor and model, for the profile cache
+};
+
+/* how to read it */
+struct io_profile {
+  size_t iosize;		// bytes in each request sent to the device
+  unsigned int depth;		// requests in flight
+  int direct;			// read with O_DIRECT
+  const char * how;		// where the profile came from
+};
+
+//fills out D for the device open on FD
+void io_probe(int fd, struct io_device * d);
+
+/* chooses P for the device open on FD, described by D
+ *  the profile is taken from the options in ARGS if given, else from the
+ *   profile cache, else by timing reads of the first blocks listed in
+ *   MAP (which is left where it was), else from D alone
+ *  a calibrated profile is saved in the cache for the device model
+ */
+void io_tune(int fd, const struct io_device * d, FILE * map, size_t blocklen,
+	     struct keylist * args, struct io_profile * p);
+
+//return: a read-only stream on PATH using O_DIRECT reads of SIZE bytes
+// aligned to ALIGN, or NULL if the file cannot be opened that way
+FILE * io_direct_open(const char * path, size_t size, unsigned int align);
+
+#endif
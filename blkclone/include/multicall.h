@@ -25,6 +25,8 @@
  *  means to contruct multicall binaries.
  */
 
+#include <sys/types.h>
+
 #include "ldtable.h"
 
 #define MULTICALL_LDTABLE_NAME(name) mcall_ ## name
@@ -43,6 +45,30 @@ struct multicall_cell {
 //central place to print a usage message for an invalid call
 void print_usage_and_exit(char * usagetext);
 
+//run subprogram NAME with the given arguments, as if from the command line
+// returns the subprogram's exit status, or -1 if there is no such subprogram
+int multicall_run(char * name, int argc, char ** argv);
+
+#define MULTICALL_MAX_ARGS	24
+
+//arguments for a subprogram, built up by multicall_arg
+struct multicall_argv {
+  char * v[MULTICALL_MAX_ARGS];
+  int c;
+};
+
+//adds an argument to A, formatted as by printf; exits if A is full
+void multicall_arg(struct multicall_argv * a, const char * fmt, ...);
+
+//runs the subprogram named in A, then frees the arguments in A
+// returns as multicall_run
+int multicall_run_argv(struct multicall_argv * a);
+
+//forks a worker with standard output and error going to the file LOG
+// (appended to if APPEND, else replaced)
+//return: as fork(); the worker gets 0 and exits if LOG cannot be opened
+pid_t multicall_fork_logged(const char * log, int append);
+
 /* the ... are the args for main; followed by function body */
 #define SUBCALL_MAIN(tabname,module_name,use_,hlp_,...)	    \
   int main__ ## tabname ## __ ## module_name (__VA_ARGS__);  \
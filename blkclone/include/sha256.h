@@ -0,0 +1,42 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+/* SHA-256 message digest (FIPS 180-4)
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32	/* bytes in a digest */
+
+struct sha256 {
+  uint32_t h[8];	// chaining state
+  uint64_t len;		// bytes hashed so far
+  uint8_t buf[64];	// partial input block
+};
+
+void sha256_init(struct sha256 * c);
+void sha256_update(struct sha256 * c, const void * data, size_t len);
+void sha256_final(struct sha256 * c, uint8_t out[SHA256_LEN]);
+
+//digest of LEN bytes at DATA, in one call
+void sha256(const void * data, size_t len, uint8_t out[SHA256_LEN]);
+
+#endif
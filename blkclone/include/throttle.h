@@ -0,0 +1,50 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+/* Bandwidth pacing shared between processes
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  A throttle is a timeline for one shared resource (a network link, an
+ *   HBA) with a fixed rate.  Each process charges the bytes it moves, in
+ *   steps of IO_THROTTLE_QUANTUM, by reserving the next free slot on the
+ *   timeline and sleeping until it starts.  Since every process reserves
+ *   equal steps in turn, the rate is divided evenly between them, and the
+ *   total never exceeds it.
+ *  The throttle lives in shared memory, so it is made once by a parent
+ *   and inherited by the worker processes it forks.
+ */
+
+#include <stddef.h>
+
+#define IO_THROTTLE_QUANTUM	(1 << 20)	/* bytes reserved at once */
+
+struct io_throttle;
+
+//return: a new throttle for RATE bytes per second, or NULL on failure
+struct io_throttle * io_throttle_new(double rate);
+
+//makes T the throttle charged by io_throttle (NULL for none)
+void io_throttle_use(struct io_throttle * t);
+
+//charges BYTES moved to the current throttle, sleeping if they came early
+// does nothing if no throttle is in use
+void io_throttle(size_t bytes);
+
+#endif
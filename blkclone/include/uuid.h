@@ -68,4 +68,18 @@ static inline void print_uuid(FILE * out, uuid_t * uuid)
   }
 }
 
+//get a new (random) UUID from the system
+// returns 0 on success, -1 on failure
+static inline int generate_uuid(uuid_t * uuid)
+{
+  char buf[40];
+  FILE * f = fopen("/proc/sys/kernel/random/uuid","r");
+
+  if (!f) return -1;
+  if (!fgets(buf,sizeof(buf),f)) { fclose(f); return -1; }
+  fclose(f);
+  parse_uuid(buf,uuid);
+  return 0;
+}
+
 #endif
@@ -0,0 +1,160 @@
+/* simple test program for blkclone extent list facilities
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Compares the word-at-a-time bitmap scanner against a bit-at-a-time
+ *  scan of random bitmaps, fed in pieces of random length.
+ * Then checks sort, subtract and intersect against the same operations
+ *  on bitmaps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "analyze/extents.h"
+
+#define NBYTES 4096
+
+// the obvious way, one bit at a time
+static void naive_scan(struct extent_list * l, const unsigned char * map,
+		       uint64_t nbits, uint64_t base)
+{
+  uint64_t i;
+
+  for (i = 0; i < nbits; i++)
+    if (map[i/8] & (1 << (i%8)))
+      extent_list_append(l, base + i, 1);
+}
+
+// report any difference between A and B; returns nonzero on mismatch
+static int compare(int round, struct extent_list * a, struct extent_list * b)
+{
+  size_t i;
+
+  if ((a->count != b->count) || (a->blocks != b->blocks)) {
+    printf("round %d: %zu/%llu extents/blocks, expected %zu/%llu\n",
+	   round, a->count, (unsigned long long) a->blocks,
+	   b->count, (unsigned long long) b->blocks);
+    return 1;
+  }
+  for (i = 0; i < a->count; i++)
+    if ((a->ext[i].start != b->ext[i].start)
+	||(a->ext[i].length != b->ext[i].length)) {
+      printf("round %d: extent %zu differs\n", round, i);
+      return 1;
+    }
+  return 0;
+}
+
+int main(int argc, char ** argv) {
+  unsigned char map[NBYTES];
+  unsigned char holes[NBYTES];
+  struct extent_list a = {0}, b = {0};
+  int round, fail = 0;
+  size_t i;
+
+  srandom(argc > 1 ? atoi(argv[1]) : 1);
+
+  for (round = 0; round < 200; round++) {
+    uint64_t nbits = random() % (NBYTES * 8);
+    uint64_t done = 0;
+    int density = random() % 4;
+
+    for (i = 0; i < NBYTES; i++)
+      switch (density) {
+      case 0:  map[i] = random();			break;
+      case 1:  map[i] = (random() % 16) ? 0 : random();	break;
+      case 2:  map[i] = (random() % 16) ? 0xFF : random(); break;
+      default: map[i] = (random() % 2) ? 0 : 0xFF;	break;
+      }
+
+    // pieces start on byte boundaries, as they do when reading a file
+    while (done < nbits) {
+      uint64_t piece = 8 * (1 + random() % 256);
+      if (piece > nbits - done) piece = nbits - done;
+      extent_list_add_bitmap(&a, map + done/8, piece, 1000 + done);
+      done += piece;
+    }
+    naive_scan(&b, map, nbits, 1000);
+
+    fail |= compare(round, &a, &b);
+
+    extent_list_free(&a);
+    extent_list_free(&b);
+  }
+
+  for (round = 0; round < 200; round++) {
+    struct extent_list h = {0};
+    uint64_t nbits = NBYTES * 8;
+
+    for (i = 0; i < NBYTES; i++) {
+      map[i] = (random() % 4) ? 0xFF : random();
+      holes[i] = (random() % 4) ? 0 : random();
+    }
+
+    // holes go in out of order and overlapping, one bit at a time
+    for (i = nbits; i--; )
+      if (holes[i/8] & (1 << (i%8)))
+	extent_list_add(&h, i, 1 + (i % 2));
+    extent_list_sort(&h);
+    for (i = nbits; i--; )
+      if ((holes[i/8] & (1 << (i%8))) && (i % 2) && (i + 1 < nbits))
+	holes[(i+1)/8] |= 1 << ((i+1)%8);
+
+    extent_list_add_bitmap(&a, map, nbits, 0);
+    extent_list_subtract(&a, &h);
+
+    for (i = 0; i < NBYTES; i++)
+      map[i] &= ~holes[i];
+    extent_list_add_bitmap(&b, map, nbits, 0);
+
+    fail |= compare(round, &a, &b);
+
+    extent_list_free(&a);
+    extent_list_free(&b);
+    extent_list_free(&h);
+  }
+
+  for (round = 0; round < 200; round++) {
+    struct extent_list w = {0};
+    uint64_t nbits = NBYTES * 8;
+
+    for (i = 0; i < NBYTES; i++) {
+      map[i] = (random() % 4) ? 0xFF : random();
+      holes[i] = (random() % 3) ? 0xFF : random();
+    }
+
+    extent_list_add_bitmap(&a, map, nbits, 0);
+    extent_list_add_bitmap(&w, holes, nbits, 0);
+    extent_list_intersect(&a, &w);
+
+    for (i = 0; i < NBYTES; i++)
+      map[i] &= holes[i];
+    extent_list_add_bitmap(&b, map, nbits, 0);
+
+    fail |= compare(round, &a, &b);
+
+    extent_list_free(&a);
+    extent_list_free(&b);
+    extent_list_free(&w);
+  }
+
+  puts(fail ? "FAIL" : "ok");
+  return fail;
+}
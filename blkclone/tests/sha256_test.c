@@ -0,0 +1,62 @@
+/* simple test program for blkclone SHA-256 digests
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sha256.h"
+
+struct {
+  char * text;		// hashed REPEAT times over
+  int repeat;
+  char * digest;
+} *test, testcases[] = {
+  {"", 1,
+   "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+  {"abc", 1,
+   "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+  {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+   "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+  {"a", 1000000,
+   "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+  {"0123456701234567012345670123456701234567012345670123456701234567", 10,
+   "594847328451bdfa85056225462cc1d867d877fb388df0ce35f25ab5562bfbb5"},
+  {NULL}};
+
+int main(void) {
+  uint8_t out[SHA256_LEN];
+  char hex[2*SHA256_LEN+1];
+  int fail = 0, i;
+
+  for (test = testcases; test->text; test++) {
+    struct sha256 c;
+    sha256_init(&c);
+    for (i = 0; i < test->repeat; i++)
+      sha256_update(&c, test->text, strlen(test->text));
+    sha256_final(&c, out);
+    for (i = 0; i < SHA256_LEN; i++)
+      sprintf(hex + 2*i, "%02x", out[i]);
+    printf("%s %s\n", strcmp(hex, test->digest) ? "FAIL" : "ok  ", hex);
+    fail |= !!strcmp(hex, test->digest);
+  }
+
+  return fail;
+}
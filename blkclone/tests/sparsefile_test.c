@@ -0,0 +1,113 @@
+/* simple test program for the sparsefile analysis module
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Maps small sparse files at block sizes larger than their holes, where
+ *  the ends of two data regions fall in one block, and checks that each
+ *  block is listed once.
+ * The file is made in the current directory; on a filesystem without
+ *  holes, all of it is data and the checks still hold.
+ */
+
+#include "../block/analyze/sparsefile/analyze-sparsefile.c"
+
+struct keylist * analysis_args = NULL; // normally defined by analyze
+
+// not reached without within=; here only to link
+struct analysis_module * analysis_find_module(FILE * fs, const char * type)
+{ return NULL; }
+int analysis_run_sink(struct analysis_module * mod, FILE * fs,
+		      char * mntpnt, struct extent_sink * sink)
+{ return -ENOSYS; }
+
+//writes 4 KiB of data at each offset in AT (ending with -1) to a new file
+//return: its descriptor
+static int make_file(const off_t * at, off_t size)
+{
+  char path[] = "sparsefile_test.XXXXXX", buf[4096];
+  int fd = mkstemp(path);
+
+  if (fd < 0) { perror("mkstemp"); exit(1); }
+  unlink(path);
+  memset(buf, 0xAA, sizeof(buf));
+  for (; *at >= 0; at++)
+    if (pwrite(fd, buf, sizeof(buf), *at) != sizeof(buf))
+      { perror("pwrite"); exit(1); }
+  if (ftruncate(fd, size)) { perror("ftruncate"); exit(1); }
+  return fd;
+}
+
+//scans a file with data at AT in blocks of BSIZE and compares with WANT
+//return: nonzero on mismatch
+static int check(const char * what, const off_t * at, off_t size,
+		 uint64_t bsize, const struct extent * want, size_t nwant)
+{
+  struct extent_list l = {0};
+  int fd = make_file(at, size), fail = 0;
+  uint64_t blocks = 0;
+  size_t i;
+
+  if (sparsefile_scan(fd, size, bsize, &l)) { perror(what); exit(1); }
+  for (i = 0; i < l.count; i++) {
+    if (i && (l.ext[i].start < l.ext[i-1].start + l.ext[i-1].length))
+      fail = 1; // overlapping or out of order
+    blocks += l.ext[i].length;
+  }
+  if (blocks != l.blocks) fail = 1;
+  // without holes the file is one region; then only order is checked
+  if (lseek(fd, 0, SEEK_HOLE) == size) nwant = 0;
+  if (nwant && (l.count != nwant)) fail = 1;
+  for (i = 0; !fail && (i < nwant); i++)
+    if ((l.ext[i].start != want[i].start)
+	|| (l.ext[i].length != want[i].length))
+      fail = 1;
+  if (fail) {
+    printf("%s: got", what);
+    for (i = 0; i < l.count; i++)
+      printf(" %llu+%llu", (unsigned long long) l.ext[i].start,
+	     (unsigned long long) l.ext[i].length);
+    printf("\n");
+  }
+  extent_list_free(&l);
+  close(fd);
+  return fail;
+}
+
+int main(int argc, char ** argv) {
+  int fail = 0;
+
+  { // two regions in block 0
+    off_t at[] = { 0, 8192, -1 };
+    struct extent want[] = { { 0, 1 } };
+    fail |= check("one block", at, 1 << 20, 65536, want, 1);
+  }
+  { // a region ending in the block where the next begins
+    off_t at[] = { 0, 61440, 65536 + 8192, 196608, -1 };
+    struct extent want[] = { { 0, 2 }, { 3, 1 } };
+    fail |= check("shared block", at, 1 << 20, 65536, want, 2);
+  }
+  { // holes as large as the blocks are still holes
+    off_t at[] = { 0, 65536 * 4, -1 };
+    struct extent want[] = { { 0, 1 }, { 4, 1 } };
+    fail |= check("block holes", at, 1 << 20, 65536, want, 2);
+  }
+
+  puts(fail ? "FAIL" : "ok");
+  return fail;
+}
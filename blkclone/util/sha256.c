@@ -0,0 +1,130 @@
+/* SHA-256 message digest (FIPS 180-4)
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*  A plain implementation, written for clarity; the chunk repository is
+ *   the only user and reads from disk are slower than this anyway.
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+#define ROR(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t h[8], const uint8_t * p)
+{
+  uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+  int i;
+
+  for (i = 0; i < 16; i++, p += 4)
+    w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+      | ((uint32_t) p[2] << 8) | p[3];
+  for (; i < 64; i++)
+    w[i] = w[i-16] + (ROR(w[i-15],7) ^ ROR(w[i-15],18) ^ (w[i-15] >> 3))
+      + w[i-7] + (ROR(w[i-2],17) ^ ROR(w[i-2],19) ^ (w[i-2] >> 10));
+
+  a = h[0]; b = h[1]; c = h[2]; d = h[3];
+  e = h[4]; f = h[5]; g = h[6]; k = h[7];
+  for (i = 0; i < 64; i++) {
+    t1 = k + (ROR(e,6) ^ ROR(e,11) ^ ROR(e,25)) + ((e & f) ^ (~e & g))
+      + K[i] + w[i];
+    t2 = (ROR(a,2) ^ ROR(a,13) ^ ROR(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+    k = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+  h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+void sha256_init(struct sha256 * c)
+{
+  static const uint32_t h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+  memcpy(c->h, h0, sizeof(h0));
+  c->len = 0;
+}
+
+void sha256_update(struct sha256 * c, const void * data, size_t len)
+{
+  const uint8_t * p = data;
+  size_t fill = c->len % 64;
+
+  c->len += len;
+  if (fill) {
+    size_t n = (len < 64 - fill) ? len : 64 - fill;
+    memcpy(c->buf + fill, p, n);
+    p += n; len -= n;
+    if (fill + n < 64) return;
+    sha256_block(c->h, c->buf);
+  }
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_block(c->h, p);
+  memcpy(c->buf, p, len);
+}
+
+void sha256_final(struct sha256 * c, uint8_t out[SHA256_LEN])
+{
+  size_t fill = c->len % 64;
+  uint64_t bits = c->len * 8;
+  int i;
+
+  c->buf[fill++] = 0x80;
+  if (fill > 56) {
+    memset(c->buf + fill, 0, 64 - fill);
+    sha256_block(c->h, c->buf);
+    fill = 0;
+  }
+  memset(c->buf + fill, 0, 56 - fill);
+  for (i = 0; i < 8; i++)
+    c->buf[63 - i] = bits >> (8 * i);
+  sha256_block(c->h, c->buf);
+
+  for (i = 0; i < 32; i++)
+    out[i] = c->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void sha256(const void * data, size_t len, uint8_t out[SHA256_LEN])
+{
+  struct sha256 c;
+
+  sha256_init(&c);
+  sha256_update(&c, data, len);
+  sha256_final(&c, out);
+}
@@ -0,0 +1,95 @@
+/* Bandwidth pacing shared between processes
+ * Copyright (C) 2010 Jacob Bachmeyer
+ *
+ * This file is part of blkclone.
+ *
+ * The blkclone tools are free software; you can redistribute and/or modify
+ * them under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "throttle.h"
+
+struct io_throttle {
+  pthread_mutex_t lock;	// process-shared, robust
+  double rate;		// bytes per second
+  struct timespec next;	// when the resource is next free
+};
+
+static struct io_throttle * current;
+static size_t pending;	// bytes charged but not yet reserved
+
+struct io_throttle * io_throttle_new(double rate)
+{
+  struct io_throttle * t;
+  pthread_mutexattr_t attr;
+
+  if (rate <= 0) { errno = EINVAL; return NULL; }
+  t = mmap(NULL, sizeof(struct io_throttle), PROT_READ | PROT_WRITE,
+	   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (t == MAP_FAILED) return NULL;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  // a worker killed while holding the lock must not stop all the others
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&t->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  t->rate = rate;
+  return t;
+}
+
+void io_throttle_use(struct io_throttle * t)
+{
+  current = t;
+  pending = 0;
+}
+
+void io_throttle(size_t bytes)
+{
+  struct timespec now, start;
+  double d;
+
+  if (!current) return;
+  pending += bytes;
+  if (pending < IO_THROTTLE_QUANTUM) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (pthread_mutex_lock(&current->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&current->lock);
+  // an idle resource saves up no credit for later
+  if ((current->next.tv_sec < now.tv_sec)
+      || ((current->next.tv_sec == now.tv_sec)
+	  && (current->next.tv_nsec < now.tv_nsec)))
+    current->next = now;
+  start = current->next;
+  d = pending / current->rate;
+  current->next.tv_sec += (time_t) d;
+  current->next.tv_nsec += (long) ((d - (time_t) d) * 1e9);
+  if (current->next.tv_nsec >= 1000000000L) {
+    current->next.tv_sec++;
+    current->next.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_unlock(&current->lock);
+  pending = 0;
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &start, NULL)
+	 == EINTR);
+}